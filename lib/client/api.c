@@ -22,6 +22,8 @@
  *   - start (\ref omlc_start)
  *   - addMP (\ref omlc_add_mp)
  *   - inject (\ref omlc_inject)
+ *   - injectBatch (\ref omlc_inject_batch)
+ *   - row builder (\ref omlc_row_begin, omlc_row_set_int32, ..., \ref omlc_row_commit)
  *   - injectMetadata (\ref omlc_inject_metadata)
  *   - close (\ref omlc_close)
  *
@@ -95,8 +97,11 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include <sys/time.h>
 
 #include "oml2/oml_filter.h"
@@ -109,7 +114,8 @@
 #include "buffered_writer.h"
 
 static void omlc_ms_process(OmlMStream* ms);
-static int omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_dropped, uint64_t bytes_allocated, uint64_t bytes_freed, uint64_t bytes_in_use, uint64_t bytes_max);
+static int omlc_mp_batch(OmlMP* mp, int begin);
+static int omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_dropped, uint64_t bytes_allocated, uint64_t bytes_freed, uint64_t bytes_in_use, uint64_t bytes_max, uint32_t ring_full, uint32_t interval_missed, uint32_t queue_dropped_oldest, uint32_t queue_dropped_newest, uint32_t queue_blocked, uint32_t queue_thinned);
 
 extern OmlMP* schema0;
 
@@ -137,21 +143,23 @@ omlc_process(OmlMP *mp, OmlValueU *values)
  * filter, the call omlc_ms_process() to determine whether a new sample has to
  * be output on that MS.
  *
- * The content of values is deep-copied into the MSs' storage, so values can be
- * directly freed/reused when inject returns.
+ * The content of values is marshalled by the writers of the MSs outputting
+ * samples as is (see filter_passthrough), or deep-copied into the filters'
+ * storage, so values can be directly freed/reused when inject returns.
  *
  * This function might call omlc_inject_client_instr which in turns calls
  * omlc_inject. We make sure not to loop.
  *
+ * When the injection mode is IM_Ring (--oml-inject-mode ring), the sample is
+ * instead copied into the calling thread's injection ring, and the above
+ * processing happens later, in the ring consumer thread.
+ *
  * \see omlc_add_mp, omlc_ms_process, oml_value_set, omlc_inject_client_instr
+ * \see omlc_inject_rows, inject_ring_push
  */
 int
 omlc_inject(OmlMP *mp, OmlValueU *values)
 {
-  OmlMStream* ms;
-  OmlValue v;
-  int i;
-
   if (NULL == omlc_instance || omlc_instance->start_time <= 0) {
     logerror("Cannot inject samples prior to calling omlc_init and omlc_start\n");
     return -1;
@@ -160,9 +168,439 @@ omlc_inject(OmlMP *mp, OmlValueU *values)
     return -1;
   }
 
-  LOGDEBUG("Injecting data into MP '%s'\n", mp->name);
+  if (IM_Ring == omlc_instance->inject_mode && mp != omlc_instance->client_instr) {
+    return inject_ring_push(mp, values);
+  }
+
+  return omlc_inject_rows(mp, values, 1);
+}
+
+/** Inject a batch of measurement samples into a Measurement Point.
+ *
+ * \param mp pointer to OmlMP into which the new samples are being injected
+ * \param rows nrows arrays of mp->param_count OmlValueU, laid out back-to-back
+ * \param nrows number of samples in rows
+ * \return 0 on success, <0 otherwise (see below for the ring injection mode)
+ *
+ * This is equivalent to calling omlc_inject on each sample in sequence, but
+ * the MP is only locked once, as well as each of the BufferedWriters of its
+ * MSs. The samples are therefore serialised back-to-back, and the writing
+ * threads only woken up once. The instrumentation bookkeeping is also only
+ * done once per batch.
+ *
+ * The \f$i\f$-th field of the \f$n\f$-th sample is rows[n * mp->param_count + i].
+ *
+ * \code {.c}
+ *   OmlValueU rows[NSAMPLES * 2];
+ *   omlc_zero_array(rows, NSAMPLES * 2);
+ *   for (n = 0; n < NSAMPLES; n++) {
+ *     omlc_set_uint32(rows[2 * n], src[n]);
+ *     omlc_set_double(rows[2 * n + 1], weight[n]);
+ *   }
+ *   omlc_inject_batch(mp, rows, NSAMPLES);
+ * \endcode
+ *
+ * In ring injection mode (--oml-inject-mode ring), each sample is queued
+ * separately, and those which cannot be are dropped as with omlc_inject, the
+ * others still being queued. The return value is then minus the number of
+ * dropped samples, and the batch must therefore not be injected again.
+ *
+ * \see omlc_inject
+ */
+int
+omlc_inject_batch(OmlMP *mp, OmlValueU *rows, unsigned int nrows)
+{
+  unsigned int r;
+  int lost = 0;
+
+  if (NULL == omlc_instance || omlc_instance->start_time <= 0) {
+    logerror("Cannot inject samples prior to calling omlc_init and omlc_start\n");
+    return -1;
+  }
+  if (mp == NULL || rows == NULL) {
+    return -1;
+  }
+
+  if (IM_Ring == omlc_instance->inject_mode && mp != omlc_instance->client_instr) {
+    /* Keep ordering with samples already queued by this thread, and carry on
+     * past samples which cannot be queued, as successive omlc_inject would */
+    for (r = 0; r < nrows; r++) {
+      if (inject_ring_push(mp, rows + r * mp->param_count)) {
+        lost++;
+      }
+    }
+    if (lost) {
+      logwarn("MP '%s': %d of %u samples of a batch could not be queued\n", mp->name, lost, nrows);
+    }
+    return -lost;
+  }
+
+  return omlc_inject_rows(mp, rows, nrows);
+}
+
+/** A sample being built for an MP \see omlc_row_begin */
+struct OmlRow {
+  /** MP the sample is being built for, NULL if none */
+  OmlMP *mp;
+  /** Fields of the sample, pointing to the caller's storage */
+  OmlValueU *values;
+  /** Number of allocated elements in values */
+  int size;
+};
+
+/** Key to the OmlRow of each thread */
+static pthread_key_t row_key;
+/** Make sure row_key is only created once */
+static pthread_once_t row_key_once = PTHREAD_ONCE_INIT;
+
+/** Free the OmlRow of a thread which is terminating \see pthread_key_create */
+static void
+row_free(void *row)
+{
+  oml_free(((OmlRow*)row)->values);
+  oml_free(row);
+}
+
+/** Create row_key \see pthread_once */
+static void
+row_key_create(void)
+{
+  if (pthread_key_create(&row_key, row_free)) {
+    logerror("Cannot create key for per-thread rows\n");
+  }
+}
+
+/** Start building a sample for a Measurement Point, field by field.
+ *
+ * This is an alternative to filling an array of OmlValueU for omlc_inject.
+ * Fields are set with the omlc_row_set_* functions, which check their type,
+ * and the sample is injected with omlc_row_commit. Fields which are not set
+ * are zero, or empty.
+ *
+ * Strings, blobs and vectors are not copied when set: only a pointer to them
+ * is kept, and they must stay valid until omlc_row_commit returns. Unless
+ * in IM_Ring injection mode, the sample is then directly marshalled from them
+ * into the writers' buffers for MSs outputting samples as is (see
+ * filter_passthrough), e.g., those created by default with --oml-samples 1.
+ *
+ * \code {.c}
+ *   OmlRow *row = omlc_row_begin(mp);
+ *   omlc_row_set_uint32(row, 0, seq);
+ *   omlc_row_set_string(row, 1, hostname);
+ *   omlc_row_set_blob(row, 2, packet, packet_len);
+ *   omlc_row_commit(row);
+ * \endcode
+ *
+ * Each thread has one row, which is reused for every sample; beginning a new
+ * one discards any uncommitted sample. No lock is held between
+ * omlc_row_begin and omlc_row_commit.
+ *
+ * \param mp pointer to OmlMP into which the sample will be injected
+ * \return a pointer to the row to set the fields of, or NULL on error
+ * \see omlc_row_commit, omlc_inject
+ */
+OmlRow*
+omlc_row_begin(OmlMP *mp)
+{
+  OmlRow *row;
+  OmlValueU *values;
+
+  if (NULL == omlc_instance || omlc_instance->start_time <= 0) {
+    logerror("Cannot inject samples prior to calling omlc_init and omlc_start\n");
+    return NULL;
+  }
+  if (mp == NULL) {
+    return NULL;
+  }
+
+  pthread_once(&row_key_once, row_key_create);
+  if (!(row = pthread_getspecific(row_key))) {
+    if (!(row = oml_malloc(sizeof(OmlRow)))) {
+      logerror("Cannot allocate memory for a new row\n");
+      return NULL;
+    }
+    memset(row, 0, sizeof(OmlRow));
+    pthread_setspecific(row_key, row);
+  }
+
+  if (row->size < mp->param_count) {
+    if (!(values = oml_realloc(row->values, mp->param_count * sizeof(OmlValueU)))) {
+      logerror("Cannot allocate memory for a row of MP '%s'\n", mp->name);
+      return NULL;
+    }
+    row->values = values;
+    row->size = mp->param_count;
+  }
+  omlc_zero_array(row->values, mp->param_count);
+  row->mp = mp;
+
+  return row;
+}
+
+/** Get a field of a row, checking its type.
+ *
+ * \param row OmlRow being built
+ * \param index index of the field in the MP
+ * \param type expected OmlValueT of the field
+ * \return a pointer to the value of the field, or NULL if the row has not
+ * been begun, the index is out of range, or the field has another type
+ */
+static OmlValueU*
+row_field(OmlRow *row, int index, OmlValueT type)
+{
+  if (!row || !row->mp) {
+    logwarn("Cannot set field %d of a row which was not begun\n", index);
+    return NULL;
+  }
+  if (index < 0 || index >= row->mp->param_count) {
+    logwarn("MP '%s' has no field %d\n", row->mp->name, index);
+    return NULL;
+  }
+  if (row->mp->param_defs[index].param_types != type) {
+    logwarn("Field %d of MP '%s' has type %s, not %s\n", index, row->mp->name,
+        oml_type_to_s(row->mp->param_defs[index].param_types), oml_type_to_s(type));
+    return NULL;
+  }
+  return &row->values[index];
+}
+
+/** Set an int32 field of a row.
+ *
+ * \param row OmlRow returned by omlc_row_begin
+ * \param index index of the field in the MP
+ * \param value value of the field
+ * \return 0 on success, -1 if the field does not exist or has another type
+ * \see omlc_row_begin
+ */
+int
+omlc_row_set_int32(OmlRow *row, int index, int32_t value)
+{
+  OmlValueU *v = row_field(row, index, OML_INT32_VALUE);
+  if (!v) {
+    return -1;
+  }
+  omlc_set_int32(*v, value);
+  return 0;
+}
+
+/** Set a uint32 field of a row. \copydetails omlc_row_set_int32 */
+int
+omlc_row_set_uint32(OmlRow *row, int index, uint32_t value)
+{
+  OmlValueU *v = row_field(row, index, OML_UINT32_VALUE);
+  if (!v) {
+    return -1;
+  }
+  omlc_set_uint32(*v, value);
+  return 0;
+}
+
+/** Set an int64 field of a row. \copydetails omlc_row_set_int32 */
+int
+omlc_row_set_int64(OmlRow *row, int index, int64_t value)
+{
+  OmlValueU *v = row_field(row, index, OML_INT64_VALUE);
+  if (!v) {
+    return -1;
+  }
+  omlc_set_int64(*v, value);
+  return 0;
+}
+
+/** Set a uint64 field of a row. \copydetails omlc_row_set_int32 */
+int
+omlc_row_set_uint64(OmlRow *row, int index, uint64_t value)
+{
+  OmlValueU *v = row_field(row, index, OML_UINT64_VALUE);
+  if (!v) {
+    return -1;
+  }
+  omlc_set_uint64(*v, value);
+  return 0;
+}
+
+/** Set a double field of a row. \copydetails omlc_row_set_int32 */
+int
+omlc_row_set_double(OmlRow *row, int index, double value)
+{
+  OmlValueU *v = row_field(row, index, OML_DOUBLE_VALUE);
+  if (!v) {
+    return -1;
+  }
+  omlc_set_double(*v, value);
+  return 0;
+}
+
+/** Set a boolean field of a row. \copydetails omlc_row_set_int32 */
+int
+omlc_row_set_bool(OmlRow *row, int index, int value)
+{
+  OmlValueU *v = row_field(row, index, OML_BOOL_VALUE);
+  if (!v) {
+    return -1;
+  }
+  omlc_set_bool(*v, value ? OMLC_BOOL_TRUE : OMLC_BOOL_FALSE);
+  return 0;
+}
+
+/** Set a GUID field of a row. \copydetails omlc_row_set_int32 */
+int
+omlc_row_set_guid(OmlRow *row, int index, oml_guid_t value)
+{
+  OmlValueU *v = row_field(row, index, OML_GUID_VALUE);
+  if (!v) {
+    return -1;
+  }
+  omlc_set_guid(*v, value);
+  return 0;
+}
+
+/** Set a string field of a row, without copying the string.
+ *
+ * \param row OmlRow returned by omlc_row_begin
+ * \param index index of the field in the MP
+ * \param value nil-terminated string, which must stay valid until omlc_row_commit returns
+ * \return 0 on success, -1 if the field does not exist or has another type
+ * \see omlc_row_begin, omlc_set_const_string
+ */
+int
+omlc_row_set_string(OmlRow *row, int index, const char *value)
+{
+  OmlValueU *v = row_field(row, index, OML_STRING_VALUE);
+  if (!v) {
+    return -1;
+  }
+  omlc_set_const_string(*v, value);
+  return 0;
+}
+
+/** Set a blob field of a row, without copying the blob.
+ *
+ * \param row OmlRow returned by omlc_row_begin
+ * \param index index of the field in the MP
+ * \param value pointer to the data, which must stay valid until omlc_row_commit returns
+ * \param length length of the data
+ * \return 0 on success, -1 if the field does not exist or has another type
+ * \see omlc_row_begin
+ */
+int
+omlc_row_set_blob(OmlRow *row, int index, const void *value, size_t length)
+{
+  OmlValueU *v = row_field(row, index, OML_BLOB_VALUE);
+  if (!v) {
+    return -1;
+  }
+  omlc_set_blob_ptr(*v, value);
+  omlc_set_blob_length(*v, length);
+  return 0;
+}
+
+/** Set a vector field of a row, without copying its elements.
+ *
+ * The type of the elements is that of the field, e.g., double for an
+ * OML_VECTOR_DOUBLE_VALUE, or bool for an OML_VECTOR_BOOL_VALUE.
+ *
+ * \param row OmlRow returned by omlc_row_begin
+ * \param index index of the field in the MP
+ * \param elts pointer to the elements, which must stay valid until omlc_row_commit returns
+ * \param nof_elts number of elements
+ * \return 0 on success, -1 if the field does not exist or is not a vector
+ * \see omlc_row_begin
+ */
+int
+omlc_row_set_vector(OmlRow *row, int index, const void *elts, size_t nof_elts)
+{
+  OmlValueU *v;
+  size_t elt_sz;
+
+  if (!row || !row->mp || index < 0 || index >= row->mp->param_count) {
+    /* Let row_field report the error */
+    row_field(row, index, OML_UNKNOWN_VALUE);
+    return -1;
+  }
+  switch (row->mp->param_defs[index].param_types) {
+  case OML_VECTOR_DOUBLE_VALUE: elt_sz = sizeof(double); break;
+  case OML_VECTOR_INT32_VALUE: elt_sz = sizeof(int32_t); break;
+  case OML_VECTOR_UINT32_VALUE: elt_sz = sizeof(uint32_t); break;
+  case OML_VECTOR_INT64_VALUE: elt_sz = sizeof(int64_t); break;
+  case OML_VECTOR_UINT64_VALUE: elt_sz = sizeof(uint64_t); break;
+  case OML_VECTOR_BOOL_VALUE: elt_sz = sizeof(bool); break;
+  default:
+    logwarn("Field %d of MP '%s' has type %s, not a vector\n", index, row->mp->name,
+        oml_type_to_s(row->mp->param_defs[index].param_types));
+    return -1;
+  }
+  if (nof_elts > UINT16_MAX) {
+    logwarn("Vector of %zu elements too long for field %d of MP '%s'\n",
+        nof_elts, index, row->mp->name);
+    return -1;
+  }
+
+  v = &row->values[index];
+  omlc_set_vector_ptr(*v, elts);
+  omlc_set_vector_length(*v, nof_elts * elt_sz);
+  omlc_set_vector_nof_elts(*v, nof_elts);
+  omlc_set_vector_elt_size(*v, elt_sz);
+  return 0;
+}
+
+/** Inject the sample built in a row.
+ *
+ * \param row OmlRow returned by omlc_row_begin
+ * \return 0 on success, <0 otherwise
+ * \see omlc_row_begin, omlc_inject
+ */
+int
+omlc_row_commit(OmlRow *row)
+{
+  OmlMP *mp;
+
+  if (!row || !(mp = row->mp)) {
+    logwarn("Cannot commit a row which was not begun\n");
+    return -1;
+  }
+  row->mp = NULL;
+
+  if (IM_Ring == omlc_instance->inject_mode && mp != omlc_instance->client_instr) {
+    return inject_ring_push(mp, row->values);
+  }
+
+  return omlc_inject_rows(mp, row->values, 1);
+}
+
+/** Inject a sequence of samples into a Measurement Point, under one lock.
+ *
+ * \param mp pointer to OmlMP into which the new samples are being injected
+ * \param rows nrows arrays of mp->param_count OmlValueU, laid out back-to-back
+ * \param nrows number of samples in rows
+ * \return 0 on success, <0 otherwise
+ *
+ * This is the processing part of omlc_inject and omlc_inject_batch, without
+ * the argument checks nor the choice of injection mode. It is also used by the
+ * injection ring consumer to apply the filters to a run of samples queued by
+ * one thread.
+ *
+ * When there is more than one sample, the BufferedWriters of all MSs are also
+ * locked for the whole run, if they can all be.
+ *
+ * \see omlc_inject, omlc_inject_batch, inject_ring_push, omlc_mp_batch
+ */
+int
+omlc_inject_rows(OmlMP *mp, OmlValueU *rows, unsigned int nrows)
+{
+  OmlMStream* ms;
+  OmlValueU *values;
+  unsigned int r;
+  int i;
+
+  LOGDEBUG("Injecting %u samples into MP '%s'\n", nrows, mp->name);
+
+  /* Typed views of the injected values, sharing their storage */
+  OmlValue fields[mp->param_count > 0 ? mp->param_count : 1];
+  for (i = 0; i < mp->param_count; i++) {
+    fields[i].type = mp->param_defs[i].param_types;
+  }
 
-  oml_value_init(&v);
   if (mp_lock(mp) == -1) {
     logwarn("Cannot lock MP '%s' for injection\n", mp->name);
     return -1;
@@ -170,17 +608,36 @@ omlc_inject(OmlMP *mp, OmlValueU *values)
 
   uint64_t written = 0;
   uint64_t dropped = 0;
-  for (ms = mp->streams; ms; ms = ms->next) {
-    LOGDEBUG("Filtering MP '%s' data into MS '%s'\n", mp->name, ms->table_name);
-    OmlFilter* f = ms->filters;
-    for (; f != NULL; f = f->next) {
-
-      /* FIXME:  Should validate this indexing */
-      oml_value_set(&v, &values[f->index], mp->param_defs[f->index].param_types);
+  int batched = 0;
+  if (nrows > 1) {
+    /* Otherwise, the samples are written one by one */
+    batched = (omlc_mp_batch(mp, 1) == 0);
+  }
+  for (r = 0, values = rows; r < nrows; r++, values += mp->param_count) {
+    for (i = 0; i < mp->param_count; i++) {
+      fields[i].value = values[i];
+    }
+    for (ms = mp->streams; ms; ms = ms->next) {
+      if (filter_passthrough(ms)) {
+        LOGDEBUG("Outputting MP '%s' data into MS '%s'\n", mp->name, ms->table_name);
+        filter_process_sample(ms, fields);
+        continue;
+      }
 
-      f->input(f, &v);
+      LOGDEBUG("Filtering MP '%s' data into MS '%s'\n", mp->name, ms->table_name);
+      OmlFilter* f = ms->filters;
+      for (; f != NULL; f = f->next) {
+        /* FIXME:  Should validate this indexing */
+        /* Filters keep a copy of what they need */
+        f->input(f, &fields[f->index]);
+      }
+      omlc_ms_process(ms);
     }
-    omlc_ms_process(ms);
+  }
+  if (batched) {
+    omlc_mp_batch(mp, 0);
+  }
+  for (ms = mp->streams; ms; ms = ms->next) {
     written += ms->written;
     dropped += ms->dropped;
     for (i=0; i<ms->nwriters; i++) {
@@ -188,7 +645,6 @@ omlc_inject(OmlMP *mp, OmlValueU *values)
     }
   }
   mp_unlock(mp);
-  oml_value_reset(&v);
 
   /* do we need to send client instrumentation? */
   if(mp != omlc_instance->client_instr && omlc_instance->instr_interval) {
@@ -196,7 +652,10 @@ omlc_inject(OmlMP *mp, OmlValueU *values)
     time(&now);
     if(omlc_instance->instr_time + omlc_instance->instr_interval <= now) {
       omlc_instance->instr_time = now; /* Make sure we don't loop */
-      omlc_inject_client_instr(written, dropped, xmemnew(), xmemfreed(), xmembytes(), xmaxbytes());
+      omlc_inject_client_instr(written, dropped, xmemnew(), xmemfreed(), xmembytes(), xmaxbytes(),
+          inject_ring_nfull_reset(), filter_engine_nmissed_reset(),
+          bw_policy_count_reset(BW_POLICY_DROP_OLDEST), bw_policy_count_reset(BW_POLICY_DROP_NEWEST),
+          bw_policy_count_reset(BW_POLICY_BLOCK), bw_policy_count_reset(BW_POLICY_THIN));
     }
   }
 
@@ -280,25 +739,104 @@ omlc_inject_metadata(OmlMP *mp, const char *key, const OmlValueU *value, OmlValu
  * \param bytes_freed number of previously allocated bytes freed
  * \param bytes_in_use number of bytes currently allocated
  * \param bytes_max total number of bytes allocated
+ * \param ring_full number of samples dropped because an injection ring was full
+ * \param interval_missed number of periodic reports missed by the filter scheduler
+ * \param queue_dropped_oldest number of samples dropped from the oldest data of a full queue
+ * \param queue_dropped_newest number of samples dropped from the newest data of a full queue
+ * \param queue_blocked number of times a writer waited for room in a full queue
+ * \param queue_thinned number of samples thinned out of a queue above its high-water mark
  * \return 0 on success, -1 otherwise
  *
- * \see omlc_inject
+ * \see omlc_inject, inject_ring_nfull_reset, filter_engine_nmissed_reset, bw_policy_count_reset
  */
 static int
 omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_dropped,
-    uint64_t bytes_allocated, uint64_t bytes_freed, uint64_t bytes_in_use, uint64_t bytes_max)
+    uint64_t bytes_allocated, uint64_t bytes_freed, uint64_t bytes_in_use, uint64_t bytes_max,
+    uint32_t ring_full, uint32_t interval_missed,
+    uint32_t queue_dropped_oldest, uint32_t queue_dropped_newest,
+    uint32_t queue_blocked, uint32_t queue_thinned)
 {
-  OmlValueU values[6];
-  omlc_zero_array(values, 6);
+  OmlValueU values[12];
+  omlc_zero_array(values, 12);
   omlc_set_uint32(values[0], measurements_injected);
   omlc_set_uint32(values[1], measurements_dropped);
   omlc_set_uint64(values[2], bytes_allocated);
   omlc_set_uint64(values[3], bytes_freed);
   omlc_set_uint64(values[4], bytes_in_use);
   omlc_set_uint64(values[5], bytes_max);
+  omlc_set_uint32(values[6], ring_full);
+  omlc_set_uint32(values[7], interval_missed);
+  omlc_set_uint32(values[8], queue_dropped_oldest);
+  omlc_set_uint32(values[9], queue_dropped_newest);
+  omlc_set_uint32(values[10], queue_blocked);
+  omlc_set_uint32(values[11], queue_thinned);
   return omlc_inject(omlc_instance->client_instr, values);
 }
 
+/** Check whether one of the streams of an MP uses a writer.
+ *
+ * \param mp pointer to the OmlMP whose streams to check
+ * \param w OmlWriter to look for
+ * \return 1 if the writer is used, 0 otherwise
+ * \see omlc_mp_batch
+ */
+static int
+omlc_mp_uses_writer(OmlMP* mp, OmlWriter *w)
+{
+  OmlMStream *ms;
+  int i;
+
+  for (ms = mp->streams; ms; ms = ms->next) {
+    for (i = 0; i < ms->nwriters; i++) {
+      if (ms->writers[i] == w) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/** Start or end a batch on all the BufferedWriters used by an MP's streams.
+ *
+ * To avoid deadlocks between concurrent batches on different MPs, the
+ * BufferedWriters are always locked in the order of the global writer list.
+ *
+ * If a batch cannot be begun on one of the BufferedWriters, those already
+ * begun on the previous ones are ended, so the samples can be written
+ * without batching.
+ *
+ * A lock for the MP must be held before calling this function.
+ *
+ * \param mp pointer to the OmlMP whose writers to lock or unlock
+ * \param begin 1 to lock the writers with bw_batch_begin, 0 to release them with bw_batch_end
+ * \return 0 on success, -1 if the batches could not be begun
+ * \see bw_batch_begin, bw_batch_end
+ */
+static int
+omlc_mp_batch(OmlMP* mp, int begin)
+{
+  OmlWriter *w, *failed;
+
+  for (w = omlc_instance->first_writer; w; w = w->next) {
+    if (!w->bufferedWriter || !omlc_mp_uses_writer(mp, w)) {
+      continue;
+    }
+    if (!begin) {
+      bw_batch_end(w->bufferedWriter);
+
+    } else if (bw_batch_begin(w->bufferedWriter)) {
+      logwarn("Cannot begin a batch on the BufferedWriter of MP '%s'\n", mp->name);
+      for (failed = w, w = omlc_instance->first_writer; w != failed; w = w->next) {
+        if (w->bufferedWriter && omlc_mp_uses_writer(mp, w)) {
+          bw_batch_end(w->bufferedWriter);
+        }
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
 /** Called when the particular MS has been filled.
  *
  * Determine whether a new sample must be issued (in per-sample reporting), and
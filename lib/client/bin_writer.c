@@ -52,6 +52,10 @@ typedef struct OmlBinWriter {
   OmlWriter* next;
   /** \see OmlWriter::bufferedWriter */
   BufferedWriterHdl bufferedWriter;
+  /** \see OmlWriter::encode */
+  oml_writer_encode encode;
+  /** \see OmlWriter::out_encoded */
+  oml_writer_out_encoded out_encoded;
 
   /*
    * Fields specific to the OmlBinWriter
@@ -69,6 +73,33 @@ typedef struct OmlBinWriter {
   /* Type of messages to generate */
   OmlBinMsgType msgtype;
 
+  /** Delta-encoding state of each stream, for compact messages */
+  OmlBinStreamState streams[OMB_MAX_STREAMS];
+  /** BufferedWriter epoch in which each stream's state was last updated \see bw_epoch */
+  unsigned long stream_epochs[OMB_MAX_STREAMS];
+
+  /** MBuffer containing the batch packet rows can be added to, or NULL */
+  MBuffer* batch_mbuf;
+  /** Offset of the current batch packet in batch_mbuf */
+  size_t batch_offset;
+  /** Offset of the end of the current batch packet in batch_mbuf */
+  size_t batch_end;
+  /** BufferedWriter epoch in which the current batch packet was written \see bw_epoch */
+  unsigned long batch_epoch;
+  /** Stream of the current batch packet */
+  int batch_stream;
+  /** Number of rows in the current batch packet */
+  int batch_rows;
+  /** Number of values written so far in the current row of a batch packet */
+  int batch_values;
+  /** Set to 1 when the current row is being written into a batch packet */
+  int in_batch;
+
+  /** MarshalPlan of the MS of the current row, or NULL */
+  const MarshalPlan* plan;
+  /** Index in plan of the next value of the current row */
+  int plan_pos;
+
 } OmlBinWriter;
 
 static int owb_meta(OmlWriter* writer, char* str);
@@ -76,6 +107,8 @@ static int owb_header_done(OmlWriter* writer);
 
 static int owb_row_start(OmlWriter* writer, OmlMStream* ms, double now);
 static int owb_row_cols(OmlWriter* writer, OmlValue* values, int value_count);
+static int owb_encode(OmlWriter* writer, MBuffer* mbuf, OmlMStream* ms, int first, OmlValue* values, int value_count);
+static int owb_row_cols_encoded(OmlWriter* writer, const uint8_t* data, size_t length, int value_count);
 static int owb_row_end(OmlWriter* writer, OmlMStream* ms);
 
 static OmlWriter *owb_close(OmlWriter* writer);
@@ -104,9 +137,15 @@ bin_writer_new(OmlOutStream* out_stream)
   self->row_start = owb_row_start;
   self->row_end = owb_row_end;
   self->out = owb_row_cols;
+  self->encode = owb_encode;
+  self->out_encoded = owb_row_cols_encoded;
   self->close = owb_close;
 
-  self->msgtype = OMB_DATA_P; // Short packets.
+  if (omlc_instance->protocol >= OMB_COMPACT_PROTOCOL) {
+    self->msgtype = OMB_CDATA_P; // Short compact packets.
+  } else {
+    self->msgtype = OMB_DATA_P; // Short packets.
+  }
 
   return (OmlWriter*)self;
 }
@@ -142,8 +181,12 @@ owb_header_done(OmlWriter* writer)
 }
 
 /** Function called for every result value in a measurement tuple (sample)
+ *
+ * If the MS has a MarshalPlan, the values are marshalled following it, as the
+ * next fields of the row.
+ *
  * \see oml_writer_out
- * \see marshal_values
+ * \see marshal_values, marshal_plan_values
  */
 static int
 owb_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
@@ -154,10 +197,69 @@ owb_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
     return 0; /* previous use of mbuf failed */
   }
 
-  int cnt = marshal_values(mbuf, values, value_count);
+  int first = self->plan_pos;
+  self->plan_pos += value_count;
+
+  if (self->in_batch) {
+    /* Filters may each output some of the values */
+    self->batch_values += value_count;
+    if (self->plan) {
+      return marshal_plan_batch_values(mbuf, self->plan, first, values, value_count) == 1;
+    }
+    return marshal_batch_values(mbuf, values, value_count, omlc_instance->protocol) == 1;
+  }
+
+  if (self->plan) {
+    return marshal_plan_values(mbuf, self->plan, first, values, value_count) == 1;
+  }
+
+  int cnt = marshal_values2(mbuf, values, value_count, omlc_instance->protocol);
   return cnt == value_count;
 }
 
+/** Function called to marshal values for several writers
+ *
+ * The values are marshalled as in a batch packet, without touching any
+ * message header, following the MarshalPlan of the MS if it has one.
+ *
+ * \see oml_writer_encode
+ * \see marshal_plan_batch_values, marshal_batch_values
+ */
+static int
+owb_encode(OmlWriter* writer, MBuffer* mbuf, OmlMStream* ms, int first, OmlValue* values, int value_count)
+{
+  (void)writer;
+  if (ms->plan) {
+    return marshal_plan_batch_values(mbuf, ms->plan, first, values, value_count) == 1;
+  }
+  return marshal_batch_values(mbuf, values, value_count, omlc_instance->protocol) == 1;
+}
+
+/** Function called with values marshalled by owb_encode, instead of owb_row_cols
+ * \see oml_writer_out_encoded
+ * \see marshal_encoded_values
+ */
+static int
+owb_row_cols_encoded(OmlWriter* writer, const uint8_t* data, size_t length, int value_count)
+{
+  OmlBinWriter* self = (OmlBinWriter*)writer;
+  MBuffer* mbuf;
+  if ((mbuf = self->mbuf) == NULL) {
+    return 0; /* previous use of mbuf failed */
+  }
+
+  if (self->in_batch) {
+    /* The message being written is only this row, its header is updated by owb_row_end */
+    self->batch_values += value_count;
+    if (mbuf_write(mbuf, data, length)) {
+      mbuf_reset_write(mbuf);
+      return 0;
+    }
+    return 1;
+  }
+  return marshal_encoded_values(mbuf, data, length, value_count) == 1;
+}
+
 /** Function called after all items in a tuple have been sent
  * \see oml_writer_row_start
  *
@@ -167,7 +269,19 @@ owb_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
  * This acquires a lock on the BufferedWriter (bw_get_write_buf(...,
  * exclusive=1)).
  *
- * \see BufferedWriter, bw_get_write_buf, marshal_init, marshal_measurements
+ * With compact messages, the sequence number and timestamp are delta-encoded
+ * against the previous message of the same stream, unless it was written in a
+ * different BufferedWriter epoch, as the server might then not receive it
+ * just before this one. Schema 0 messages are always absolute, as they are
+ * also replayed on their own after a reconnection.
+ *
+ * With batch messages, if the last message in the MBuffer is a batch for the
+ * same stream, written in the current BufferedWriter epoch (so the reader
+ * has not started sending it), the new row is added to it rather than to a
+ * new message. Schema 0 rows are never batched.
+ *
+ * \see BufferedWriter, bw_get_write_buf, bw_epoch, marshal_init, marshal_measurements, marshal_measurements_compact
+ * \see marshal_batch_init, marshal_batch_row
  * \see gettimeofday(3)
  */
 static int
@@ -181,8 +295,44 @@ owb_row_start(OmlWriter* writer, OmlMStream* ms, double now)
     return 0;
   }
 
+  self->in_batch = 0;
+  self->plan = ms->plan;
+  self->plan_pos = 0;
+  if (omlc_instance->protocol >= OMB_BATCH_PROTOCOL && 0 != ms->index) {
+    unsigned long epoch = bw_epoch(self->bufferedWriter);
+    int idx = ms->index & (OMB_MAX_STREAMS - 1);
+    if (self->batch_mbuf == mbuf && self->batch_epoch == epoch &&
+        self->batch_stream == ms->index && self->batch_end == mbuf_write_offset(mbuf) &&
+        self->batch_rows < UINT16_MAX) {
+      /* mbuf_begin_write was called by owb_row_end, so a failure only resets this row */
+      marshal_batch_row(mbuf, ms->seq_no, now, &self->streams[idx], 0);
+    } else {
+      marshal_init (mbuf, OMB_BATCH_P);
+      self->batch_mbuf = mbuf;
+      self->batch_offset = mbuf_message_offset(mbuf);
+      self->batch_epoch = epoch;
+      self->batch_stream = ms->index;
+      self->batch_rows = 0;
+      marshal_batch_init(mbuf, ms->index);
+      marshal_batch_row(mbuf, ms->seq_no, now, &self->streams[idx],
+          self->stream_epochs[idx] != epoch);
+    }
+    self->stream_epochs[idx] = epoch;
+    self->batch_values = 0;
+    self->in_batch = 1;
+    return 1;
+  }
+
   marshal_init (mbuf, self->msgtype);
-  marshal_measurements(mbuf, ms->index, ms->seq_no, now);
+  if (OMB_CDATA_P == self->msgtype || OMB_LCDATA_P == self->msgtype) {
+    unsigned long epoch = bw_epoch(self->bufferedWriter);
+    int idx = ms->index & (OMB_MAX_STREAMS - 1);
+    marshal_measurements_compact(mbuf, ms->index, ms->seq_no, now, &self->streams[idx],
+        (0 == idx || self->stream_epochs[idx] != epoch));
+    self->stream_epochs[idx] = epoch;
+  } else {
+    marshal_measurements2(mbuf, ms->index, ms->seq_no, now, omlc_instance->protocol);
+  }
   return 1;
 }
 
@@ -191,7 +341,7 @@ owb_row_start(OmlWriter* writer, OmlMStream* ms, double now)
  *
  * This releases the lock on the BufferedWriter.
  *
- * \see BufferedWriter, bw_unlock_buf, marshal_finalize
+ * \see BufferedWriter, bw_unlock_buf, marshal_finalize, marshal_batch_finalize
  */
 static int
 owb_row_end(OmlWriter* writer, OmlMStream* ms) {
@@ -202,9 +352,40 @@ owb_row_end(OmlWriter* writer, OmlMStream* ms) {
     return 0; /* previous use of mbuf failed */
   }
 
+  if (self->in_batch) {
+    self->in_batch = 0;
+    if (0 == mbuf_message_length(mbuf) ||
+        (self->batch_rows = marshal_batch_finalize(mbuf,
+                                                   self->batch_offset, self->batch_values)) < 0) {
+      /* Marshalling failed; drop this row, and start a new absolute batch
+       * with the next one */
+      mbuf_reset_write(mbuf);
+      self->stream_epochs[ms->index & (OMB_MAX_STREAMS - 1)] = 0;
+      self->batch_mbuf = NULL;
+    } else {
+      self->batch_end = mbuf_write_offset(mbuf);
+      bw_msgcount_add(self->bufferedWriter, 1);
+    }
+    mbuf_begin_write(mbuf);
+    self->mbuf = NULL;
+    bw_unlock_buf(self->bufferedWriter);
+    return 1;
+  }
+
+  if (0 == mbuf_message_length(mbuf)) {
+    /* Marshalling failed and the message was reset; don't delta-encode
+     * the next one against it */
+    self->stream_epochs[ms->index & (OMB_MAX_STREAMS - 1)] = 0;
+  }
+
   marshal_finalize(self->mbuf);
-  if (marshal_get_msgtype (self->mbuf) == OMB_LDATA_P) {
-    self->msgtype = OMB_LDATA_P; // Generate long packets from now on.
+  switch (marshal_get_msgtype (self->mbuf)) {
+  case OMB_LDATA_P:
+  case OMB_LCDATA_P:
+    self->msgtype = marshal_get_msgtype (self->mbuf); // Generate long packets from now on.
+    break;
+  default:
+    break;
   }
 
   if (0 == ms->index) {
@@ -18,16 +18,26 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <stdint.h>
 
 #include "oml2/omlc.h"
 #include "ocomm/o_log.h"
 #include "ocomm/o_socket.h"
+#include "mem.h"
 
 #include "client.h"
 #include "buffered_writer.h"
 
 /** Default target size in each MBuffer of the chunk */
 #define DEF_CHAIN_BUFFER_SIZE 1024
+/** Default time writers wait for room with BW_POLICY_BLOCK [ms] */
+#define DEF_BLOCK_TIMEOUT 1000
+/** Default fraction of samples kept with BW_POLICY_THIN (one in DEF_THIN_KEEP) */
+#define DEF_THIN_KEEP 10
+/** Default high-water mark above which BW_POLICY_THIN thins samples [%] */
+#define DEF_THIN_HWM 75
 
 /** A chunk of data to be put in a circular chain */
 typedef struct BufferChunk {
@@ -40,7 +50,8 @@ typedef struct BufferChunk {
   /** Target maximal size of mbuf for that chunk */
   size_t   targetBufSize;
 
-  /** Set to 1 when the reader is processing this chunk */
+  /** Set to 1 when the reader has claimed this chunk and is sending its
+   * content without holding the BufferedWriter lock; writers must not touch it */
   int   reading;
 
   int nmessages; /**< Number of messages contained in this chunk */
@@ -64,9 +75,13 @@ typedef struct BufferedWriter {
   BufferChunk* writerChunk;
   /** Immutable entry into the chain */
   BufferChunk* firstChunk;
+  /** Next chunk to be sent by the reader thread (oldest data) */
+  BufferChunk* readerChunk;
 
   /** Buffer holding protocol headers */
   MBuffer*     meta_buf;
+  /** Copy of meta_buf owned by the reader thread, so it can be used without the lock */
+  MBuffer*     reader_meta_buf;
 
   /** Mutex protecting the object */
   pthread_mutex_t lock;
@@ -86,14 +101,77 @@ typedef struct BufferedWriter {
 
   int nlost; /**< Number of lost messages since last query */
 
+  /** Incremented whenever data already written may not be sent contiguously
+   * with what is written next \see bw_epoch */
+  unsigned long epoch;
+
+  /** Set to 1 while a thread holds the lock across several writes; only
+   * accessed with the lock held \see bw_batch_begin */
+  int batching;
+  /** Thread holding the lock across several writes, if batching */
+  pthread_t batch_owner;
+
+  /** Path of the spill file, or NULL if spilling is disabled \see bw_set_spill */
+  char* spill_path;
+  /** Descriptor of the spill file, or -1 */
+  int spill_fd;
+  /** Maximal size of the spill file [B] */
+  size_t spill_quota;
+  /** Number of appended chunks after which the spill file is fsync(2)ed; 0 never does */
+  int spill_sync;
+  /** Number of chunks appended since the last fsync(2) */
+  int spill_unsynced;
+  /** Amount of data in the spill file [B] */
+  size_t spill_size;
+  /** Offset of the next record to replay from the spill file [B] */
+  size_t spill_read;
+  /** Buffer for the record being replayed, owned by the reader thread */
+  uint8_t* spill_buf;
+  /** Allocated size of spill_buf [B] */
+  size_t spill_buf_size;
+
+  /** What to do when the queue is full \see bw_set_policy */
+  BwPolicy policy;
+  /** Signalled by the reader thread when it frees a chunk, for BW_POLICY_BLOCK */
+  pthread_cond_t room;
+  /** Maximal time to wait for room with BW_POLICY_BLOCK [ms] */
+  long block_timeout;
+  /** BW_POLICY_THIN keeps one in thin_keep samples above the high-water mark */
+  int thin_keep;
+  /** High-water mark, as a percentage of the queue, above which BW_POLICY_THIN thins samples */
+  int thin_hwm;
+  /** Number of samples seen since the queue went above the high-water mark */
+  unsigned int thin_count;
+  /** Total number of chunks the queue can hold */
+  long nchunks;
+  /** Number of full chunks waiting to be sent, kept up to date for BW_POLICY_THIN */
+  long queued;
+
 } BufferedWriter;
+
+/** Number of samples affected by each overflow policy since last query \see bw_policy_count_reset */
+static uint32_t npolicy[BW_POLICY_MAX];
 #define REATTEMP_INTERVAL 5    //! Seconds to open the stream again
 
 static BufferChunk* getNextWriteChunk(BufferedWriter* self, BufferChunk* current);
+static BufferChunk* getNextReadChunk(BufferedWriter* self);
+static void releaseReadChunk(BufferedWriter* self, BufferChunk* chunk, int allsent);
 static BufferChunk* createBufferChunk(BufferedWriter* self);
 static int destroyBufferChain(BufferedWriter* self);
+static int backoffDeadline(BufferedWriter* self, struct timespec* deadline);
 static void* threadStart(void* handle);
-static int processChunk(BufferedWriter* self, BufferChunk* chunk);
+static int processChunk(BufferedWriter* self, BufferChunk* chunk, MBuffer* meta);
+static int processBuffer(BufferedWriter* self, uint8_t* buf, size_t size, MBuffer* meta);
+static int lockUnlessBatching(BufferedWriter* self);
+static int spillPending(BufferedWriter* self);
+static int spillChunk(BufferedWriter* self, BufferChunk* chunk);
+static int replaySpill(BufferedWriter* self, size_t offset, MBuffer* meta, size_t* length);
+static void releaseSpill(BufferedWriter* self, size_t length, int allsent);
+static void dropNewest(BufferedWriter* self, BufferChunk* current);
+static int queueFull(BufferedWriter* self);
+static int waitForRoom(BufferedWriter* self);
+static int thinSample(BufferedWriter* self);
+static void updateQueued(BufferedWriter* self);
 
 /** Create a BufferedWriter instance
  *
@@ -118,24 +196,34 @@ bw_create(OmlOutStream* outStream, long  queueCapacity, long chunkSize)
     memset(self, 0, sizeof(BufferedWriter));
 
     self->outStream = outStream;
+    self->spill_fd = -1;
     /* This forces a 'connected' INFO message upon first connection */
     self->backoff = 1;
+    /* So users can initialise their copy to 0 to mean 'no epoch' */
+    self->epoch = 1;
 
     self->bufSize = chunkSize > 0 ? chunkSize : DEF_CHAIN_BUFFER_SIZE;
 
     nchunks = queueCapacity / self->bufSize;
     self->unallocatedBuffers = (nchunks > 2) ? nchunks : 2; /* at least two chunks */
+    self->nchunks = self->unallocatedBuffers;
+    self->block_timeout = DEF_BLOCK_TIMEOUT;
+    self->thin_keep = DEF_THIN_KEEP;
+    self->thin_hwm = DEF_THIN_HWM;
 
     logdebug ("%s: Buffer size %dB (%d chunks of %dB)\n",
         self->outStream->dest,
         self->unallocatedBuffers*self->bufSize,
         self->unallocatedBuffers, self->bufSize);
 
-    if(NULL == (self->writerChunk = self->firstChunk = createBufferChunk(self))) {
+    if(NULL == (self->writerChunk = self->readerChunk =
+          self->firstChunk = createBufferChunk(self))) {
       oml_free(self);
       self = NULL;
 
-    } else if(NULL == (self->meta_buf = mbuf_create())) {
+    } else if(NULL == (self->meta_buf = mbuf_create()) ||
+        NULL == (self->reader_meta_buf = mbuf_create())) {
+      mbuf_destroy(self->meta_buf);
       destroyBufferChain(self);
       oml_free(self);
       self = NULL;
@@ -143,7 +231,13 @@ bw_create(OmlOutStream* outStream, long  queueCapacity, long chunkSize)
     } else {
       /* Initialize mutex and condition variable objects */
       pthread_cond_init(&self->semaphore, NULL);
-      pthread_mutex_init(&self->lock, NULL);
+      pthread_cond_init(&self->room, NULL);
+      /* Error-checking, so the thread holding it for a batch can tell */
+      pthread_mutexattr_t mattr;
+      pthread_mutexattr_init(&mattr);
+      pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_ERRORCHECK);
+      pthread_mutex_init(&self->lock, &mattr);
+      pthread_mutexattr_destroy(&mattr);
 
       /* Initialize and set thread detached attribute */
       pthread_attr_t tattr;
@@ -175,6 +269,7 @@ bw_close(BufferedWriterHdl instance)
   loginfo ("%s: Waiting for buffered queue thread to drain...\n", self->outStream->dest);
 
   pthread_cond_signal (&self->semaphore);
+  pthread_cond_broadcast (&self->room);
   oml_unlock (&self->lock, __FUNCTION__);
 
   if(pthread_join (self->readerThread, (void**)&retval)) {
@@ -190,11 +285,177 @@ bw_close(BufferedWriterHdl instance)
     }
   }
 
+  if (self->spill_fd >= 0) {
+    close(self->spill_fd);
+    if (spillPending(self)) {
+      logwarn ("%s: %dB of data could not be replayed, and are left in '%s'\n",
+          self->outStream->dest, self->spill_size - self->spill_read, self->spill_path);
+    } else {
+      unlink(self->spill_path);
+    }
+  }
   self->outStream->close(self->outStream);
+  oml_free(self->spill_path);
+  oml_free(self->spill_buf);
   destroyBufferChain(self);
+  mbuf_destroy(self->meta_buf);
+  mbuf_destroy(self->reader_meta_buf);
   oml_free(self);
 }
 
+/** Spill data to a local file instead of dropping it when the queue is full.
+ *
+ * Once the queue is full, full chunks are appended to the spill file rather
+ * than dropping older data. As long as the spill file contains data, all new
+ * chunks are also appended to it, so data is sent in order. The reader thread
+ * replays the spill file after the older chunks still in memory have been
+ * sent, and empties it once everything has been replayed.
+ *
+ * Data is only dropped when the spill file would grow beyond quota.
+ *
+ * \param instance BufferedWriter handle
+ * \param path path of the spill file, truncated if it exists
+ * \param quota maximal size of the spill file [B]
+ * \param sync number of chunks appended to the spill file between calls to fsync(2); 0 leaves it to the OS
+ * \return 0 on success, -1 otherwise
+ * \see spillChunk, replaySpill
+ */
+int
+bw_set_spill(BufferedWriterHdl instance, const char* path, size_t quota, int sync)
+{
+  BufferedWriter* self = (BufferedWriter*)instance;
+  int fd;
+
+  assert(path);
+  if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600)) < 0) {
+    logerror ("%s: Cannot open spill file '%s': %s\n", self->outStream->dest,
+        path, strerror(errno));
+    return -1;
+  }
+
+  if (oml_lock(&self->lock, __FUNCTION__)) {
+    close(fd);
+    return -1;
+  }
+  if (self->spill_fd >= 0) {
+    close(self->spill_fd);
+    unlink(self->spill_path);
+    oml_free(self->spill_path);
+  }
+  self->spill_fd = fd;
+  self->spill_path = oml_strndup(path, strlen(path));
+  self->spill_quota = quota;
+  self->spill_sync = sync;
+  self->spill_size = self->spill_read = 0;
+  oml_unlock(&self->lock, __FUNCTION__);
+
+  logdebug ("%s: Spilling up to %dB to '%s' when the queue is full\n",
+      self->outStream->dest, quota, path);
+  return 0;
+}
+
+/** Select what to do when the queue is full.
+ *
+ * The policy is given as a string, with optional colon-separated parameters:
+ * - drop-oldest: drop the oldest chunk of data to make room (default);
+ * - drop-newest: drop the newest data instead, keeping what is already queued;
+ * - block[:TIMEOUT]: block writers for up to TIMEOUT ms (DEF_BLOCK_TIMEOUT)
+ *   until the reader thread frees a chunk, then drop the newest data;
+ * - thin[:KEEP[:HWM]]: once more than HWM% (DEF_THIN_HWM) of the queue is
+ *   used, only keep one in KEEP (DEF_THIN_KEEP) samples; if the queue still
+ *   fills up, drop the oldest data.
+ *
+ * If a spill file is set, it is used before any data is dropped, and writers
+ * do not block.
+ *
+ * \param instance BufferedWriter handle
+ * \param spec policy specification
+ * \return 0 on success, -1 if spec is invalid
+ * \see bw_set_spill, bw_policy_count_reset
+ */
+int
+bw_set_policy(BufferedWriterHdl instance, const char* spec)
+{
+  BufferedWriter* self = (BufferedWriter*)instance;
+  BwPolicy policy;
+  long param[2] = { -1, -1 };
+  const char *p;
+  char *end;
+  int nparams = 0, maxparams = 0;
+  size_t len;
+
+  assert(spec);
+  len = strcspn(spec, ":");
+  if (!strncmp(spec, "drop-oldest", len) && len == strlen("drop-oldest")) {
+    policy = BW_POLICY_DROP_OLDEST;
+  } else if (!strncmp(spec, "drop-newest", len) && len == strlen("drop-newest")) {
+    policy = BW_POLICY_DROP_NEWEST;
+  } else if (!strncmp(spec, "block", len) && len == strlen("block")) {
+    policy = BW_POLICY_BLOCK;
+    maxparams = 1;
+  } else if (!strncmp(spec, "thin", len) && len == strlen("thin")) {
+    policy = BW_POLICY_THIN;
+    maxparams = 2;
+  } else {
+    logerror ("%s: Unknown queue overflow policy '%s'\n", self->outStream->dest, spec);
+    return -1;
+  }
+
+  for (p = spec + len; *p == ':' && nparams < maxparams; p = end) {
+    param[nparams] = strtol(p + 1, &end, 10);
+    if (end == p + 1 || param[nparams] < 0) {
+      break;
+    }
+    nparams++;
+  }
+  if (*p) {
+    logerror ("%s: Invalid parameters in queue overflow policy '%s'\n",
+        self->outStream->dest, spec);
+    return -1;
+  }
+  if (BW_POLICY_THIN == policy &&
+      (0 == param[0] || param[1] > 100)) {
+    logerror ("%s: Thinning must keep at least one sample, below a high-water mark of at most 100%%: '%s'\n",
+        self->outStream->dest, spec);
+    return -1;
+  }
+
+  if (oml_lock(&self->lock, __FUNCTION__)) {
+    return -1;
+  }
+  self->policy = policy;
+  if (BW_POLICY_BLOCK == policy) {
+    self->block_timeout = param[0] >= 0 ? param[0] : DEF_BLOCK_TIMEOUT;
+  } else if (BW_POLICY_THIN == policy) {
+    self->thin_keep = param[0] > 0 ? param[0] : DEF_THIN_KEEP;
+    self->thin_hwm = param[1] >= 0 ? param[1] : DEF_THIN_HWM;
+    updateQueued(self);
+  }
+  oml_unlock(&self->lock, __FUNCTION__);
+
+  logdebug ("%s: Using queue overflow policy '%s'\n", self->outStream->dest, spec);
+  return 0;
+}
+
+/** Get the number of samples affected by an overflow policy since the last call.
+ *
+ * For BW_POLICY_DROP_OLDEST and BW_POLICY_DROP_NEWEST, this is the number of
+ * samples dropped from the oldest or newest data, respectively, regardless
+ * of the configured policy. For BW_POLICY_BLOCK, this is the number of times
+ * writers had to wait for room, and for BW_POLICY_THIN, the number of samples
+ * thinned out. Counts are aggregated over all BufferedWriters.
+ *
+ * \param policy BwPolicy for which to return the count
+ * \return the count before resetting it
+ * \see bw_set_policy
+ */
+uint32_t
+bw_policy_count_reset(BwPolicy policy)
+{
+  assert(policy < BW_POLICY_MAX);
+  return __atomic_exchange_n(&npolicy[policy], 0, __ATOMIC_RELAXED);
+}
+
 /** Add some data to the end of the queue.
  *
  * This function tries to acquire the lock on the BufferedWriter, and releases
@@ -238,7 +499,13 @@ _bw_push(BufferedWriterHdl instance, uint8_t* data, size_t size)
   if (chunk == NULL) { return 0; }
 
   if (mbuf_wr_remaining(chunk->mbuf) < size) {
-    chunk = getNextWriteChunk(self, chunk);
+    if (waitForRoom(self)) {
+      if (!self->active) { return 0; }
+      chunk = self->writerChunk;
+    }
+    if (mbuf_wr_remaining(chunk->mbuf) < size) {
+      chunk = getNextWriteChunk(self, chunk);
+    }
   }
 
   if (mbuf_write(chunk->mbuf, data, size) < 0) {
@@ -350,6 +617,27 @@ bw_nlost_reset(BufferedWriterHdl instance) {
   self->nlost = 0;
   return n;
 }
+
+/** Get the current epoch of the BufferedWriter.
+ *
+ * The epoch changes whenever the data written so far may not be sent
+ * immediately before the data written next, i.e., when writers move to a new
+ * chunk, or when data is dropped. Within the same epoch, the receiver is
+ * guaranteed to see all the messages, in order, even after reconnecting.
+ * Writers can use this to decide whether to delta-encode against previously
+ * written messages.
+ *
+ * The caller should hold the lock (e.g., with bw_get_write_buf(..., exclusive=1)).
+ *
+ * \param instance BufferedWriter handle
+ * \return the current epoch
+ * \see bw_get_write_buf
+ */
+unsigned long
+bw_epoch(BufferedWriterHdl instance) {
+  BufferedWriter* self = (BufferedWriter*)instance;
+  return self->epoch;
+}
 /** Return an MBuffer with (optional) exclusive write access
  *
  * If exclusive access is required, the caller is in charge of releasing the
@@ -365,18 +653,35 @@ MBuffer*
 bw_get_write_buf(BufferedWriterHdl instance, int exclusive)
 {
   BufferedWriter* self = (BufferedWriter*)instance;
-  if (oml_lock(&self->lock, __FUNCTION__)) { return 0; }
-  if (!self->active) { return 0; }
+  int batched = lockUnlessBatching(self);
+  if (batched < 0) { return 0; }
 
   BufferChunk* chunk = self->writerChunk;
-  if (chunk == NULL) { return 0; }
+  if (!self->active || chunk == NULL || thinSample(self)) {
+    if (!batched) {
+      oml_unlock(&self->lock, __FUNCTION__);
+    }
+    return 0;
+  }
 
   MBuffer* mbuf = chunk->mbuf;
   if (mbuf_write_offset(mbuf) >= chunk->targetBufSize) {
-    chunk = getNextWriteChunk(self, chunk);
+    if (waitForRoom(self)) {
+      /* Other writers may have moved on while waiting */
+      if (!self->active) {
+        if (!batched) {
+          oml_unlock(&self->lock, __FUNCTION__);
+        }
+        return 0;
+      }
+      chunk = self->writerChunk;
+    }
+    if (mbuf_write_offset(chunk->mbuf) >= chunk->targetBufSize) {
+      chunk = getNextWriteChunk(self, chunk);
+    }
     mbuf = chunk->mbuf;
   }
-  if (! exclusive) {
+  if (! exclusive && !batched) {
     oml_unlock(&self->lock, __FUNCTION__);
   }
   return mbuf;
@@ -392,16 +697,92 @@ void
 bw_unlock_buf(BufferedWriterHdl instance)
 {
   BufferedWriter* self = (BufferedWriter*)instance;
+  /* The caller holds the lock, either from bw_get_write_buf or for a batch;
+   * other threads can get it while the batch owner waits for room */
+  if (self->batching && pthread_equal(self->batch_owner, pthread_self())) {
+    return; /* bw_batch_end will do it */
+  }
   pthread_cond_signal(&self->semaphore); /* assume we locked for a reason */
   oml_unlock(&self->lock, __FUNCTION__);
 }
 
+/** Lock the BufferedWriter for a batch of writes.
+ *
+ * Until bw_batch_end is called, bw_get_write_buf and bw_unlock_buf calls from
+ * the same thread do not take nor release the lock, and the reader thread is
+ * only signalled once, at the end of the batch. Other writers block until
+ * then, unless this thread waits for room with BW_POLICY_BLOCK, which releases
+ * the lock.
+ *
+ * Batches cannot be nested.
+ *
+ * \param instance BufferedWriter handle
+ * \return 0 on success, -1 otherwise
+ * \see bw_batch_end, bw_get_write_buf, bw_unlock_buf
+ */
+int
+bw_batch_begin(BufferedWriterHdl instance)
+{
+  BufferedWriter* self = (BufferedWriter*)instance;
+  if (oml_lock(&self->lock, __FUNCTION__)) { return -1; }
+  self->batching = 1;
+  self->batch_owner = pthread_self();
+  return 0;
+}
+
+/** Terminate a batch of writes, signal the reader and release the lock.
+ *
+ * \param instance BufferedWriter handle
+ * \see bw_batch_begin
+ */
+void
+bw_batch_end(BufferedWriterHdl instance)
+{
+  BufferedWriter* self = (BufferedWriter*)instance;
+  self->batching = 0;
+  pthread_cond_signal(&self->semaphore);
+  oml_unlock(&self->lock, __FUNCTION__);
+}
+
+/** Acquire the lock, unless the current thread already holds it for a batch.
+ *
+ * The lock is error-checking, so trying to lock it again from the thread
+ * holding it fails with EDEADLK instead of blocking. Only bw_batch_begin
+ * keeps the lock across calls, so this identifies the batch owner, and
+ * batching is then read with the lock held.
+ *
+ * \param self BufferedWriter pointer
+ * \return 1 if this thread called bw_batch_begin, 0 if the lock was acquired, -1 on error
+ * \see bw_batch_begin
+ */
+static int
+lockUnlessBatching(BufferedWriter* self)
+{
+  int ret = pthread_mutex_lock(&self->lock);
+
+  if (EDEADLK == ret) {
+    assert(self->batching && pthread_equal(self->batch_owner, pthread_self()));
+    return 1;
+  } else if (ret) {
+    logwarn("%s: Couldn't get mutex lock (%s)\n", __FUNCTION__, strerror(ret));
+    return -1;
+  }
+  return 0;
+}
+
 /** Find the next empty write chunk, sets self->writeChunk to it and returns it.
  *
  * We only use the next one if it is empty. If not, we essentially just filled
  * up the last chunk and wrapped around to the socket reader. In that case, we
- * either create a new chunk if the overall buffer can still grow, or we drop
- * the data from the current one.
+ * either create a new chunk if the overall buffer can still grow, spill the
+ * current chunk to disk if a spill file is set, or we drop the data from the
+ * oldest one. If that oldest chunk is currently being sent by the reader
+ * thread, or if the policy says so (BW_POLICY_DROP_NEWEST, or
+ * BW_POLICY_BLOCK after the wait timed out), we drop the complete messages of
+ * the current chunk instead.
+ *
+ * Any partial message at the end of the current chunk is moved to the new
+ * writer chunk.
  *
  * This assumes that the current thread holds the self->lock and the lock on
  * the self->writeChunk.
@@ -417,7 +798,20 @@ getNextWriteChunk(BufferedWriter* self, BufferChunk* current) {
   BufferChunk* nextBuffer = current->next;
   assert(nextBuffer != NULL);
 
-  if (mbuf_rd_remaining(nextBuffer->mbuf) == 0) {
+  self->epoch++;
+
+  if (self->spill_fd >= 0 && (spillPending(self) ||
+        (mbuf_rd_remaining(nextBuffer->mbuf) > 0 && self->unallocatedBuffers <= 0)) &&
+      0 == spillChunk(self, current)) {
+    // The chain is full, or older data has already been spilled
+    return current;
+
+  } else if (spillPending(self)) {
+    // Could not spill, but newer data cannot overtake what already has been
+    dropNewest(self, current);
+    return current;
+
+  } else if (mbuf_rd_remaining(nextBuffer->mbuf) == 0) {
     // It's empty (the reader has finished with it), we can use it
     mbuf_clear2(nextBuffer->mbuf, 0);
     self->writerChunk = nextBuffer;
@@ -431,16 +825,26 @@ getNextWriteChunk(BufferedWriter* self, BufferChunk* current) {
     current->next = newBuffer;
     self->writerChunk = newBuffer;
 
+  } else if (nextBuffer->reading ||
+      BW_POLICY_DROP_NEWEST == self->policy || BW_POLICY_BLOCK == self->policy) {
+    // The chain is full, and either the oldest data is being sent, or it
+    // should be kept; drop the newest instead
+    dropNewest(self, current);
+    return current;
+
   } else {
     // The chain is full, time to drop data and reuse the next buffer
-    current = nextBuffer;
-    assert(nextBuffer->reading == 0); /* Ensure this is not the chunk currently being read */
     self->writerChunk = nextBuffer;
+    if (self->readerChunk == nextBuffer) {
+      // Don't let the reader send the new data before the older one
+      self->readerChunk = nextBuffer->next;
+    }
 
     nlost = bw_msgcount_reset(self);
     self->nlost += nlost;
+    __atomic_fetch_add(&npolicy[BW_POLICY_DROP_OLDEST], nlost, __ATOMIC_RELAXED);
     logwarn("Dropped %d samples (%dB)\n", nlost, mbuf_fill(nextBuffer->mbuf));
-    mbuf_repack_message2(self->writerChunk->mbuf);
+    mbuf_clear2(nextBuffer->mbuf, 0);
   }
 
   // Now we just need to copy the message from current to self->writerChunk
@@ -450,10 +854,371 @@ getNextWriteChunk(BufferedWriter* self, BufferChunk* current) {
     mbuf_reset_write(current->mbuf);
     bw_msgcount_add(self, 1);
   }
+  updateQueued(self);
 
   return self->writerChunk;
 }
 
+/** Drop the complete messages of the current writer chunk.
+ *
+ * Any partial message is moved to the beginning of the chunk.
+ *
+ * This assumes that the current thread holds the self->lock and the lock on
+ * the chunk.
+ *
+ * \param self BufferedWriter pointer
+ * \param current BufferChunk to drop messages from
+ * \see getNextWriteChunk
+ */
+static void
+dropNewest(BufferedWriter* self, BufferChunk* current)
+{
+  int nlost = current->nmessages;
+  current->nmessages = 0;
+  self->nlost += nlost;
+  __atomic_fetch_add(&npolicy[BW_POLICY_DROP_NEWEST], nlost, __ATOMIC_RELAXED);
+  logwarn("Dropped %d samples (%dB)\n", nlost, mbuf_message_offset(current->mbuf));
+  mbuf_repack_message2(current->mbuf);
+}
+
+/** Check whether the queue is full.
+ *
+ * The queue is full when the chunk after the writer chunk still holds data,
+ * and no new chunk can be allocated.
+ *
+ * This assumes that the current thread holds the self->lock.
+ *
+ * \param self BufferedWriter pointer
+ * \return 1 if the queue is full, 0 otherwise
+ */
+static int
+queueFull(BufferedWriter* self)
+{
+  return self->unallocatedBuffers <= 0 &&
+    mbuf_rd_remaining(self->writerChunk->next->mbuf) > 0;
+}
+
+/** Wait for room in the queue, with BW_POLICY_BLOCK.
+ *
+ * This is only called before writing a new message, when the writer chunk is
+ * full, so other writers can safely use the BufferedWriter while this thread
+ * waits. The wait ends when the reader thread frees a chunk, when the
+ * BufferedWriter is closed, or after self->block_timeout ms.
+ *
+ * This assumes that the current thread holds the self->lock, which is
+ * released while waiting.
+ *
+ * \param self BufferedWriter pointer
+ * \return 1 if the lock was released (and self->writerChunk may have changed), 0 otherwise
+ * \see bw_set_policy
+ */
+static int
+waitForRoom(BufferedWriter* self)
+{
+  struct timespec deadline;
+
+  if (BW_POLICY_BLOCK != self->policy || self->spill_fd >= 0 || !queueFull(self)) {
+    return 0;
+  }
+
+  __atomic_fetch_add(&npolicy[BW_POLICY_BLOCK], 1, __ATOMIC_RELAXED);
+  /* The reader is not signalled until the end of a batch */
+  pthread_cond_signal(&self->semaphore);
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += self->block_timeout / 1000;
+  deadline.tv_nsec += (self->block_timeout % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
+  }
+
+  while (self->active && queueFull(self)) {
+    if (ETIMEDOUT == pthread_cond_timedwait(&self->room, &self->lock, &deadline)) {
+      logdebug("%s: Still no room after %ldms\n", self->outStream->dest, self->block_timeout);
+      break;
+    }
+  }
+
+  return 1;
+}
+
+/** Decide whether to thin out a new sample, with BW_POLICY_THIN.
+ *
+ * Above the high-water mark, only one in self->thin_keep samples is kept.
+ * Data in the spill file counts as a full queue.
+ *
+ * This assumes that the current thread holds the self->lock.
+ *
+ * \param self BufferedWriter pointer
+ * \return 1 if the sample should be dropped, 0 otherwise
+ * \see bw_set_policy
+ */
+static int
+thinSample(BufferedWriter* self)
+{
+  if (BW_POLICY_THIN != self->policy) {
+    return 0;
+  }
+
+  if (!spillPending(self) &&
+      self->queued * 100 < self->thin_hwm * (self->nchunks - 1)) {
+    self->thin_count = 0;
+    return 0;
+  }
+
+  if (self->thin_count++ % self->thin_keep) {
+    __atomic_fetch_add(&npolicy[BW_POLICY_THIN], 1, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+/** Count the full chunks waiting to be sent, for BW_POLICY_THIN.
+ *
+ * These are the chunks from the reader chunk up to, but excluding, the writer
+ * chunk. This walks the chain, so is only done when chunks change hands.
+ *
+ * This assumes that the current thread holds the self->lock.
+ *
+ * \param self BufferedWriter pointer
+ */
+static void
+updateQueued(BufferedWriter* self)
+{
+  BufferChunk* chunk;
+
+  if (BW_POLICY_THIN != self->policy) {
+    return;
+  }
+
+  self->queued = 0;
+  for (chunk = self->readerChunk; chunk != self->writerChunk; chunk = chunk->next) {
+    self->queued++;
+  }
+}
+
+/** Claim the next chunk containing data to be sent by the reader thread.
+ *
+ * If that chunk is also the one currently being written into, it is sealed
+ * first, by moving the writers on to the next chunk, so its content cannot
+ * change (or be reallocated) while it is being sent.
+ *
+ * The claimed chunk is marked as being read, so writers will not try to reuse
+ * it until it is returned with releaseReadChunk.
+ *
+ * This assumes that the current thread holds the self->lock.
+ *
+ * \param self BufferedWriter pointer
+ * \return the claimed BufferChunk, or NULL if there is nothing to send
+ * \see releaseReadChunk, getNextWriteChunk
+ */
+static BufferChunk*
+getNextReadChunk(BufferedWriter* self)
+{
+  BufferChunk* chunk = self->readerChunk;
+
+  if (mbuf_message(chunk->mbuf) <= mbuf_rdptr(chunk->mbuf)) {
+    /* No complete message to send */
+    return NULL;
+  }
+
+  if (chunk == self->writerChunk) {
+    getNextWriteChunk(self, chunk);
+  }
+
+  chunk->reading = 1;
+  return chunk;
+}
+
+/** Return a chunk claimed with getNextReadChunk.
+ *
+ * If all its data has been sent, the chunk is emptied so writers can reuse
+ * it, and the reader moves on to the next one.
+ *
+ * This assumes that the current thread holds the self->lock.
+ *
+ * \param self BufferedWriter pointer
+ * \param chunk BufferChunk returned by getNextReadChunk
+ * \param allsent return value of processChunk for that chunk
+ * \see getNextReadChunk, processChunk
+ */
+static void
+releaseReadChunk(BufferedWriter* self, BufferChunk* chunk, int allsent)
+{
+  chunk->reading = 0;
+
+  if (allsent > 0) {
+    mbuf_clear2(chunk->mbuf, 0);
+    chunk->nmessages = 0;
+    if (chunk != self->writerChunk) {
+      self->readerChunk = chunk->next;
+    } else {
+      self->epoch++;
+    }
+    updateQueued(self);
+    pthread_cond_broadcast(&self->room);
+  }
+}
+
+/** Check whether the spill file contains data not yet replayed.
+ *
+ * This assumes that the current thread holds the self->lock.
+ *
+ * \param self BufferedWriter pointer
+ * \return non-zero if data remains to be replayed, 0 otherwise
+ */
+static int
+spillPending(BufferedWriter* self)
+{
+  return self->spill_read < self->spill_size;
+}
+
+/** Append the complete messages of a chunk to the spill file.
+ *
+ * Each record in the spill file is the length of its data, as a uint32_t in
+ * host byte order, followed by the data. On success, the complete messages
+ * are removed from the chunk, and any partial message is moved to its
+ * beginning.
+ *
+ * This assumes that the current thread holds the self->lock and the lock on
+ * the chunk, and that the chunk is not being read.
+ *
+ * \param self BufferedWriter pointer
+ * \param chunk BufferChunk to spill
+ * \return 0 on success (or if there was nothing to spill), -1 if the quota would be exceeded or on error
+ * \see bw_set_spill, replaySpill
+ */
+static int
+spillChunk(BufferedWriter* self, BufferChunk* chunk)
+{
+  struct iovec iov[2];
+  uint32_t length = mbuf_message_offset(chunk->mbuf) - mbuf_read_offset(chunk->mbuf);
+  ssize_t total = sizeof(length) + length;
+
+  if (!length) {
+    return 0;
+  }
+  if (self->spill_size + total > self->spill_quota) {
+    logwarn("%s: Spill file '%s' is full (%dB)\n", self->outStream->dest,
+        self->spill_path, self->spill_size);
+    return -1;
+  }
+
+  iov[0].iov_base = &length;
+  iov[0].iov_len = sizeof(length);
+  iov[1].iov_base = mbuf_rdptr(chunk->mbuf);
+  iov[1].iov_len = length;
+  if (writev(self->spill_fd, iov, 2) != total) {
+    logerror("%s: Cannot append %dB to spill file '%s': %s\n", self->outStream->dest,
+        total, self->spill_path, strerror(errno));
+    /* Do not leave a partial record behind */
+    if (ftruncate(self->spill_fd, self->spill_size)) {
+      logerror("%s: Cannot truncate spill file '%s': %s\n", self->outStream->dest,
+          self->spill_path, strerror(errno));
+    }
+    return -1;
+  }
+
+  if (!self->spill_size) {
+    logwarn("%s: Queue full, spilling data to '%s'\n", self->outStream->dest, self->spill_path);
+  }
+  logdebug("%s: Spilled %d samples (%dB)\n", self->outStream->dest, chunk->nmessages, length);
+  self->spill_size += total;
+
+  if (self->spill_sync > 0 && ++self->spill_unsynced >= self->spill_sync) {
+    if (fsync(self->spill_fd)) {
+      logwarn("%s: Cannot sync spill file '%s': %s\n", self->outStream->dest,
+          self->spill_path, strerror(errno));
+    }
+    self->spill_unsynced = 0;
+  }
+
+  chunk->nmessages = 0;
+  mbuf_repack_message2(chunk->mbuf);
+
+  return 0;
+}
+
+/** Send the next record of the spill file.
+ *
+ * Records are never modified once written, and the spill file is only
+ * truncated by the reader thread, so this function does not need, and should
+ * not be called with, the BufferedWriter lock.
+ *
+ * \param self BufferedWriter to process
+ * \param offset offset of the record in the spill file
+ * \param meta MBuffer containing the headers to send in case of (re)connection
+ * \param length pointer to store the size of the record in the spill file
+ *
+ * \return 1 if the record has been fully sent, -2 if it could not be sent, -1 if it could not be read
+ * \see spillChunk, releaseSpill, processBuffer
+ */
+static int
+replaySpill(BufferedWriter* self, size_t offset, MBuffer* meta, size_t* length)
+{
+  uint32_t size;
+
+  if (pread(self->spill_fd, &size, sizeof(size), offset) != sizeof(size)) {
+    logerror("%s: Cannot read record header from spill file '%s' at %d\n",
+        self->outStream->dest, self->spill_path, offset);
+    return -1;
+  }
+
+  if (size > self->spill_buf_size) {
+    uint8_t* buf = oml_realloc(self->spill_buf, size);
+    if (!buf) {
+      return -1;
+    }
+    self->spill_buf = buf;
+    self->spill_buf_size = size;
+  }
+
+  if (pread(self->spill_fd, self->spill_buf, size, offset + sizeof(size)) != size) {
+    logerror("%s: Cannot read %dB record from spill file '%s' at %d\n",
+        self->outStream->dest, size, self->spill_path, offset);
+    return -1;
+  }
+
+  *length = sizeof(size) + size;
+  return processBuffer(self, self->spill_buf, size, meta);
+}
+
+/** Account for a record returned by replaySpill.
+ *
+ * If it has been sent, the reader moves on to the next record, and the spill
+ * file is emptied once all records have been replayed. If it could not be
+ * read, the rest of the spill file is discarded.
+ *
+ * This assumes that the current thread holds the self->lock.
+ *
+ * \param self BufferedWriter pointer
+ * \param length size of the record in the spill file
+ * \param allsent return value of replaySpill for that record
+ * \see replaySpill
+ */
+static void
+releaseSpill(BufferedWriter* self, size_t length, int allsent)
+{
+  if (allsent > 0) {
+    self->spill_read += length;
+  } else if (-1 == allsent) {
+    logerror("%s: Dropping %dB of spilled data\n", self->outStream->dest,
+        self->spill_size - self->spill_read);
+    self->spill_read = self->spill_size;
+  }
+
+  if (self->spill_size && !spillPending(self)) {
+    logdebug("%s: Replayed spill file '%s' (%dB)\n", self->outStream->dest,
+        self->spill_path, self->spill_size);
+    if (ftruncate(self->spill_fd, 0)) {
+      logwarn("%s: Cannot truncate spill file '%s': %s\n", self->outStream->dest,
+          self->spill_path, strerror(errno));
+    }
+    self->spill_size = self->spill_read = 0;
+    self->spill_unsynced = 0;
+  }
+}
+
 /** Initialise a BufferChunk for a BufferedWriter.
  * \param self BufferedWriter pointer
  * \return a pointer to the newly-created BufferChunk, or NULL on error
@@ -509,13 +1274,42 @@ destroyBufferChain(BufferedWriter* self) {
   }
 
   pthread_cond_destroy(&self->semaphore);
+  pthread_cond_destroy(&self->room);
   pthread_mutex_destroy(&self->lock);
 
   return 0;
 }
 
 
+/** Compute the end of the current back-off period, if any.
+ *
+ * \param self BufferedWriter pointer
+ * \param deadline pointer to a timespec to store the (absolute) end of the back-off period
+ * \return 1 if the BufferedWriter is currently backing off, 0 otherwise
+ */
+static int
+backoffDeadline(BufferedWriter* self, struct timespec* deadline)
+{
+  time_t now;
+  time(&now);
+  if (difftime(now, self->last_failure_time) < self->backoff) {
+    deadline->tv_sec = self->last_failure_time + self->backoff;
+    deadline->tv_nsec = 0;
+    return 1;
+  }
+  return 0;
+}
+
 /** Writing thread
+ *
+ * The lock is only held to claim or return a chunk of data (see
+ * getNextReadChunk and releaseReadChunk), and to take a snapshot of the
+ * headers. It is released while the data is sent to the output stream, and
+ * while backing off after an error, so injecting threads are never blocked by
+ * a slow or unresponsive stream.
+ *
+ * Once the BufferedWriter is deactivated, the thread drains the remaining
+ * chunks before terminating, and gives up at the first error.
  *
  * \param handle the stream to use the filters on
  * \return 1 if all the buffer chain has been processed, <1 otherwise
@@ -525,76 +1319,109 @@ threadStart(void* handle)
 {
   int allsent = 1;
   BufferedWriter* self = (BufferedWriter*)handle;
-  BufferChunk* chunk = self->firstChunk;
-
-  while (self->active) {
-    oml_lock(&self->lock, "bufferedWriter");
-    pthread_cond_wait(&self->semaphore, &self->lock);
-    // Process all chunks which have data in them
-    do {
-      if (mbuf_message(chunk->mbuf) > mbuf_rdptr(chunk->mbuf)) {
-        allsent = processChunk(self, chunk);
-      }
-      // stop if we caught up to the writer
+  BufferChunk* chunk;
+  struct timespec deadline;
+  size_t offset, length = 0;
+
+  oml_lock_persistent(&self->lock, "bufferedWriter");
+  while (1) {
+    if (backoffDeadline(self, &deadline)) {
+      logdebug("%s: Still in back-off period (%ds)\n", self->outStream->dest, self->backoff);
+      pthread_cond_timedwait(&self->semaphore, &self->lock, &deadline);
+      continue;
+    }
+
+    if (mbuf_fill(self->meta_buf) != mbuf_fill(self->reader_meta_buf)) {
+      mbuf_clear2(self->reader_meta_buf, 0);
+      mbuf_write(self->reader_meta_buf,
+          mbuf_buffer(self->meta_buf), mbuf_fill(self->meta_buf));
+    }
 
-      if (chunk == self->writerChunk) break;
+    if (self->readerChunk == self->writerChunk && spillPending(self)) {
+      /* All older chunks have been sent, replay the spill file before the
+       * newer data in the writer chunk */
+      offset = self->spill_read;
+      oml_unlock(&self->lock, "bufferedWriter");
+      allsent = replaySpill(self, offset, self->reader_meta_buf, &length);
+      oml_lock_persistent(&self->lock, "bufferedWriter");
+
+      releaseSpill(self, length, allsent);
+      if (!self->active && allsent < 1) {
+        break;
+      }
+      continue;
+    }
 
-      if (allsent>0) {
-        chunk = chunk->next;
+    if (NULL == (chunk = getNextReadChunk(self))) {
+      if (!self->active) {
+        allsent = 1;
+        break;
       }
-    } while(allsent > 0);
+      pthread_cond_wait(&self->semaphore, &self->lock);
+      continue;
+    }
+
     oml_unlock(&self->lock, "bufferedWriter");
-  }
-  /* Drain this writer before terminating */
-  /* XXX: “Backing-off for ...” messages might confuse the user as
-   * we don't actually wait after a failure when draining at the end */
-  while ((allsent=processChunk(self, chunk))>=-1) {
-    if(allsent>0) {
-      if (chunk == self->writerChunk) break;
-      chunk = chunk->next;
-    } else if (-1 == allsent) {
-      sleep(self->backoff);
+    allsent = processChunk(self, chunk, self->reader_meta_buf);
+    oml_lock_persistent(&self->lock, "bufferedWriter");
+
+    releaseReadChunk(self, chunk, allsent);
+
+    /* XXX: “Backing-off for ...” messages might confuse the user as
+     * we don't actually wait after a failure when draining at the end */
+    if (!self->active && allsent < 1) {
+      break;
     }
-  };
+  }
+  oml_unlock(&self->lock, "bufferedWriter");
+
   self->retval = allsent;
   pthread_exit(&(self->retval));
 }
 
 /** Send data contained in one chunk.
+ *
+ * The chunk must have been claimed with getNextReadChunk. This function does
+ * not need, and should not be called with, the BufferedWriter lock.
  *
  * \param self BufferedWriter to process
  * \param chunk link of the chunk to process
+ * \param meta MBuffer containing the headers to send in case of (re)connection
  *
- * \return 1 if chunk has been fully sent, 0 if not, -1 on continuing back-off, -2 otherwise
- * \see oml_outs_write_f
+ * \return 1 if chunk has been fully sent, -2 otherwise
+ * \see oml_outs_write_f, getNextReadChunk
  */
 static int
-processChunk(BufferedWriter* self, BufferChunk* chunk)
+processChunk(BufferedWriter* self, BufferChunk* chunk, MBuffer* meta)
 {
   assert(self);
-  assert(self->meta_buf);
+  assert(meta);
   assert(chunk);
   assert(chunk->mbuf);
+  assert(chunk->reading);
 
-  uint8_t* buf = mbuf_rdptr(chunk->mbuf);
-  size_t size = mbuf_message_offset(chunk->mbuf) - mbuf_read_offset(chunk->mbuf);
-  size_t sent = 0;
-
-  MBuffer* meta = self->meta_buf;
-
-  /* XXX: Should we use a timer instead? */
-  time_t now;
-  time(&now);
-  if (difftime(now, self->last_failure_time) < self->backoff) {
-    logdebug("%s: Still in back-off period (%ds)\n", self->outStream->dest, self->backoff);
-    return -1;
-  }
+  return processBuffer(self, mbuf_rdptr(chunk->mbuf),
+      mbuf_message_offset(chunk->mbuf) - mbuf_read_offset(chunk->mbuf), meta);
+}
 
-  chunk->reading = 1;
+/** Send a buffer of complete messages.
+ *
+ * \param self BufferedWriter to process
+ * \param buf pointer to the data to send
+ * \param size length of the data to send
+ * \param meta MBuffer containing the headers to send in case of (re)connection
+ *
+ * \return 1 if the buffer has been fully sent, -2 otherwise
+ * \see processChunk, replaySpill
+ */
+static int
+processBuffer(BufferedWriter* self, uint8_t* buf, size_t size, MBuffer* meta)
+{
+  size_t sent = 0;
 
   while (size > sent) {
     long cnt = self->outStream->write(self->outStream, (void*)(buf + sent), size - sent,
-                               meta->rdptr, meta->fill);
+                               mbuf_buffer(meta), mbuf_fill(meta));
     if (cnt > 0) {
       sent += cnt;
       if (self->backoff) {
@@ -603,7 +1430,7 @@ processChunk(BufferedWriter* self, BufferChunk* chunk)
       }
 
     } else {
-      self->last_failure_time = now;
+      time(&self->last_failure_time);
       if (!self->backoff) {
         self->backoff = 1;
       } else if (self->backoff < UINT8_MAX) {
@@ -611,22 +1438,11 @@ processChunk(BufferedWriter* self, BufferChunk* chunk)
       }
       logwarn("%s: Error sending, backing off for %ds\n", self->outStream->dest, self->backoff);
 
-      chunk->reading = 0;
       return -2;
     }
   }
 
-  /* Check that we have sent everything, and reset the MBuffer
-   * XXX: is this really needed? size>sent *should* be enough
-   */
-  mbuf_read_skip(chunk->mbuf, sent);
-  chunk->reading = 0;
-  /* XXX: Redundant with allsent */
-  if (mbuf_write_offset(chunk->mbuf) == mbuf_read_offset(chunk->mbuf)) {
-    mbuf_clear2(chunk->mbuf, 1);
-    return 1;
-  }
-  return 0;
+  return 1;
 }
 
 /*
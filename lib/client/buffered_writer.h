@@ -20,10 +20,27 @@
 
 typedef void* BufferedWriterHdl;
 
+/** What a BufferedWriter does when its queue is full \see bw_set_policy */
+typedef enum BwPolicy {
+  /** Drop the oldest chunk of data to make room (default) */
+  BW_POLICY_DROP_OLDEST = 0,
+  /** Drop the newest data, which has not been queued yet */
+  BW_POLICY_DROP_NEWEST,
+  /** Block writers until there is room, then drop the newest data */
+  BW_POLICY_BLOCK,
+  /** Only keep one in every few samples above a high-water mark, then drop the oldest data */
+  BW_POLICY_THIN,
+  BW_POLICY_MAX
+} BwPolicy;
+
 BufferedWriterHdl bw_create(OmlOutStream* outStream, long queueCapacity, long chainSize);
 
 void bw_close(BufferedWriterHdl instance);
 
+int bw_set_spill(BufferedWriterHdl instance, const char* path, size_t quota, int sync);
+int bw_set_policy(BufferedWriterHdl instance, const char* spec);
+uint32_t bw_policy_count_reset(BwPolicy policy);
+
 int bw_push(BufferedWriterHdl instance, uint8_t* data, size_t size);
 int _bw_push(BufferedWriterHdl instance, uint8_t* data, size_t size);
 int bw_push_meta(BufferedWriterHdl instance, uint8_t* data, size_t size);
@@ -32,11 +49,15 @@ int _bw_push_meta(BufferedWriterHdl instance, uint8_t* data, size_t size);
 int bw_msgcount_add(BufferedWriterHdl instance, int nmessages);
 int bw_msgcount_reset(BufferedWriterHdl instance);
 int bw_nlost_reset(BufferedWriterHdl instance);
+unsigned long bw_epoch(BufferedWriterHdl instance);
 
 MBuffer* bw_get_write_buf(BufferedWriterHdl instance, int exclusive);
 
 void bw_unlock_buf(BufferedWriterHdl instance);
 
+int bw_batch_begin(BufferedWriterHdl instance);
+void bw_batch_end(BufferedWriterHdl instance);
+
 #endif // OML_BUFFERED_WRITER_H_
 
 /*
@@ -30,6 +30,14 @@
 #define DEF_PORT 3003
 #define DEF_PORT_STRING  xstr(DEF_PORT)
 
+/** How omlc_inject hands samples over to the filters \see omlc_inject */
+enum InjectMode {
+  /** Process the sample in the calling thread, under the MP lock */
+  IM_Direct = 0,
+  /** Queue the sample in a per-thread ring, drained by a consumer thread */
+  IM_Ring
+};
+
 /** Internal data structure holding OML parameters */
 typedef struct OmlClient {
   /** Application name */
@@ -85,6 +93,16 @@ typedef struct OmlClient {
   /** Minimum period between client instrumentation reports [s] (0 == disabled) */
   uint32_t instr_interval;
 
+  /** How samples are handed over to the filters \see omlc_inject */
+  enum InjectMode inject_mode;
+
+  /** OMSP version to advertise and encode samples with */
+  int protocol;
+
+  /** Default queue overflow policy for new writers, or NULL \see bw_set_policy */
+  const char* overflow_policy;
+
+
 } OmlClient;
 
 /** Global OmlClient instance */
@@ -110,10 +128,26 @@ OmlMStream *destroy_ms(OmlMStream *ms);
 void create_default_filters(OmlMP* mp, OmlMStream* ms);
 OmlFilter* create_default_filter(OmlMPDef* def, OmlMStream* ms, int index);
 
+/* from api.c */
+
+int omlc_inject_rows(OmlMP *mp, OmlValueU *rows, unsigned int nrows);
+
+/* from inject_ring.c */
+
+int inject_ring_start(void);
+void inject_ring_stop(void);
+int inject_ring_push(OmlMP *mp, OmlValueU *values);
+uint32_t inject_ring_nfull_reset(void);
+
 /* from filter.c */
 
 void filter_engine_start(OmlMStream* mp);
+void filter_engine_stop(OmlMStream* ms);
+void filter_engine_shutdown(void);
+uint32_t filter_engine_nmissed_reset(void);
 extern int filter_process(OmlMStream* mp);
+int filter_passthrough(OmlMStream* ms);
+int filter_process_sample(OmlMStream* ms, OmlValue* fields);
 
 /* from misc.c */
 
@@ -140,6 +174,10 @@ int file_stream_get_buffered(OmlOutStream* hdl);
 
 extern OmlOutStream *net_stream_new(const char *transport, const char *hostname, const char *port);
 
+/* from zlib_stream.c */
+
+extern OmlOutStream *zlib_stream_new(OmlOutStream *out);
+
 /* from validate.c */
 
 const char *validate_app_name (const char* name);
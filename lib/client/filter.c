@@ -29,65 +29,551 @@
 #include <errno.h>
 #include <sys/time.h>
 #include <time.h>
-#include <pthread.h>
-#define _XOPEN_SOURCE 500     /* Or: #define _BSD_SOURCE; for useconds_t to be defined */
-#include <unistd.h>
 
 #include "oml2/omlc.h"
 #include "oml2/oml_filter.h"
 #include "oml2/oml_writer.h"
 #include "ocomm/o_log.h"
+#include "mem.h"
 #include "client.h"
+#include "filter/factory.h"
+#include "mbuf.h"
+
+/** An MS scheduled for periodic reporting */
+typedef struct ScheduledMS {
+  /** MS to report on */
+  OmlMStream *ms;
+  /** Absolute time of the next report, on CLOCK_MONOTONIC [ns] */
+  int64_t deadline;
+  /** Reporting period [ns] */
+  int64_t period;
+} ScheduledMS;
+
+/** Mutex protecting the scheduler state */
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Condition variable (on CLOCK_MONOTONIC) signalled when the heap changes */
+static pthread_cond_t sched_cond;
+/** Scheduler thread */
+static pthread_t sched_thread;
+/** Set to 1 while the scheduler thread should run */
+static int sched_active = 0;
 
-static void* thread_start(void* handle);
+/** Binary min-heap of scheduled MSs, ordered by deadline */
+static ScheduledMS *heap = NULL;
+/** Number of elements in heap */
+static int heap_len = 0;
+/** Number of allocated elements in heap */
+static int heap_size = 0;
+
+/** Number of reporting periods missed since last query \see filter_engine_nmissed_reset */
+static uint32_t nmissed = 0;
+
+static void* sched_start(void* handle);
+static int64_t monotonic_ns(void);
+static void heap_up(int i);
+static void heap_down(int i);
 
 extern OmlClient* omlc_instance;
 
 /** Start the filtering engine on the given MS
+ *
+ * The MS is added to the scheduler, which calls filter_process every
+ * ms->sample_interval seconds. The first report happens one interval from
+ * now. The scheduler thread is started with the first MS.
+ *
  * \param ms pointer to OmlMStream to start filtering on
+ * \see filter_engine_stop
  */
 void
 filter_engine_start(OmlMStream* ms)
 {
-  logdebug ("Starting filtering thread for MS '%s'\n", ms->table_name);
-  pthread_create(&ms->filter_thread, NULL, thread_start, (void*)ms);
+  ScheduledMS *sms;
+  pthread_condattr_t cattr;
+  double interval = ms->sample_interval;
+
+  logdebug ("Scheduling MS '%s' every %fs\n", ms->table_name, interval);
+
+  pthread_mutex_lock(&sched_lock);
+  if (!sched_active) {
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched_cond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    sched_active = 1;
+    if (pthread_create(&sched_thread, NULL, sched_start, NULL)) {
+      logerror("Cannot start filter scheduler thread; MS '%s' will not report periodically\n",
+          ms->table_name);
+      sched_active = 0;
+      pthread_cond_destroy(&sched_cond);
+      pthread_mutex_unlock(&sched_lock);
+      return;
+    }
+  }
+
+  if (heap_len == heap_size) {
+    sms = oml_realloc(heap, (heap_size + 16) * sizeof(ScheduledMS));
+    if (!sms) {
+      logerror("Cannot allocate memory to schedule MS '%s'\n", ms->table_name);
+      pthread_mutex_unlock(&sched_lock);
+      return;
+    }
+    heap = sms;
+    heap_size += 16;
+  }
+
+  sms = &heap[heap_len];
+  sms->ms = ms;
+  sms->period = (int64_t)(interval * 1e9);
+  if (sms->period <= 0) {
+    sms->period = 1;
+  }
+  sms->deadline = monotonic_ns() + sms->period;
+  heap_up(heap_len++);
+
+  pthread_cond_signal(&sched_cond);
+  pthread_mutex_unlock(&sched_lock);
 }
 
-/** Filtering thread
+/** Stop periodic reporting for the given MS
  *
- * Loops until the stream is not active anymore, or an error occurs
+ * The MP lock must be held, so the scheduler does not report on the MS after
+ * this function returns.
  *
- * \param handle pointer to OmlMStream to use the filters on (cast as void*)
+ * \param ms pointer to OmlMStream to stop filtering on
+ * \see filter_engine_start
+ */
+void
+filter_engine_stop(OmlMStream* ms)
+{
+  int i;
+
+  pthread_mutex_lock(&sched_lock);
+  for (i = 0; i < heap_len; i++) {
+    if (heap[i].ms == ms) {
+      heap[i] = heap[--heap_len];
+      if (i < heap_len) {
+        heap_down(i);
+        heap_up(i);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&sched_lock);
+}
+
+/** Stop the scheduler thread
+ *
+ * All MSs should have been removed with filter_engine_stop beforehand.
  *
- * \return NULL, inconditionally; shouldn't return in normal operation
+ * \see filter_engine_start
+ */
+void
+filter_engine_shutdown(void)
+{
+  pthread_mutex_lock(&sched_lock);
+  if (!sched_active) {
+    pthread_mutex_unlock(&sched_lock);
+    return;
+  }
+  sched_active = 0;
+  pthread_cond_signal(&sched_cond);
+  pthread_mutex_unlock(&sched_lock);
+
+  pthread_join(sched_thread, NULL);
+
+  pthread_cond_destroy(&sched_cond);
+  oml_free(heap);
+  heap = NULL;
+  heap_len = heap_size = 0;
+}
+
+/** Get the number of missed reporting periods since the last call, and reset it.
+ *
+ * A period is missed when the scheduler could not report on an MS before
+ * the next report was due, e.g., because another MS's filters, or a writer,
+ * took too long.
+ *
+ * \return the number of missed reporting periods
+ */
+uint32_t
+filter_engine_nmissed_reset(void)
+{
+  uint32_t n;
+  pthread_mutex_lock(&sched_lock);
+  n = nmissed;
+  nmissed = 0;
+  pthread_mutex_unlock(&sched_lock);
+  return n;
+}
+
+/** Scheduler thread
+ *
+ * Waits until the earliest deadline in the heap, and runs the filters of the
+ * corresponding MS. Deadlines are absolute, so processing time does not
+ * introduce drift; if more than one period has elapsed, the missed ones are
+ * counted and skipped.
+ *
+ * \param handle unused
+ * \return NULL, inconditionally
  */
 static void*
-thread_start(void* handle)
+sched_start(void* handle)
 {
-  OmlMStream* ms = (OmlMStream*)handle;
-  OmlMP* mp = ms->mp;
-  useconds_t usec = (useconds_t)(1000000 * ms->sample_interval);
-  int status = 0;
+  struct timespec deadline;
+  int64_t now, late;
+  OmlMStream *ms;
+  OmlMP *mp;
+  (void)handle;
+
+  pthread_mutex_lock(&sched_lock);
+  while (sched_active) {
+    if (heap_len == 0) {
+      pthread_cond_wait(&sched_cond, &sched_lock);
+      continue;
+    }
+
+    now = monotonic_ns();
+    if (now < heap[0].deadline) {
+      deadline.tv_sec = heap[0].deadline / 1000000000;
+      deadline.tv_nsec = heap[0].deadline % 1000000000;
+      pthread_cond_timedwait(&sched_cond, &sched_lock, &deadline);
+      continue;
+    }
+
+    /* Reschedule before processing, so filter_engine_stop can remove it meanwhile */
+    ms = heap[0].ms;
+    mp = ms->mp;
+    late = (now - heap[0].deadline) / heap[0].period;
+    nmissed += late;
+    heap[0].deadline += (late + 1) * heap[0].period;
+    heap_down(0);
+    pthread_mutex_unlock(&sched_lock);
 
-  while (1) {
-    usleep(usec);
     if (!mp_lock(mp)) {
-      if (!mp->active) {
-        mp_unlock(mp);
-        return NULL;  // we are done
+      /* ms might have been destroyed with the MP while we were not holding any lock */
+      if (mp->active && filter_process(ms) == -1) {
+        logwarn("Error reporting on MS '%s'\n", ms->table_name);
       }
-
-      status = filter_process(ms);
       mp_unlock(mp);
     }
 
-    if (status == -1) {
-      return NULL; // Fatal error --> exit thread
+    pthread_mutex_lock(&sched_lock);
+  }
+  pthread_mutex_unlock(&sched_lock);
+
+  return NULL;
+}
+
+/** Get the current time on CLOCK_MONOTONIC [ns] */
+static int64_t
+monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/** Move heap element i up until the heap property is restored */
+static void
+heap_up(int i)
+{
+  ScheduledMS tmp;
+  int parent;
+
+  for (; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (heap[i].deadline >= heap[parent].deadline) {
+      break;
     }
+    tmp = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = tmp;
+  }
+}
 
+/** Move heap element i down until the heap property is restored */
+static void
+heap_down(int i)
+{
+  ScheduledMS tmp;
+  int child;
+
+  for (; (child = 2 * i + 1) < heap_len; i = child) {
+    if (child + 1 < heap_len && heap[child + 1].deadline < heap[child].deadline) {
+      child++;
+    }
+    if (heap[child].deadline >= heap[i].deadline) {
+      break;
+    }
+    tmp = heap[i];
+    heap[i] = heap[child];
+    heap[child] = tmp;
   }
 }
 
+/** Check whether the samples injected into an MS can be output as is.
+ *
+ * This is the case when each sample is reported on its own (a sample_thres of
+ * 1, and no sample_interval), and all the filters of the MS are identity
+ * filters. The result is cached in ms->passthrough, as the filters of an MS
+ * do not change once samples are injected.
+ *
+ * A lock for the MP containing that MS must be held.
+ *
+ * \param ms MS to check
+ * \return 1 if all the fields of the MP are output in order, 2 if only some of
+ * them or in a different order, 0 if samples must go through the filters
+ * \see filter_is_identity, filter_process_sample
+ */
+int
+filter_passthrough(OmlMStream* ms)
+{
+  OmlFilter *f;
+  int i;
+
+  if (!ms->passthrough) {
+    ms->passthrough = (1 == ms->sample_thres && ms->sample_interval <= 0 && ms->filters) ? 1 : -1;
+    for (i = 0, f = ms->filters; f && ms->passthrough > 0; i++, f = f->next) {
+      if (!filter_is_identity(f)) {
+        ms->passthrough = -1;
+      } else if (f->index != i) {
+        ms->passthrough = 2;
+      }
+    }
+    if (1 == ms->passthrough && i != ms->mp->param_count) {
+      ms->passthrough = 2;
+    }
+    logdebug("%s: Samples %s\n", ms->table_name,
+        ms->passthrough > 0 ? "output as injected" : "going through filters");
+  }
+
+  return ms->passthrough > 0 ? ms->passthrough : 0;
+}
+
+/** An OmlWriter collecting the output of the filters of an MS, to marshal it
+ * once for all the writers using the same encoding as its target.
+ * \see filter_write_row
+ */
+typedef struct RowEncoder {
+  /** OmlWriter interface, of which filters only use out */
+  OmlWriter writer;
+  /** Writer whose encoding is used */
+  OmlWriter *target;
+  /** MS the sample is for */
+  OmlMStream *ms;
+  /** MBuffer into which the values are marshalled */
+  MBuffer *mbuf;
+  /** Number of values marshalled so far */
+  int count;
+  /** Set to 0 if marshalling failed */
+  int ok;
+} RowEncoder;
+
+/** Function called by the filters for every result value they output
+ * \see oml_writer_out
+ */
+static int
+row_encoder_out(OmlWriter* writer, OmlValue* values, int values_count)
+{
+  RowEncoder *self = (RowEncoder*)writer;
+
+  if (self->ok && !self->target->encode(self->target, self->mbuf, self->ms, self->count,
+        values, values_count)) {
+    self->ok = 0;
+  }
+  self->count += values_count;
+  return self->ok;
+}
+
+/** Get one of the MBuffers into which samples of an MS are encoded, cleared.
+ *
+ * \param ms MS to get the MBuffer of
+ * \param idx index of the MBuffer, one per distinct encoding
+ * \return the MBuffer, or NULL on error
+ */
+static MBuffer*
+filter_encoding_buffer(OmlMStream *ms, int idx)
+{
+  MBuffer **encoded;
+
+  if (idx >= ms->nencoded) {
+    if (!(encoded = oml_realloc(ms->encoded, (idx + 1) * sizeof(MBuffer*)))) {
+      return NULL;
+    }
+    ms->encoded = encoded;
+    while (ms->nencoded <= idx) {
+      if (!(ms->encoded[ms->nencoded] = mbuf_create())) {
+        return NULL;
+      }
+      ms->nencoded++;
+    }
+  }
+  mbuf_clear2(ms->encoded[idx], 0);
+  return ms->encoded[idx];
+}
+
+/** Output the values of a sample to a writer.
+ *
+ * \param ms MS the sample is for
+ * \param writer OmlWriter to output to
+ * \param values values to output, or NULL to have each filter output its own
+ * \param n number of values
+ */
+static void
+filter_output(OmlMStream *ms, OmlWriter *writer, OmlValue *values, int n)
+{
+  OmlFilter *f;
+
+  if (values) {
+    writer->out(writer, values, n);
+  } else {
+    for (f = ms->firstFilter; f != NULL; f = f->next) {
+      f->output(f, writer);
+    }
+  }
+}
+
+/** Check whether another writer of an MS uses the same encoding as one.
+ *
+ * \param ms MS to check the writers of
+ * \param i index of the writer in ms->writers
+ * \return non zero if one of the following writers has the same encode function
+ */
+static int
+filter_shared_encoding(OmlMStream *ms, int i)
+{
+  int j;
+
+  for (j = i + 1; j < ms->nwriters; j++) {
+    if (ms->writers[j] && ms->writers[j]->encode == ms->writers[i]->encode) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Write a sample to all the writers of an MS.
+ *
+ * Each writer generates its own metadata (seqno and time, delta-encoded
+ * against what it previously sent). When several writers use the same
+ * encoding, the values are only output by the filters and marshalled once,
+ * by the first of them, and the resulting bytes are copied to the others.
+ *
+ * \param ms MS to generate output for
+ * \param now timestamp of the sample
+ * \param values values of the sample, or NULL to have each filter output its own
+ * \param n number of values
+ *
+ * \see oml_writer_encode, oml_writer_out_encoded
+ */
+static void
+filter_write_row(OmlMStream *ms, double now, OmlValue *values, int n)
+{
+  RowEncoder encoders[ms->nwriters > 0 ? ms->nwriters : 1];
+  RowEncoder *enc;
+  OmlWriter *writer;
+  int i, j, nencoders = 0;
+
+  for (i=0; i<ms->nwriters; i++) {
+    writer = ms->writers[i];
+
+    if (writer == NULL) {
+      logwarn("%s: Sending data NULL writer (at %d)\n", ms->table_name, i);
+      continue;
+    }
+
+    enc = NULL;
+    if (writer->encode && writer->out_encoded) {
+      for (j = 0; j < nencoders && encoders[j].target->encode != writer->encode; j++);
+      if (j < nencoders) {
+        enc = &encoders[j];
+
+      } else if (filter_shared_encoding(ms, i)) {
+        enc = &encoders[nencoders];
+        memset(enc, 0, sizeof(*enc));
+        enc->writer.out = row_encoder_out;
+        enc->target = writer;
+        enc->ms = ms;
+        enc->ok = (enc->mbuf = filter_encoding_buffer(ms, nencoders++)) != NULL;
+        if (enc->ok) {
+          filter_output(ms, &enc->writer, values, n);
+        }
+      }
+    }
+
+    /* Be aware that row_start is obtaining a lock on the writer
+     * which is released in row_end. Always ensure that row_end is
+     * called, even if there is a problem somewhere along the way.
+     * \see oml_writer_row_start, oml_writer_out, oml_writer_row_end
+     */
+    if(writer->row_start(writer, ms, now) == 1)
+      ms->written++;
+    else
+      ms->dropped++;
+
+    if (enc && enc->ok) {
+      writer->out_encoded(writer, mbuf_rdptr(enc->mbuf), mbuf_fill(enc->mbuf), enc->count);
+    } else {
+      filter_output(ms, writer, values, n);
+    }
+    writer->row_end(writer, ms);
+  }
+}
+
+/** Output an injected sample on an MS, without going through its filters.
+ *
+ * This replaces omlc_ms_process and filter_process for MSs on which
+ * filter_passthrough is true. Each writer marshals the fields directly from
+ * the injected values, which are therefore not copied.
+ *
+ * A lock for the MP containing that MS must be held.
+ *
+ * \param ms MS to generate output for
+ * \param fields the ms->mp->param_count fields of the injected sample
+ * \return 0 if success, -1 otherwise
+ *
+ * \see filter_passthrough, filter_process
+ */
+int
+filter_process_sample(OmlMStream* ms, OmlValue* fields)
+{
+  struct timeval tv;
+  double now;
+  int i, n;
+  OmlFilter *f;
+  OmlValue *out = fields;
+
+  /* Get the time as soon as possible */
+  gettimeofday(&tv, NULL);
+
+  if (ms == NULL || omlc_instance == NULL || ms->writers == NULL) {
+    logerror("Could not output sample because of null measurement stream, instance or writers array\n");
+    return -1;
+  }
+
+  n = ms->mp->param_count;
+  if (2 == ms->passthrough) {
+    for (n = 0, f = ms->filters; f; f = f->next) {
+      n++;
+    }
+  }
+  OmlValue selected[2 == ms->passthrough ? n : 1];
+  if (2 == ms->passthrough) {
+    for (i = 0, f = ms->filters; f; i++, f = f->next) {
+      selected[i] = fields[f->index];
+    }
+    out = selected;
+  }
+
+  now = tv.tv_sec - omlc_instance->start_time + 0.000001 * tv.tv_usec;
+  ms->seq_no++;
+
+  filter_write_row(ms, now, out, n);
+
+  return 0;
+}
+
 /** Run filters associated to an MS.
  *
  * Get the writer associated to the MS, and generate and write initial metadata
@@ -104,9 +590,7 @@ filter_process(OmlMStream* ms)
 {
   struct timeval tv;
   double now;
-  int i;
   OmlFilter *f;
-  OmlWriter *writer;
 
   /* Get the time as soon as possible */
   gettimeofday(&tv, NULL);
@@ -119,30 +603,7 @@ filter_process(OmlMStream* ms)
   now = tv.tv_sec - omlc_instance->start_time + 0.000001 * tv.tv_usec;
   ms->seq_no++;
 
-  for (i=0; i<ms->nwriters; i++) {
-    writer = ms->writers[i];
-
-    if (writer == NULL) {
-      logwarn("%s: Sending data NULL writer (at %d)\n", ms->table_name, i);
-
-    } else {
-      /* Be aware that row_start is obtaining a lock on the writer
-       * which is released in row_end. Always ensure that row_end is
-       * called, even if there is a problem somewhere along the way.
-       * \see oml_writer_row_start, oml_writer_out, oml_writer_row_end
-       */
-      if(writer->row_start(writer, ms, now) == 1)
-        ms->written++;
-      else
-        ms->dropped++;
-
-      f = ms->firstFilter;
-      for (; f != NULL; f = f->next) {
-        f->output(f, writer);
-      }
-      writer->row_end(writer, ms);
-    }
-  }
+  filter_write_row(ms, now, NULL, 0);
 
   f = ms->firstFilter;
   for (; f != NULL; f = f->next) {
@@ -173,7 +173,7 @@ default_filter_meta (OmlFilter* filter,
              int index_offset,
              char** name_ptr,
              OmlValueT* type_ptr,
-             OMLSemDef* concepts_ptr)
+             OMLSemDef** concepts_ptr)
 {
   if (!filter || (index_offset < 0) || (index_offset >= filter->output_count))
     return -1;
@@ -190,7 +190,7 @@ default_filter_meta (OmlFilter* filter,
     *type_ptr = type;
   }
   if (concepts_ptr)
-    concepts_ptr = filter->concepts;
+    *concepts_ptr = filter->concepts;
   return 0;
 }
 
@@ -255,6 +255,26 @@ omlf_register_filter(const char* filter_name,
   return 0;
 }
 
+/** Check whether a filter outputs the last sample it received as is.
+ *
+ * This is the case of the "first" and "last" filters, when their window only
+ * contains one sample.
+ *
+ * \param f OmlFilter to check
+ * \return 1 if f is an instance of the "first" or "last" filter, 0 otherwise
+ */
+int
+filter_is_identity(OmlFilter *f)
+{
+  FilterType* ft = filter_types;
+  for (; ft != NULL; ft = ft->next) {
+    if (ft->input == f->input) {
+      return !strcmp(ft->name, "first") || !strcmp(ft->name, "last");
+    }
+  }
+  return 0;
+}
+
 /* Builtin filter registration functions */
 void omlf_register_filter_average (void);
 void omlf_register_filter_first (void);
@@ -263,6 +283,7 @@ void omlf_register_filter_histogram (void);
 void omlf_register_filter_stddev (void);
 void omlf_register_filter_sum (void);
 void omlf_register_filter_delta (void);
+void omlf_register_filter_quantile (void);
 
 /**
  *  Register all built-in filters.
@@ -272,10 +293,11 @@ void register_builtin_filters ()
   omlf_register_filter_average ();
   omlf_register_filter_first ();
   omlf_register_filter_last ();
-  //  omlf_register_filter_histogram ();
+  omlf_register_filter_histogram ();
   omlf_register_filter_stddev ();
   omlf_register_filter_sum ();
   omlf_register_filter_delta ();
+  omlf_register_filter_quantile ();
 }
 
 /** Unregister all built-in filters.
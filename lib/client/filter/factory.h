@@ -45,6 +45,8 @@ create_filter(
 
 OmlFilter *destroy_filter(OmlFilter* f);
 
+int filter_is_identity(OmlFilter *f);
+
 #endif /* OML_FILTER_FACTORY_H_ */
 
 /*
@@ -8,21 +8,37 @@
  * in the License.
  */
 /** \file histogram_filter.c
- * \brief Implements a filter which calculates
+ * \brief Implements a filter which counts the samples falling in each bucket of a histogram.
  *
- * XXX: This filter is currently non-functional, and therefore disabled.
+ * The buckets evenly divide [min, max[, either linearly or logarithmically.
+ * Two more buckets count the samples below min (including NaNs and, for a
+ * logarithmic scale, non-positive values) and those not below max. The
+ * counts of all the buckets are output as one OML_VECTOR_UINT64_VALUE of
+ * buckets + 2 elements per sampling period.
  *
- * \see register_builtin_filters
+ * The bucket of a sample is found arithmetically, clamping its scaled value
+ * into range rather than comparing it to the boundaries, so the cost of a
+ * sample does not depend on its value, nor on the number of buckets.
+ *
+ * The boundaries are set with the following properties:
+ *  - min (double): lower bound of the first bucket, HISTOGRAM_DEFAULT_MIN by default;
+ *  - max (double): upper bound of the last bucket, HISTOGRAM_DEFAULT_MAX by default;
+ *  - buckets (integer): number of buckets between min and max, HISTOGRAM_DEFAULT_BUCKETS by default;
+ *  - scale (string): "linear" (default) or "log".
+ *
+ * \see parse_filter_properties
  */
 
 #define _GNU_SOURCE  /* For NAN */
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "oml2/omlc.h"
 #include "oml2/oml_filter.h"
 #include "ocomm/o_log.h"
+#include "mem.h"
 #include "oml_value.h"
 #include "histogram_filter.h"
 
@@ -30,6 +46,9 @@
 
 typedef struct OmlHistFilterInstanceData InstanceData;
 
+static int
+set(OmlFilter* f, const char* name, OmlValue* value);
+
 static int
 process(OmlFilter* filter, OmlWriter* writer);
 
@@ -39,10 +58,28 @@ sample(OmlFilter* f, OmlValue* value);
 static int
 newwindow(OmlFilter* f);
 
-/*
-static int
-meta(OmlFilter* f, int param_index, char** namePtr, OmlValueT* type);
-*/
+/** Allocate instance data with room for the counts of a number of buckets
+ *
+ * \param self current instance data to resize, or NULL
+ * \param buckets number of buckets between min and max
+ * \return the (re)allocated instance data, or NULL on error, in which case self is left untouched
+ */
+static InstanceData*
+alloc_instance(InstanceData* self, int buckets)
+{
+  size_t size = sizeof(InstanceData) + (buckets + 2) * sizeof(uint64_t);
+  InstanceData* new = (InstanceData*)oml_realloc(self, size);
+
+  if (!new) {
+    logerror ("%s filter: Could not allocate %zu bytes for instance data\n",
+        FILTER_NAME, size);
+    return NULL;
+  }
+  new->buckets = buckets;
+  memset(new->counts, 0, (buckets + 2) * sizeof(uint64_t));
+
+  return new;
+}
 
 void*
 omlf_histogram_new(
@@ -54,21 +91,15 @@ omlf_histogram_new(
     return NULL;
   }
 
-  InstanceData* self = (InstanceData *)oml_malloc(sizeof(InstanceData));
+  InstanceData* self = alloc_instance(NULL, HISTOGRAM_DEFAULT_BUCKETS);
 
   if(self) {
-    memset(self, 0, sizeof(InstanceData));
-
-    self->sample_sum = NAN;
-    self->sample_min = NAN;
-    self->sample_max = NAN;
-    self->sample_count = 0;
     self->result = result;
-  } else {
-    logerror ("%s filter: Could not allocate %d bytes for instance data\n",
-        FILTER_NAME,
-        sizeof(InstanceData));
-    return NULL;
+    self->sample_count = 0;
+    self->min = HISTOGRAM_DEFAULT_MIN;
+    self->max = HISTOGRAM_DEFAULT_MAX;
+    self->scale = HISTOGRAM_LINEAR;
+    self->configured = 0;
   }
 
   return self;
@@ -79,15 +110,13 @@ omlf_register_filter_histogram (void)
 {
   OmlFilterDef def [] =
     {
-      { "avg", OML_DOUBLE_VALUE },
-      { "min", OML_DOUBLE_VALUE },
-      { "max", OML_DOUBLE_VALUE },
+      { "counts", OML_VECTOR_UINT64_VALUE },
       { NULL, 0 }
     };
 
   omlf_register_filter (FILTER_NAME,
             omlf_histogram_new,
-            NULL,
+            set,
             sample,
             process,
             newwindow,
@@ -95,35 +124,120 @@ omlf_register_filter_histogram (void)
             def);
 }
 
+/** Compute the mapping of sample values to buckets from the properties.
+ *
+ * This is done on the first sample after the properties have been changed,
+ * so they can be set in any order. Should they be inconsistent, an error is
+ * reported, and the closest usable boundaries are used instead.
+ *
+ * \param f histogram filter to configure
+ */
+static void
+configure(OmlFilter* f)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+
+  if (self->scale == HISTOGRAM_LOG && !(self->min > 0.)) {
+    logerror ("%s filter %s: min must be positive for logarithmic buckets, not %g; using linear buckets\n",
+        FILTER_NAME, f->name, self->min);
+    self->scale = HISTOGRAM_LINEAR;
+  }
+  if (!(self->max > self->min)) {
+    logerror ("%s filter %s: max (%g) must be greater than min (%g); using max=%g\n",
+        FILTER_NAME, f->name, self->max, self->min, self->min + self->buckets);
+    self->max = self->min + self->buckets;
+  }
+
+  if (self->scale == HISTOGRAM_LOG) {
+    self->offset = log(self->min);
+    self->factor = self->buckets / (log(self->max) - self->offset);
+  } else {
+    self->offset = self->min;
+    self->factor = self->buckets / (self->max - self->min);
+  }
+  self->configured = 1;
+}
+
+static int
+set(OmlFilter* f, const char* name, OmlValue* value)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* new;
+  double val;
+
+  if (!strcmp(name, "scale")) {
+    const char *s = omlc_is_string (*value) ? omlc_get_string_ptr(*oml_value_get_value(value)) : NULL;
+    if (s && !strcasecmp(s, "linear")) {
+      self->scale = HISTOGRAM_LINEAR;
+    } else if (s && !strcasecmp(s, "log")) {
+      self->scale = HISTOGRAM_LOG;
+    } else {
+      logerror ("%s filter %s: scale must be either 'linear' or 'log'\n", FILTER_NAME, f->name);
+      return -1;
+    }
+
+  } else if (!omlc_is_numeric (*value)) {
+    logerror ("%s filter %s: Property '%s' must be numeric\n", FILTER_NAME, f->name, name);
+    return -1;
+
+  } else if (!strcmp(name, "min")) {
+    self->min = oml_value_to_double(value);
+
+  } else if (!strcmp(name, "max")) {
+    self->max = oml_value_to_double(value);
+
+  } else if (!strcmp(name, "buckets")) {
+    val = oml_value_to_double(value);
+    if (!(val >= 1 && val <= HISTOGRAM_MAX_BUCKETS)) {
+      logerror ("%s filter %s: Number of buckets must be between 1 and %d, not %g\n",
+          FILTER_NAME, f->name, HISTOGRAM_MAX_BUCKETS, val);
+      return -1;
+    }
+    if (!(new = alloc_instance(self, (int)val))) {
+      return -1;
+    }
+    f->instance_data = self = new;
+
+  } else {
+    logwarn ("%s filter %s: Ignoring unknown property '%s'\n", FILTER_NAME, f->name, name);
+    return -1;
+  }
+
+  self->configured = 0;
+  return 0;
+}
+
 static int
 sample(
     OmlFilter* f,
     OmlValue*  value  //! values of sample
 ) {
   InstanceData* self = (InstanceData*)f->instance_data;
-  OmlValueU* v = oml_value_get_value(value);;
-  OmlValueT type = oml_value_get_type(value);;
   double val;
 
-  switch (type) {
-  case OML_LONG_VALUE:
-    val = v->longValue;
-    break;
-  case OML_DOUBLE_VALUE:
-    val = v->doubleValue;
-    break;
-  default:
-    // raise error;
+  if (! omlc_is_numeric (*value))
     return -1;
+
+  if (!self->configured) {
+    configure(f);
   }
-  if (isnan(self->sample_sum)) {
-    self->sample_sum = val;
-  } else {
-    self->sample_sum += val;
+
+  val = oml_value_to_double (value);
+  if (self->scale == HISTOGRAM_LOG) {
+    /* -inf or NaN for non-positive values, which end up in the underflow bucket */
+    val = log(val);
   }
-  if (val < self->sample_min || isnan(self->sample_min)) self->sample_min = val;
-  if (val > self->sample_max || isnan(self->sample_max)) self->sample_max = val;
+
+  /* Scale to the bucket number, 0 being the first bucket from min, and clamp
+   * to [-1, buckets]; NaNs fail the first comparison, and are counted as
+   * underflows. Both comparisons compile to plain (branchless) max/min
+   * instructions, and the truncation of a non-negative value is its floor. */
+  val = (val - self->offset) * self->factor;
+  val = val > -1. ? val : -1.;
+  val = val < self->buckets ? val : self->buckets;
+  self->counts[(int)(val + 1.)]++;
   self->sample_count++;
+
   return 0;
 }
 
@@ -134,11 +248,8 @@ process(
 ) {
   InstanceData* self = (InstanceData*)f->instance_data;
 
-  omlc_set_double(*oml_value_get_value(&self->result[0]), 1.0 * self->sample_sum / self->sample_count);
-  omlc_set_double(*oml_value_get_value(&self->result[1]), self->sample_min);
-  omlc_set_double(*oml_value_get_value(&self->result[2]), self->sample_max);
-
-  writer->out(writer, self->result, 3);
+  omlc_set_vector_uint64(*oml_value_get_value(&self->result[0]), self->counts, self->buckets + 2);
+  writer->out(writer, self->result, f->output_count);
 
   return 0;
 }
@@ -148,41 +259,12 @@ newwindow(OmlFilter* f)
 {
   InstanceData* self = (InstanceData*)f->instance_data;
 
-  self->sample_sum = NAN;
-  self->sample_min = NAN;
-  self->sample_max = NAN;
+  memset(self->counts, 0, (self->buckets + 2) * sizeof(uint64_t));
   self->sample_count = 0;
 
   return 0;
 }
 
-/*
-static int
-meta(
-  OmlFilter* f,
-  int param_index,
-  char** namePtr,
-  OmlValueT* type
-) {
-
-  if (param_index > 2) return -1;
-
-  switch (param_index) {
-  case 0:
-    *namePtr = "avg";
-    break;
-  case 1:
-    *namePtr = "min";
-    break;
-  case 2:
-    *namePtr = "max";
-    break;
-  }
-  *type = OML_DOUBLE_VALUE;
-  return 0;
-}
-*/
-
 /*
  Local Variables:
  mode: C
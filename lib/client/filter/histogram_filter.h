@@ -23,6 +23,26 @@
 #ifndef HISTOGRAM_FILTER_H__
 #define HISTOGRAM_FILTER_H__
 
+#include <stdint.h>
+#include <oml2/omlc.h>
+
+/** Default lower bound of the first bucket */
+#define HISTOGRAM_DEFAULT_MIN 0.
+/** Default upper bound of the last bucket */
+#define HISTOGRAM_DEFAULT_MAX 100.
+/** Default number of buckets between min and max */
+#define HISTOGRAM_DEFAULT_BUCKETS 10
+/** Maximal number of buckets between min and max */
+#define HISTOGRAM_MAX_BUCKETS 4096
+
+/** Spacing of the bucket boundaries of a histogram filter */
+typedef enum {
+  /** Buckets of equal width */
+  HISTOGRAM_LINEAR = 0,
+  /** Buckets of equal width in log-space, i.e., with boundaries in geometric progression */
+  HISTOGRAM_LOG,
+} HistogramScale;
+
 struct OmlHistFilterInstanceData {
   /** Array to store the current output data for writing */
   OmlValue*     result;
@@ -30,13 +50,26 @@ struct OmlHistFilterInstanceData {
   /** Number of samples received during the current sampling period */
   unsigned int  sample_count;
 
-  /** Sum of the samples of the current sampling period */
-  double        sample_sum;
+  /** Lower bound of the first bucket, as set by the "min" property */
+  double        min;
+  /** Upper bound of the last bucket, as set by the "max" property */
+  double        max;
+  /** Spacing of the bucket boundaries, as set by the "scale" property */
+  HistogramScale scale;
+  /** Number of buckets between min and max, as set by the "buckets" property */
+  int           buckets;
+
+  /** Non-zero once offset and factor have been computed from the properties */
+  int           configured;
+  /** Value (or its log) mapped to the lower bound of the first bucket */
+  double        offset;
+  /** Number of buckets per unit of value (or of its log) */
+  double        factor;
 
-  /** Minimal sample value seen during the current sampling period */
-  double        sample_min;
-  /** Maximal sample value seen during the current sampling period */
-  double        sample_max;
+  /** Number of samples in each bucket of the current sampling period;
+   * counts[0] holds samples below min, and counts[buckets + 1] samples not
+   * below max */
+  uint64_t      counts[];
 };
 
 #endif // HISTOGRAM_FILTER_H__
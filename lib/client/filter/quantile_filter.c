@@ -0,0 +1,264 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file quantile_filter.c
+ * \brief Implements a filter which estimates quantiles of the samples it received over the sample period.
+ *
+ * The samples are counted in a DDSketch, in bounded memory, and each
+ * estimated quantile is within the accuracy of the sketch of the actual
+ * value, relative to it. The filter outputs the configured quantiles as an
+ * OML_VECTOR_DOUBLE_VALUE, and the serialised sketch as an OML_BLOB_VALUE,
+ * so sketches from several periods or sources can be merged later to
+ * compute quantiles over all of them.
+ *
+ * The filter is configured with the following properties:
+ *  - quantiles (string): space- or comma-separated quantiles to output, between 0 and 1,
+ *    QUANTILE_DEFAULT_QUANTILES by default;
+ *  - accuracy (double): relative accuracy of the quantiles, DDSKETCH_DEFAULT_ACCURACY by default;
+ *  - bins (integer): maximal number of bins for each sign, DDSKETCH_DEFAULT_BINS by default.
+ *
+ * \see ddsketch.c, ddsketch_encode, parse_filter_properties
+ */
+
+#define _GNU_SOURCE  /* For NAN */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_filter.h"
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "oml_value.h"
+#include "quantile_filter.h"
+
+#define FILTER_NAME "quantile"
+
+typedef struct OmlQuantileFilterInstanceData InstanceData;
+
+static int
+set(OmlFilter* f, const char* name, OmlValue* value);
+
+static int
+process(OmlFilter* filter, OmlWriter* writer);
+
+static int
+sample(OmlFilter* f, OmlValue* value);
+
+static int
+newwindow(OmlFilter* f);
+
+/** Allocate instance data with an empty DDSketch right after it
+ *
+ * \param self current instance data to resize, or NULL
+ * \param accuracy relative accuracy of the DDSketch
+ * \param bins maximal number of bins of each store of the DDSketch
+ * \return the (re)allocated instance data, or NULL on error, in which case self is left untouched
+ * \see ddsketch_init
+ */
+static InstanceData*
+alloc_instance(InstanceData* self, double accuracy, int bins)
+{
+  size_t size = sizeof(InstanceData) + ddsketch_size(bins);
+  InstanceData* new;
+
+  if (!(new = (InstanceData*)oml_realloc(self, size))) {
+    logerror ("%s filter: Could not allocate %zu bytes for instance data\n",
+        FILTER_NAME, size);
+    return NULL;
+  }
+  new->sketch = (DDSketch*)(new + 1);
+  ddsketch_init(new->sketch, accuracy, bins);
+
+  return new;
+}
+
+/** Parse a list of quantiles
+ *
+ * \param self instance data to set the quantiles of
+ * \param s space- or comma-separated quantiles
+ * \return 0 on success, -1 otherwise, in which case self is left untouched
+ */
+static int
+parse_quantiles(InstanceData* self, const char* s)
+{
+  double quantiles[QUANTILE_MAX_QUANTILES];
+  char *end;
+  int n = 0;
+
+  while (*s) {
+    if (*s == ' ' || *s == ',' || *s == '\t') {
+      s++;
+      continue;
+    }
+    if (n == QUANTILE_MAX_QUANTILES) {
+      logerror ("%s filter: At most %d quantiles can be output\n", FILTER_NAME, QUANTILE_MAX_QUANTILES);
+      return -1;
+    }
+    quantiles[n] = strtod(s, &end);
+    if (end == s || !(quantiles[n] >= 0. && quantiles[n] <= 1.)) {
+      logerror ("%s filter: Invalid quantile '%s', quantiles must be between 0 and 1\n", FILTER_NAME, s);
+      return -1;
+    }
+    n++;
+    s = end;
+  }
+  if (!n) {
+    logerror ("%s filter: No quantiles to output\n", FILTER_NAME);
+    return -1;
+  }
+
+  memcpy(self->quantiles, quantiles, n * sizeof(double));
+  self->nquantiles = n;
+  return 0;
+}
+
+void*
+omlf_quantile_new(OmlValueT type, OmlValue* result)
+{
+  if (! omlc_is_numeric_type (type)) {
+    logerror ("%s filter: Can only handle numeric parameters\n", FILTER_NAME);
+    return NULL;
+  }
+
+  InstanceData* self = alloc_instance(NULL, DDSKETCH_DEFAULT_ACCURACY, DDSKETCH_DEFAULT_BINS);
+
+  if (self) {
+    self->result = result;
+    parse_quantiles(self, QUANTILE_DEFAULT_QUANTILES);
+  }
+
+  return self;
+}
+
+void
+omlf_register_filter_quantile (void)
+{
+  OmlFilterDef def [] =
+    {
+      { "quantiles", OML_VECTOR_DOUBLE_VALUE },
+      { "sketch", OML_BLOB_VALUE },
+      { NULL, 0 }
+    };
+
+  omlf_register_filter (FILTER_NAME,
+                        omlf_quantile_new,
+                        set,
+                        sample,
+                        process,
+                        newwindow,
+                        NULL,
+                        def);
+}
+
+static int
+set(OmlFilter* f, const char* name, OmlValue* value)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  InstanceData* new;
+  double accuracy = self->sketch->accuracy;
+  int bins = self->sketch->max_bins;
+
+  if (!strcmp(name, "quantiles")) {
+    if (!omlc_is_string (*value)) {
+      logerror ("%s filter %s: Property 'quantiles' must be a string\n", FILTER_NAME, f->name);
+      return -1;
+    }
+    return parse_quantiles(self, omlc_get_string_ptr(*oml_value_get_value(value)));
+
+  } else if (!omlc_is_numeric (*value)) {
+    logerror ("%s filter %s: Property '%s' must be numeric\n", FILTER_NAME, f->name, name);
+    return -1;
+
+  } else if (!strcmp(name, "accuracy")) {
+    accuracy = oml_value_to_double(value);
+    if (ddsketch_init(self->sketch, accuracy, bins)) {
+      logerror ("%s filter %s: Invalid accuracy %g\n", FILTER_NAME, f->name, accuracy);
+      return -1;
+    }
+
+  } else if (!strcmp(name, "bins")) {
+    double val = oml_value_to_double(value);
+    if (!(val >= 1 && val <= QUANTILE_MAX_BINS)) {
+      logerror ("%s filter %s: Number of bins must be between 1 and %d, not %g\n",
+          FILTER_NAME, f->name, QUANTILE_MAX_BINS, val);
+      return -1;
+    }
+    if (!(new = alloc_instance(self, accuracy, (int)val))) {
+      return -1;
+    }
+    f->instance_data = new;
+
+  } else {
+    logwarn ("%s filter %s: Ignoring unknown property '%s'\n", FILTER_NAME, f->name, name);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int
+sample(OmlFilter* f, OmlValue* value)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+
+  if (! omlc_is_numeric (*value))
+    return -1;
+
+  ddsketch_add(self->sketch, oml_value_to_double (value));
+
+  return 0;
+}
+
+static int
+process(OmlFilter* f, OmlWriter* writer)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+  double values[QUANTILE_MAX_QUANTILES];
+  size_t size = ddsketch_encode(self->sketch, NULL, 0);
+  uint8_t *buf = oml_malloc(size);
+  int i;
+
+  for (i = 0; i < self->nquantiles; i++) {
+    values[i] = ddsketch_quantile(self->sketch, self->quantiles[i]);
+  }
+  omlc_set_vector_double(*oml_value_get_value(&self->result[0]), values, self->nquantiles);
+
+  if (buf) {
+    ddsketch_encode(self->sketch, buf, size);
+    omlc_set_blob(*oml_value_get_value(&self->result[1]), buf, size);
+    oml_free(buf);
+  } else {
+    logerror ("%s filter %s: Could not allocate %zu bytes to serialise sketch\n", FILTER_NAME, f->name, size);
+    omlc_set_blob_length(*oml_value_get_value(&self->result[1]), 0);
+  }
+
+  writer->out(writer, self->result, f->output_count);
+
+  return 0;
+}
+
+static int
+newwindow(OmlFilter* f)
+{
+  InstanceData* self = (InstanceData*)f->instance_data;
+
+  ddsketch_clear(self->sketch);
+
+  return 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
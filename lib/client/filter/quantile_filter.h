@@ -0,0 +1,48 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+#ifndef QUANTILE_FILTER_H__
+#define QUANTILE_FILTER_H__
+
+#include <oml2/omlc.h>
+#include "ddsketch.h"
+
+/** Default quantiles output by the quantile filter */
+#define QUANTILE_DEFAULT_QUANTILES "0.5 0.9 0.99 0.999"
+/** Maximal number of quantiles output by the quantile filter */
+#define QUANTILE_MAX_QUANTILES 16
+/** Maximal number of bins of each sign of the DDSketch of a quantile filter */
+#define QUANTILE_MAX_BINS 65536
+
+struct OmlQuantileFilterInstanceData
+{
+  /** Array to store the current output data for writing */
+  OmlValue*     result;
+
+  /** Number of quantiles to output */
+  int           nquantiles;
+  /** Quantiles to output, as set by the "quantiles" property */
+  double        quantiles[QUANTILE_MAX_QUANTILES];
+
+  /** DDSketch of the samples of the current sampling period, allocated
+   * right after this structure, with the accuracy and number of bins set by
+   * the "accuracy" and "bins" properties */
+  DDSketch*     sketch;
+};
+
+#endif /* QUANTILE_FILTER_H__ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -34,6 +34,8 @@
 #include "filter/factory.h"
 #include "oml_util.h"
 #include "client.h"
+#include "buffered_writer.h"
+#include "marshal.h"
 
 #define OMLC_COPYRIGHT "Copyright 2007-2014, NICTA"
 
@@ -56,6 +58,12 @@ static OmlMPDef _client_instrumentation[] = {
   {"bytes_freed", OML_UINT64_VALUE, NULL},
   {"bytes_in_use", OML_UINT64_VALUE, NULL},
   {"bytes_max", OML_UINT64_VALUE, NULL},
+  {"inject_ring_full", OML_UINT32_VALUE, NULL},
+  {"interval_missed", OML_UINT32_VALUE, NULL},
+  {"queue_dropped_oldest", OML_UINT32_VALUE, NULL},
+  {"queue_dropped_newest", OML_UINT32_VALUE, NULL},
+  {"queue_blocked", OML_UINT32_VALUE, NULL},
+  {"queue_thinned", OML_UINT32_VALUE, NULL},
   {NULL, (OmlValueT)0, NULL}
 };
 
@@ -68,6 +76,7 @@ static int  default_configuration(void);
 static char *schemastr_from_mpdef(OmlMPDef *mpdef);
 static int  write_meta(void);
 static int  write_schema(OmlMStream* ms, int index);
+static void ms_compile_plan(OmlMStream* ms);
 static void termination_handler(int signum);
 static void install_close_handler(sighandler sig_hdl);
 static void setup_features(const char * const features);
@@ -106,7 +115,10 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
   int sample_count = 0;
   double sample_interval = 0.0;
   int max_queue = 0;
+  const char* overflow_policy = NULL;
   uint32_t instr_interval = 1;
+  enum InjectMode inject_mode = IM_Direct;
+  int protocol = OML_DEFAULT_PROTOCOL_VERSION;
   const char** arg = argv;
 
   if (!app_name) {
@@ -216,6 +228,13 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
         }
         max_queue = atoi(*++arg);
         *pargc -= 2;
+      } else if (strcmp(*arg, "--oml-overflow") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-overflow'\n");
+          return -1;
+        }
+        overflow_policy = *++arg;
+        *pargc -= 2;
       } else if (strcmp(*arg, "--oml-instr-interval") == 0) {
         start = (char *)*++arg; /* XXX: Drop arg's const */
         end = NULL;
@@ -233,6 +252,37 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
           loginfo("Client instrumentation disabled\n");
         }
 
+      } else if (strcmp(*arg, "--oml-inject-mode") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-inject-mode'\n");
+          return -1;
+        }
+        arg++;
+        if (strcmp(*arg, "direct") == 0) {
+          inject_mode = IM_Direct;
+        } else if (strcmp(*arg, "ring") == 0) {
+          inject_mode = IM_Ring;
+        } else {
+          logwarn("Unknown injection mode '%s', using 'direct'\n", *arg);
+          inject_mode = IM_Direct;
+        }
+        *pargc -= 2;
+
+      } else if (strcmp(*arg, "--oml-protocol") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-protocol'\n");
+          return -1;
+        }
+        protocol = (int)strtol(*++arg, &end, 10);
+        if (end == *arg || *end != '\0' ||
+            protocol < OML_DEFAULT_PROTOCOL_VERSION || protocol > OML_PROTOCOL_VERSION) {
+          logwarn("Invalid protocol version '%s' (should be in [%d, %d]), using %d\n",
+              *arg, OML_DEFAULT_PROTOCOL_VERSION, OML_PROTOCOL_VERSION,
+              OML_DEFAULT_PROTOCOL_VERSION);
+          protocol = OML_DEFAULT_PROTOCOL_VERSION;
+        }
+        *pargc -= 2;
+
       } else if (strcmp(*arg, "--oml-noop") == 0) {
         *pargc -= 1;
         omlc_close();
@@ -290,8 +340,11 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
   omlc_instance->sample_interval = sample_interval;
   omlc_instance->default_encoding = default_encoding;
   omlc_instance->max_queue = max_queue;
+  omlc_instance->overflow_policy = overflow_policy;
   omlc_instance->instr_time = 0;
   omlc_instance->instr_interval = instr_interval;
+  omlc_instance->inject_mode = inject_mode;
+  omlc_instance->protocol = protocol;
 
   if (local_data_file != NULL) {
     // dump every sample into local_data_file
@@ -437,6 +490,7 @@ omlc_add_mp (const char* mp_name, OmlMPDef* mp_def)
 
     /* At this stage, we only have one stream set up, and we now its index */
     mp->streams->index = omlc_instance->next_ms_idx++;
+    ms_compile_plan(mp->streams);
 
   }
 
@@ -562,6 +616,10 @@ omlc_start()
       return -3;
     }
   }
+  if (IM_Ring == omlc_instance->inject_mode && inject_ring_start()) {
+    omlc_close();
+    return -1;
+  }
   install_close_handler(termination_handler);
   if (write_meta() == -1) {
     return -1;
@@ -646,7 +704,10 @@ omlc_close(void)
 
     install_close_handler(SIG_DFL);
 
+    inject_ring_stop();
+
     while( (mp = destroy_mp(mp)) );
+    filter_engine_shutdown();
     if (w) {
       while( (w =  w->close(w)) );
     }
@@ -683,6 +744,12 @@ usage(void)
   printf("  --oml-text             .. Use text encoding for all output streams\n");
   printf("  --oml-binary           .. Use binary encoding for all output streams\n");
   printf("  --oml-bufsize size     .. Set size of internal buffers to 'size' bytes\n");
+  printf("  --oml-overflow policy  .. What to do when a buffer is full ('drop-oldest', default,\n");
+  printf("                            'drop-newest', 'block[:ms]', or 'thin[:keep[:hwm%%]]')\n");
+  printf("  --oml-inject-mode mode .. Process samples in the injecting thread ('direct', default)\n");
+  printf("                            or queue them in per-thread rings ('ring')\n");
+  printf("  --oml-protocol version .. OMSP version to use (default: %d, max: %d)\n",
+           OML_DEFAULT_PROTOCOL_VERSION, OML_PROTOCOL_VERSION);
   printf("  --oml-log-file file    .. Writes log messages to 'file'\n");
   printf("  --oml-log-level level  .. Log level used (error: -2 .. info: 0 .. debug4: 4)\n");
   printf("  --oml-noop             .. Do not collect measurements\n");
@@ -732,15 +799,17 @@ print_filters(void)
 }
 
 /** Create either a file writer or a network writer
- * \param uri collection URI
+ * \param uri collection URI, optionally prefixed with a compression (e.g., zlib+tcp:host)
  * \param encoding StreamEncoding to use for the output, either SE_Text or SE_Binary
  *
  * \return a pointer to the new OmlWriter, or NULL on error
+ * \see oml_uri_strip_compression, zlib_stream_new
  */
 OmlWriter*
 create_writer(const char* uri, enum StreamEncoding encoding)
 {
-  OmlURIType uri_type = oml_uri_type(uri);
+  OmlURIType uri_type;
+  OmlURICompression compression;
 
   if (omlc_instance == NULL){
     logerror("No omlc_instance:  OML client was not initialized properly.\n");
@@ -751,6 +820,16 @@ create_writer(const char* uri, enum StreamEncoding encoding)
     logerror ("Missing or invalid collection URI definition (e.g., --oml-collect)\n");
     return NULL;
   }
+  if ((uri = oml_uri_strip_compression(uri, &compression)) == NULL) {
+    return NULL;
+  }
+#ifndef HAVE_LIBZ
+  if (OML_URI_COMPRESSION_ZLIB == compression) {
+    logerror ("Compressed collection URIs are not supported, as liboml2 was built without zlib\n");
+    return NULL;
+  }
+#endif
+  uri_type = oml_uri_type(uri);
   if (omlc_instance->node_name == NULL) {
     logerror ("Missing '--oml-id' flag \n");
     return NULL;
@@ -815,6 +894,17 @@ create_writer(const char* uri, enum StreamEncoding encoding)
     logerror ("Failed to create stream for URI %s\n", uri);
     return NULL;
   }
+#ifdef HAVE_LIBZ
+  if (OML_URI_COMPRESSION_ZLIB == compression) {
+    OmlOutStream *zlib_stream = zlib_stream_new(out_stream);
+    if (zlib_stream == NULL) {
+      logerror ("Failed to create compressed stream for URI %s\n", uri);
+      out_stream->close(out_stream);
+      return NULL;
+    }
+    out_stream = zlib_stream;
+  }
+#endif
 
   oml_free ((void*)transport);
   oml_free ((void*)path);
@@ -835,6 +925,11 @@ create_writer(const char* uri, enum StreamEncoding encoding)
     logerror ("Failed to create writer for encoding '%s'.\n", encoding == SE_Binary ? "binary" : "text");
     return NULL;
   }
+  if (omlc_instance->overflow_policy &&
+      bw_set_policy(writer->bufferedWriter, omlc_instance->overflow_policy)) {
+    writer->close(writer);
+    return NULL;
+  }
   writer->next = omlc_instance->first_writer;
   omlc_instance->first_writer = writer;
 
@@ -1098,6 +1193,10 @@ destroy_ms(OmlMStream *ms)
 
   next = ms->next;
 
+  if (ms->sample_interval > 0) {
+    filter_engine_stop(ms);
+  }
+
   if (ms->sample_size > 0) {
     loginfo("Reporting last (partial) sample for MS %s\n", ms->table_name);
     filter_process(ms);
@@ -1106,6 +1205,11 @@ destroy_ms(OmlMStream *ms)
 
   while( (ft = destroy_filter(ft)) );
 
+  marshal_plan_free(ms->plan);
+  while (ms->nencoded > 0) {
+    mbuf_destroy(ms->encoded[--ms->nencoded]);
+  }
+  oml_free(ms->encoded);
   oml_free(ms->writers);
   oml_free(ms);
 
@@ -1272,7 +1376,7 @@ sem_from_mpdef(OMLSemDef *dp)
 static char*
 schemastr_from_mpdef(OmlMPDef *mpdef)
 {
-  OMLSemDef*sp;
+  char *sp;
   char *schema_str;
   MString *schema_mstr;
   OmlMPDef *dp = mpdef;
@@ -1324,7 +1428,7 @@ write_meta(void)
   OmlWriter* writer = omlc_instance->first_writer;
   for (; writer != NULL; writer = writer->next) {
     char s[128];
-    sprintf(s, "protocol: %d", OML_PROTOCOL_VERSION);
+    sprintf(s, "protocol: %d", omlc_instance->protocol);
     writer->meta(writer, s);
     sprintf(s, "domain: %s", omlc_instance->domain);
     writer->meta(writer, s);
@@ -1448,9 +1552,46 @@ write_schema(OmlMStream *ms, int index)
   }
 
   oml_free (schema);
+  ms_compile_plan(ms);
   return 0;
 }
 
+/** Compile the marshalling plan of an MS, now that its schema is fixed
+ *
+ * The types of the fields are collected from the filters' meta functions, in
+ * the same order as in the schema written by write_schema. Failing to compile
+ * the plan is not an error, the binary writers then marshal each value on its
+ * own.
+ *
+ * \param ms the stream definition
+ * \see marshal_plan_new, OmlMStream::plan
+ */
+static void
+ms_compile_plan(OmlMStream *ms)
+{
+  OmlFilter* filter;
+  int count = 0;
+  int j;
+
+  for (filter = ms->filters; filter != NULL; filter = filter->next) {
+    count += filter->output_count;
+  }
+
+  OmlValueT types[count + 1];
+  count = 0;
+  for (filter = ms->filters; filter != NULL; filter = filter->next) {
+    for (j = 0; j < filter->output_count; j++) {
+      char* name;
+      if (filter->meta(filter, j, &name, &types[count], NULL) != -1) {
+        count++;
+      }
+    }
+  }
+
+  marshal_plan_free(ms->plan);
+  ms->plan = marshal_plan_new(types, count, omlc_instance->protocol);
+}
+
 /**
  *  Validate the name of the application.
  *
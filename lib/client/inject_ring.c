@@ -0,0 +1,475 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file inject_ring.c
+ * \brief Per-thread injection rings, drained by a single consumer thread.
+ *
+ * In IM_Ring mode, omlc_inject does not take the MP lock. Instead, each
+ * injecting thread copies its sample into its own single-producer,
+ * single-consumer ring, and publishes it with a release store of the head
+ * index. A consumer thread drains all rings, and hands runs of consecutive
+ * samples for the same MP to omlc_inject_rows, so the MP lock is only taken
+ * once per run.
+ *
+ * Samples from one thread are processed in the order they were injected.
+ * There is no ordering guarantee between threads. When a ring is full, the
+ * sample is dropped and counted; the count is reported in the
+ * client instrumentation MP.
+ *
+ * When all rings are empty, the consumer waits on a condition variable.
+ * Producers only take the corresponding lock to signal it when the consumer
+ * has announced it is about to wait, so the fast path stays lock-free.
+ *
+ * Note that sample timestamps are taken when the consumer processes them, not
+ * when they are injected.
+ *
+ * \see omlc_inject, omlc_inject_rows, inject_ring_nfull_reset
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "oml2/omlc.h"
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "oml_value.h"
+#include "client.h"
+
+/** Number of slots in each ring; must be a power of 2 */
+#define INJECT_RING_SIZE 1024
+/** Maximum number of samples handed to omlc_inject_rows at once */
+#define INJECT_RING_BATCH 64
+
+/** One sample queued in a ring */
+typedef struct InjectSlot {
+  /** MP the sample was injected into */
+  OmlMP *mp;
+  /** Deep copy of the sample; storage is reused for subsequent samples */
+  OmlValue *values;
+  /** Number of allocated elements in values */
+  unsigned int nvalues;
+} InjectSlot;
+
+/** A single-producer, single-consumer ring of samples */
+typedef struct InjectRing {
+  /** Next ring in the consumer's list */
+  struct InjectRing *next;
+
+  /** Index of the next slot to fill; only written by the producer */
+  unsigned long head;
+  /** Index of the next slot to process; only written by the consumer */
+  unsigned long tail;
+
+  /** Set to 1 when the producer thread has exited */
+  int orphaned;
+
+  InjectSlot slots[INJECT_RING_SIZE];
+} InjectRing;
+
+/** Key to the calling thread's InjectRing */
+static pthread_key_t ring_key;
+/** Protects insertions and removals in rings */
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+/** List of all rings; new rings are added at the head */
+static InjectRing *rings = NULL;
+/** Number of samples dropped because a ring was full \see inject_ring_nfull_reset */
+static uint32_t nfull = 0;
+
+/** Consumer thread */
+static pthread_t consumer;
+/** Set to 1 while the consumer should keep running */
+static int consumer_active = 0;
+/** Set to 1 while the consumer is (about to be) waiting on semaphore */
+static int consumer_idle = 0;
+/** Protects the consumer's decision to wait on semaphore */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled when a sample is queued, a ring is orphaned, or the consumer is stopped */
+static pthread_cond_t semaphore = PTHREAD_COND_INITIALIZER;
+
+/** Scratch space to pass a run of samples to omlc_inject_rows */
+static OmlValueU *batch = NULL;
+/** Number of OmlValueU allocated in batch */
+static size_t batch_size = 0;
+
+static void ring_orphan(void *ring);
+static InjectRing* ring_get(void);
+static void ring_destroy(InjectRing *ring);
+static int ring_drain(InjectRing *ring);
+static int rings_drain(void);
+static int rings_pending(void);
+static void consumer_wake(void);
+static void* consumer_start(void* handle);
+
+/** Start the injection ring consumer thread.
+ *
+ * \return 0 on success, -1 otherwise
+ * \see inject_ring_stop
+ */
+int
+inject_ring_start(void)
+{
+  if (consumer_active) {
+    return 0;
+  }
+
+  if (pthread_key_create(&ring_key, ring_orphan)) {
+    logerror("Cannot create key for per-thread injection rings\n");
+    return -1;
+  }
+
+  consumer_active = 1;
+  if (pthread_create(&consumer, NULL, consumer_start, NULL)) {
+    logerror("Cannot start injection ring consumer thread\n");
+    consumer_active = 0;
+    pthread_key_delete(ring_key);
+    return -1;
+  }
+
+  logdebug("Started injection ring consumer thread\n");
+  return 0;
+}
+
+/** Stop the injection ring consumer thread, after draining all rings.
+ *
+ * All rings are freed. Producers must not inject anymore when this is called.
+ *
+ * \see inject_ring_start
+ */
+void
+inject_ring_stop(void)
+{
+  InjectRing *ring;
+
+  if (!consumer_active) {
+    return;
+  }
+
+  pthread_mutex_lock(&idle_lock);
+  __atomic_store_n(&consumer_active, 0, __ATOMIC_RELEASE);
+  pthread_cond_signal(&semaphore);
+  pthread_mutex_unlock(&idle_lock);
+  pthread_join(consumer, NULL);
+
+  rings_drain();
+  while ((ring = rings)) {
+    rings = ring->next;
+    ring_destroy(ring);
+  }
+  pthread_key_delete(ring_key);
+
+  if (batch) {
+    oml_free(batch);
+    batch = NULL;
+    batch_size = 0;
+  }
+  logdebug("Stopped injection ring consumer thread\n");
+}
+
+/** Queue a sample in the calling thread's injection ring.
+ *
+ * The content of values is deep-copied, so values can be directly
+ * freed/reused when this function returns.
+ *
+ * \param mp pointer to OmlMP into which the new sample is being injected
+ * \param values an array of mp->param_count OmlValueU
+ * \return 0 on success, <0 otherwise (including if the ring is full)
+ *
+ * \see omlc_inject
+ */
+int
+inject_ring_push(OmlMP *mp, OmlValueU *values)
+{
+  InjectRing *ring;
+  InjectSlot *slot;
+  OmlValue *new;
+  unsigned long head;
+  int i;
+
+  if (!(ring = ring_get())) {
+    return -1;
+  }
+
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= INJECT_RING_SIZE) {
+    __atomic_fetch_add(&nfull, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+
+  slot = &ring->slots[head & (INJECT_RING_SIZE - 1)];
+  if (slot->nvalues < (unsigned int)mp->param_count) {
+    if (!(new = oml_realloc(slot->values, mp->param_count * sizeof(OmlValue)))) {
+      logerror("Cannot allocate space for %d values in injection ring\n", mp->param_count);
+      return -1;
+    }
+    slot->values = new;
+    oml_value_array_init(slot->values + slot->nvalues, mp->param_count - slot->nvalues);
+    slot->nvalues = mp->param_count;
+  }
+
+  slot->mp = mp;
+  for (i = 0; i < mp->param_count; i++) {
+    if (oml_value_set(&slot->values[i], &values[i], mp->param_defs[i].param_types)) {
+      return -1;
+    }
+  }
+
+  /* Sequentially consistent, so either the consumer sees this sample before
+   * waiting, or consumer_wake sees it is idle; see consumer_start */
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+  consumer_wake();
+  return 0;
+}
+
+/** Get the number of samples dropped because of full rings since the last call.
+ *
+ * \return the number of samples dropped
+ * \see inject_ring_push
+ */
+uint32_t
+inject_ring_nfull_reset(void)
+{
+  return __atomic_exchange_n(&nfull, 0, __ATOMIC_RELAXED);
+}
+
+/** Get the calling thread's ring, creating it if needed.
+ *
+ * \return the InjectRing, or NULL on error
+ */
+static InjectRing*
+ring_get(void)
+{
+  InjectRing *ring;
+
+  if (!consumer_active) {
+    logerror("Injection ring consumer not running\n");
+    return NULL;
+  }
+
+  if ((ring = pthread_getspecific(ring_key))) {
+    return ring;
+  }
+
+  if (!(ring = oml_malloc(sizeof(InjectRing)))) {
+    logerror("Cannot allocate injection ring\n");
+    return NULL;
+  }
+  memset(ring, 0, sizeof(InjectRing));
+  pthread_setspecific(ring_key, ring);
+
+  pthread_mutex_lock(&rings_lock);
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+
+  logdebug("Created injection ring %p\n", ring);
+  return ring;
+}
+
+/** Mark a ring as orphaned when its producer thread exits.
+ *
+ * The consumer frees it once drained.
+ *
+ * \param ring InjectRing to mark (cast as void*)
+ * \see pthread_key_create
+ */
+static void
+ring_orphan(void *ring)
+{
+  __atomic_store_n(&((InjectRing*)ring)->orphaned, 1, __ATOMIC_SEQ_CST);
+  consumer_wake();
+}
+
+/** Free a ring and the storage of all its slots.
+ *
+ * \param ring InjectRing to free
+ */
+static void
+ring_destroy(InjectRing *ring)
+{
+  int i;
+
+  for (i = 0; i < INJECT_RING_SIZE; i++) {
+    if (ring->slots[i].values) {
+      oml_value_array_reset(ring->slots[i].values, ring->slots[i].nvalues);
+      oml_free(ring->slots[i].values);
+    }
+  }
+  oml_free(ring);
+}
+
+/** Process all samples currently queued in a ring.
+ *
+ * Runs of consecutive samples for the same MP are passed to omlc_inject_rows
+ * together, up to INJECT_RING_BATCH at a time.
+ *
+ * \param ring InjectRing to drain
+ * \return the number of samples processed
+ */
+static int
+ring_drain(InjectRing *ring)
+{
+  unsigned long tail = ring->tail;
+  unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  unsigned long n, i, count = 0;
+  InjectSlot *slot;
+  OmlValueU *new;
+  OmlMP *mp;
+  int j;
+
+  while (tail != head) {
+    mp = ring->slots[tail & (INJECT_RING_SIZE - 1)].mp;
+
+    if (batch_size < (size_t)INJECT_RING_BATCH * mp->param_count) {
+      if (!(new = oml_realloc(batch, INJECT_RING_BATCH * mp->param_count * sizeof(OmlValueU)))) {
+        logerror("Cannot allocate space to process %d samples from injection ring\n", INJECT_RING_BATCH);
+        return count;
+      }
+      batch = new;
+      batch_size = (size_t)INJECT_RING_BATCH * mp->param_count;
+    }
+
+    for (n = 0; n < INJECT_RING_BATCH && tail + n != head; n++) {
+      slot = &ring->slots[(tail + n) & (INJECT_RING_SIZE - 1)];
+      if (slot->mp != mp) {
+        break;
+      }
+      for (j = 0; j < mp->param_count; j++) {
+        /* Shallow copy; omlc_inject_rows deep-copies into the filters */
+        batch[n * mp->param_count + j] = *oml_value_get_value(&slot->values[j]);
+      }
+    }
+
+    omlc_inject_rows(mp, batch, n);
+
+    for (i = 0; i < n; i++) {
+      ring->slots[(tail + i) & (INJECT_RING_SIZE - 1)].mp = NULL;
+    }
+    tail += n;
+    count += n;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  return count;
+}
+
+/** Drain all rings, and free those whose producer has exited.
+ *
+ * Only the consumer removes rings from the list, and producers only add them
+ * at its head, so the list can be walked without holding rings_lock. The lock
+ * is only needed to unlink a ring.
+ *
+ * \return the number of samples processed
+ */
+static int
+rings_drain(void)
+{
+  InjectRing **prev, *ring, *next;
+  int orphaned, count = 0;
+
+  pthread_mutex_lock(&rings_lock);
+  ring = rings;
+  pthread_mutex_unlock(&rings_lock);
+
+  for (; ring; ring = next) {
+    next = ring->next;
+    /* Check before draining, so no sample pushed before exiting is missed */
+    orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+    count += ring_drain(ring);
+
+    if (orphaned) {
+      pthread_mutex_lock(&rings_lock);
+      for (prev = &rings; *prev != ring; prev = &(*prev)->next);
+      *prev = ring->next;
+      pthread_mutex_unlock(&rings_lock);
+      ring_destroy(ring);
+    }
+  }
+
+  return count;
+}
+
+/** Check whether any ring has samples to process, or is orphaned.
+ *
+ * \return 1 if rings_drain would have something to do, 0 otherwise
+ */
+static int
+rings_pending(void)
+{
+  InjectRing *ring;
+
+  pthread_mutex_lock(&rings_lock);
+  ring = rings;
+  pthread_mutex_unlock(&rings_lock);
+
+  for (; ring; ring = ring->next) {
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail ||
+        __atomic_load_n(&ring->orphaned, __ATOMIC_SEQ_CST)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/** Wake the consumer up if it is waiting for samples.
+ *
+ * \see consumer_start
+ */
+static void
+consumer_wake(void)
+{
+  if (__atomic_load_n(&consumer_idle, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&idle_lock);
+    pthread_cond_signal(&semaphore);
+    pthread_mutex_unlock(&idle_lock);
+  }
+}
+
+/** Injection ring consumer thread
+ *
+ * Loops draining all rings until inject_ring_stop is called. When there was
+ * nothing to drain, it announces it is idle, checks the rings once more, and
+ * waits on semaphore if they are still empty. As producers publish their
+ * samples before checking consumer_idle, and idle_lock is held from that
+ * last check until pthread_cond_wait, no wake-up can be missed.
+ *
+ * \param handle unused
+ * \return NULL, inconditionally
+ */
+static void*
+consumer_start(void* handle)
+{
+  int count;
+  (void)handle;
+
+  while (__atomic_load_n(&consumer_active, __ATOMIC_ACQUIRE)) {
+    count = rings_drain();
+    if (!count) {
+      pthread_mutex_lock(&idle_lock);
+      __atomic_store_n(&consumer_idle, 1, __ATOMIC_SEQ_CST);
+      if (!rings_pending() && __atomic_load_n(&consumer_active, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&semaphore, &idle_lock);
+      }
+      __atomic_store_n(&consumer_idle, 0, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&idle_lock);
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
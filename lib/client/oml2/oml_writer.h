@@ -22,15 +22,25 @@
 
 #include <oml2/omlc.h>
 
-/** The OMSP version that this library speaks.
+/** The highest OMSP version that this library speaks.
  *
  * This also defines the highest protocol revision that the oml2-server built
  * along can understand.
+ *
+ * \see OML_DEFAULT_PROTOCOL_VERSION
  */
-#define OML_PROTOCOL_VERSION 5
+#define OML_PROTOCOL_VERSION 8
+
+/** The OMSP version that this library speaks by default.
+ *
+ * This stays at version 5, so clients keep interoperating with older servers;
+ * versions 6 to OML_PROTOCOL_VERSION have to be requested with --oml-protocol.
+ */
+#define OML_DEFAULT_PROTOCOL_VERSION 5
 
 struct OmlWriter;
 typedef struct BufferedWriter BufferedWriter; /* XXX: From buffered_writer.h */
+struct MBuffer; /* XXX: From mbuf.h */
 
 /** Function called whenever some header metadata needs to be added.
  * \param writer pointer to OmlWriter instance
@@ -82,6 +92,35 @@ typedef int (*oml_writer_row_end)(struct OmlWriter* writer, OmlMStream* ms);
  */
 typedef int (*oml_writer_out)( struct OmlWriter* writer, OmlValue* values, int values_count);
 
+/** Function called to marshal values into an MBuffer other than the writer's own.
+ *
+ * This is optional; writers providing it also provide oml_writer_out_encoded,
+ * so a sample output to several writers using the same encoding only needs to
+ * be marshalled once.
+ *
+ * \param writer pointer to OmlWriter instance
+ * \param mbuf MBuffer to write the marshalled values into
+ * \param ms OmlMStream for which the sample is
+ * \param first index, in the sample, of the first of values
+ * \param values array of OmlValue to marshal
+ * \param values_count size of the values array
+ * \return 1 on success, 0 on error
+ * \see oml_writer_out_encoded
+ */
+typedef int (*oml_writer_encode)(struct OmlWriter* writer, struct MBuffer* mbuf, OmlMStream* ms,
+    int first, OmlValue* values, int values_count);
+
+/** Function called with values already marshalled by oml_writer_encode, instead of oml_writer_out
+ * \param writer pointer to OmlWriter instance
+ * \param data values marshalled by the oml_writer_encode function of this writer
+ * \param length length of data
+ * \param values_count number of values in data
+ * \return 1 on success, 0 on error
+ * \see oml_writer_encode, oml_writer_out
+ */
+typedef int (*oml_writer_out_encoded)(struct OmlWriter* writer, const uint8_t* data, size_t length,
+    int values_count);
+
 /** Function called to close the writer and free its allocated objects.
  *
  * This function is designed so it can be used in a while loop to clean up the
@@ -119,6 +158,11 @@ typedef struct OmlWriter {
   /** Buffered writer into which the serialised data is written */
   BufferedWriter* bufferedWriter;
 
+  /** Pointer to function marshalling values for several writers (optional) \see oml_writer_encode */
+  oml_writer_encode encode;
+  /** Pointer to function outputting marshalled values (optional) \see oml_writer_out_encoded */
+  oml_writer_out_encoded out_encoded;
+
 } OmlWriter;
 
 /** Stream encoding type, for use with create_writer */
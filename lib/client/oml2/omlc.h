@@ -204,7 +204,7 @@ size_t oml_malloc_usable_size(void *ptr);
  * \param n number of OmlValueU in the array
  */
 #define omlc_zero_array(var, n) \
-  memset((var), 0, n*sizeof(OmlValueU))
+  memset((var), 0, (n) * sizeof(OmlValueU))
 
 /** Get an intrinsic C value from an OmlValueU.
  *
@@ -743,7 +743,7 @@ typedef struct OmlMStream {
 
   /** Condition variable for sample-mode filter (XXX: Never used) */
   pthread_cond_t  condVar;
-  /** Filtering thread */
+  /** Filtering thread (XXX: Not used anymore, all periodic MSs share the same scheduler thread) */
   pthread_t  filter_thread;
 
   /** Outputting function
@@ -767,6 +767,21 @@ typedef struct OmlMStream {
   /** Number of tuples dropped */
   uint32_t dropped;
 
+  /** Whether injected samples bypass the filters, and are output as is:
+   * 0 if not determined yet, -1 if not, 1 if all the fields of the MP are
+   * output in order, 2 if only some of them, or in a different order
+   * \see filter_passthrough */
+  int passthrough;
+
+  /** Precompiled marshalling of the fields of the schema, for binary writers
+   * \see marshal_plan_new, ms_compile_plan */
+  struct MarshalPlan *plan;
+
+  /** MBuffers into which samples are encoded once for several writers \see filter_process */
+  struct MBuffer **encoded;
+  /** Number of elements in encoded */
+  int nencoded;
+
 } OmlMStream;
 
 /* Initialise the measurement library. */
@@ -781,6 +796,27 @@ int omlc_start(void);
 /*  Inject a measurement sample into a Measurement Point.  */
 int omlc_inject(OmlMP *mp, OmlValueU *values);
 
+/*  Inject nrows measurement samples, laid out back-to-back in rows, into a Measurement Point.  */
+int omlc_inject_batch(OmlMP *mp, OmlValueU *rows, unsigned int nrows);
+
+/** A sample being built field by field \see omlc_row_begin */
+typedef struct OmlRow OmlRow;
+
+/*  Start building a sample for a Measurement Point, without copying its fields.  */
+OmlRow *omlc_row_begin(OmlMP *mp);
+int omlc_row_set_int32(OmlRow *row, int index, int32_t value);
+int omlc_row_set_uint32(OmlRow *row, int index, uint32_t value);
+int omlc_row_set_int64(OmlRow *row, int index, int64_t value);
+int omlc_row_set_uint64(OmlRow *row, int index, uint64_t value);
+int omlc_row_set_double(OmlRow *row, int index, double value);
+int omlc_row_set_bool(OmlRow *row, int index, int value);
+int omlc_row_set_guid(OmlRow *row, int index, oml_guid_t value);
+int omlc_row_set_string(OmlRow *row, int index, const char *value);
+int omlc_row_set_blob(OmlRow *row, int index, const void *value, size_t length);
+int omlc_row_set_vector(OmlRow *row, int index, const void *elts, size_t nof_elts);
+/*  Inject the sample built in a row.  */
+int omlc_row_commit(OmlRow *row);
+
 /** Inject metadata (key/value) for a specific MP.  */
 int omlc_inject_metadata(OmlMP *mp, const char *key, const OmlValueU *value, OmlValueT type, const char *fname);
 
@@ -21,6 +21,7 @@
 #include "mem.h"
 #include "filter/factory.h"
 #include "client.h"
+#include "buffered_writer.h"
 #include "oml_value.h"
 
 enum ConfToken {
@@ -30,6 +31,10 @@ enum ConfToken {
   CT_COLLECT,
   CT_COLLECT_URL,
   CT_COLLECT_ENCODING,
+  CT_COLLECT_SPILL,
+  CT_COLLECT_SPILL_QUOTA,
+  CT_COLLECT_SPILL_SYNC,
+  CT_COLLECT_OVERFLOW,
   CT_STREAM,
   CT_STREAM_NAME,
   CT_STREAM_SOURCE,
@@ -50,12 +55,16 @@ struct synonym {
   struct synonym *next;
 };
 
+/** Default maximal size of a spill file [B] \see parse_spill */
+#define DEF_SPILL_QUOTA (64 * 1024 * 1024)
+
 static struct synonym *tokmap_[CT_Max] = {0};
 static enum ConfToken curtok = CT_ROOT;
 
 static int add_metadata_stream(OmlWriter *writer);
 
 static int parse_collector(xmlNodePtr el);
+static int parse_spill(xmlNodePtr el, OmlWriter* writer);
 static int parse_stream_or_mp(xmlNodePtr el, OmlWriter* writer);
 static int parse_mp(xmlNodePtr el, OmlWriter* writer);
 static int parse_stream(xmlNodePtr el, OmlWriter* writer);
@@ -89,6 +98,10 @@ init_tokens (void)
   setcurtok (CT_COLLECT),          mksyn ("collect");
   setcurtok (CT_COLLECT_URL),      mksyn ("url");
   setcurtok (CT_COLLECT_ENCODING), mksyn ("encoding");
+  setcurtok (CT_COLLECT_SPILL),    mksyn ("spill");
+  setcurtok (CT_COLLECT_SPILL_QUOTA), mksyn ("spill-quota");
+  setcurtok (CT_COLLECT_SPILL_SYNC), mksyn ("spill-sync");
+  setcurtok (CT_COLLECT_OVERFLOW), mksyn ("overflow");
   setcurtok (CT_STREAM),           mksyn ("mp"), mksyn ("stream");
   setcurtok (CT_STREAM_NAME),      mksyn ("name");
   /* CT_STREAM_SOURCE is a special case */
@@ -301,6 +314,18 @@ parse_collector(xmlNodePtr el)
   if ((writer = create_writer(url, encoding)) == NULL) {
     return -2;
   }
+  if (parse_spill(el, writer)) {
+    return -2;
+  }
+  char* overflow = get_xml_attr(el, CT_COLLECT_OVERFLOW);
+  if (overflow) {
+    int ret = bw_set_policy(writer->bufferedWriter, overflow);
+    oml_free(overflow);
+    if (ret) {
+      logerror("Config line %hu: Invalid 'overflow' value for <%s ...>'.\n", el->line, el->name);
+      return -2;
+    }
+  }
 
   xmlNodePtr cur = el->xmlChildrenNode;
   if (cur == NULL) {
@@ -342,6 +367,77 @@ parse_collector(xmlNodePtr el)
   return 0;
 }
 
+/** Set up spilling of a writer's queue to disk, if requested.
+ *
+ * The 'spill' attribute gives the path of the spill file, 'spill-quota' its
+ * maximal size in bytes (optionally followed by a 'k', 'M' or 'G' multiplier;
+ * DEF_SPILL_QUOTA by default), and 'spill-sync' the number of chunks appended
+ * to it between calls to fsync(2) (0, the default, never does).
+ *
+ * \param el the \verbatim<collect />\endverbatim XML element to analyse
+ * \param writer OmlWriter created for that element
+ * \return 0 if successful (or not requested), <0 otherwise
+ * \see bw_set_spill
+ */
+static int
+parse_spill(xmlNodePtr el, OmlWriter *writer)
+{
+  char *path = get_xml_attr(el, CT_COLLECT_SPILL);
+  char *quota_s = get_xml_attr(el, CT_COLLECT_SPILL_QUOTA);
+  char *sync_s = get_xml_attr(el, CT_COLLECT_SPILL_SYNC);
+  unsigned long long quota = DEF_SPILL_QUOTA;
+  long sync = 0;
+  char *end;
+  int ret = -1;
+
+  if (path == NULL) {
+    if (quota_s || sync_s) {
+      logwarn("Config line %hu: Ignoring 'spill-quota' and 'spill-sync' without 'spill' for <%s ...>'.\n",
+          el->line, el->name);
+    }
+    ret = 0;
+    goto cleanup;
+  }
+
+  if (!writer->bufferedWriter) {
+    logerror("Config line %hu: Cannot spill an unbuffered writer for <%s ...>'.\n",
+        el->line, el->name);
+    goto cleanup;
+  }
+
+  if (quota_s) {
+    quota = strtoull(quota_s, &end, 10);
+    switch(*end) {
+    case 'G': quota *= 1024; /* Fall through */
+    case 'M': quota *= 1024; /* Fall through */
+    case 'k': quota *= 1024; end++;
+    default: break;
+    }
+    if (end == quota_s || *end) {
+      logerror("Config line %hu: Invalid 'spill-quota' value '%s' for <%s ...>'.\n",
+          el->line, quota_s, el->name);
+      goto cleanup;
+    }
+  }
+
+  if (sync_s) {
+    sync = strtol(sync_s, &end, 10);
+    if (end == sync_s || *end || sync < 0) {
+      logerror("Config line %hu: Invalid 'spill-sync' value '%s' for <%s ...>'.\n",
+          el->line, sync_s, el->name);
+      goto cleanup;
+    }
+  }
+
+  ret = bw_set_spill(writer->bufferedWriter, path, quota, sync);
+
+cleanup:
+  oml_free(path);
+  oml_free(quota_s);
+  oml_free(sync_s);
+  return ret;
+}
+
 /** Add the metadata stream to a writer
  *
  * \param writer OmlWriter to send metadata stream to
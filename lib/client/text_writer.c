@@ -50,6 +50,10 @@ typedef struct OmlTextWriter {
   OmlWriter* next;
   /** \see OmlWriter::bufferedWriter */
   BufferedWriterHdl bufferedWriter;
+  /** \see OmlWriter::encode */
+  oml_writer_encode encode;
+  /** \see OmlWriter::out_encoded */
+  oml_writer_out_encoded out_encoded;
 
   /*
    * Fields specific to the OmlTextWriter
@@ -68,6 +72,8 @@ static int owt_header_done(OmlWriter* writer);
 
 static int owt_row_start(OmlWriter* writer, OmlMStream* ms, double now);
 static int owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count);
+static int owt_encode(OmlWriter* writer, MBuffer* mbuf, OmlMStream* ms, int first, OmlValue* values, int value_count);
+static int owt_row_cols_encoded(OmlWriter* writer, const uint8_t* data, size_t length, int value_count);
 static int owt_row_end(OmlWriter* writer, OmlMStream* ms);
 
 static OmlWriter* owt_close(OmlWriter* writer);
@@ -95,6 +101,8 @@ text_writer_new(OmlOutStream* out_stream)
   self->row_start = owt_row_start;
   self->row_end = owt_row_end;
   self->out = owt_row_cols;
+  self->encode = owt_encode;
+  self->out_encoded = owt_row_cols_encoded;
   self->close = owt_close;
 
 
@@ -133,19 +141,18 @@ owt_header_done(OmlWriter* writer)
 }
 
 
-/** Function called for every result value in a measurement tuple (sample)
- * \see oml_writer_out
+/** Print values, separated by tabs, into an MBuffer
+ *
+ * \param mbuf MBuffer to print into
+ * \param values array of OmlValue to print
+ * \param value_count size of the values array
+ * \return 1 on success, 0 if a value is of an unsupported type, or -1 if printing failed
  */
 static int
-owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
+owt_print_values(MBuffer* mbuf, OmlValue* values, int value_count)
 {
   char *enc;
-  OmlTextWriter* self = (OmlTextWriter*)writer;
-  MBuffer* mbuf;
-  if ((mbuf = self->mbuf) == NULL) {
-    return 0; /* previous use of mbuf failed */
-  }
-
+  size_t j;
   int i;
   OmlValue* v = values;
   for (i = 0; i < value_count; i++, v++) {
@@ -180,7 +187,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
     case OML_STRING_VALUE:
       if(omlc_get_string_ptr(*oml_value_get_value(v)) &&
           0 < omlc_get_string_length(*oml_value_get_value(v))) {
-        enc = oml_malloc(backslash_encode_size(omlc_get_string_size(v->value)));
+        /* The string might not be ours (e.g., from a pass-through MS), so its size cannot be trusted */
+        enc = oml_malloc(backslash_encode_size(strlen(omlc_get_string_ptr(v->value))));
         backslash_encode(omlc_get_string_ptr(v->value), enc);
         res = mbuf_print(mbuf, "\t%s", enc);
         oml_free(enc);
@@ -219,8 +227,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       double *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %.*g", DBL_DIG, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %.*g", DBL_DIG, elts[j]);
       break;
     }
 
@@ -229,8 +237,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       int32_t *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %" PRId32, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %" PRId32, elts[j]);
       break;
     }
 
@@ -239,8 +247,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       uint32_t *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %" PRIu32, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %" PRIu32, elts[j]);
       break;
     }
 
@@ -249,8 +257,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       int64_t *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %" PRId64, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %" PRId64, elts[j]);
       break;
     }
 
@@ -259,8 +267,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       uint64_t *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %" PRIu64, elts[i]);
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %" PRIu64, elts[j]);
       break;
     }
 
@@ -269,8 +277,8 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
       size_t nof_elts = omlc_get_vector_nof_elts(*u);
       bool *elts = omlc_get_vector_ptr(*u);
       res = mbuf_print(mbuf, "\t%zu", nof_elts);
-      for(i = 0; 0 == res && i < nof_elts; i++)
-        res = mbuf_print(mbuf, " %s", elts[i] ? "True" : "False");
+      for(j = 0; 0 == res && j < nof_elts; j++)
+        res = mbuf_print(mbuf, " %s", elts[j] ? "True" : "False");
       break;
     }
 
@@ -281,14 +289,66 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
     }
 
     if (res < 0) {
-      mbuf_reset_write(mbuf);
-      self->mbuf = NULL;
-      return 0;
+      return -1;
     }
   }
   return 1;
 }
 
+/** Function called for every result value in a measurement tuple (sample)
+ * \see oml_writer_out
+ */
+static int
+owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
+{
+  OmlTextWriter* self = (OmlTextWriter*)writer;
+  MBuffer* mbuf;
+  int res;
+  if ((mbuf = self->mbuf) == NULL) {
+    return 0; /* previous use of mbuf failed */
+  }
+
+  if ((res = owt_print_values(mbuf, values, value_count)) < 0) {
+    mbuf_reset_write(mbuf);
+    self->mbuf = NULL;
+    return 0;
+  }
+  return res;
+}
+
+/** Function called to print values for several writers
+ * \see oml_writer_encode
+ */
+static int
+owt_encode(OmlWriter* writer, MBuffer* mbuf, OmlMStream* ms, int first, OmlValue* values, int value_count)
+{
+  (void)writer;
+  (void)ms;
+  (void)first;
+  return owt_print_values(mbuf, values, value_count) == 1;
+}
+
+/** Function called with values printed by owt_encode, instead of owt_row_cols
+ * \see oml_writer_out_encoded
+ */
+static int
+owt_row_cols_encoded(OmlWriter* writer, const uint8_t* data, size_t length, int value_count)
+{
+  (void)value_count;
+  OmlTextWriter* self = (OmlTextWriter*)writer;
+  MBuffer* mbuf;
+  if ((mbuf = self->mbuf) == NULL) {
+    return 0; /* previous use of mbuf failed */
+  }
+
+  if (mbuf_write(mbuf, data, length)) {
+    mbuf_reset_write(mbuf);
+    self->mbuf = NULL;
+    return 0;
+  }
+  return 1;
+}
+
 /** Function called after all items in a tuple have been sent
  * \see oml_writer_row_start
  */
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file zlib_stream.c
+ * \brief An OmlOutStream implementation that compresses data with zlib before
+ * passing it to another OmlOutStream.
+ *
+ * The output starts with an uncompressed `encapsulation: deflate` header line,
+ * followed by a raw DEFLATE stream (RFC1951) carrying the OMSP headers and
+ * data. Each buffer passed to zlib_stream_write (i.e., a whole BufferChunk) is
+ * compressed on its own, and terminated with a full flush. The compressed
+ * headers and any compressed buffer therefore form a valid DEFLATE stream,
+ * which can be sent again as is after a reconnection.
+ *
+ * \see oml_uri_strip_compression, \ref omspencapsulation
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <zlib.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_out_stream.h"
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "mbuf.h"
+#include "mstring.h"
+#include "client.h"
+
+/** Header advertising the compression to the server; sent uncompressed */
+#define ZLIB_STREAM_HEADER "encapsulation: deflate\n"
+/** Compression level, trading ratio for speed */
+#define ZLIB_STREAM_LEVEL 1
+/** Size of the intermediate buffer for compressed data */
+#define ZLIB_STREAM_CHUNK 16384
+
+typedef struct OmlZlibOutStream {
+
+  /*
+   * Fields from OmlOutStream interface
+   */
+
+  /** \see OmlOutStream::write, oml_outs_write_f */
+  oml_outs_write_f write;
+  /** \see OmlOutStream::close, oml_outs_close_f */
+  oml_outs_close_f close;
+
+  /** \see OmlOutStream::dest */
+  char *dest;
+
+  /*
+   * Fields specific to the OmlZlibOutStream
+   */
+
+  /** OmlOutStream into which the compressed data is written */
+  OmlOutStream *os;
+
+  /** DEFLATE compressor state */
+  z_stream strm;
+
+  /** Uncompressed copy of the last headers given to zlib_stream_write */
+  MBuffer *plain_header;
+  /** Encapsulation header followed by the compressed plain_header */
+  MBuffer *header;
+  /** Compressed data being written */
+  MBuffer *out;
+
+} OmlZlibOutStream;
+
+static size_t zlib_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length);
+static int zlib_stream_close(OmlOutStream* hdl);
+static int zlib_stream_deflate(OmlZlibOutStream* self, MBuffer* dst, uint8_t* src, size_t length);
+
+/** Create a new out stream compressing data into another OmlOutStream.
+ *
+ * \param out OmlOutStream to write compressed data into; it is closed along with the new stream
+ * \return a new OmlOutStream instance, or NULL on error
+ *
+ * \see zlib_stream_close
+ */
+OmlOutStream*
+zlib_stream_new(OmlOutStream *out)
+{
+  MString *dest;
+  OmlZlibOutStream* self;
+
+  assert(out != NULL);
+  self = (OmlZlibOutStream *)oml_malloc(sizeof(OmlZlibOutStream));
+  if (!self) {
+    return NULL;
+  }
+  memset(self, 0, sizeof(OmlZlibOutStream));
+
+  /* Raw DEFLATE (negative window bits), without the zlib wrapper */
+  if (Z_OK != deflateInit2(&self->strm, ZLIB_STREAM_LEVEL, Z_DEFLATED, -MAX_WBITS, 8,
+        Z_DEFAULT_STRATEGY)) {
+    logerror("%s: Cannot initialise zlib compression: %s\n", out->dest,
+        self->strm.msg ? self->strm.msg : "unknown error");
+    oml_free(self);
+    return NULL;
+  }
+
+  dest = mstring_create();
+  mstring_sprintf(dest, "zlib+%s", out->dest);
+  self->dest = (char*)oml_strndup (mstring_buf(dest), mstring_len(dest));
+  mstring_delete(dest);
+
+  self->os = out;
+  self->plain_header = mbuf_create();
+  self->header = mbuf_create();
+  self->out = mbuf_create();
+
+  logdebug("%s: Created OmlZlibOutStream\n", self->dest);
+
+  self->write = zlib_stream_write;
+  self->close = zlib_stream_close;
+  return (OmlOutStream*)self;
+}
+
+/** Compress a buffer and write it into the underlying stream.
+ *
+ * The headers are compressed again only when they change. Unlike other
+ * streams, the buffer is either entirely written, or not at all, as a
+ * partially sent compressed block could not be resumed after a reconnection.
+ *
+ * \param hdl pointer to the OmlOutStream
+ * \param buffer pointer to the buffer containing the data to write
+ * \param length length of the buffer to write
+ * \param header pointer to an optional buffer containing headers to be sent after (re)connecting
+ * \param header_length length of the header to write; must be 0 if header is NULL
+ * \return length if the buffer was written, 0 otherwise
+ * \see oml_outs_write_f
+ */
+static size_t
+zlib_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length)
+{
+  OmlZlibOutStream* self = (OmlZlibOutStream*)hdl;
+  size_t count;
+
+  /* The header can be NULL, but header_length MUST be 0 in that case */
+  assert(header || !header_length);
+
+  if (!mbuf_fill(self->header) || header_length != mbuf_fill(self->plain_header) ||
+      memcmp(header, mbuf_buffer(self->plain_header), header_length)) {
+    mbuf_clear2(self->plain_header, 0);
+    mbuf_clear2(self->header, 0);
+    if ((header_length && mbuf_write(self->plain_header, header, header_length) < 0) ||
+        mbuf_write(self->header, (uint8_t*)ZLIB_STREAM_HEADER, strlen(ZLIB_STREAM_HEADER)) < 0 ||
+        zlib_stream_deflate(self, self->header, header, header_length) < 0) {
+      logerror("%s: Cannot compress headers\n", self->dest);
+      mbuf_clear2(self->plain_header, 0);
+      return 0;
+    }
+  }
+
+  mbuf_clear2(self->out, 0);
+  if (zlib_stream_deflate(self, self->out, buffer, length) < 0) {
+    logerror("%s: Cannot compress %zu bytes of data\n", self->dest, length);
+    return 0;
+  }
+  logdebug2("%s: Compressed %zu bytes into %zu\n", self->dest, length, mbuf_fill(self->out));
+
+  while (mbuf_rd_remaining(self->out) > 0) {
+    count = self->os->write(self->os, mbuf_rdptr(self->out), mbuf_rd_remaining(self->out),
+        mbuf_buffer(self->header), mbuf_fill(self->header));
+    if ((long)count <= 0) {
+      return 0;
+    }
+    mbuf_read_skip(self->out, count);
+  }
+
+  return length;
+}
+
+/** Compress data into an MBuffer, and terminate it with a full flush.
+ *
+ * \param self OmlZlibOutStream to use
+ * \param dst MBuffer to append compressed data to
+ * \param src pointer to the data to compress
+ * \param length length of the data to compress
+ * \return 0 on success, -1 otherwise
+ */
+static int
+zlib_stream_deflate(OmlZlibOutStream* self, MBuffer* dst, uint8_t* src, size_t length)
+{
+  uint8_t chunk[ZLIB_STREAM_CHUNK];
+  int ret;
+
+  self->strm.next_in = src;
+  self->strm.avail_in = length;
+  do {
+    self->strm.next_out = chunk;
+    self->strm.avail_out = sizeof(chunk);
+    ret = deflate(&self->strm, Z_FULL_FLUSH);
+    if (Z_STREAM_ERROR == ret) {
+      return -1;
+    }
+    if (mbuf_write(dst, chunk, sizeof(chunk) - self->strm.avail_out) < 0) {
+      return -1;
+    }
+  } while (0 == self->strm.avail_out);
+
+  return 0;
+}
+
+/** Close an OmlZlibOutStream, and the stream it writes into.
+ *
+ * \param hdl pointer to the OmlZlibOutStream
+ * \return the return value of closing the underlying stream
+ * \see oml_outs_close_f
+ */
+static int
+zlib_stream_close(OmlOutStream* hdl)
+{
+  OmlZlibOutStream* self = (OmlZlibOutStream*)hdl;
+  int ret;
+
+  ret = self->os->close(self->os);
+  deflateEnd(&self->strm);
+  mbuf_destroy(self->plain_header);
+  mbuf_destroy(self->header);
+  mbuf_destroy(self->out);
+
+  logdebug("%s: Destroying OmlZlibOutStream at %p\n", self->dest, self);
+  oml_free(self->dest);
+  oml_free(self);
+  return ret;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -13,9 +13,12 @@
  * \see eventloop_init, eventloop_run, eventloop_stop
  * \eventloop_on_stdin, eventloop_on_monitor_in_channel, eventloop_on_read_in_channel, eventloop_on_out_channel
  * \see o_el_timer_callback, o_el_read_socket_callback, o_el_monitor_socket_callback, o_el_state_socket_callback, o_el_timer_callback
- * \see poll(3)
+ * \see poll(3), epoll(7)
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,12 +29,16 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <time.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #include "mem.h"
 #include "ocomm/o_log.h"
 #include "ocomm/o_socket.h"
 #include "ocomm/o_eventloop.h"
 #include "mem.h"
+#include "mbuf.h"
 
 /** Initial expected number of socket event sources */
 #define DEF_FDS_LENGTH 10
@@ -40,6 +47,14 @@
 /** Default time, in second, after which an idle socket is cleaned up */
 #define DEF_SOCKET_TIMEOUT 60
 
+/** Default maximum number of bytes read from a Channel with an MBuffer at each iteration */
+#define DEF_READ_BUDGET (256 * 1024)
+/** Minimum free space to make in a Channel's MBuffer before each recv(2) */
+#define MIN_MBUF_READ_SIZE 16384
+
+/** Environment variable which, if set to "poll", disables the epoll(7) backend */
+#define EVENTLOOP_BACKEND_ENV "OML_EVENTLOOP"
+
 /* A quick hace to avoid having to repeat too much */
 #define case_string(val)  case val: { return #val; break; }
 const char* socket_status_string(SocketStatus status)
@@ -132,6 +147,10 @@ typedef struct _channel {
   /** Mask of events monitored for that FD \see poll(3) */
   int fds_events;
 
+  /** If not NULL, MBuffer into which data is directly read
+   * \see eventloop_socket_set_mbuf */
+  MBuffer *mbuf;
+
   /** Pointer to next Channel in the linked-list */
   struct _channel* next;
 
@@ -140,6 +159,15 @@ typedef struct _channel {
 
   /** Last UNIX time this channel was active */
   time_t last_activity;
+
+  /** Events reported for that FD in the current iteration of the EventLoop \see poll(3) */
+  short revents;
+  /** If non zero, the FD cannot be monitored with epoll(7) (e.g., a
+   * regular file), and is considered ready at every iteration */
+  int is_always_ready;
+  /** If non zero, errno of a failed attempt to monitor the FD with epoll(7),
+   * to report at the end of the current iteration \see epoll_update */
+  int error;
 } Channel;
 
 /** EventLoop object storing the internal internal state */
@@ -166,11 +194,37 @@ typedef struct _eventLoop {
    * \see DEF_SOCKET_TIMEOUT */
   int socket_timeout;
 
+  /** Maximum number of bytes read from a Channel with an MBuffer at each iteration
+   * \see DEF_READ_BUDGET, eventloop_set_read_budget */
+  size_t read_budget;
+
   /** Stopping condition for the event loop */
   int stopping;
   /** If set to 1, the eventloop will not wait for active FDs to be closed */
   int force_stop;
 
+  /** epoll(7) instance monitoring active channels, or -1 to use poll(3)
+   * \see eventloop_socket_activate */
+  int epfd;
+#ifdef USE_EPOLL
+  /** Array receiving ready events from epoll_wait(2) */
+  struct epoll_event* events;
+#endif
+  /** Allocated size of events */
+  int events_length;
+  /** Number of events being processed, or 0 outside of run_epoll */
+  int nevents;
+  /** Number of active channels which cannot be monitored with epoll(7) */
+  int always_ready;
+  /** Number of channels with a monitoring error to report \see epoll_update */
+  int nfailed;
+  /** Channels released since the last iteration, to remove once events have been processed */
+  Channel** released;
+  /** Number of channels in released */
+  int nreleased;
+  /** Allocated size of released */
+  int released_length;
+
   /** UNIX Time when the EventLoop was started
    * \see time(3) */
   time_t start;
@@ -195,16 +249,30 @@ static Channel* eventloop_on_out_fd( char* name, int fd, o_el_state_socket_callb
 static int update_fds(void);
 static void terminate_fds(void);
 
+static void run_poll(int timeout);
+#ifdef USE_EPOLL
+static void run_epoll(int timeout);
+static int epoll_update(Channel *ch);
+#endif
+static void reap_idle(Channel *ch);
+static void dispatch_channel(Channel *ch);
+static int do_mbuf_read(Channel *ch, size_t budget);
+
 static void do_read_callback (Channel *ch, void *buffer, int buf_size);
 static void do_monitor_callback (Channel *ch);
 static void do_status_callback (Channel *ch, SocketStatus status, int error);
 
 
-/** Global EventLoop object */
-static EventLoop self;
+/** EventLoop object of the current thread
+ *
+ * Each thread can run its own EventLoop, and the eventloop_* functions always
+ * act on that of the calling thread; Channels and timers must therefore only
+ * be manipulated from the thread which created them.
+ */
+static __thread EventLoop self;
 
 
-/** Initialise the global EventLoop
+/** Initialise the EventLoop of the calling thread
  * \see eventloop_run, eventloop_stop, eventloop_terminate
  */
 void eventloop_init()
@@ -217,8 +285,22 @@ void eventloop_init()
 
   self.size = 0;
   self.length = 0;
+  self.epfd = -1;
+
+#ifdef USE_EPOLL
+  const char *backend = getenv(EVENTLOOP_BACKEND_ENV);
+  if (backend && !strcmp(backend, "poll")) {
+    o_log(O_LOG_INFO, "EventLoop: Using poll(), as requested by " EVENTLOOP_BACKEND_ENV "\n");
+  } else if ((self.epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    o_log(O_LOG_WARN, "EventLoop: Cannot create epoll instance, falling back to poll(): %s\n",
+        strerror(errno));
+  } else {
+    o_log(O_LOG_DEBUG, "EventLoop: Using epoll()\n");
+  }
+#endif
 
   eventloop_set_socket_timeout(DEF_SOCKET_TIMEOUT);
+  eventloop_set_read_budget(DEF_READ_BUDGET);
 
   /* Just to be sure we initialise everything */
   self.start = self.now = self.last_reaped = -1;
@@ -234,29 +316,44 @@ void eventloop_set_socket_timeout(unsigned int to)
   self.socket_timeout = to;
 }
 
+/** Set the maximum amount of data read from one socket before serving others.
+ *
+ * This only applies to channels reading directly into an MBuffer, which
+ * otherwise keep reading until no more data is available. Any remaining data
+ * is read at the next iteration of the EventLoop.
+ *
+ * \param budget maximum number of bytes read at each iteration, 0 for no limit
+ * \see eventloop_socket_set_mbuf
+ */
+void eventloop_set_read_budget(size_t budget)
+{
+  o_log(O_LOG_DEBUG2, "EventLoop: Setting read budget to %zuB\n", budget);
+  self.read_budget = budget;
+}
+
 /** Run the global EventLoop until eventloop_stop() or eventloop_terminate() is called.
  *
- * The loop is based around the poll(3) system call. It monitor event sources
- * such as Channel or Timers, registered in the respective fields of the global
- * EventLoop object self. It first consider all timers to find whether some
- * have expired and to set the timeout for the poll(3) call. It then calls
- * poll(3) on the file descriptors (STDIN or sockets) related to active
- * Channels, and runs the relevant callbacks for those with pending events.  It
- * finally executes the callback functions of the expired timers.  The loop
- * will not return until eventloop_stop() or eventloop_terminate() is called.
- * In the former case, it will try to wait until all active sockets are close,
- * while not in the latter.
+ * The loop is based around the poll(3) system call, or epoll(7) where
+ * available. It monitor event sources such as Channel or Timers, registered
+ * in the respective fields of the global EventLoop object self. It first
+ * consider all timers to find whether some have expired and to set the
+ * timeout for the poll(3) call. It then waits for events on the file
+ * descriptors (STDIN or sockets) related to active Channels, and runs the
+ * relevant callbacks for those with pending events.  It finally executes the
+ * callback functions of the expired timers.  The loop will not return until
+ * eventloop_stop() or eventloop_terminate() is called.  In the former case,
+ * it will try to wait until all active sockets are close, while not in the
+ * latter.
  *
  * \return the (non-zero) value passed to eventloop_stop() or eventloop_terminate()
  *
  * \see eventloop_init, eventloop_stop, eventloop_terminate
  * \eventloop_on_stdin, eventloop_on_monitor_in_channel, eventloop_on_read_in_channel, eventloop_on_out_channel
  * \see o_el_timer_callback, o_el_read_socket_callback, o_el_monitor_socket_callback, o_el_state_socket_callback, o_el_timer_callback
- * \see poll(3)
+ * \see run_poll, run_epoll
  */
 int eventloop_run()
 {
-  int i;
   self.stopping = 0;
   self.force_stop = 0;
   self.start = self.now = self.last_reaped = time(NULL);
@@ -275,141 +372,18 @@ int eventloop_run()
     if (timeout != -1)
       o_log(O_LOG_DEBUG3, "EventLoop: Timeout = %d\n", timeout);
 
-    if (self.fds_dirty)
-      if (update_fds()<1 && timeout < 0) /* No FD nor timeout */
-        continue;
-    o_log(O_LOG_DEBUG4, "EventLoop: About to poll() on %d FDs with a timeout of %ds\n", self.size, timeout);
-    /* for(i=0; i < self.size; i++) {
-      o_log(O_LOG_DEBUG4, "EventLoop: FD %d->%s\n", self.fds[i].fd, self.fds_channels[i]->name);
-    } */
-
-    int count = poll(self.fds, self.size, timeout);
-    self.now = time(NULL);
-
-    if (count < 1) {
-      o_log(O_LOG_DEBUG4, "EventLoop: Timeout\n");
-    } else {
-    // Check sockets
-      i = 0;
-      o_log(O_LOG_DEBUG4, "EventLoop: Got events\n");
-      for (; i < self.size; i++) {
-        Channel* ch = self.fds_channels[i];
-        if (self.fds[i].revents & POLLERR) {
-          char buf[32];
-          SocketStatus status;
-          int len;
-
-          if ((len = recv(self.fds[i].fd, buf, 32, 0)) <= 0) {
-            switch (errno) {
-            case ECONNREFUSED:
-              status = SOCKET_CONN_REFUSED;
-              break;
-            default:
-              status = SOCKET_UNKNOWN;
-              if (!ch->status_cbk) {
-                o_log(O_LOG_ERROR, "EventLoop: While reading from socket '%s': (%d) %s\n",
-                      ch->name, errno, strerror(errno));
-              }
-            }
-            eventloop_socket_activate((SockEvtSource*)ch, 0);
-            do_status_callback (ch, status, errno);
-          } else {
-            o_log(O_LOG_ERROR, "EventLoop: Expected error on socket '%s' but read '%s'\n", ch->name, buf);
-          }
-        } else if (self.fds[i].revents & POLLHUP) {
-          eventloop_socket_activate((SockEvtSource*)ch, 0);
-
-          /* Client closed the connection, but there might still be bytes
-             for us to read from our end of the connection. */
-          int len;
-          int fd = self.fds[i].fd;
-          char buf[MAX_READ_BUFFER_SIZE];
-          do {
-            if (fd == 0) {
-              len = read(fd, buf, MAX_READ_BUFFER_SIZE);
-            } else {
-              len = recv(fd, buf, 512, 0);
-            }
-            if (len > 0) {
-              o_log(O_LOG_DEBUG3, "EventLoop: Received last %i bytes\n", len);
-              do_read_callback (ch, buf, len);
-            }
-          } while (len > 0);
-          do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
-        } else if (self.fds[i].revents & POLLIN) {
-          char buf[MAX_READ_BUFFER_SIZE];
-          if (ch->read_cbk) {
-            int len;
-            int fd = self.fds[i].fd;
-            if (fd == 0) {
-              // stdin
-              len = read(fd, buf, MAX_READ_BUFFER_SIZE);
-            } else {
-              // socket
-              len = recv(fd, buf, 512, 0);
-            }
-            ch->last_activity = self.now;
-            if (len > 0) {
-              o_log(O_LOG_DEBUG3, "EventLoop: Received %i bytes\n", len);
-              do_read_callback (ch, buf, len);
-            } else if (len == 0 && ch->socket != NULL) {  // skip stdin
-              // closed down
-              eventloop_socket_activate((SockEvtSource*)ch, 0);
-              do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
-            } else if (len < 0) {
-              if (errno == ENOTSOCK) {
-                o_log(O_LOG_ERROR,
-                      "EventLoop: Monitored socket '%s' is now invalid; "
-                      "removing from monitored set\n",
-                      ch->name);
-                eventloop_socket_remove ((SockEvtSource*)ch);
-              } else {
-                o_log(O_LOG_ERROR, "EventLoop: Unrecognized read error not handled (errno=%d)\n",
-                      errno);
-              }
-            }
-          } else {
-            do_monitor_callback (ch);
-          }
-        } else if (ch->is_shutting_down) {
-          /* The socket was shutting down, and nothing new has appeared;
-           * We flushed the buffers, mark it as removable */
-          eventloop_socket_release((SockEvtSource*)ch);
-        }
-
-        if (self.fds[i].revents & POLLOUT) {
-          do_status_callback(ch, SOCKET_WRITEABLE, 0);
-          if (0 != ch->last_activity) {
-            /* If we track the activity of this socket */
-            ch->last_activity = self.now;
-          }
-        }
-
-        if (self.fds[i].revents & POLLNVAL) {
-          o_log(O_LOG_WARN, "EventLoop: socket '%s' invalid, deactivating...\n", ch->name);
-          eventloop_socket_activate((SockEvtSource*)ch, 0);
-          do_status_callback(ch, SOCKET_DROPPED, 0);
-        }
-
-        /* We reap idle channels as we go through the list.  XXX: There might
-         * be a corner case where all FDs are already used, and some of them
-         * idle, however a new a new connection (on one listening socket early
-         * in the list) would be dropped before cleanup triggered by its
-         * arrival freed the resources it needs (from the idle sockets further
-         * towards the end of the list. See #959.*/
-        if (ch->last_activity != 0 &&
-            self.socket_timeout > 0 &&
-            self.now - ch->last_activity > self.socket_timeout) {
-            o_log(O_LOG_DEBUG2, "EventLoop: Socket '%s' idle for %ds, reaping...\n", ch->name, self.now - ch->last_activity);
-          do_status_callback(ch, SOCKET_IDLE, 0);
-        }
-      }
-      for (i = 0; i < self.size; i++) {
-        Channel* ch = self.fds_channels[i];
-        if (ch->is_removable)
-          eventloop_socket_remove ((SockEvtSource*)ch);
-      }
+#ifdef USE_EPOLL
+    if (self.epfd >= 0) {
+      run_epoll(timeout);
+    } else
+#endif
+    {
+      if (self.fds_dirty)
+        if (update_fds()<1 && timeout < 0) /* No FD nor timeout */
+          continue;
+      run_poll(timeout);
     }
+
     if (timeout >= 0) {
       // check timers
       TimerInt* t = self.timers;
@@ -438,6 +412,408 @@ int eventloop_run()
   return self.stopping;
 }
 
+/** Wait for events on all active channels with poll(3), and process them.
+ *
+ * All active channels are scanned after each wakeup, both for events and to
+ * reap idle ones.
+ *
+ * \param timeout maximal time to wait [ms], or -1 to wait indefinitely
+ * \see eventloop_run, update_fds, dispatch_channel
+ */
+static void run_poll(int timeout)
+{
+  int i;
+
+  o_log(O_LOG_DEBUG4, "EventLoop: About to poll() on %d FDs with a timeout of %ds\n", self.size, timeout);
+  /* for(i=0; i < self.size; i++) {
+    o_log(O_LOG_DEBUG4, "EventLoop: FD %d->%s\n", self.fds[i].fd, self.fds_channels[i]->name);
+  } */
+
+  int count = poll(self.fds, self.size, timeout);
+  self.now = time(NULL);
+
+  if (count < 1) {
+    o_log(O_LOG_DEBUG4, "EventLoop: Timeout\n");
+  } else {
+    // Check sockets
+    o_log(O_LOG_DEBUG4, "EventLoop: Got events\n");
+    for (i = 0; i < self.size; i++) {
+      Channel* ch = self.fds_channels[i];
+      ch->revents = self.fds[i].revents;
+      dispatch_channel(ch);
+      ch->revents = 0;
+
+      /* We reap idle channels as we go through the list.  XXX: There might
+       * be a corner case where all FDs are already used, and some of them
+       * idle, however a new a new connection (on one listening socket early
+       * in the list) would be dropped before cleanup triggered by its
+       * arrival freed the resources it needs (from the idle sockets further
+       * towards the end of the list. See #959.*/
+      reap_idle(ch);
+    }
+    for (i = 0; i < self.size; i++) {
+      Channel* ch = self.fds_channels[i];
+      if (ch->is_removable)
+        eventloop_socket_remove ((SockEvtSource*)ch);
+    }
+  }
+}
+
+#ifdef USE_EPOLL
+/** Wait for events on all active channels with epoll(7), and process them.
+ *
+ * Unlike run_poll, the cost of each iteration only depends on the number of
+ * channels with pending events, rather than on the number of active channels.
+ * Channels are (de)registered with the epoll instance when they are
+ * (de)activated. Channels released while processing events are removed
+ * afterwards. Idle channels are reaped at most once per second, and channels
+ * shutting down are only checked when the EventLoop is stopping.
+ *
+ * \param timeout maximal time to wait [ms], or -1 to wait indefinitely
+ * \see eventloop_run, epoll_update, dispatch_channel
+ */
+static void run_epoll(int timeout)
+{
+  int i, count;
+  Channel *ch, *next;
+
+  if (self.events_length < self.size || !self.events) {
+    int l = self.events_length > 0 ? 2 * self.events_length : DEF_FDS_LENGTH;
+    while (l < self.size) l *= 2;
+    self.events = (struct epoll_event *)oml_realloc(self.events, l * sizeof(struct epoll_event));
+    self.events_length = l;
+  }
+  if (self.always_ready > 0 || self.nfailed > 0) {
+    timeout = 0;
+  }
+
+  o_log(O_LOG_DEBUG4, "EventLoop: About to epoll_wait() on %d FDs with a timeout of %ds\n", self.size, timeout);
+  count = epoll_wait(self.epfd, self.events, self.events_length, timeout);
+  self.now = time(NULL);
+
+  if (count < 0 && errno != EINTR) {
+    o_log(O_LOG_ERROR, "EventLoop: epoll_wait() failed: %s\n", strerror(errno));
+  }
+
+  if (count < 1 && !self.always_ready) {
+    o_log(O_LOG_DEBUG4, "EventLoop: Timeout\n");
+  } else {
+    o_log(O_LOG_DEBUG4, "EventLoop: Got %d events\n", count);
+    /* Channels removed by a callback are forgotten from self.events
+     * \see eventloop_socket_remove */
+    self.nevents = count > 0 ? count : 0;
+    for (i = 0; i < self.nevents; i++) {
+      uint32_t events = self.events[i].events;
+      if (!(ch = (Channel*)self.events[i].data.ptr)) {
+        continue;
+      }
+      ch->revents = ((events & EPOLLIN) ? POLLIN : 0) |
+        ((events & EPOLLOUT) ? POLLOUT : 0) |
+        ((events & EPOLLERR) ? POLLERR : 0) |
+        ((events & EPOLLHUP) ? POLLHUP : 0);
+      dispatch_channel(ch);
+    }
+
+    if (self.always_ready > 0 || self.stopping) {
+      /* Channels which cannot be monitored are always ready; channels
+       * shutting down without new events can be released */
+      for (ch = self.channels; ch != NULL; ch = next) {
+        next = ch->next;
+        if (ch->is_active && !ch->revents &&
+            (ch->is_always_ready || ch->is_shutting_down)) {
+          ch->revents = ch->is_always_ready ? (ch->fds_events & (POLLIN | POLLOUT)) : 0;
+          dispatch_channel(ch);
+        }
+      }
+    }
+
+    for (i = 0; i < self.nevents; i++) {
+      if ((ch = (Channel*)self.events[i].data.ptr)) {
+        ch->revents = 0;
+      }
+    }
+    self.nevents = 0;
+    if (self.always_ready > 0) {
+      for (ch = self.channels; ch != NULL; ch = ch->next) {
+        ch->revents = 0;
+      }
+    }
+  }
+
+  if (self.now != self.last_reaped) {
+    self.last_reaped = self.now;
+    for (ch = self.channels; ch != NULL; ch = ch->next) {
+      if (ch->is_active) {
+        reap_idle(ch);
+      }
+    }
+  }
+
+  if (self.nfailed > 0) {
+    /* Let the owners of channels which could not be monitored close them */
+    self.nfailed = 0;
+    for (ch = self.channels; ch != NULL; ch = next) {
+      next = ch->next;
+      if (ch->error && !ch->is_removable) {
+        int error = ch->error;
+        ch->error = 0;
+        do_status_callback(ch, SOCKET_DROPPED, error);
+      }
+    }
+  }
+
+  while (self.nreleased > 0) {
+    eventloop_socket_remove ((SockEvtSource*)self.released[self.nreleased - 1]);
+  }
+}
+
+/** (Un)register a channel with the epoll instance, depending on whether it is active.
+ *
+ * If an activated channel cannot be monitored, it is deactivated again, and
+ * SOCKET_DROPPED is reported to its status callback at the end of the
+ * current iteration, so its owner can close it.
+ *
+ * \param ch Channel which has just been (de)activated
+ * \return 0 on success, or -1 if the channel could not be monitored
+ * \see eventloop_socket_activate, run_epoll
+ */
+static int epoll_update(Channel *ch)
+{
+  struct epoll_event ev;
+  int ret;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = ((ch->fds_events & POLLIN) ? EPOLLIN : 0) |
+    ((ch->fds_events & POLLOUT) ? EPOLLOUT : 0);
+  ev.data.ptr = ch;
+
+  if (ch->is_active) {
+    ret = epoll_ctl(self.epfd, EPOLL_CTL_ADD, ch->fds_fd, &ev);
+    if (ret < 0 && errno == EEXIST) {
+      ret = epoll_ctl(self.epfd, EPOLL_CTL_MOD, ch->fds_fd, &ev);
+    } else if (ret < 0 && errno == EPERM) {
+      /* Regular files are always ready, but cannot be monitored with epoll */
+      ch->is_always_ready = 1;
+      self.always_ready++;
+      ret = 0;
+    }
+    if (ret < 0) {
+      o_log(O_LOG_ERROR, "EventLoop: Cannot monitor FD %d of '%s': %s\n",
+          ch->fds_fd, ch->name, strerror(errno));
+      if (!ch->error) {
+        self.nfailed++;
+      }
+      ch->error = errno;
+      ch->is_active = 0;
+      return -1;
+    }
+    self.size++;
+
+  } else {
+    self.size--;
+    if (ch->is_always_ready) {
+      ch->is_always_ready = 0;
+      self.always_ready--;
+    } else if (epoll_ctl(self.epfd, EPOLL_CTL_DEL, ch->fds_fd, &ev) < 0 &&
+        errno != EBADF && errno != ENOENT) {
+      o_log(O_LOG_WARN, "EventLoop: Cannot stop monitoring FD %d of '%s': %s\n",
+          ch->fds_fd, ch->name, strerror(errno));
+    }
+  }
+
+  return 0;
+}
+#endif
+
+/** Report a channel as idle if it has been inactive for too long.
+ *
+ * \param ch Channel to check
+ * \see eventloop_set_socket_timeout
+ */
+static void reap_idle(Channel *ch)
+{
+  if (ch->last_activity != 0 &&
+      self.socket_timeout > 0 &&
+      self.now - ch->last_activity > self.socket_timeout) {
+    o_log(O_LOG_DEBUG2, "EventLoop: Socket '%s' idle for %ds, reaping...\n", ch->name, self.now - ch->last_activity);
+    do_status_callback(ch, SOCKET_IDLE, 0);
+  }
+}
+
+/** Process the events reported for a channel in ch->revents.
+ *
+ * This reads available data and passes it to the read callback, or calls the
+ * monitoring callback, and reports status changes to the status callback.
+ *
+ * \param ch Channel to process
+ * \see do_read_callback, do_monitor_callback, do_status_callback
+ */
+static void dispatch_channel(Channel *ch)
+{
+  short revents = ch->revents;
+  int fd = ch->fds_fd;
+
+  if (revents & POLLERR) {
+    char buf[32];
+    SocketStatus status;
+    int len;
+
+    if ((len = recv(fd, buf, 32, 0)) <= 0) {
+      switch (errno) {
+      case ECONNREFUSED:
+        status = SOCKET_CONN_REFUSED;
+        break;
+      default:
+        status = SOCKET_UNKNOWN;
+        if (!ch->status_cbk) {
+          o_log(O_LOG_ERROR, "EventLoop: While reading from socket '%s': (%d) %s\n",
+                ch->name, errno, strerror(errno));
+        }
+      }
+      eventloop_socket_activate((SockEvtSource*)ch, 0);
+      do_status_callback (ch, status, errno);
+    } else {
+      o_log(O_LOG_ERROR, "EventLoop: Expected error on socket '%s' but read '%s'\n", ch->name, buf);
+    }
+  } else if (revents & POLLHUP) {
+    eventloop_socket_activate((SockEvtSource*)ch, 0);
+
+    /* Client closed the connection, but there might still be bytes
+       for us to read from our end of the connection. */
+    int len;
+    char buf[MAX_READ_BUFFER_SIZE];
+    do {
+      if (ch->mbuf) {
+        /* Also passes the data to the read callback */
+        do_mbuf_read(ch, 0);
+        break;
+      } else if (fd == 0) {
+        len = read(fd, buf, MAX_READ_BUFFER_SIZE);
+      } else {
+        len = recv(fd, buf, 512, 0);
+      }
+      if (len > 0) {
+        o_log(O_LOG_DEBUG3, "EventLoop: Received last %i bytes\n", len);
+        do_read_callback (ch, buf, len);
+      }
+    } while (len > 0);
+    do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
+  } else if (revents & POLLIN) {
+    char buf[MAX_READ_BUFFER_SIZE];
+    if (ch->read_cbk) {
+      int len, direct = (NULL != ch->mbuf);
+      if (direct) {
+        len = do_mbuf_read(ch, self.read_budget);
+        if (len < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+          len = 1; /* All available data was read */
+        }
+      } else if (fd == 0) {
+        // stdin
+        len = read(fd, buf, MAX_READ_BUFFER_SIZE);
+      } else {
+        // socket
+        len = recv(fd, buf, 512, 0);
+      }
+      ch->last_activity = self.now;
+      if (len > 0) {
+        if (!direct) {
+          o_log(O_LOG_DEBUG3, "EventLoop: Received %i bytes\n", len);
+          do_read_callback (ch, buf, len);
+        }
+      } else if (ch->is_removable) {
+        /* The read callback released the channel */
+      } else if (len == 0 && ch->socket != NULL) {  // skip stdin
+        // closed down
+        eventloop_socket_activate((SockEvtSource*)ch, 0);
+        do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
+      } else if (len < 0) {
+        if (errno == ENOTSOCK) {
+          o_log(O_LOG_ERROR,
+                "EventLoop: Monitored socket '%s' is now invalid; "
+                "removing from monitored set\n",
+                ch->name);
+          /* Not removed right away, as the caller still uses ch */
+          eventloop_socket_release ((SockEvtSource*)ch);
+        } else {
+          o_log(O_LOG_ERROR, "EventLoop: Unrecognized read error not handled (errno=%d)\n",
+                errno);
+        }
+      }
+    } else {
+      do_monitor_callback (ch);
+    }
+  } else if (ch->is_shutting_down) {
+    /* The socket was shutting down, and nothing new has appeared;
+     * We flushed the buffers, mark it as removable */
+    eventloop_socket_release((SockEvtSource*)ch);
+  }
+
+  if (revents & POLLOUT) {
+    do_status_callback(ch, SOCKET_WRITEABLE, 0);
+    if (0 != ch->last_activity) {
+      /* If we track the activity of this socket */
+      ch->last_activity = self.now;
+    }
+  }
+
+  if (revents & POLLNVAL) {
+    o_log(O_LOG_WARN, "EventLoop: socket '%s' invalid, deactivating...\n", ch->name);
+    eventloop_socket_activate((SockEvtSource*)ch, 0);
+    do_status_callback(ch, SOCKET_DROPPED, 0);
+  }
+}
+
+/** Read available data from a channel directly into its MBuffer.
+ *
+ * Data is received at the write pointer of the MBuffer, which is grown as
+ * needed, until no more data is available, the connection is closed, or the
+ * budget is exhausted. All the data is then passed at once to the read
+ * callback, as a pointer into the MBuffer; the callback must not write it
+ * into the MBuffer again.
+ *
+ * \param ch Channel to read from, with an MBuffer
+ * \param budget maximum number of bytes to read, 0 for no limit
+ * \return the return value of the last recv(2) call: >0 if the budget was exhausted, 0 if the connection was closed, or -1 on error (including EAGAIN), with errno set accordingly
+ * \see eventloop_socket_set_mbuf, eventloop_set_read_budget
+ */
+static int do_mbuf_read(Channel *ch, size_t budget)
+{
+  MBuffer *mbuf = ch->mbuf;
+  size_t offset = mbuf_write_offset(mbuf), total = 0, want;
+  ssize_t len;
+  int err;
+
+  do {
+    /* Grow geometrically, in case a lot of data keeps arriving */
+    if (mbuf_length(mbuf) - mbuf_fill(mbuf) < MIN_MBUF_READ_SIZE &&
+        mbuf_check_resize(mbuf, mbuf_fill(mbuf) > MIN_MBUF_READ_SIZE ?
+          mbuf_fill(mbuf) : MIN_MBUF_READ_SIZE) < 0) {
+      o_log(O_LOG_ERROR, "EventLoop: Cannot grow buffer of '%s'\n", ch->name);
+      len = -1;
+      errno = ENOMEM;
+      break;
+    }
+    want = mbuf_length(mbuf) - mbuf_fill(mbuf);
+    if (budget > 0 && want > budget - total) {
+      want = budget - total;
+    }
+    /* Never block, even if the socket is in blocking mode */
+    if ((len = recv(ch->fds_fd, mbuf_wrptr(mbuf), want, MSG_DONTWAIT)) > 0) {
+      mbuf_write_skip(mbuf, len);
+      total += len;
+    }
+  } while (len > 0 && (!budget || total < budget));
+
+  if (total > 0) {
+    err = errno;
+    o_log(O_LOG_DEBUG3, "EventLoop: Received %zu bytes into buffer\n", total);
+    do_read_callback (ch, mbuf_buffer(mbuf) + offset, total);
+    errno = err;
+  }
+
+  return len;
+}
+
 /** Stop the eventloop,
  *
  * The eventloop will try to gracefully finish by waiting for all active FDs to be closed.
@@ -472,7 +848,11 @@ void eventloop_terminate(int reason)
  */
 void eventloop_report (int loglevel)
 {
-  o_log(loglevel, "EventLoop: Open file descriptors: %d/%d\n", self.size, self.length);
+  if (self.epfd >= 0) {
+    o_log(loglevel, "EventLoop: Open file descriptors: %d (epoll)\n", self.size);
+  } else {
+    o_log(loglevel, "EventLoop: Open file descriptors: %d/%d\n", self.size, self.length);
+  }
   o_log(loglevel, "EventLoop: Memory usage: %s\n", oml_memsummary());
 }
 
@@ -579,6 +959,36 @@ SockEvtSource* eventloop_on_stdin(
   return (SockEvtSource*)ch;
 }
 
+/** Register a socket file descriptor as a new input channel to read data from.
+ *
+ * This is meant for internal signalling (e.g., one end of a socketpair(2)),
+ * rather than for network connections, which should use OComm Sockets. The
+ * descriptor is never closed by the EventLoop, and the channel is released
+ * without shutting anything down when the EventLoop is terminated.
+ *
+ * \param name name of this channel, used for debugging
+ * \param fd socket file descriptor to read from
+ * \param data_cbk read callback called with freshly-read data, can be NULL
+ * \param status_cbk status-change callback, can be NULL
+ * \param handle pointer to opaque data passed to callback functions
+ * \return a pointer to a new Channel cast as a SockEvtSource
+ *
+ * \see o_el_read_socket_callback, o_el_state_socket_callback
+ */
+SockEvtSource* eventloop_on_read_in_fd(
+  char* name,
+  int fd,
+  o_el_read_socket_callback data_cbk,
+  o_el_state_socket_callback status_cbk,
+  void* handle
+) {
+  Channel* ch;
+
+  ch = eventloop_on_in_fd(name, fd, data_cbk, NULL, status_cbk, handle);
+
+  return (SockEvtSource*)ch;
+}
+
 /** Register a Socket as a new input channel to read data from.
  *
  * \param socket OComm Socket
@@ -665,20 +1075,52 @@ SockEvtSource* eventloop_on_out_channel(
 
 /** Mark socket event source (channel) as active or not.
  *
- * This triggers FD update if need be.
+ * This triggers FD update if need be. Inactive channels are not reaped when
+ * idle; the idleness of a reactivated channel is counted from its
+ * reactivation.
+ *
+ * With epoll(7), a channel which cannot be monitored stays inactive, and
+ * SOCKET_DROPPED is later reported to its status callback.
  *
  * \param source SockEvtSource to (de)activate
  * \param flag 0 to deactivate, anything else to activate (use 1)
+ * \return 0 on success, or -1 if the channel could not be activated
  *
- * \see update_fds
+ * \see update_fds, epoll_update
  */
-void eventloop_socket_activate(SockEvtSource* source, int flag)
+int eventloop_socket_activate(SockEvtSource* source, int flag)
 {
   Channel* ch = (Channel*)source;
   if (ch->is_active != flag) {
     ch->is_active = flag;
     self.fds_dirty = 1;
+    if (flag && 0 != ch->last_activity) {
+      ch->last_activity = self.now;
+    }
+#ifdef USE_EPOLL
+    if (self.epfd >= 0) {
+      return epoll_update(ch);
+    }
+#endif
   }
+  return 0;
+}
+
+/** Make a channel read data directly into an MBuffer.
+ *
+ * Rather than a copy of each chunk read from the socket, the read callback
+ * receives all the data which was available, once it has been appended to the
+ * MBuffer. The callback should not write it into the MBuffer again, but
+ * process it from there, and consume it.
+ *
+ * \param source SockEvtSource (Channel) of a socket, with a read callback
+ * \param mbuf MBuffer to read data into, or NULL to go back to copying data
+ * \see eventloop_set_read_budget, o_el_read_socket_callback
+ */
+void eventloop_socket_set_mbuf(SockEvtSource* source, struct MBuffer* mbuf)
+{
+  Channel* ch = (Channel*)source;
+  ch->mbuf = mbuf;
 }
 
 /** Tell the EventLoop to release a channel.
@@ -699,6 +1141,15 @@ void eventloop_socket_release(SockEvtSource* source)
 {
   Channel *ch = (Channel*)source;
   eventloop_socket_activate(source, 0);
+  ch->mbuf = NULL;
+  if (self.epfd >= 0 && !ch->is_removable) {
+    /* Remove it once all events have been processed \see run_epoll */
+    if (self.nreleased >= self.released_length) {
+      self.released_length = self.released_length > 0 ? 2 * self.released_length : DEF_FDS_LENGTH;
+      self.released = (Channel **)oml_realloc(self.released, self.released_length * sizeof(Channel*));
+    }
+    self.released[self.nreleased++] = ch;
+  }
   ch->is_removable = 1;
   ch->handle = NULL;
 }
@@ -714,9 +1165,25 @@ void eventloop_socket_release(SockEvtSource* source)
 void eventloop_socket_remove(SockEvtSource* source)
 {
   Channel* ch = (Channel*)source;
+  int i;
 
   eventloop_socket_activate(source, 0);
 
+  /* Forget any pending reference to it \see run_epoll */
+  for (i = 0; i < self.nreleased; i++) {
+    if (self.released[i] == ch) {
+      self.released[i] = self.released[--self.nreleased];
+      break;
+    }
+  }
+#ifdef USE_EPOLL
+  for (i = 0; i < self.nevents; i++) {
+    if (self.events[i].data.ptr == ch) {
+      self.events[i].data.ptr = NULL;
+    }
+  }
+#endif
+
   /* Update the linked list */
   if (self.channels == ch) {
     self.channels = ch->next;
@@ -902,7 +1369,7 @@ static void terminate_fds(void)
   while (ch != NULL) {
     next = ch->next;
     o_log(O_LOG_DEBUG4, "EventLoop: Terminating channel %s\n", ch->name);
-    if (!ch->is_active ||
+    if (!ch->is_active || NULL == ch->socket ||
         socket_is_disconnected(ch->socket) ||
         socket_is_listening(ch->socket)) {
       o_log(O_LOG_DEBUG3, "EventLoop: Releasing listening channel %s\n", ch->name);
@@ -919,7 +1386,9 @@ static void terminate_fds(void)
     ch = next;
   }
 
-  update_fds();
+  if (self.epfd < 0) {
+    update_fds();
+  }
 }
 
 /** Execute the data-read callback of a channel, if defined.
@@ -18,6 +18,7 @@
 #include <inttypes.h>
 #include <stdarg.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "ocomm/o_log.h"
 #include "oml_util.h"
@@ -187,10 +188,13 @@ o_vlog(int log_level, const char* fmt, va_list va)
   static time_t last_time = (time_t)0;
   static uint64_t nseen = 0;
   static uint64_t exponent = INIT_LOG_EXPONENT;
+  /* Protects the static state above, as well as the log file */
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
   time_t now;
 
   if (!o_log_level_active(log_level)) { return; }
 
+  pthread_mutex_lock(&lock);
   time(&now);
 
   if (!new_log || !last_log || last_time == (time_t)-1) {
@@ -246,6 +250,7 @@ o_vlog(int log_level, const char* fmt, va_list va)
     last_log = tmp;
 
   }
+  pthread_mutex_unlock(&lock);
 }
 
 /** Simplified logging function (default)
@@ -62,6 +62,10 @@ typedef struct _sockEvtSource {
 
 } SockEvtSource;
 
+/** Buffer into which some channels read data directly (see mbuf.h)
+ * \see eventloop_socket_set_mbuf */
+struct MBuffer;
+
 /** Possible socket statuses after state change.
  *
  * Depends on poll(3) revents and additional condition during further
@@ -152,6 +156,7 @@ typedef void (*o_el_state_socket_callback)(SockEvtSource* source, SocketStatus s
 
 void eventloop_init(void);
 void eventloop_set_socket_timeout(unsigned int to);
+void eventloop_set_read_budget(size_t budget);
 int eventloop_run(void);
 void eventloop_stop(int reason);
 void eventloop_terminate(int reason);
@@ -160,15 +165,18 @@ void eventloop_report (int loglevel);
 TimerEvtSource* eventloop_every(char* name, int period, o_el_timer_callback callback, void* handle);
 void eventloop_timer_stop(TimerEvtSource* timer);
 
-/* These functions create new channels around either STDIN or an OComm socket,
+/* These functions create new channels around either STDIN, a socket file
+ * descriptor or an OComm socket,
  * with various callbacks depending on their use */
 SockEvtSource* eventloop_on_stdin( o_el_read_socket_callback callback, void* handle);
+SockEvtSource* eventloop_on_read_in_fd(char* name, int fd, o_el_read_socket_callback data_cbk, o_el_state_socket_callback status_cbk, void* handle);
 SockEvtSource* eventloop_on_monitor_in_channel(Socket* socket, o_el_monitor_socket_callback monitor_cbk, o_el_state_socket_callback status_cbk, void* handle);
 SockEvtSource* eventloop_on_read_in_channel(Socket* socket,o_el_read_socket_callback data_cbk, o_el_state_socket_callback status_cbk, void* handle);
 SockEvtSource* eventloop_on_out_channel( Socket* socket, o_el_state_socket_callback status_cbk, void* handle);
 
 /* XXX: Is "socket" the right term here? */
-void eventloop_socket_activate(SockEvtSource* source, int flag);
+int eventloop_socket_activate(SockEvtSource* source, int flag);
+void eventloop_socket_set_mbuf(SockEvtSource* source, struct MBuffer* mbuf);
 void eventloop_socket_release(SockEvtSource* source);
 void eventloop_socket_remove(SockEvtSource* source);
 
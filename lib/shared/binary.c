@@ -31,6 +31,22 @@
 #define OMB_LDATA_P 0x2
 #endif
 
+#ifndef OMB_CDATA_P
+#define OMB_CDATA_P 0x3
+#endif
+
+#ifndef OMB_LCDATA_P
+#define OMB_LCDATA_P 0x4
+#endif
+
+#ifndef OMB_BATCH_P
+#define OMB_BATCH_P 0x5
+#endif
+
+#ifndef OMB_LBATCH_P
+#define OMB_LBATCH_P 0x6
+#endif
+
 static int
 bin_read_value (MBuffer *mbuf, OmlValue *value)
 {
@@ -96,6 +112,14 @@ bin_value_size (OmlValue *value)
  * to, what the length of the message is, the sequence number, and the
  * timestamp.  Fill in the msg struct with this information.
  *
+ * Compact messages (OMSPv7) are decoded using, and update, the per-stream
+ * state in msg->streams, which must then be the same for all calls on a given
+ * connection.
+ *
+ * For batch messages (OMSPv8), all rows are read to keep that state up to
+ * date; msg->count is the number of values in each row, and msg->seqno and
+ * msg->timestamp are those of the first row.
+ *
  * Return value == 0 means "wait for more data"
  * Return value == -1 means "error in protocol" or memory alloc error
  * Return value > 0 means "following message length is the many bytes"
@@ -132,6 +156,8 @@ bin_read_msg_start (struct oml_message *msg, MBuffer *mbuf)
 
   switch (packet_type) {
   case OMB_DATA_P:
+  case OMB_CDATA_P:
+  case OMB_BATCH_P:
     // FIXME:  Return type (maybe not enough bytes)
     mbuf_read (mbuf, (uint8_t*)&msglen16, 2);
     msglen16 = ntohs (msglen16);
@@ -139,6 +165,8 @@ bin_read_msg_start (struct oml_message *msg, MBuffer *mbuf)
     header_length = 5;
     break;
   case OMB_LDATA_P:
+  case OMB_LCDATA_P:
+  case OMB_LBATCH_P:
     mbuf_read (mbuf, (uint8_t*)&length, 4);
     length = ntohl (length);
     header_length = 7;
@@ -162,6 +190,45 @@ bin_read_msg_start (struct oml_message *msg, MBuffer *mbuf)
   msg->length = length + header_length;
   msg->count = count;
 
+  if (packet_type == OMB_BATCH_P || packet_type == OMB_LBATCH_P) {
+    uint16_t nrows, i;
+    int32_t seqno;
+    double timestamp;
+    uint8_t j;
+
+    if (msg->streams == NULL ||
+        mbuf_read (mbuf, (uint8_t*)&nrows, 2) == -1) {
+      return -1;
+    }
+    nrows = ntohs (nrows);
+    for (i = 0; i < nrows; i++) {
+      if (unmarshal_measurements_compact (mbuf, &msg->streams[stream], &seqno, &timestamp) == -1) {
+        return -1;
+      }
+      if (0 == i) {
+        msg->seqno = seqno;
+        msg->timestamp = timestamp;
+      }
+      for (j = 0; j < count; j++) {
+        if (bin_read_value (mbuf, &value) == 0) {
+          oml_value_reset(&value);
+          return -1;
+        }
+      }
+    }
+    oml_value_reset(&value);
+    return msg->length;
+  }
+
+  if (packet_type == OMB_CDATA_P || packet_type == OMB_LCDATA_P) {
+    int32_t seqno;
+    if (msg->streams == NULL ||
+        unmarshal_measurements_compact (mbuf, &msg->streams[stream], &seqno, &msg->timestamp) == -1) {
+      return -1;
+    }
+    msg->seqno = seqno;
+    return msg->length;
+  }
 
   oml_value_set_type(&value, OML_INT32_VALUE);
   // FIXME: check for error (e.g. type mismatch)
@@ -0,0 +1,513 @@
+/*
+ * Copyright 2014 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file ddsketch.c
+ * \brief A mergeable quantile sketch with relative-error guarantees (DDSketch).
+ *
+ * Values are counted in bins whose bounds grow geometrically by a factor
+ * gamma = (1 + accuracy) / (1 - accuracy); the bin of index k counts the
+ * values in ]gamma^(k-1), gamma^k]. Any quantile estimated from the bins is
+ * within accuracy of the actual value, relative to it. Negative values are
+ * counted by absolute value in a second store, and values too close to 0 to
+ * be indexed in a third, single, bin.
+ *
+ * Each store keeps counts for at most max_bins contiguous indices. Should a
+ * value fall further away, the lowest bins are collapsed into one, so the
+ * memory used is bounded, and the accuracy of the highest quantiles (e.g.,
+ * tail latencies) is preserved. With the default accuracy of 1%, 2048 bins
+ * cover 18 orders of magnitude.
+ *
+ * Sketches with the same accuracy can be merged losslessly, which allows to
+ * compute quantiles over several sampling periods or sources from their
+ * serialised form.
+ *
+ * \see ddsketch_encode
+ */
+
+#include <float.h>
+#include <math.h>
+#include <string.h>
+
+#include "mem.h"
+#include "htonll.h"
+#include "ddsketch.h"
+
+/** Smallest relative accuracy, for which indices still fit in an int */
+#define DDSKETCH_MIN_ACCURACY 1e-6
+
+/** Compute the memory needed by a DDSketch
+ *
+ * \param max_bins maximal number of bins of each store
+ * \return the size of the DDSketch and of its bins [B]
+ * \see ddsketch_init
+ */
+size_t
+ddsketch_size(int max_bins)
+{
+  return sizeof(DDSketch) + DDSKETCH_NSTORES * (size_t)max_bins * sizeof(uint64_t);
+}
+
+/** Initialise an empty DDSketch in caller-provided memory
+ *
+ * \param sketch memory of at least ddsketch_size(max_bins) bytes
+ * \param accuracy relative accuracy of the quantiles, between DDSKETCH_MIN_ACCURACY and 1 (excluded)
+ * \param max_bins maximal number of bins of each store, at least 1
+ * \return 0 on success, -1 if the parameters are invalid
+ * \see ddsketch_new
+ */
+int
+ddsketch_init(DDSketch* sketch, double accuracy, int max_bins)
+{
+  if (!(accuracy >= DDSKETCH_MIN_ACCURACY && accuracy < 1.) || max_bins < 1) {
+    return -1;
+  }
+
+  sketch->accuracy = accuracy;
+  sketch->gamma = (1. + accuracy) / (1. - accuracy);
+  sketch->multiplier = 1. / log(sketch->gamma);
+  sketch->min_indexable = DBL_MIN * sketch->gamma;
+  sketch->max_bins = max_bins;
+  ddsketch_clear(sketch);
+
+  return 0;
+}
+
+/** Allocate and initialise an empty DDSketch
+ *
+ * \copydetails ddsketch_init
+ * \return a new DDSketch to be freed with ddsketch_free, or NULL on error
+ */
+DDSketch*
+ddsketch_new(double accuracy, int max_bins)
+{
+  DDSketch *self;
+
+  if (max_bins < 1 || !(self = oml_malloc(ddsketch_size(max_bins)))) {
+    return NULL;
+  }
+  if (ddsketch_init(self, accuracy, max_bins)) {
+    oml_free(self);
+    return NULL;
+  }
+  return self;
+}
+
+/** Free a DDSketch allocated by ddsketch_new or ddsketch_decode
+ *
+ * \param sketch DDSketch to free
+ */
+void
+ddsketch_free(DDSketch* sketch)
+{
+  oml_free(sketch);
+}
+
+/** Forget all values counted in a DDSketch
+ *
+ * \param sketch DDSketch to clear
+ */
+void
+ddsketch_clear(DDSketch* sketch)
+{
+  sketch->zero_count = 0;
+  memset(sketch->stores, 0, sizeof(sketch->stores));
+  memset(sketch->bins, 0, DDSKETCH_NSTORES * (size_t)sketch->max_bins * sizeof(uint64_t));
+}
+
+/** Move the bins of a store so they include index k, collapsing the lowest bins if needed
+ *
+ * \param sketch DDSketch to modify
+ * \param st store to modify, DDSKETCH_POSITIVE or DDSKETCH_NEGATIVE
+ * \param k index which does not fit in the current range of the store
+ * \return the index of the bin where k is now counted
+ */
+static int
+store_extend(DDSketch* sketch, int st, int k)
+{
+  DDSketchStore *store = &sketch->stores[st];
+  uint64_t *bins = sketch->bins + st * (size_t)sketch->max_bins;
+  int m = sketch->max_bins;
+  int lo = k < store->lo ? k : store->lo;
+  int hi = k > store->hi ? k : store->hi;
+  int from = store->lo, offset, i;
+  uint64_t folded = 0;
+
+  if (hi - lo >= m) {
+    /* Keep the m highest indices, and count everything below in the lowest */
+    lo = hi - m + 1;
+    for (i = store->lo; i < lo && i <= store->hi; i++) {
+      folded += bins[i - store->offset];
+      bins[i - store->offset] = 0;
+    }
+    from = i;
+    if (k < lo) {
+      k = lo;
+    }
+  }
+
+  /* Centre the non-empty range, to leave room for growth either way */
+  offset = lo - (m - (hi - lo + 1)) / 2;
+  if (from <= store->hi) {
+    int len = store->hi - from + 1;
+    memmove(bins + (from - offset), bins + (from - store->offset), len * sizeof(uint64_t));
+    memset(bins, 0, (from - offset) * sizeof(uint64_t));
+    memset(bins + (from - offset) + len, 0, (m - (from - offset) - len) * sizeof(uint64_t));
+  } else {
+    memset(bins, 0, m * sizeof(uint64_t));
+  }
+  bins[lo - offset] += folded;
+
+  store->offset = offset;
+  store->lo = lo;
+  store->hi = hi;
+
+  return k;
+}
+
+/** Count n values of index k in a store
+ *
+ * \param sketch DDSketch to modify
+ * \param st store to modify, DDSKETCH_POSITIVE or DDSKETCH_NEGATIVE
+ * \param k index of the bin of the values
+ * \param n number of values
+ */
+static void
+store_add(DDSketch* sketch, int st, int k, uint64_t n)
+{
+  DDSketchStore *store = &sketch->stores[st];
+
+  if (!store->count) {
+    store->offset = k - sketch->max_bins / 2;
+    store->lo = store->hi = k;
+
+  } else if (k < store->offset || k - store->offset >= sketch->max_bins) {
+    k = store_extend(sketch, st, k);
+
+  } else if (k < store->lo) {
+    store->lo = k;
+
+  } else if (k > store->hi) {
+    store->hi = k;
+  }
+
+  sketch->bins[st * (size_t)sketch->max_bins + (k - store->offset)] += n;
+  store->count += n;
+}
+
+/** Get the value representative of a bin, equally far from its bounds in relative terms
+ *
+ * \param sketch DDSketch the bin belongs to
+ * \param k index of the bin
+ * \return the absolute value representing the values of the bin
+ */
+static double
+bin_value(const DDSketch* sketch, int k)
+{
+  return 2. * exp(k / sketch->multiplier) / (1. + sketch->gamma);
+}
+
+/** Count a value in a DDSketch
+ *
+ * NaNs and infinite values are ignored.
+ *
+ * \param sketch DDSketch to add the value to
+ * \param value value to count
+ */
+void
+ddsketch_add(DDSketch* sketch, double value)
+{
+  if (value > sketch->min_indexable) {
+    if (value <= DBL_MAX) {
+      store_add(sketch, DDSKETCH_POSITIVE, (int)ceil(log(value) * sketch->multiplier), 1);
+    }
+  } else if (value < -sketch->min_indexable) {
+    if (value >= -DBL_MAX) {
+      store_add(sketch, DDSKETCH_NEGATIVE, (int)ceil(log(-value) * sketch->multiplier), 1);
+    }
+  } else if (value == value) {
+    sketch->zero_count++;
+  }
+}
+
+/** Get the number of values counted in a DDSketch
+ *
+ * \param sketch DDSketch to examine
+ * \return the number of values counted
+ */
+uint64_t
+ddsketch_count(const DDSketch* sketch)
+{
+  return sketch->zero_count +
+    sketch->stores[DDSKETCH_POSITIVE].count + sketch->stores[DDSKETCH_NEGATIVE].count;
+}
+
+/** Estimate a quantile of the values counted in a DDSketch
+ *
+ * The estimate is within the accuracy of the sketch, relative to the actual
+ * value of rank q * (count - 1) in the sorted values, unless that value was
+ * in a collapsed bin.
+ *
+ * \param sketch DDSketch to examine
+ * \param q quantile to estimate, between 0 and 1
+ * \return the estimated quantile, or NAN if the sketch is empty or q is out of range
+ */
+double
+ddsketch_quantile(const DDSketch* sketch, double q)
+{
+  const DDSketchStore *neg = &sketch->stores[DDSKETCH_NEGATIVE];
+  const DDSketchStore *pos = &sketch->stores[DDSKETCH_POSITIVE];
+  const uint64_t *bins;
+  uint64_t count = ddsketch_count(sketch);
+  double rank, cumul = 0.;
+  int k;
+
+  if (!count || !(q >= 0. && q <= 1.)) {
+    return NAN;
+  }
+  rank = q * (count - 1);
+
+  if (neg->count) {
+    bins = sketch->bins + DDSKETCH_NEGATIVE * (size_t)sketch->max_bins;
+    for (k = neg->hi; k >= neg->lo; k--) {
+      cumul += bins[k - neg->offset];
+      if (cumul > rank) {
+        return -bin_value(sketch, k);
+      }
+    }
+  }
+
+  cumul += sketch->zero_count;
+  if (cumul > rank) {
+    return 0.;
+  }
+
+  bins = sketch->bins + DDSKETCH_POSITIVE * (size_t)sketch->max_bins;
+  for (k = pos->lo; pos->count && k < pos->hi; k++) {
+    cumul += bins[k - pos->offset];
+    if (cumul > rank) {
+      return bin_value(sketch, k);
+    }
+  }
+  return bin_value(sketch, pos->hi);
+}
+
+/** Add all the values counted in a DDSketch to another
+ *
+ * \param sketch DDSketch to add the values to
+ * \param other DDSketch to add the values of, unmodified
+ * \return 0 on success, -1 if the sketches do not have the same accuracy
+ */
+int
+ddsketch_merge(DDSketch* sketch, const DDSketch* other)
+{
+  const uint64_t *bins;
+  const DDSketchStore *store;
+  int st, k;
+
+  if (sketch->gamma != other->gamma) {
+    return -1;
+  }
+
+  for (st = 0; st < DDSKETCH_NSTORES; st++) {
+    store = &other->stores[st];
+    bins = other->bins + st * (size_t)other->max_bins;
+    for (k = store->lo; store->count && k <= store->hi; k++) {
+      if (bins[k - store->offset]) {
+        store_add(sketch, st, k, bins[k - store->offset]);
+      }
+    }
+  }
+  sketch->zero_count += other->zero_count;
+
+  return 0;
+}
+
+/** Append an unsigned LEB128 varint to a buffer, if there is room for it
+ *
+ * \param buf buffer to write to
+ * \param size size of buf
+ * \param pos position to write at, updated even if the buffer is too small
+ * \param v value to write
+ */
+static void
+put_varint(uint8_t* buf, size_t size, size_t* pos, uint64_t v)
+{
+  do {
+    uint8_t b = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+    if (*pos < size) {
+      buf[*pos] = b;
+    }
+    (*pos)++;
+    v >>= 7;
+  } while (v);
+}
+
+/** Read an unsigned LEB128 varint from a buffer
+ *
+ * \param buf buffer to read from
+ * \param size size of buf
+ * \param pos position to read at, updated
+ * \param v pointer where the value is stored
+ * \return 0 on success, -1 if the buffer is too short or the varint too long
+ */
+static int
+get_varint(const uint8_t* buf, size_t size, size_t* pos, uint64_t* v)
+{
+  int shift;
+
+  *v = 0;
+  for (shift = 0; shift < 64 && *pos < size; shift += 7) {
+    uint8_t b = buf[(*pos)++];
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/** Serialise a DDSketch, so it can be merged elsewhere
+ *
+ * The serialised form is
+ *  - the version of the encoding, DDSKETCH_ENCODING_VERSION, on one byte;
+ *  - gamma, as an IEEE 754 double, in network byte order;
+ *  - the number of values counted as zero;
+ * then, for the positive then the negative store,
+ *  - the number n of bins from the lowest to the highest non-empty one;
+ *  - if n is not 0, the index of the lowest of these bins, zigzag-encoded;
+ *  - the counts of the n bins.
+ * All integers but the version are unsigned LEB128 varints.
+ *
+ * As with snprintf(3), the size needed is returned even if the buffer is
+ * too small, in which case it only contains the beginning of the encoding.
+ *
+ * \param sketch DDSketch to serialise
+ * \param buf buffer to write to (can be NULL if size is 0)
+ * \param size size of buf
+ * \return the size of the serialised DDSketch
+ * \see ddsketch_decode
+ */
+size_t
+ddsketch_encode(const DDSketch* sketch, uint8_t* buf, size_t size)
+{
+  const DDSketchStore *store;
+  const uint64_t *bins;
+  uint64_t nv;
+  size_t pos = 0;
+  int st, k, i;
+
+  if (size > 0) {
+    buf[0] = DDSKETCH_ENCODING_VERSION;
+  }
+  pos++;
+  memcpy(&nv, &sketch->gamma, sizeof(nv));
+  nv = htonll(nv);
+  for (i = 0; i < (int)sizeof(nv); i++, pos++) {
+    if (pos < size) {
+      buf[pos] = ((uint8_t*)&nv)[i];
+    }
+  }
+  put_varint(buf, size, &pos, sketch->zero_count);
+
+  for (st = 0; st < DDSKETCH_NSTORES; st++) {
+    store = &sketch->stores[st];
+    bins = sketch->bins + st * (size_t)sketch->max_bins;
+    if (!store->count) {
+      put_varint(buf, size, &pos, 0);
+      continue;
+    }
+    put_varint(buf, size, &pos, store->hi - store->lo + 1);
+    put_varint(buf, size, &pos, ((uint64_t)store->lo << 1) ^ (uint64_t)(int64_t)(store->lo >> 31));
+    for (k = store->lo; k <= store->hi; k++) {
+      put_varint(buf, size, &pos, bins[k - store->offset]);
+    }
+  }
+
+  return pos;
+}
+
+/** Deserialise a DDSketch
+ *
+ * \param buf buffer containing a DDSketch serialised by ddsketch_encode
+ * \param size size of buf
+ * \param max_bins maximal number of bins of each store of the new DDSketch;
+ * the lowest bins of the serialised DDSketch are collapsed if it had more
+ * \return a new DDSketch to be freed with ddsketch_free, or NULL if buf is not a valid serialised DDSketch
+ * \see ddsketch_encode
+ */
+DDSketch*
+ddsketch_decode(const uint8_t* buf, size_t size, int max_bins)
+{
+  DDSketch *self;
+  uint64_t nv, n, lo, count;
+  double gamma;
+  size_t pos = 1 + sizeof(nv);
+  int st;
+
+  if (size < pos || buf[0] != DDSKETCH_ENCODING_VERSION) {
+    return NULL;
+  }
+  memcpy(&nv, buf + 1, sizeof(nv));
+  nv = ntohll(nv);
+  memcpy(&gamma, &nv, sizeof(gamma));
+  if (!(gamma > 1. && gamma <= DBL_MAX) ||
+      !(self = ddsketch_new((gamma - 1.) / (gamma + 1.), max_bins))) {
+    return NULL;
+  }
+  /* Use the exact same bins as the original */
+  self->gamma = gamma;
+  self->multiplier = 1. / log(gamma);
+  self->min_indexable = DBL_MIN * gamma;
+
+  if (get_varint(buf, size, &pos, &self->zero_count)) {
+    goto error;
+  }
+  for (st = 0; st < DDSKETCH_NSTORES; st++) {
+    if (get_varint(buf, size, &pos, &n)) {
+      goto error;
+    }
+    if (!n) {
+      continue;
+    }
+    /* Each count takes at least one byte */
+    if (n > size - pos || get_varint(buf, size, &pos, &lo)) {
+      goto error;
+    }
+    int64_t k = (int64_t)(lo >> 1) ^ -(int64_t)(lo & 1);
+    if (k < INT32_MIN || k + (int64_t)n - 1 > INT32_MAX) {
+      goto error;
+    }
+    for (; n > 0; n--, k++) {
+      if (get_varint(buf, size, &pos, &count)) {
+        goto error;
+      }
+      if (count) {
+        store_add(self, st, (int)k, count);
+      }
+    }
+  }
+  if (pos != size) {
+    goto error;
+  }
+
+  return self;
+
+error:
+  ddsketch_free(self);
+  return NULL;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2014 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file ddsketch.h
+ * \brief Interface for DDSketch, a mergeable quantile sketch with relative-error guarantees.
+ * \see ddsketch.c
+ */
+#ifndef DDSKETCH_H__
+#define DDSKETCH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Default relative accuracy of the quantiles of a DDSketch */
+#define DDSKETCH_DEFAULT_ACCURACY 0.01
+/** Default maximal number of bins of each sign of a DDSketch */
+#define DDSKETCH_DEFAULT_BINS 2048
+
+/** Version of the serialised form of DDSketches \see ddsketch_encode */
+#define DDSKETCH_ENCODING_VERSION 1
+
+/** Contiguous range of bins of a DDSketch, for values of one sign */
+typedef struct DDSketchStore {
+  /** Index of the value range counted in the first bin of the store */
+  int offset;
+  /** Lowest index of a non-empty bin */
+  int lo;
+  /** Highest index of a non-empty bin */
+  int hi;
+  /** Number of values counted in the store */
+  uint64_t count;
+} DDSketchStore;
+
+/** Stores of a DDSketch */
+enum {
+  DDSKETCH_POSITIVE = 0,
+  DDSKETCH_NEGATIVE,
+  DDSKETCH_NSTORES
+};
+
+/** A DDSketch.
+ *
+ * Its memory, including the bins, is ddsketch_size(max_bins) bytes long.
+ * \see ddsketch_init, ddsketch_new
+ */
+typedef struct DDSketch {
+  /** Relative accuracy of the quantiles */
+  double accuracy;
+  /** Ratio between the upper and lower bounds of a bin, (1 + accuracy) / (1 - accuracy) */
+  double gamma;
+  /** Factor turning the log of a value into the index of its bin, 1 / ln(gamma) */
+  double multiplier;
+  /** Smallest absolute value not counted as zero */
+  double min_indexable;
+
+  /** Maximal number of bins in each store */
+  int max_bins;
+
+  /** Number of values counted as zero */
+  uint64_t zero_count;
+  /** Positive and negative (by absolute value) stores */
+  DDSketchStore stores[DDSKETCH_NSTORES];
+
+  /** Counts of the bins of all stores, max_bins each */
+  uint64_t bins[];
+} DDSketch;
+
+size_t ddsketch_size(int max_bins);
+int ddsketch_init(DDSketch* sketch, double accuracy, int max_bins);
+DDSketch* ddsketch_new(double accuracy, int max_bins);
+void ddsketch_free(DDSketch* sketch);
+void ddsketch_clear(DDSketch* sketch);
+void ddsketch_add(DDSketch* sketch, double value);
+uint64_t ddsketch_count(const DDSketch* sketch);
+double ddsketch_quantile(const DDSketch* sketch, double q);
+int ddsketch_merge(DDSketch* sketch, const DDSketch* other);
+size_t ddsketch_encode(const DDSketch* sketch, uint8_t* buf, size_t size);
+DDSketch* ddsketch_decode(const uint8_t* buf, size_t size, int max_bins);
+
+#endif /* DDSKETCH_H__ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -34,7 +34,7 @@
  *
  * \section Generalities
  *
- * There are 5 versions of the OML protocol.
+ * There are 8 versions of the OML protocol.
  *
  * - OMSP V1 was the initial protocol, inherited from OML (version 1!);
  * - OMSP V2 introduced more precise types (<a
@@ -47,10 +47,18 @@
  * - OMSP V4 was introduced with OML 2.10.0; its main additions are the support
  *   for the definition of new Measurement Points (and Measurement Stream
  *   Schemas) at any time, and the ability to inject metadata.
- * - OMSP V5 which is the current, most recent and implemented version (since
- *   OML 2.11); its main advantages are the support for vectors, and the
- *   introduction of a DOUBLE64_T IEEE 754 binary64 for more precision in
- *   representing doubles in binary mode (vectors only).
+ * - OMSP V5 (since OML 2.11); its main advantages are the support for
+ *   vectors, and the introduction of a DOUBLE64_T IEEE 754 binary64 for more
+ *   precision in representing doubles in binary mode (vectors only). It is
+ *   still the version clients use by default.
+ * - OMSP V6 uses DOUBLE64_T for all doubles in binary mode, including
+ *   timestamps, so they are transported exactly.
+ * - OMSP V7 introduces \ref omspbincompact "compact packets" in binary
+ *   mode, with delta-encoded sequence numbers and timestamps, and varint
+ *   integers.
+ * - OMSP V8 is the most recent version; in binary mode, it introduces \ref
+ *   omspbinbatch "batch packets", carrying several consecutive samples of the
+ *   same stream under a single header.
  *
  * The protocol is loosely modelled after HTTP. The client first start
  * with a few \ref omspheaders "textual headers", then switches into
@@ -99,6 +107,15 @@
  * These parameters can only be set as part of the \ref omspheaders "headers",
  * and are not valid once the server expects serialised measurements (V<4).
  *
+ * \subsection omspencapsulation Encapsulation
+ *
+ * Independently of the protocol version, a client may compress the whole
+ * stream. It then sends a single uncompressed `encapsulation: deflate` line
+ * before anything else, and all the following bytes, including the rest of
+ * the headers, are a raw DEFLATE stream (RFC1951). The client terminates each
+ * compressed block with a full flush, so the server can decompress data as it
+ * arrives.
+ *
  * Since V>=4, key/value metadata can be sent along with tuples using the \ref
  * schema0 "schema 0", the rest of the key/value parameters presented here
  * are all invalid in schema 0, and will be rejected by the server, _except_
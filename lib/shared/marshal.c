@@ -92,6 +92,22 @@
  *       |  mant-byte-LL |   exponent    |
  *       +---------------+---------------+--
  *
+ * This representation only keeps 31 bits of the mantissa. From OMSPv6 (\ref
+ * OMB_DOUBLE64_PROTOCOL), doubles, including the timestamp, are instead
+ * marshalled as a \ref DOUBLE64_T followed by their IEEE 754 binary64
+ * representation in network byte order, as for vector elements below. This is
+ * both exact and cheaper to convert. The protocol version is passed to
+ * marshal_measurements2(), marshal_values2() and marshal_value2(); the
+ * unmarshalling functions accept both encodings.
+ *
+ *     --+---------------+---------------+---------------+---------------+
+ *       |  DOUBLE64_T   |   MS-byte     |    byte-7     |    byte-6     |
+ *     --+---------------+---------------+---------------+---------------+
+ *       |    byte-5     |    byte-4     |    byte-3     |    byte-2     |
+ *       +---------------+---------------+---------------+---------------+
+ *       |   LS-byte     |
+ *       +---------------+--
+ *
  * Strings (\ref STRING_T) and blobs (\ref BLOB_T) are serialised as bytes,
  * with the second byte (i.e., first after the type), being their length.
  *
@@ -158,7 +174,65 @@
  *       | dbl[0]-byte-4 |  dbl[0]-byte-3  | dbl[0]-byte-2 |dbl[0]-LS-byte |
  *       +---------------+-----------------+---------------+---------------+--
  *
+ * \subsection omspbincompact Compact Packets
+ *
+ * From OMSPv7 (\ref OMB_COMPACT_PROTOCOL), packets use the \ref OMB_CDATA_P
+ * and \ref OMB_LCDATA_P types instead. The headers, num-meas and ms-index are
+ * the same, but the sequence number and timestamp are delta-encoded against
+ * the previous packet of the same stream, using unsigned LEB128 varints (7
+ * bits per byte, least significant group first, with the most significant
+ * bit set on all but the last byte) of zigzag-encoded differences (0, -1, 1,
+ * -2, ... are mapped to 0, 1, 2, 3, ...). There is no type byte for either.
+ *
+ *                  --+---------------+---------------+-----...-----+-----...-----+-
+ *                    |   num-meas    |   ms-index    |   seq-var   |   ts-var    |
+ *                  --+---------------+---------------+-----...-----+-----...-----+-
+ *
+ * The least significant bit of seq-var indicates that the packet is
+ * absolute, i.e., that the differences are taken against a sequence number
+ * and timestamp of 0 rather than the previous packet; the rest is the zigzag
+ * sequence number difference. Senders emit an absolute packet whenever the
+ * previous one may not reach the receiver (e.g., after a disconnection or
+ * dropped data), as well as for stream 0, which is replayed on reconnection.
+ *
+ * The least significant bit of ts-var is 0 if the rest is a zigzag
+ * difference in microseconds. If it is 1, the timestamp could not be exactly
+ * represented in microseconds, and its IEEE 754 binary64 representation
+ * follows in network byte order, as for \ref DOUBLE64_T.
+ *
+ * In these packets, integers are marshalled as varints too, using the \ref
+ * VINT32_T and \ref VINT64_T types (zigzag-encoded) and \ref VUINT32_T and
+ * \ref VUINT64_T, and doubles use \ref DOUBLE64_T. Both can be unmarshalled
+ * regardless of the packet type.
+ *
+ *     --+---------------+-----...-----+--
+ *       |   VINT32_T    |   varint    |
+ *     --+---------------+-----...-----+--
+ *
+ * \subsection omspbinbatch Batch Packets
+ *
+ * From OMSPv8 (\ref OMB_BATCH_PROTOCOL), consecutive samples of the same
+ * stream can be sent in a single \ref OMB_BATCH_P (or \ref OMB_LBATCH_P)
+ * packet, with only one header. num-meas is then the number of values in
+ * each row, and is followed by the number of rows, as a 16-bit integer.
+ *
+ *                  --+---------------+---------------+---------------+---------------+-
+ *                    |   num-meas    |   ms-index    |   num-rows-H  |   num-rows-L  |
+ *                  --+---------------+---------------+---------------+---------------+-
+ *
+ * Each row then consists of a seq-var and a ts-var, as in compact packets,
+ * followed by num-meas values. The first row is delta-encoded against the
+ * previous packet of the same stream, and the following ones against the
+ * previous row.
+ *
+ *     -+-----...-----+-----...-----+--...--+-----...-----+-----...-----+--...--+-
+ *      |   seq-var   |   ts-var    | values|   seq-var   |   ts-var    | values|
+ *     -+-----...-----+-----...-----+--...--+-----...-----+-----...-----+--...--+-
+ *
  * \see marshal_init, marshal_header_short, marshal_header_long, marshal_measurements, marshal_values, marshal_finalize
+ * \see marshal_measurements2, marshal_values2, marshal_value2
+ * \see marshal_measurements_compact, unmarshal_measurements_compact
+ * \see marshal_batch_init, marshal_batch_row, marshal_batch_values, marshal_batch_finalize, unmarshal_batch_row
  */
 
 #define _GNU_SOURCE  /* For NAN */
@@ -213,6 +287,14 @@
 #define BOOL_T        0xE
 /** Marshalled data type for double, using IEEE 754 binary64 representation */
 #define DOUBLE64_T        0xF
+/** Marshalled data type for a OML_INT32_VALUE, as a zigzag varint */
+#define VINT32_T      0x10
+/** Marshalled data type for a OML_UINT32_VALUE, as a varint */
+#define VUINT32_T     0x11
+/** Marshalled data type for a OML_INT64_VALUE, as a zigzag varint */
+#define VINT64_T      0x12
+/** Marshalled data type for a OML_UINT64_VALUE, as a varint */
+#define VUINT64_T     0x13
 
 /** Synchronisation byte repeated twice before a new marshalled message */
 #define SYNC_BYTE 0xAA
@@ -220,9 +302,12 @@
 /** Size of short marshalled message headers (OMB_DATA_P); OMB_LDATA_P are 2 bytes longer */
 #define PACKET_HEADER_SIZE 5
 #define STREAM_HEADER_SIZE 2
+/** Size of the row count following the stream header in OMB_BATCH_P */
+#define BATCH_HEADER_SIZE 2
 
 #define LONG_T_SIZE       4
 #define DOUBLE_T_SIZE     5
+#define DOUBLE64_T_SIZE   8
 /** Marshalled strings are limited to 254 characters */
 #define STRING_T_MAX_SIZE 254
 #define INT32_T_SIZE      4
@@ -232,61 +317,23 @@
 #define BLOB_T_MAX_SIZE   UINT32_MAX
 #define GUID_T_SIZE       8
 #define VECTOR_T_SIZE     4
+/** Maximum size of a 64-bit LEB128 varint */
+#define VARINT_MAX_SIZE   10
+/** Zigzag-encode a signed 64-bit integer, so small magnitudes give small varints */
+#define ZIGZAG(v)   (((uint64_t)(v) << 1) ^ (uint64_t)((int64_t)(v) >> 63))
+/** Decode a zigzag-encoded integer */
+#define UNZIGZAG(v) ((int64_t)(((uint64_t)(v) >> 1) ^ -((uint64_t)(v) & 1)))
 
 #define MAX_STRING_LENGTH STRING_T_MAX_SIZE
 
 #define MIN_LENGTH 64
 
-/** Map from OML_*_VALUE types to protocol types.
- *
- * This array must be ordered identically to the conrete OmlValueT types in
- * oml/omlc.h. It is used for marshalling.
- *
- * \see OmlValueT, marshal_value, oml_size_map
- */
-static const int oml_type_map[] = {
-  DOUBLE_T,
-  LONG_T,
-  -1, /* OML_PADDING1_VALUE */
-  STRING_T,
-  INT32_T,
-  UINT32_T,
-  INT64_T,
-  UINT64_T,
-  BLOB_T,
-  GUID_T,
-  /* XXX: Booleans are marshalled differently */
-  /* XXX: Vectors are marshalled differently */
-};
-
-/** Map from OML_*_VALUE types to size of protocol types on the wire.
- *
- * This array must be ordered identically to the conrete OmlValueT types in
- * oml/omlc.h. It is used for marshalling.
- *
- * \see OmlValueT, marshal_value, oml_type_map
- */
-static const size_t oml_size_map[] = {
-  DOUBLE_T_SIZE,
-  LONG_T_SIZE,
-  -1, /* OML_PADDING1_VALUE */
-  STRING_T_MAX_SIZE,
-  INT32_T_SIZE,
-  UINT32_T_SIZE,
-  INT64_T_SIZE,
-  UINT64_T_SIZE,
-  BLOB_T_MAX_SIZE,
-  UINT64_T_SIZE, /* GUIDs are uint64s */
-  /* XXX: Booleans are marshalled differently */
-  /* XXX: Vectors are marshalled differently */
-};
-
 /** Map from OML_VECTOR_*_VALUE to vector element protocol types.
  *
  * This array must be ordered identically to the vector OmlValueT types in
  * oml/omlc.h. It is used for marshalling.
  *
- * \see OmlValueT, marshal_value, oml_type_map
+ * \see OmlValueT, marshal_value, encoders
  */
 static const uint8_t vector_protocol_map[] = {
   [OML_VECTOR_DOUBLE_VALUE] = DOUBLE64_T,
@@ -316,6 +363,11 @@ static const size_t protocol_type_map[] = {
   OML_UINT64_VALUE,
   OML_BLOB_VALUE,
   OML_GUID_VALUE,
+  OML_UNKNOWN_VALUE, // BOOL_FALSE_T
+  OML_UNKNOWN_VALUE, // BOOL_TRUE_T
+  OML_UNKNOWN_VALUE, // VECTOR_T
+  OML_UNKNOWN_VALUE, // BOOL_T
+  OML_DOUBLE_VALUE, // DOUBLE64_T
   /* XXX: Booleans are unmarshalled differently */
   /* XXX: Vectors are unmarshalled differently */
 };
@@ -339,6 +391,11 @@ static const size_t protocol_size_map[] = {
   UINT64_T_SIZE,
   BLOB_T_MAX_SIZE,
   UINT64_T_SIZE, /* GUIDs are uint64s */
+  -1, /* BOOL_FALSE_T */
+  -1, /* BOOL_TRUE_T */
+  -1, /* VECTOR_T */
+  -1, /* BOOL_T */
+  DOUBLE64_T_SIZE,
   /* XXX: Booleans are unmarshalled differently */
   /* XXX: Vectors are unmarshalled differently */
 };
@@ -378,15 +435,130 @@ uint8_t* find_sync (const uint8_t *buf, int len)
   return NULL;
 }
 
+/** Encode an unsigned integer as a LEB128 varint.
+ *
+ * \param buf buffer of at least VARINT_MAX_SIZE bytes to encode into
+ * \param v value to encode
+ * \return the number of bytes used in buf
+ * \see unmarshal_varint
+ */
+static size_t
+marshal_varint (uint8_t *buf, uint64_t v)
+{
+  size_t n = 0;
+  while (v >= 0x80) {
+    buf[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = (uint8_t)v;
+  return n;
+}
+
+/** Read a LEB128 varint from an MBuffer.
+ *
+ * \param mbuf MBuffer to read from
+ * \param v pointer to store the decoded value into
+ * \return 0 on success, -1 if there was not enough data or the varint was too long
+ * \see marshal_varint
+ */
+static int
+unmarshal_varint (MBuffer *mbuf, uint64_t *v)
+{
+  int b, shift = 0;
+  *v = 0;
+  do {
+    if (shift >= 7 * VARINT_MAX_SIZE || (b = mbuf_read_byte (mbuf)) == -1) {
+      return -1;
+    }
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return 0;
+}
+
+/** Convert a timestamp in microseconds into seconds.
+ *
+ * This is computed the same way as sample timestamps in the client, so both
+ * give exactly the same double.
+ *
+ * \param us timestamp in microseconds, positive
+ * \return the timestamp in seconds
+ * \see ts_to_usec
+ */
+static double
+usec_to_ts (int64_t us)
+{
+  return (double)(us / 1000000) + 0.000001 * (us % 1000000);
+}
+
+/** Convert a timestamp in seconds into microseconds, if it is exact.
+ *
+ * \param ts timestamp in seconds
+ * \param us pointer to store the timestamp in microseconds into
+ * \return 1 if usec_to_ts(*us) gives back exactly ts, 0 otherwise
+ * \see usec_to_ts
+ */
+static int
+ts_to_usec (double ts, int64_t *us)
+{
+  if (!(ts >= 0. && ts < 1e12) || signbit(ts)) {
+    return 0;
+  }
+  *us = llround(ts * 1e6);
+  return usec_to_ts(*us) == ts;
+}
+
+/** Marshal the seq-var and ts-var of a compact sample into buf.
+ *
+ * \param buf buffer to write into, of at least 2 * VARINT_MAX_SIZE + DOUBLE64_T_SIZE bytes
+ * \param seqno sample sequence number
+ * \param now sample time
+ * \param prev OmlBinStreamState of the stream, updated to this sample (can be NULL if absolute)
+ * \param absolute if non-zero, do not delta-encode against prev
+ * \return the number of bytes written
+ * \see marshal_measurements_compact, marshal_batch_row, \ref omspbincompact
+ */
+static size_t
+marshal_compact_row(uint8_t *buf, int seqno, double now,
+                    OmlBinStreamState *prev, int absolute)
+{
+  OmlBinStreamState zero = { 0, 0 };
+  const OmlBinStreamState *base = (absolute || !prev) ? &zero : prev;
+  size_t n = 0;
+  int64_t ts_us;
+  uint64_t nv64;
+
+  absolute = (base == &zero);
+
+  n += marshal_varint (&buf[n], ZIGZAG((int64_t)seqno - base->seqno) << 1 | absolute);
+  if (ts_to_usec (now, &ts_us)) {
+    n += marshal_varint (&buf[n], ZIGZAG(ts_us - base->ts_us) << 1);
+  } else {
+    ts_us = base->ts_us;
+    buf[n++] = 1;
+    memcpy (&nv64, &now, sizeof (nv64));
+    nv64 = htonll (nv64);
+    memcpy (&buf[n], &nv64, sizeof (nv64));
+    n += sizeof (nv64);
+  }
+
+  if (prev) {
+    prev->seqno = seqno;
+    prev->ts_us = ts_us;
+  }
+  return n;
+}
+
 /** Prepare a short marshalling header into an MBuffer.
  *
  * \param mbuf MBuffer to write the mbuf marshalling header to
+ * \param msgtype OmlBinMsgType of short packet (OMB_DATA_P or OMB_CDATA_P)
  * \return the 0 on success, -1 on failure (\see mbuf_write)
  */
-static int marshal_header_short (MBuffer *mbuf)
+static int marshal_header_short (MBuffer *mbuf, OmlBinMsgType msgtype)
 {
   uint8_t buf[] = {
-    SYNC_BYTE, SYNC_BYTE, OMB_DATA_P, 0, 0
+    SYNC_BYTE, SYNC_BYTE, (uint8_t)msgtype, 0, 0
   };
   return mbuf_write (mbuf, buf, LENGTH (buf));
 }
@@ -394,12 +566,13 @@ static int marshal_header_short (MBuffer *mbuf)
 /** Prepare a long marshalling header into an MBuffer.
  *
  * \param mbuf MBuffer to write the mbuf marshalling header to
+ * \param msgtype OmlBinMsgType of long packet (OMB_LDATA_P or OMB_LCDATA_P)
  * \return the 0 on success, -1 on failure (\see mbuf_write)
  */
-static int marshal_header_long (MBuffer *mbuf)
+static int marshal_header_long (MBuffer *mbuf, OmlBinMsgType msgtype)
 {
   uint8_t buf[] = {
-    SYNC_BYTE, SYNC_BYTE, OMB_LDATA_P, 0, 0, 0, 0
+    SYNC_BYTE, SYNC_BYTE, (uint8_t)msgtype, 0, 0, 0, 0
   };
   return mbuf_write (mbuf, buf, LENGTH (buf));
 }
@@ -420,7 +593,9 @@ marshal_get_msgtype (MBuffer *mbuf)
  *
  * Two basic types (OmlBinMsgType) of packets are available, short and long.
  * Short packets (OMB_DATA_P) can contain up to UINT16_MAX, whislt long packets
- * (OMB_LDATA_P) extend this to UINT32_MAX.
+ * (OMB_LDATA_P) extend this to UINT32_MAX. The same goes for compact packets
+ * (OMB_CDATA_P and OMB_LCDATA_P) and batch packets (OMB_BATCH_P and
+ * OMB_LBATCH_P).
  *
  * Packets headers start with two SYNC_BYTEs (0xAA), then the packet type
  * (OMB_DATA_P or OMB_LDATA_P).
@@ -452,8 +627,16 @@ marshal_init(MBuffer *mbuf, OmlBinMsgType msgtype)
   }
 
   switch (msgtype) {
-  case OMB_DATA_P:  result = marshal_header_short (mbuf); break;
-  case OMB_LDATA_P: result = marshal_header_long (mbuf); break;
+  case OMB_DATA_P:
+  case OMB_CDATA_P:
+  case OMB_BATCH_P:
+    result = marshal_header_short (mbuf, msgtype);
+    break;
+  case OMB_LDATA_P:
+  case OMB_LCDATA_P:
+  case OMB_LBATCH_P:
+    result = marshal_header_long (mbuf, msgtype);
+    break;
   }
 
   if (result == -1) {
@@ -486,6 +669,23 @@ marshal_init(MBuffer *mbuf, OmlBinMsgType msgtype)
  */
 int
 marshal_measurements(MBuffer* mbuf, int stream, int seqno, double now)
+{
+  return marshal_measurements2(mbuf, stream, seqno, now, OMB_DOUBLE64_PROTOCOL - 1);
+}
+
+/** Marshal meta-data for an OML measurement stream's sample for a specific
+ * protocol version.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param stream Measurement Stream's index
+ * \param seqno message sequence number
+ * \param now message time
+ * \param protocol OMSP version to marshal for
+ * \return 1 if successful, -1 otherwise
+ * \see marshal_measurements, marshal_value2
+ */
+int
+marshal_measurements2(MBuffer* mbuf, int stream, int seqno, double now, int protocol)
 {
   OmlValueU v;
   uint8_t s[2] = { 0, (uint8_t)stream };
@@ -506,11 +706,193 @@ marshal_measurements(MBuffer* mbuf, int stream, int seqno, double now)
   marshal_value(mbuf, OML_INT32_VALUE, &v);
 
   omlc_set_double(v, now);
-  marshal_value(mbuf, OML_DOUBLE_VALUE, &v);
+  marshal_value2(mbuf, OML_DOUBLE_VALUE, &v, protocol);
+
+  return 1;
+}
+
+/** Marshal meta-data for an OML measurement stream's sample in a compact
+ * packet.
+ *
+ * The packet should have been prepared with marshal_init() as an OMB_CDATA_P
+ * or OMB_LCDATA_P. The sequence number and timestamp are delta-encoded against
+ * prev, which is then updated to this sample. If the receiver may not have
+ * seen the packet prev was last updated with, the sample must be marshalled
+ * as absolute, by passing absolute=1.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param stream Measurement Stream's index
+ * \param seqno message sequence number
+ * \param now message time
+ * \param prev OmlBinStreamState of the stream, updated to this sample (can be NULL if absolute)
+ * \param absolute if non-zero, do not delta-encode against prev
+ * \return 1 if successful, -1 otherwise
+ * \see marshal_init, unmarshal_measurements_compact, \ref omspbincompact
+ */
+int
+marshal_measurements_compact(MBuffer* mbuf, int stream, int seqno, double now,
+                             OmlBinStreamState *prev, int absolute)
+{
+  uint8_t buf[2 + 2 * VARINT_MAX_SIZE + DOUBLE64_T_SIZE] = { 0, (uint8_t)stream };
+  size_t n = 2;
+
+  logdebug("Marshalling compact sample %d for stream %d\n", seqno, stream);
+
+  n += marshal_compact_row (&buf[n], seqno, now, prev, absolute);
+
+  if (mbuf_write (mbuf, buf, n) == -1) {
+    logerror("Unable to marshal compact sample metadata (mbuf_write())\n");
+    mbuf_reset_write (mbuf);
+    return -1;
+  }
+
+  return 1;
+}
+
+/** Marshal the stream header of a batch packet.
+ *
+ * The packet should have been prepared with marshal_init() as an OMB_BATCH_P
+ * or OMB_LBATCH_P. Rows can then be added with marshal_batch_row() and
+ * marshal_batch_values(), each followed by a call to
+ * marshal_batch_finalize().
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param stream Measurement Stream's index
+ * \return 1 if successful, -1 otherwise
+ * \see marshal_init, marshal_batch_row, marshal_batch_finalize, \ref omspbinbatch
+ */
+int
+marshal_batch_init(MBuffer* mbuf, int stream)
+{
+  /* Write num-meas and num-rows (0, for now), and the stream index */
+  uint8_t buf[STREAM_HEADER_SIZE + BATCH_HEADER_SIZE] = { 0, (uint8_t)stream, 0, 0 };
+
+  if (mbuf_write (mbuf, buf, LENGTH (buf)) == -1) {
+    logerror("Unable to marshal batch stream header (mbuf_write())\n");
+    mbuf_reset_write (mbuf);
+    return -1;
+  }
+
+  return 1;
+}
+
+/** Marshal the sequence number and timestamp of a new row in a batch packet.
+ *
+ * The row is delta-encoded against prev, which is then updated to this row,
+ * as with marshal_measurements_compact(). A row can be added to a batch packet
+ * already finalised with marshal_batch_finalize(), as long as it is still the
+ * last data in mbuf; mbuf_begin_write() must have been called since, so a
+ * failure only resets the new row.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param seqno row sequence number
+ * \param now row time
+ * \param prev OmlBinStreamState of the stream, updated to this row (can be NULL if absolute)
+ * \param absolute if non-zero, do not delta-encode against prev
+ * \return 1 if successful, -1 otherwise
+ * \see marshal_batch_init, marshal_batch_values, marshal_batch_finalize
+ */
+int
+marshal_batch_row(MBuffer* mbuf, int seqno, double now,
+                  OmlBinStreamState *prev, int absolute)
+{
+  uint8_t buf[2 * VARINT_MAX_SIZE + DOUBLE64_T_SIZE];
+  size_t n = marshal_compact_row (buf, seqno, now, prev, absolute);
+
+  if (mbuf_write (mbuf, buf, n) == -1) {
+    logerror("Unable to marshal batch row metadata (mbuf_write())\n");
+    mbuf_reset_write (mbuf);
+    return -1;
+  }
+
+  return 1;
+}
+
+/** Marshal the values of a row in a batch packet.
+ *
+ * Unlike marshal_values2(), this does not update the packet header; this is
+ * done by marshal_batch_finalize().
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param values array of OmlValue of length value_count
+ * \param value_count length  the values array
+ * \param protocol OMSP version to marshal for
+ * \return 1 on success, or -1 otherwise (the row has been reset)
+ * \see marshal_batch_row, marshal_batch_finalize, marshal_value2
+ */
+int
+marshal_batch_values(MBuffer* mbuf, OmlValue* values, int value_count, int protocol)
+{
+  OmlValue* val = values;
+  int i;
 
+  for (i = 0; i < value_count; i++, val++) {
+    if(!marshal_value2(mbuf, oml_value_get_type(val), oml_value_get_value(val), protocol))
+      return -1;
+  }
   return 1;
 }
 
+/** Account for a new row in a batch packet.
+ *
+ * The row count and length of the batch packet starting at offset in mbuf are
+ * updated to include all data up to the write pointer, and the number of
+ * values per row is set. If the packet becomes too long for a short header,
+ * it is promoted to an OMB_LBATCH_P.
+ *
+ * \param mbuf MBuffer where marshalled data is
+ * \param offset offset of the batch packet in mbuf (\see mbuf_message_offset)
+ * \param value_count number of values in each row
+ * \return the new number of rows in the packet, or -1 if it cannot contain any more
+ * \see marshal_batch_init, marshal_batch_row, marshal_finalize
+ */
+int
+marshal_batch_finalize(MBuffer* mbuf, size_t offset, int value_count)
+{
+  uint8_t* buf = mbuf_buffer (mbuf) + offset;
+  size_t len = mbuf_write_offset (mbuf) - offset;
+  size_t hdr = (buf[2] == OMB_BATCH_P) ? PACKET_HEADER_SIZE : PACKET_HEADER_SIZE + 2;
+  uint16_t nrows16;
+  uint32_t nlen32;
+
+  memcpy (&nrows16, &buf[hdr + STREAM_HEADER_SIZE], sizeof (nrows16));
+  nrows16 = ntohs (nrows16);
+  if (UINT16_MAX == nrows16 || len > UINT32_MAX) {
+    logerror("Batch packet cannot contain more rows\n");
+    return -1;
+  }
+
+  if (buf[2] == OMB_BATCH_P && len > UINT16_MAX) {
+    /* As in marshal_finalize, shift everything down by 2 bytes, making sure
+     * the buffer has room first */
+    uint8_t s[2] = {0};
+    if (mbuf_write (mbuf, s, sizeof (s)) == -1) {
+      logerror("Unable to promote batch packet to a long packet (mbuf_write())\n");
+      return -1;
+    }
+    buf = mbuf_buffer (mbuf) + offset;
+    memmove (&buf[PACKET_HEADER_SIZE+2], &buf[PACKET_HEADER_SIZE],
+             len - PACKET_HEADER_SIZE);
+    len += 2;
+    buf[2] = OMB_LBATCH_P;
+    hdr += 2;
+  }
+
+  buf[hdr] = (uint8_t)value_count;
+  nrows16 = htons (nrows16 + 1);
+  memcpy (&buf[hdr + STREAM_HEADER_SIZE], &nrows16, sizeof (nrows16));
+
+  if (buf[2] == OMB_BATCH_P) {
+    uint16_t nlen16 = htons (len - hdr);
+    memcpy (&buf[3], &nlen16, sizeof (nlen16));
+  } else {
+    nlen32 = htonl (len - hdr);
+    memcpy (&buf[3], &nlen32, sizeof (nlen32));
+  }
+
+  return ntohs (nrows16);
+}
+
 /** Marshal the array of values into an MBuffer.
  *
  * Metadata of the measurement stream should already have been written
@@ -526,6 +908,9 @@ marshal_measurements(MBuffer* mbuf, int stream, int seqno, double now)
  * marshal_init(), after the MBuffer has been adequately resized or
  * repacked.
  *
+ * Values are marshalled using the OMSPv5 encoding; use marshal_values2() to
+ * select another protocol version.
+ *
  * Once all data has been marshalled, marshal_finalize() should be
  * called to finish preparing the message.
  *
@@ -537,20 +922,50 @@ marshal_measurements(MBuffer* mbuf, int stream, int seqno, double now)
  */
 int marshal_values(MBuffer* mbuf, OmlValue* values, int value_count)
 {
-  OmlValue* val = values;
-  int i;
+  return marshal_values2(mbuf, values, value_count, OMB_DOUBLE64_PROTOCOL - 1);
+}
 
-  for (i = 0; i < value_count; i++, val++) {
-    if(!marshal_value(mbuf, oml_value_get_type(val), oml_value_get_value(val)))
-      return -1;
+/** Update the value count in the header of the message being marshalled.
+ *
+ * Batch packets are updated by marshal_batch_finalize instead.
+ *
+ * \param mbuf MBuffer where the message is being marshalled
+ * \param value_count number of values just marshalled
+ */
+static void
+marshal_count_values(MBuffer* mbuf, int value_count)
+{
+  uint8_t* buf = mbuf_message (mbuf);
+  switch (marshal_get_msgtype (mbuf)) {
+  case OMB_DATA_P:
+  case OMB_CDATA_P:
+    buf[5] += value_count;
+    break;
+  case OMB_LDATA_P:
+  case OMB_LCDATA_P:
+    buf[7] += value_count;
+    break;
+  default:
+    break;
   }
+}
 
-  uint8_t* buf = mbuf_message (mbuf);
-  OmlBinMsgType type = marshal_get_msgtype (mbuf);
-  switch (type) {
-  case OMB_DATA_P: buf[5] += value_count; break;
-  case OMB_LDATA_P: buf[7] += value_count; break;
+/** Marshal the array of values into an MBuffer for a specific protocol version.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param values array of OmlValue of length value_count
+ * \param value_count length  the values array
+ * \param protocol OMSP version to marshal for
+ * \return 1 on success, or -1 otherwise (marshalling should then restart from marshal_init())
+ * \see marshal_values, marshal_value2
+ */
+int marshal_values2(MBuffer* mbuf, OmlValue* values, int value_count, int protocol)
+{
+  if (marshal_batch_values(mbuf, values, value_count, protocol) == -1) {
+    return -1;
   }
+
+  marshal_count_values (mbuf, value_count);
   return 1;
 }
 
@@ -569,276 +984,613 @@ int marshal_values(MBuffer* mbuf, OmlValue* values, int value_count)
 int
 marshal_value(MBuffer* mbuf, OmlValueT val_type, OmlValueU* val)
 {
-  switch (val_type) {
-  case OML_LONG_VALUE: {
-    long v = oml_value_clamp_long (omlc_get_long(*val));
-    uint32_t uv = (uint32_t)v;
-    uint32_t nv = htonl(uv);
-    uint8_t buf[LONG_T_SIZE+1];
+  return marshal_value2(mbuf, val_type, val, OMB_DOUBLE64_PROTOCOL - 1);
+}
 
-    buf[0] = LONG_T;
-    memcpy(&buf[1], &nv, sizeof (nv));
+/** Encode one value at buf, which must have enough room for it.
+ *
+ * \param buf buffer to write the marshalled value into
+ * \param val pointer to the OmlValueU to marshal
+ * \return a pointer to the first byte after the marshalled value
+ * \see MarshalEncoder
+ */
+typedef uint8_t* (*marshal_encode_fn)(uint8_t *buf, const OmlValueU *val);
+
+/** How to marshal values of a given type for a given protocol version */
+typedef struct MarshalEncoder {
+  /** Function writing a value */
+  marshal_encode_fn encode;
+  /** Maximum size of a marshalled value, or 0 if it depends on the value */
+  size_t max_size;
+  /** Function returning the size of a marshalled value, for those of variable size */
+  size_t (*size)(const OmlValueU *val);
+} MarshalEncoder;
+
+/** A precompiled sequence of MarshalEncoders for the rows of one schema \see marshal_plan_new */
+struct MarshalPlan {
+  /** OMSP version the plan marshals for */
+  int protocol;
+  /** Number of fields in the schema */
+  int count;
+  /** Types of the fields */
+  OmlValueT *types;
+  /** MarshalEncoder of each field */
+  const MarshalEncoder **encoders;
+  /** fixed[i] is the maximum size of the fixed-size fields before field i (count+1 elements) */
+  size_t *fixed;
+  /** Indices of the variable-size fields */
+  int *variable;
+  /** Number of elements in variable */
+  int nvariable;
+};
 
-    logdebug3("Marshalling long %ld\n", nv);
-    int result = mbuf_write (mbuf, buf, LENGTH (buf));
-    if (result == -1) {
-      logerror("Failed to marshal OML_LONG_VALUE (mbuf_write())\n");
-      mbuf_reset_write (mbuf);
-      return 0;
-    }
-    break;
-  }
-  case OML_INT32_VALUE:
-  case OML_UINT32_VALUE:
-  case OML_INT64_VALUE:
-  case OML_UINT64_VALUE: {
-    uint8_t buf[UINT64_T_SIZE+1]; // Max integer size
-    uint32_t uv32;
-    uint32_t nv32;
-    uint64_t uv64;
-    uint64_t nv64;
-    uint8_t *p_nv;
+/** Marshal a 32-bit integer with the given protocol type */
+static inline uint8_t*
+encode_fixed32 (uint8_t *buf, uint8_t type, uint32_t v)
+{
+  uint32_t nv = htonl (v);
+  buf[0] = type;
+  memcpy (&buf[1], &nv, sizeof (nv));
+  return buf + 1 + sizeof (nv);
+}
 
-    if (oml_size_map[val_type] == 4)
-    {
-      uv32 = omlc_get_uint32(*val);
-      nv32 = htonl(uv32);
-      p_nv = (uint8_t*)&nv32;
-      logdebug3("Marshalling %s %" PRIu32 "\n", oml_type_to_s(val_type), uv32);
-    } else {
-      uv64 = omlc_get_uint64(*val);
-      nv64 = htonll(uv64);
-      p_nv = (uint8_t*)&nv64;
-      logdebug3("Marshalling %s %" PRIu64 "\n", oml_type_to_s(val_type), uv64);
-    }
+/** Marshal a 64-bit integer with the given protocol type */
+static inline uint8_t*
+encode_fixed64 (uint8_t *buf, uint8_t type, uint64_t v)
+{
+  uint64_t nv = htonll (v);
+  buf[0] = type;
+  memcpy (&buf[1], &nv, sizeof (nv));
+  return buf + 1 + sizeof (nv);
+}
 
-    buf[0] = oml_type_map[val_type];
-    memcpy(&buf[1], p_nv, oml_size_map[val_type]);
+/** Marshal a varint with the given protocol type */
+static inline uint8_t*
+encode_varint (uint8_t *buf, uint8_t type, uint64_t v)
+{
+  buf[0] = type;
+  return buf + 1 + marshal_varint (&buf[1], v);
+}
 
-    int result = mbuf_write (mbuf, buf, oml_size_map[val_type] + 1);
-    if (result == -1)
-      {
-        logerror("Failed to marshal %s value (mbuf_write())\n",
-               oml_type_to_s (val_type));
-        mbuf_reset_write (mbuf);
-        return 0;
-      }
-    break;
-  }
-  case OML_DOUBLE_VALUE: {
-    uint8_t type = DOUBLE_T;
-    double v = omlc_get_double(*val);
-    int exp;
-    double mant = frexp(v, &exp);
-    int8_t nexp = (int8_t)exp;
-    logdebug3("Marshalling double %f\n", v);
-    if (isnan(v)) {
-      type = DOUBLE_NAN;
-      nexp = 0;
-      mant = 0;
-    } else if (nexp != exp) {
-      logerror("Double number '%lf' is out of bounds, sending NaN\n", v);
-      type = DOUBLE_NAN;
-      nexp = 0;
-      mant = 0;
-   }
-   int32_t imant = (int32_t)(mant * (1 << BIG_L));
-   uint32_t nmant = htonl(imant);
-
-   uint8_t buf[6] = { type, 0, 0, 0, 0, nexp };
-
-   memcpy(&buf[1], &nmant, sizeof (nmant));
-
-   int result = mbuf_write (mbuf, buf, LENGTH (buf));
-
-   if (result == -1)
-     {
-       logerror("Failed to marshal OML_DOUBLE_VALUE (mbuf_write())\n");
-       mbuf_reset_write (mbuf);
-       return 0;
-     }
-   break;
- }
- case OML_STRING_VALUE: {
-   char* str = omlc_get_string_ptr(*val);
-
-   if (str == NULL) {
-     str = "";
-     logdebug("Attempting to send a NULL string; sending empty string instead\n");
-   }
-
-   size_t len = strlen(str);
-   if (len > STRING_T_MAX_SIZE) {
-     logerror("Truncated string '%s'\n", str);
-     len = STRING_T_MAX_SIZE;
-   }
-
-   logdebug3("Marshalling string '%s' of length %d\n", str, len);
-   uint8_t buf[2] = { STRING_T, (uint8_t)(len & 0xff) };
-   int result = mbuf_write (mbuf, buf, LENGTH (buf));
-   if (result == -1) {
-     logerror("Failed to marshal OML_STRING_VALUE type and length (mbuf_write())\n");
-     mbuf_reset_write (mbuf);
-     return 0;
-   }
-
-   result = mbuf_write (mbuf, (uint8_t*)str, len);
-
-   if (result == -1)
-     {
-       logerror("Failed to marshal OML_STRING_VALUE (mbuf_write())\n");
-       mbuf_reset_write (mbuf);
-       return 0;
-     }
-   break;
- }
- case OML_BLOB_VALUE: {
-   int result = 0;
-   void *blob = omlc_get_blob_ptr(*val);
-   size_t length = omlc_get_blob_length(*val);
-   if (blob == NULL || length == 0) {
-     logdebug ("Attempting to send NULL or empty blob; blob of length 0 will be sent\n");
-     length = 0;
-   }
-
-   uint8_t buf[5] = { BLOB_T, 0, 0, 0, 0 };
-   size_t n_length = htonl (length);
-   memcpy (&buf[1], &n_length, 4);
-
-   logdebug3("Marshalling blob of size %d\n", length);
-   result = mbuf_write (mbuf, buf, sizeof (buf));
-
-   if (result == -1) {
-     logerror ("Failed to marshall OML_BLOB_VALUE type and length (mbuf_write())\n");
-     mbuf_reset_write (mbuf);
-     return 0;
-   }
-
-   result = mbuf_write (mbuf, blob, length);
-
-   if (result == -1) {
-     logerror ("Failed to marshall %d bytes of OML_BLOB_VALUE data\n", length);
-     mbuf_reset_write (mbuf);
-     return 0;
-   }
-   break;
- }
-
-  case OML_GUID_VALUE: {
-    /* FIXME: Wrap with UINT64 marshalling, just change the type */
-    uint64_t nv64;
-    uint8_t buf[GUID_T_SIZE+1];
-    buf[0] = GUID_T;
-    nv64 = htonll(omlc_get_guid(*val));
-    memcpy(&buf[1], &nv64, sizeof(nv64));
-    logdebug3("Marshalling GUID %" PRIu64 "\n", nv64);
-    if (-1 == mbuf_write(mbuf, buf, LENGTH(buf))) {
-      logerror("Failed to marshal OML_GUID_VALUE (mbuf_write())\n");
-      mbuf_reset_write(mbuf);
-      return 0;
-    }
-    break;
-  }
+static uint8_t*
+encode_long (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_fixed32 (buf, LONG_T, (uint32_t)oml_value_clamp_long (omlc_get_long (*val)));
+}
 
-  case OML_BOOL_VALUE: {
-    uint8_t buf;
-    if (!omlc_get_bool(*val)) {
-      buf = BOOL_FALSE_T;
-    } else {
-      buf = BOOL_TRUE_T;
-    }
-    logdebug3("Marshalling boolean %d\n", BOOL_TRUE_T == buf);
-    if (-1 == mbuf_write(mbuf, &buf, 1)) {
-      logerror("Failed to marshal OML_BOOL_VALUE (mbuf_write())\n");
-      mbuf_reset_write(mbuf);
-      return 0;
-    }
-    break;
-  }
+static uint8_t*
+encode_int32 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_fixed32 (buf, INT32_T, omlc_get_uint32 (*val));
+}
 
-  case OML_VECTOR_INT32_VALUE:
-  case OML_VECTOR_UINT32_VALUE: {
-    size_t i;
-    uint8_t buf[VECTOR_T_SIZE] = { VECTOR_T, 0, 0, 0 };
-    uint16_t hn = omlc_get_vector_nof_elts(*val);
-    uint16_t nn = htons(hn);
-    buf[1] = vector_protocol_map[val_type];
-    memcpy(&buf[2], &nn, sizeof(nn));
-    if(mbuf_write(mbuf, buf, VECTOR_T_SIZE) == 0) {
-      uint32_t elts[hn];
-      uint32_t *v = omlc_get_vector_ptr(*val);
-      for(i = 0; i < hn; i++)
-        elts[i] = htonl(*((uint32_t*)(v+i)));
-      if(mbuf_write(mbuf, (const uint8_t*)(elts), sizeof(elts)) == -1) {
-        logerror("%s(): failed to marshal %s of size %" PRIu16 " (mbuf_write())\n", __func__, oml_type_to_s(val_type), hn);
-        mbuf_reset_write(mbuf);
-        return 0;
-      }
-    } else {
-      logerror("%s(): failed to marshal %s length (mbuf_write())\n", __func__, oml_type_to_s(val_type));
-      mbuf_reset_write(mbuf);
-      return 0;
-    }
-    break;
-  }
+static uint8_t*
+encode_uint32 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_fixed32 (buf, UINT32_T, omlc_get_uint32 (*val));
+}
 
-  case OML_VECTOR_INT64_VALUE:
-  case OML_VECTOR_UINT64_VALUE:
-  case OML_VECTOR_DOUBLE_VALUE: {
-    size_t i;
-    uint8_t buf[VECTOR_T_SIZE] = { VECTOR_T, 0, 0, 0 };
-    uint16_t hn = omlc_get_vector_nof_elts(*val);
-    uint16_t nn = htons(hn);
-    buf[1] = vector_protocol_map[val_type];
-    memcpy(&buf[2], &nn, sizeof(nn));
-    if(mbuf_write(mbuf, buf, VECTOR_T_SIZE) == 0) {
-      uint64_t elts[hn];
-      uint64_t *v = omlc_get_vector_ptr(*val);
-      for(i = 0; i < hn; i++)
-        elts[i] = htonll(*((uint64_t*)(v+i)));
-      if(mbuf_write(mbuf, (const uint8_t*)(elts), sizeof(elts)) == -1) {
-        logerror("%s(): failed to marshal %s of size %" PRIu16 " (mbuf_write())\n", __func__, oml_type_to_s(val_type), hn);
-        mbuf_reset_write(mbuf);
-        return 0;
-      }
-    } else {
-      logerror("%s(): failed to marshal %s length (mbuf_write())\n", __func__, oml_type_to_s(val_type));
-      mbuf_reset_write(mbuf);
-        return 0;
-    }
-    break;
+static uint8_t*
+encode_int64 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_fixed64 (buf, INT64_T, omlc_get_uint64 (*val));
+}
+
+static uint8_t*
+encode_uint64 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_fixed64 (buf, UINT64_T, omlc_get_uint64 (*val));
+}
+
+static uint8_t*
+encode_guid (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_fixed64 (buf, GUID_T, omlc_get_guid (*val));
+}
+
+static uint8_t*
+encode_vlong (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_varint (buf, VINT32_T, ZIGZAG (oml_value_clamp_long (omlc_get_long (*val))));
+}
+
+static uint8_t*
+encode_vint32 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_varint (buf, VINT32_T, ZIGZAG (omlc_get_int32 (*val)));
+}
+
+static uint8_t*
+encode_vuint32 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_varint (buf, VUINT32_T, omlc_get_uint32 (*val));
+}
+
+static uint8_t*
+encode_vint64 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_varint (buf, VINT64_T, ZIGZAG (omlc_get_int64 (*val)));
+}
+
+static uint8_t*
+encode_vuint64 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_varint (buf, VUINT64_T, omlc_get_uint64 (*val));
+}
+
+static uint8_t*
+encode_double64 (uint8_t *buf, const OmlValueU *val)
+{
+  uint64_t v64;
+  double v = omlc_get_double (*val);
+  memcpy (&v64, &v, sizeof (v64));
+  return encode_fixed64 (buf, DOUBLE64_T, v64);
+}
+
+/** Marshal a double as a 32-bit mantissa and an 8-bit exponent (\ref DOUBLE_T) */
+static uint8_t*
+encode_double (uint8_t *buf, const OmlValueU *val)
+{
+  uint8_t type = DOUBLE_T;
+  double v = omlc_get_double (*val);
+  int exp;
+  double mant = frexp (v, &exp);
+  int8_t nexp = (int8_t)exp;
+  if (isnan (v)) {
+    type = DOUBLE_NAN;
+    nexp = 0;
+    mant = 0;
+  } else if (nexp != exp) {
+    logerror("Double number '%lf' is out of bounds, sending NaN\n", v);
+    type = DOUBLE_NAN;
+    nexp = 0;
+    mant = 0;
   }
+  int32_t imant = (int32_t)(mant * (1 << BIG_L));
+  uint32_t nmant = htonl (imant);
 
-  case OML_VECTOR_BOOL_VALUE: {
-    size_t i;
-    uint8_t buf[VECTOR_T_SIZE] = { VECTOR_T, 0, 0, 0 };
-    uint16_t hn = omlc_get_vector_nof_elts(*val);
-    uint16_t nn = htons(hn);
-    buf[1] = vector_protocol_map[val_type];
-    memcpy(&buf[2], &nn, sizeof(nn));
-    if(mbuf_write(mbuf, buf, VECTOR_T_SIZE) == 0) {
-      uint8_t elts[hn];
-      bool *v = omlc_get_vector_ptr(*val);
-      for(i = 0; i < hn; i++)
-        elts[i] = v[i] ? BOOL_TRUE_T : BOOL_FALSE_T;
-      if(mbuf_write(mbuf, (const uint8_t*)(elts), hn) == -1) {
-        logerror("%s(): failed to marshal %s of size %" PRIu16 " (mbuf_write())\n", __func__, oml_type_to_s(val_type), hn);
-        mbuf_reset_write(mbuf);
-        return 0;
-      }
-    } else {
-      logerror("%s(): failed to marshal %s length (mbuf_write())\n", __func__, oml_type_to_s(val_type));
-      mbuf_reset_write(mbuf);
-      return 0;
-    }
-    break;
+  buf[0] = type;
+  memcpy (&buf[1], &nmant, sizeof (nmant));
+  buf[5] = nexp;
+  return buf + DOUBLE_T_SIZE + 1;
+}
+
+static uint8_t*
+encode_bool (uint8_t *buf, const OmlValueU *val)
+{
+  buf[0] = omlc_get_bool (*val) ? BOOL_TRUE_T : BOOL_FALSE_T;
+  return buf + 1;
+}
+
+/** Get the string to marshal, and its (possibly truncated) length */
+static inline const char*
+string_value (const OmlValueU *val, size_t *len)
+{
+  const char *str = omlc_get_string_ptr (*val);
+  if (str == NULL) {
+    str = "";
   }
+  *len = strlen (str);
+  if (*len > STRING_T_MAX_SIZE) {
+    *len = STRING_T_MAX_SIZE;
+  }
+  return str;
+}
 
-  default:
+static size_t
+size_string (const OmlValueU *val)
+{
+  size_t len;
+  string_value (val, &len);
+  return 2 + len;
+}
+
+static uint8_t*
+encode_string (uint8_t *buf, const OmlValueU *val)
+{
+  size_t len;
+  const char *str = string_value (val, &len);
+  if (str != omlc_get_string_ptr (*val)) {
+    logdebug("Attempting to send a NULL string; sending empty string instead\n");
+  } else if (str[len]) {
+    logerror("Truncated string '%s'\n", str);
+  }
+  buf[0] = STRING_T;
+  buf[1] = (uint8_t)(len & 0xff);
+  memcpy (&buf[2], str, len);
+  return buf + 2 + len;
+}
+
+/** Get the length of the blob to marshal, 0 if it has no data */
+static inline size_t
+blob_length (const OmlValueU *val)
+{
+  return omlc_get_blob_ptr (*val) ? omlc_get_blob_length (*val) : 0;
+}
+
+static size_t
+size_blob (const OmlValueU *val)
+{
+  return 5 + blob_length (val);
+}
+
+static uint8_t*
+encode_blob (uint8_t *buf, const OmlValueU *val)
+{
+  size_t length = blob_length (val);
+  uint32_t n_length = htonl (length);
+  if (length == 0) {
+    logdebug ("Attempting to send NULL or empty blob; blob of length 0 will be sent\n");
+  }
+  buf[0] = BLOB_T;
+  memcpy (&buf[1], &n_length, sizeof (n_length));
+  if (length > 0) {
+    memcpy (&buf[5], omlc_get_blob_ptr (*val), length);
+  }
+  return buf + 5 + length;
+}
+
+/** Marshal the header of a vector, and return a pointer to where its elements go */
+static inline uint8_t*
+encode_vector_header (uint8_t *buf, uint8_t type, uint16_t nof_elts)
+{
+  uint16_t nn = htons (nof_elts);
+  buf[0] = VECTOR_T;
+  buf[1] = type;
+  memcpy (&buf[2], &nn, sizeof (nn));
+  return buf + VECTOR_T_SIZE;
+}
+
+static size_t
+size_vector32 (const OmlValueU *val)
+{
+  return VECTOR_T_SIZE + sizeof (uint32_t) * omlc_get_vector_nof_elts (*val);
+}
+
+/** Marshal a vector of 32-bit elements */
+static inline uint8_t*
+encode_vector32 (uint8_t *buf, const OmlValueU *val, OmlValueT type)
+{
+  uint16_t i, n = omlc_get_vector_nof_elts (*val);
+  const uint32_t *v = omlc_get_vector_ptr (*val);
+  buf = encode_vector_header (buf, vector_protocol_map[type], n);
+  for (i = 0; i < n; i++, buf += sizeof (uint32_t)) {
+    uint32_t nv = htonl (v[i]);
+    memcpy (buf, &nv, sizeof (nv));
+  }
+  return buf;
+}
+
+static uint8_t*
+encode_vector_int32 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_vector32 (buf, val, OML_VECTOR_INT32_VALUE);
+}
+
+static uint8_t*
+encode_vector_uint32 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_vector32 (buf, val, OML_VECTOR_UINT32_VALUE);
+}
+
+static size_t
+size_vector64 (const OmlValueU *val)
+{
+  return VECTOR_T_SIZE + sizeof (uint64_t) * omlc_get_vector_nof_elts (*val);
+}
+
+/** Marshal a vector of 64-bit elements */
+static inline uint8_t*
+encode_vector64 (uint8_t *buf, const OmlValueU *val, OmlValueT type)
+{
+  uint16_t i, n = omlc_get_vector_nof_elts (*val);
+  const uint64_t *v = omlc_get_vector_ptr (*val);
+  buf = encode_vector_header (buf, vector_protocol_map[type], n);
+  for (i = 0; i < n; i++, buf += sizeof (uint64_t)) {
+    uint64_t nv = htonll (v[i]);
+    memcpy (buf, &nv, sizeof (nv));
+  }
+  return buf;
+}
+
+static uint8_t*
+encode_vector_int64 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_vector64 (buf, val, OML_VECTOR_INT64_VALUE);
+}
+
+static uint8_t*
+encode_vector_uint64 (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_vector64 (buf, val, OML_VECTOR_UINT64_VALUE);
+}
+
+static uint8_t*
+encode_vector_double (uint8_t *buf, const OmlValueU *val)
+{
+  return encode_vector64 (buf, val, OML_VECTOR_DOUBLE_VALUE);
+}
+
+static size_t
+size_vector_bool (const OmlValueU *val)
+{
+  return VECTOR_T_SIZE + omlc_get_vector_nof_elts (*val);
+}
+
+static uint8_t*
+encode_vector_bool (uint8_t *buf, const OmlValueU *val)
+{
+  uint16_t i, n = omlc_get_vector_nof_elts (*val);
+  const bool *v = omlc_get_vector_ptr (*val);
+  buf = encode_vector_header (buf, vector_protocol_map[OML_VECTOR_BOOL_VALUE], n);
+  for (i = 0; i < n; i++) {
+    buf[i] = v[i] ? BOOL_TRUE_T : BOOL_FALSE_T;
+  }
+  return buf + n;
+}
+
+/** MarshalEncoders for each OmlValueT, up to \ref OMB_DOUBLE64_PROTOCOL - 1
+ * \see marshal_encoder */
+static const MarshalEncoder encoders[OML_LAST_VALUE] = {
+  [OML_DOUBLE_VALUE]        = { encode_double, DOUBLE_T_SIZE + 1, NULL },
+  [OML_LONG_VALUE]          = { encode_long, LONG_T_SIZE + 1, NULL },
+  [OML_STRING_VALUE]        = { encode_string, 0, size_string },
+  [OML_INT32_VALUE]         = { encode_int32, INT32_T_SIZE + 1, NULL },
+  [OML_UINT32_VALUE]        = { encode_uint32, UINT32_T_SIZE + 1, NULL },
+  [OML_INT64_VALUE]         = { encode_int64, INT64_T_SIZE + 1, NULL },
+  [OML_UINT64_VALUE]        = { encode_uint64, UINT64_T_SIZE + 1, NULL },
+  [OML_BLOB_VALUE]          = { encode_blob, 0, size_blob },
+  [OML_GUID_VALUE]          = { encode_guid, GUID_T_SIZE + 1, NULL },
+  [OML_BOOL_VALUE]          = { encode_bool, 1, NULL },
+  [OML_VECTOR_DOUBLE_VALUE] = { encode_vector_double, 0, size_vector64 },
+  [OML_VECTOR_INT32_VALUE]  = { encode_vector_int32, 0, size_vector32 },
+  [OML_VECTOR_UINT32_VALUE] = { encode_vector_uint32, 0, size_vector32 },
+  [OML_VECTOR_INT64_VALUE]  = { encode_vector_int64, 0, size_vector64 },
+  [OML_VECTOR_UINT64_VALUE] = { encode_vector_uint64, 0, size_vector64 },
+  [OML_VECTOR_BOOL_VALUE]   = { encode_vector_bool, 0, size_vector_bool },
+};
+
+/** MarshalEncoder for doubles from \ref OMB_DOUBLE64_PROTOCOL */
+static const MarshalEncoder double64_encoder = { encode_double64, DOUBLE64_T_SIZE + 1, NULL };
+
+/** MarshalEncoders for integers as varints, from \ref OMB_COMPACT_PROTOCOL */
+static const MarshalEncoder varint_encoders[OML_LAST_VALUE] = {
+  [OML_LONG_VALUE]   = { encode_vlong, VARINT_MAX_SIZE + 1, NULL },
+  [OML_INT32_VALUE]  = { encode_vint32, VARINT_MAX_SIZE + 1, NULL },
+  [OML_UINT32_VALUE] = { encode_vuint32, VARINT_MAX_SIZE + 1, NULL },
+  [OML_INT64_VALUE]  = { encode_vint64, VARINT_MAX_SIZE + 1, NULL },
+  [OML_UINT64_VALUE] = { encode_vuint64, VARINT_MAX_SIZE + 1, NULL },
+};
+
+/** Find how to marshal values of a given type.
+ *
+ * \param type OmlValueT of the values
+ * \param protocol OMSP version to marshal for
+ * \return a pointer to the MarshalEncoder to use, or NULL if the type is not supported
+ */
+static const MarshalEncoder*
+marshal_encoder (OmlValueT type, int protocol)
+{
+  if ((int)type < 0 || type >= OML_LAST_VALUE) {
+    return NULL;
+  }
+  if (protocol >= OMB_COMPACT_PROTOCOL && varint_encoders[type].encode) {
+    return &varint_encoders[type];
+  }
+  if (protocol >= OMB_DOUBLE64_PROTOCOL && OML_DOUBLE_VALUE == type) {
+    return &double64_encoder;
+  }
+  return encoders[type].encode ? &encoders[type] : NULL;
+}
+
+/** Marshal a single OmlValueU of type OmlValueT into mbuf for a specific
+ * protocol version.
+ *
+ * From \ref OMB_DOUBLE64_PROTOCOL, OML_DOUBLE_VALUE is marshalled as an exact
+ * DOUBLE64_T. From \ref OMB_COMPACT_PROTOCOL, integers are marshalled as
+ * varints (VINT32_T, VUINT32_T, VINT64_T and VUINT64_T).
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param val_type OmlValueT representing the type of val
+ * \param val pointer to OmlValueU, of type val_type, to marshall
+ * \param protocol OMSP version to marshal for
+ * \return 1 on success, or 0 otherwise (marshalling should then restart from marshal_init())
+ * \see marshal_value, marshal_encoder
+ */
+int
+marshal_value2(MBuffer* mbuf, OmlValueT val_type, OmlValueU* val, int protocol)
+{
+  const MarshalEncoder *enc = marshal_encoder (val_type, protocol);
+  uint8_t *buf;
+
+  if (!enc) {
     logerror("%s(): Unsupported value type '%d'\n", __func__, val_type);
     return 0;
   }
 
+  logdebug3("Marshalling %s\n", oml_type_to_s (val_type));
+  if (-1 == mbuf_check_resize (mbuf, enc->size ? enc->size (val) : enc->max_size)) {
+    logerror("Failed to marshal %s value (mbuf_check_resize())\n", oml_type_to_s (val_type));
+    mbuf_reset_write (mbuf);
+    return 0;
+  }
+  buf = mbuf_wrptr (mbuf);
+  mbuf_write_skip (mbuf, enc->encode (buf, val) - buf);
+
+  return 1;
+}
+
+/** Compile a marshalling plan for rows of a given schema.
+ *
+ * The MarshalEncoder of each field is looked up once and for all, and the
+ * maximum size of the fixed-size fields precomputed, so marshal_plan_values
+ * can reserve space for all the values it is given at once, then write them
+ * without any further checks.
+ *
+ * \param types array of the OmlValueT of each field
+ * \param count number of fields
+ * \param protocol OMSP version to marshal for
+ * \return a new MarshalPlan, to be freed with marshal_plan_free, or NULL on error
+ * \see marshal_plan_values, marshal_plan_free
+ */
+MarshalPlan*
+marshal_plan_new(const OmlValueT *types, int count, int protocol)
+{
+  MarshalPlan *plan;
+  int i;
+
+  if (count < 0 || !(plan = oml_malloc (sizeof (MarshalPlan)))) {
+    return NULL;
+  }
+  memset (plan, 0, sizeof (MarshalPlan));
+  plan->protocol = protocol;
+  plan->count = count;
+  if (!(plan->types = oml_malloc ((count + 1) * sizeof (OmlValueT))) ||
+      !(plan->encoders = oml_malloc ((count + 1) * sizeof (MarshalEncoder*))) ||
+      !(plan->fixed = oml_malloc ((count + 1) * sizeof (size_t))) ||
+      !(plan->variable = oml_malloc ((count + 1) * sizeof (int)))) {
+    logerror("Cannot allocate memory for marshalling plan of %d fields\n", count);
+    marshal_plan_free (plan);
+    return NULL;
+  }
+
+  plan->fixed[0] = 0;
+  for (i = 0; i < count; i++) {
+    plan->types[i] = types[i];
+    if (!(plan->encoders[i] = marshal_encoder (types[i], protocol))) {
+      logwarn("Cannot marshal field %d of type %s\n", i, oml_type_to_s (types[i]));
+      marshal_plan_free (plan);
+      return NULL;
+    }
+    plan->fixed[i + 1] = plan->fixed[i] + plan->encoders[i]->max_size;
+    if (plan->encoders[i]->size) {
+      plan->variable[plan->nvariable++] = i;
+    }
+  }
+
+  return plan;
+}
+
+/** Free a MarshalPlan.
+ *
+ * \param plan MarshalPlan to free, can be NULL
+ * \see marshal_plan_new
+ */
+void
+marshal_plan_free(MarshalPlan *plan)
+{
+  if (plan) {
+    oml_free (plan->types);
+    oml_free ((void*)plan->encoders);
+    oml_free (plan->fixed);
+    oml_free (plan->variable);
+    oml_free (plan);
+  }
+}
+
+/** Marshal some consecutive fields of a row following a MarshalPlan, without
+ * updating the header of the message.
+ *
+ * Space for all the values is reserved at once, and each is written by its
+ * precompiled encoder. Values are expected to be fields first to first +
+ * value_count - 1 of the plan; should they not be, e.g., because a filter
+ * output other types than it declared, they are marshalled with
+ * marshal_batch_values instead.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param plan MarshalPlan of the rows
+ * \param first index in the plan of the field of values[0]
+ * \param values array of OmlValue of length value_count
+ * \param value_count length of the values array
+ * \return 1 on success, or -1 otherwise (marshalling should then restart from marshal_init())
+ * \see marshal_plan_new, marshal_plan_values, marshal_batch_values
+ */
+int
+marshal_plan_batch_values(MBuffer* mbuf, const MarshalPlan* plan, int first, OmlValue* values, int value_count)
+{
+  int i, j, last = first + value_count;
+  size_t size;
+  uint8_t *start, *buf;
+
+  if (first < 0 || last > plan->count) {
+    return marshal_batch_values (mbuf, values, value_count, plan->protocol);
+  }
+  for (i = 0; i < value_count; i++) {
+    if (oml_value_get_type (&values[i]) != plan->types[first + i]) {
+      return marshal_batch_values (mbuf, values, value_count, plan->protocol);
+    }
+  }
+
+  size = plan->fixed[last] - plan->fixed[first];
+  for (i = 0; i < plan->nvariable && (j = plan->variable[i]) < last; i++) {
+    if (j >= first) {
+      size += plan->encoders[j]->size (&values[j - first].value);
+    }
+  }
+  if (-1 == mbuf_check_resize (mbuf, size)) {
+    logerror("Failed to marshal %d values (mbuf_check_resize())\n", value_count);
+    mbuf_reset_write (mbuf);
+    return -1;
+  }
+
+  buf = start = mbuf_wrptr (mbuf);
+  for (i = 0; i < value_count; i++) {
+    buf = plan->encoders[first + i]->encode (buf, &values[i].value);
+  }
+  mbuf_write_skip (mbuf, buf - start);
+
+  return 1;
+}
+
+/** Marshal some consecutive fields of a row following a MarshalPlan.
+ *
+ * This is equivalent to marshal_values2, but uses the precompiled encoders
+ * of the plan (\see marshal_plan_batch_values). The number of values in the
+ * header of the message is then updated.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param plan MarshalPlan of the rows
+ * \param first index in the plan of the field of values[0]
+ * \param values array of OmlValue of length value_count
+ * \param value_count length of the values array
+ * \return 1 on success, or -1 otherwise (marshalling should then restart from marshal_init())
+ * \see marshal_plan_new, marshal_values2
+ */
+int
+marshal_plan_values(MBuffer* mbuf, const MarshalPlan* plan, int first, OmlValue* values, int value_count)
+{
+  if (marshal_plan_batch_values (mbuf, plan, first, values, value_count) == -1) {
+    return -1;
+  }
+
+  marshal_count_values (mbuf, value_count);
+  return 1;
+}
+
+/** Copy already marshalled values into a message.
+ *
+ * This allows to marshal the values of a row once, e.g., with
+ * marshal_batch_values into a separate MBuffer, and add them to several
+ * messages. The number of values in the header of the message is updated as
+ * by marshal_values2.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param data marshalled values
+ * \param length length of data
+ * \param value_count number of values in data
+ * \return 1 on success, or -1 otherwise (marshalling should then restart from marshal_init())
+ * \see marshal_values2, marshal_batch_values, marshal_plan_batch_values
+ */
+int
+marshal_encoded_values(MBuffer* mbuf, const uint8_t* data, size_t length, int value_count)
+{
+  if (-1 == mbuf_write (mbuf, data, length)) {
+    logerror("Failed to marshal %d encoded values (mbuf_write())\n", value_count);
+    mbuf_reset_write (mbuf);
+    return -1;
+  }
+
+  marshal_count_values (mbuf, value_count);
   return 1;
 }
 
@@ -866,7 +1618,7 @@ marshal_finalize(MBuffer*  mbuf)
     len = UINT32_MAX;
   }
 
-  if (type == OMB_DATA_P && len > UINT16_MAX) {
+  if ((type == OMB_DATA_P || type == OMB_CDATA_P) && len > UINT16_MAX) {
     /*
      * We assumed a short packet, but there is too much data, so we
      * have to shift the whole buffer down by 2 bytes and convert to a
@@ -878,36 +1630,68 @@ marshal_finalize(MBuffer*  mbuf)
     memmove (&buf[PACKET_HEADER_SIZE+2], &buf[PACKET_HEADER_SIZE],
              len - PACKET_HEADER_SIZE);
     len += 2;
-    buf[2] = type = OMB_LDATA_P;
+    buf[2] = type = (type == OMB_DATA_P) ? OMB_LDATA_P : OMB_LCDATA_P;
   }
 
 
   switch (type) {
   case OMB_DATA_P:
+  case OMB_CDATA_P:
     len -= PACKET_HEADER_SIZE; // Data length minus header
     uint16_t nlen16 = htons (len);
     memcpy (&buf[3], &nlen16, sizeof (nlen16));
     break;
   case OMB_LDATA_P:
+  case OMB_LCDATA_P:
     len -= PACKET_HEADER_SIZE + 2; // Data length minus header
     uint32_t nlen32 = htonl (len); // pure data length
     memcpy (&buf[3], &nlen32, sizeof (nlen32));
     break;
+  default:
+    logwarn("Batch packets should be finalised with marshal_batch_finalize()\n");
+    break;
   }
 
   return 1;
 }
 
 /** Read the marshalling header information contained in an MBuffer.
+ *
+ * Compact packets cannot be read without the decoding state, so they are
+ * rejected.
  *
  * \param mbuf MBuffer to read from
  * \param header pointer to an OmlBinaryHeader into which the data from the
  *               mbuf should be unmarshalled
  * \return 1 on success, the size of the missing section as a negative number
  *         if the buffer is too short, or 0 if something failed
+ * \see unmarshal_init2
  */
 int
 unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
+{
+  return unmarshal_init2(mbuf, header, NULL);
+}
+
+/** Read the marshalling header information contained in an MBuffer,
+ * including compact and batch packets.
+ *
+ * For batch packets, header->rows is set to the number of rows, but
+ * header->seqno and header->timestamp are only read for each row, by
+ * unmarshal_batch_row(). For all other packets, header->rows is 1.
+ *
+ * \param mbuf MBuffer to read from
+ * \param header pointer to an OmlBinaryHeader into which the data from the
+ *               mbuf should be unmarshalled
+ * \param states array of OMB_MAX_STREAMS OmlBinStreamState for the
+ *               connection, updated with compact packets (can be NULL if
+ *               none are expected)
+ * \return 1 on success, the size of the missing section as a negative number
+ *         if the buffer is too short, or 0 if something failed
+ * \see unmarshal_measurements_compact
+ */
+int
+unmarshal_init2(MBuffer* mbuf, OmlBinaryHeader* header, OmlBinStreamState *states)
 {
   uint8_t header_str[PACKET_HEADER_SIZE + 2];
   uint8_t stream_header_str[STREAM_HEADER_SIZE];
@@ -937,7 +1721,8 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
 
   header->type = (OmlBinMsgType)header_str[2];
 
-  if (header->type == OMB_DATA_P) {
+  if (header->type == OMB_DATA_P || header->type == OMB_CDATA_P ||
+      header->type == OMB_BATCH_P) {
     // Read 2 more bytes of the length field
     uint16_t nv16 = 0;
     result = mbuf_read (mbuf, (uint8_t*)&nv16, sizeof (uint16_t));
@@ -947,7 +1732,8 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
       return n;
     }
     header->length = (int)ntohs (nv16);
-  } else if (header->type == OMB_LDATA_P) {
+  } else if (header->type == OMB_LDATA_P || header->type == OMB_LCDATA_P ||
+      header->type == OMB_LBATCH_P) {
     // Read 4 more bytes of the length field
     uint32_t nv32 = 0;
     result = mbuf_read (mbuf, (uint8_t*)&nv32, sizeof (uint32_t));
@@ -977,6 +1763,34 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
 
   header->values = (int)stream_header_str[0];
   header->stream = (int)stream_header_str[1];
+  header->rows = 1;
+
+  if (header->type == OMB_BATCH_P || header->type == OMB_LBATCH_P) {
+    uint16_t nv16 = 0;
+    if (!states) {
+      logwarn("Received batch packet, but no decoding state is available\n");
+      return 0;
+    } else if (mbuf_read (mbuf, (uint8_t*)&nv16, sizeof (nv16)) == -1) {
+      return 0;
+    }
+    header->rows = (int)ntohs (nv16);
+    header->seqno = 0;
+    header->timestamp = 0.;
+    return 1;
+  }
+
+  if (header->type == OMB_CDATA_P || header->type == OMB_LCDATA_P) {
+    int32_t seqno32;
+    if (!states) {
+      logwarn("Received compact packet, but no decoding state is available\n");
+      return 0;
+    } else if (unmarshal_measurements_compact (mbuf, &states[header->stream],
+          &seqno32, &header->timestamp) == -1) {
+      return 0;
+    }
+    header->seqno = seqno32;
+    return 1;
+  }
 
   if (unmarshal_typed_value (mbuf, "seq-no", OML_INT32_VALUE, &seqno) == -1)
     return 0;
@@ -993,6 +1807,83 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
   return 1;
 }
 
+/** Read the sequence number and timestamp of a compact packet.
+ *
+ * The read pointer of mbuf should be just after the ms-index. state is updated
+ * to this packet.
+ *
+ * \param mbuf MBuffer to read from
+ * \param state OmlBinStreamState of the packet's stream
+ * \param seqno pointer to store the sequence number into
+ * \param timestamp pointer to store the timestamp into
+ * \return 0 on success, -1 otherwise
+ * \see marshal_measurements_compact, \ref omspbincompact
+ */
+int
+unmarshal_measurements_compact(MBuffer* mbuf, OmlBinStreamState *state,
+                               int32_t *seqno, double *timestamp)
+{
+  OmlBinStreamState zero = { 0, 0 };
+  const OmlBinStreamState *base = state;
+  uint64_t seqvar, tsvar, nv64;
+  int64_t ts_us;
+
+  if (unmarshal_varint (mbuf, &seqvar) == -1 ||
+      unmarshal_varint (mbuf, &tsvar) == -1) {
+    logerror("Failed to unmarshal compact sample metadata; not enough data?\n");
+    return -1;
+  }
+
+  if (seqvar & 1) {
+    base = &zero;
+  }
+  *seqno = (int32_t)(base->seqno + UNZIGZAG(seqvar >> 1));
+
+  if (tsvar & 1) {
+    if (mbuf_read (mbuf, (uint8_t*)&nv64, sizeof (nv64)) == -1) {
+      logerror("Failed to unmarshal compact sample timestamp; not enough data?\n");
+      return -1;
+    }
+    nv64 = ntohll (nv64);
+    memcpy (timestamp, &nv64, sizeof (nv64));
+    ts_us = base->ts_us;
+  } else {
+    ts_us = base->ts_us + UNZIGZAG(tsvar >> 1);
+    *timestamp = usec_to_ts (ts_us);
+  }
+
+  logdebug3("Unmarshalled compact sample %" PRId32 " at %f\n", *seqno, *timestamp);
+  state->seqno = *seqno;
+  state->ts_us = ts_us;
+  return 0;
+}
+
+/** Read the sequence number and timestamp of the next row of a batch packet.
+ *
+ * The read pointer of mbuf should be just after the header read by
+ * unmarshal_init2(), or after the last value of the previous row. The
+ * row's values can then be read with unmarshal_values().
+ *
+ * \param mbuf MBuffer to read from
+ * \param header OmlBinaryHeader of the batch packet, in which seqno and
+ *               timestamp are updated
+ * \param states array of OMB_MAX_STREAMS OmlBinStreamState for the connection
+ * \return 0 on success, -1 otherwise
+ * \see unmarshal_init2, unmarshal_measurements_compact, \ref omspbinbatch
+ */
+int
+unmarshal_batch_row(MBuffer* mbuf, OmlBinaryHeader* header, OmlBinStreamState *states)
+{
+  int32_t seqno32;
+
+  if (unmarshal_measurements_compact (mbuf, &states[header->stream],
+        &seqno32, &header->timestamp) == -1) {
+    return -1;
+  }
+  header->seqno = seqno32;
+  return 0;
+}
+
 /** \see unmarshal_values
  */
 inline int
@@ -1032,8 +1923,12 @@ unmarshal_values(MBuffer* mbuf, OmlBinaryHeader* header, OmlValue* values, int m
            (value_count - max_value_count), max_value_count, value_count);
     logwarn("Message length appears to be %d + 5\n", header->length);
 
-    mbuf_read_skip (mbuf, header->length + PACKET_HEADER_SIZE);
-    mbuf_begin_read (mbuf);
+    if (header->type != OMB_BATCH_P && header->type != OMB_LBATCH_P) {
+      /* The rest of batch packets is skipped by the caller, knowing where
+       * the current row started */
+      mbuf_read_skip (mbuf, header->length + PACKET_HEADER_SIZE);
+      mbuf_begin_read (mbuf);
+    }
 
     // FIXME:  Check for sync
     return max_value_count - value_count;  // value array is too small
@@ -1154,6 +2049,50 @@ unmarshal_value(MBuffer *mbuf, OmlValue *value)
     logdebug("Received NaN\n");
     break;
   }
+  case VINT32_T:
+  case VUINT32_T:
+  case VINT64_T:
+  case VUINT64_T: {
+    uint64_t uv64;
+    if (unmarshal_varint (mbuf, &uv64) == -1) {
+      logerror("Failed to unmarshal varint %d value; not enough data?\n", type);
+      return 0;
+    }
+    switch (type) {
+    case VINT32_T:
+      oml_value_set_type(value, OML_INT32_VALUE);
+      omlc_set_int32(*oml_value_get_value(value), (int32_t)UNZIGZAG(uv64));
+      break;
+    case VUINT32_T:
+      oml_value_set_type(value, OML_UINT32_VALUE);
+      omlc_set_uint32(*oml_value_get_value(value), (uint32_t)uv64);
+      break;
+    case VINT64_T:
+      oml_value_set_type(value, OML_INT64_VALUE);
+      omlc_set_int64(*oml_value_get_value(value), UNZIGZAG(uv64));
+      break;
+    default:
+      oml_value_set_type(value, OML_UINT64_VALUE);
+      omlc_set_uint64(*oml_value_get_value(value), uv64);
+      break;
+    }
+    logdebug3("Unmarshalled varint %s\n", oml_type_to_s(oml_value_get_type(value)));
+    break;
+  }
+  case DOUBLE64_T: {
+    uint64_t nv64;
+    double v;
+    if (mbuf_read(mbuf, (uint8_t*)&nv64, DOUBLE64_T_SIZE) == -1) {
+      logerror("Failed to unmarshal OML_DOUBLE_VALUE; not enough data?\n");
+      return 0;
+    }
+    nv64 = ntohll(nv64);
+    memcpy(&v, &nv64, sizeof(v));
+    oml_value_set_type(value, OML_DOUBLE_VALUE);
+    omlc_set_double(*oml_value_get_value(value), v);
+    logdebug3("Unmarshalled double64 %f\n", v);
+    break;
+  }
   case STRING_T: {
     int len = 0;
     uint8_t buf [STRING_T_MAX_SIZE];
@@ -34,27 +34,81 @@ typedef enum {
   OMB_DATA_P = 0x1,
   /** Long packet of size \ref PACKET_HEADER_SIZE + \ref STREAM_HEADER_SIZE bytes */
   OMB_LDATA_P = 0x2,
+  /** Short packet with compact, delta-encoded, sequence number and timestamp */
+  OMB_CDATA_P = 0x3,
+  /** Long packet with compact, delta-encoded, sequence number and timestamp */
+  OMB_LCDATA_P = 0x4,
+  /** Short packet containing several compact rows of the same stream */
+  OMB_BATCH_P = 0x5,
+  /** Long packet containing several compact rows of the same stream */
+  OMB_LBATCH_P = 0x6,
 } OmlBinMsgType;
 
+/** Lowest OMSP version marshalling scalar doubles as IEEE 754 binary64 (\ref DOUBLE64_T) */
+#define OMB_DOUBLE64_PROTOCOL 6
+/** Lowest OMSP version using compact packets (\ref OMB_CDATA_P) and varints */
+#define OMB_COMPACT_PROTOCOL 7
+/** Lowest OMSP version using batch packets (\ref OMB_BATCH_P) */
+#define OMB_BATCH_PROTOCOL 8
+
+/** Number of possible stream indices in a marshalled packet */
+#define OMB_MAX_STREAMS 256
+
+/** Delta-encoding state of one stream in compact packets.
+ *
+ * Both ends keep one per stream, updated with each compact packet.
+ *
+ * \see marshal_measurements_compact, unmarshal_measurements_compact
+ */
+typedef struct OmlBinStreamState {
+  /** Sequence number of the last packet */
+  int32_t seqno;
+  /** Timestamp of the last packet, in microseconds */
+  int64_t ts_us;
+} OmlBinStreamState;
+
 
 typedef struct {
     OmlBinMsgType type;
     size_t length;
     int values;
     int stream;
+    int rows;
     int seqno;
     double timestamp;
 } OmlBinaryHeader;
 
+/** Precompiled marshalling of the rows of one schema \see marshal_plan_new */
+typedef struct MarshalPlan MarshalPlan;
+
 int marshal_measurements(MBuffer* mbuf, int stream, int seqno, double now);
+int marshal_measurements2(MBuffer* mbuf, int stream, int seqno, double now, int protocol);
+int marshal_measurements_compact(MBuffer* mbuf, int stream, int seqno, double now,
+                                 OmlBinStreamState *prev, int absolute);
 int marshal_init(MBuffer* mbuf, OmlBinMsgType msgtype);
+int marshal_batch_init(MBuffer* mbuf, int stream);
+int marshal_batch_row(MBuffer* mbuf, int seqno, double now,
+                      OmlBinStreamState *prev, int absolute);
+int marshal_batch_values(MBuffer* mbuf, OmlValue* values, int value_count, int protocol);
+int marshal_batch_finalize(MBuffer* mbuf, size_t offset, int value_count);
 int marshal_values(MBuffer* mbuffer, OmlValue* values, int value_count);
+int marshal_values2(MBuffer* mbuffer, OmlValue* values, int value_count, int protocol);
 int marshal_value(MBuffer* mbuf, OmlValueT val_type,  OmlValueU* val);
+int marshal_value2(MBuffer* mbuf, OmlValueT val_type,  OmlValueU* val, int protocol);
 int marshal_finalize(MBuffer*  mbuf);
+MarshalPlan* marshal_plan_new(const OmlValueT *types, int count, int protocol);
+void marshal_plan_free(MarshalPlan *plan);
+int marshal_plan_batch_values(MBuffer* mbuf, const MarshalPlan* plan, int first, OmlValue* values, int value_count);
+int marshal_plan_values(MBuffer* mbuf, const MarshalPlan* plan, int first, OmlValue* values, int value_count);
+int marshal_encoded_values(MBuffer* mbuf, const uint8_t* data, size_t length, int value_count);
 OmlBinMsgType marshal_get_msgtype (MBuffer *mbuf);
 
 
 int unmarshal_init(MBuffer*  mbuf, OmlBinaryHeader* header);
+int unmarshal_init2(MBuffer*  mbuf, OmlBinaryHeader* header, OmlBinStreamState *states);
+int unmarshal_measurements_compact(MBuffer* mbuf, OmlBinStreamState *state,
+                                   int32_t *seqno, double *timestamp);
+int unmarshal_batch_row(MBuffer* mbuf, OmlBinaryHeader* header, OmlBinStreamState *states);
 int unmarshal_measurements(MBuffer* mbuf, OmlBinaryHeader* header,
                             OmlValue*  values, int max_value_count);
 int unmarshal_values(MBuffer*  mbuffer, OmlBinaryHeader* header,
@@ -399,6 +399,35 @@ mbuf_write (MBuffer* mbuf, const uint8_t* buf, size_t len)
   return 0;
 }
 
+/** Account for data written directly at the write pointer of an MBuffer.
+ *
+ * This simply advances the write pointer, e.g., after data has been
+ * recv(2)'d at mbuf_wrptr(), into space made with mbuf_check_resize().
+ *
+ * \param mbuf MBuffer to manipulate
+ * \param len amount of data which has been written
+ * \return 0 on success, or -1 otherwise
+ * \see mbuf_check_resize, mbuf_write
+ */
+int
+mbuf_write_skip (MBuffer* mbuf, size_t len)
+{
+  if (mbuf == NULL) return -1;
+
+  mbuf_check_invariant (mbuf);
+
+  if (mbuf->wr_remaining < len) return -1;
+
+  mbuf->wrptr += len;
+  mbuf->fill += len;
+  mbuf->wr_remaining -= len;
+  mbuf->rd_remaining += len;
+
+  mbuf_check_invariant (mbuf);
+
+  return 0;
+}
+
 /**  Append the printed string described by format to the MBuffer.
  *
  * Write the string described by a format string and arguments to the MBuffer,
@@ -431,8 +460,8 @@ mbuf_print(MBuffer* mbuf, const char* format, ...)
     va_start(arglist, format);
     len = vsnprintf((char*)mbuf->wrptr, mbuf->wr_remaining, format, arglist);
     va_end(arglist);
-    if (! (success = (len <= (int)mbuf->wr_remaining))) {
-      if (mbuf_check_resize(mbuf, len) == -1)
+    if (! (success = (len < (int)mbuf->wr_remaining))) {
+      if (mbuf_check_resize(mbuf, len + 1) == -1)
     return -1;
     }
   } while (! success);
@@ -33,6 +33,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "ocomm/o_log.h"
 #include "mem.h"
@@ -41,6 +42,8 @@ static size_t xbytes = 0;
 static size_t xnew = 0;
 static size_t oml_freed = 0;
 static size_t xmax = 0;
+/** Protects the counters above, as memory can be allocated from multiple threads */
+static pthread_mutex_t xcount_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /** Take into account newly allocated memory.
  * \param bytes size of the new xchunk
@@ -50,10 +53,12 @@ static void xcount_new   (size_t bytes) {
 #if OML_MEM_DEBUG
   o_log(O_LOG_DEBUG4, "Allocated %dB of memory\n", bytes);
 #endif
+  pthread_mutex_lock(&xcount_lock);
   xbytes += bytes; xnew += bytes;
   if (xbytes > xmax) {
     xmax = xbytes;
   }
+  pthread_mutex_unlock(&xcount_lock);
 }
 
 /** Take into account freed memory.
@@ -64,7 +69,9 @@ static void xcount_freed (size_t bytes) {
 #if OML_MEM_DEBUG
   o_log(O_LOG_DEBUG4, "Freed %dB of memory\n", bytes);
 #endif
+  pthread_mutex_lock(&xcount_lock);
   xbytes -= bytes; oml_freed += bytes;
+  pthread_mutex_unlock(&xcount_lock);
 }
 
 /** Report the current memory allocation tracked by oml_mem*() functions */
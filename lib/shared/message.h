@@ -32,6 +32,8 @@ struct oml_message {
   uint32_t length;  // Length in octets of this message/line
   int count;        // Expected/actual count of fields in the measurement
                     // (not including protocol metadata)
+  struct OmlBinStreamState *streams; // Delta-decoding state of compact binary
+                    // messages (OMB_MAX_STREAMS long), or NULL
 };
 
 typedef int (*msg_start_fn) (struct oml_message *msg, MBuffer *mbuf);
@@ -213,6 +213,36 @@ OmlURIType oml_uri_type(const char* uri) {
   return OML_URI_UNKNOWN;
 }
 
+/** Strip the compression prefix, if any, from a collection URI.
+ *
+ * A URI such as 'zlib+tcp:host:port' requests that the data be compressed
+ * before being written into the stream described by the rest of the URI.
+ *
+ * \param uri the URI to parse
+ * \param compression pointer to an OmlURICompression to be updated with the requested compression
+ * \return a pointer to the remainder of uri, or NULL if the prefix names an unsupported compression
+ * \see oml_uri_type, parse_uri
+ */
+const char*
+oml_uri_strip_compression(const char* uri, OmlURICompression *compression)
+{
+  const char *plus = strchr(uri, '+');
+  const char *colon = strchr(uri, ':');
+
+  *compression = OML_URI_COMPRESSION_NONE;
+  if (!plus || (colon && colon < plus)) {
+    return uri;
+  }
+
+  if (plus - uri == 4 && !strncmp(uri, "zlib", 4)) {
+    *compression = OML_URI_COMPRESSION_ZLIB;
+    return plus + 1;
+  }
+
+  logerror("Unsupported compression '%.*s' in URI '%s'\n", (int)(plus - uri), uri, uri);
+  return NULL;
+}
+
 /** Parse a collection URI of the form [proto:]path[:service].
  *
  * path can be a hostname, an IPv4 address or an IPv6 address within brackets
@@ -49,6 +49,13 @@ OmlURIType oml_uri_type(const char* uri);
 #define oml_uri_is_network(t) (t>=OML_URI_TCP && t<=OML_URI_UDP)
 int parse_uri (const char *uri, const char **protocol, const char **path, const char **port);
 
+typedef enum {
+  OML_URI_COMPRESSION_NONE = 0,
+  OML_URI_COMPRESSION_ZLIB,
+} OmlURICompression;
+
+const char* oml_uri_strip_compression(const char* uri, OmlURICompression *compression);
+
 #endif // UTIL_H__
 
 /*
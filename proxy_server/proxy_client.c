@@ -54,6 +54,7 @@ client_new (Socket* client_sock, int page_size, char* file_name,
   self->mbuf = mbuf_create ();
   self->headers = NULL;
   self->msg_start = dummy_read_msg_start;
+  self->bin_streams = oml_calloc (OMB_MAX_STREAMS, sizeof (OmlBinStreamState));
 
   self->messages = msg_queue_create ();
   self->cbuf = cbuf_create (page_size);
@@ -92,6 +93,7 @@ client_free (Client *client)
     header = next;
   }
 
+  oml_free (client->bin_streams);
   msg_queue_destroy (client->messages);
   cbuf_destroy (client->cbuf);
 
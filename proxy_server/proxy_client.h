@@ -30,6 +30,7 @@
 #include <cbuf.h>
 #include <headers.h>
 #include <message.h>
+#include <marshal.h>
 
 #include <ocomm/o_socket.h>
 #include <ocomm/o_eventloop.h>
@@ -75,6 +76,7 @@ typedef struct _client {
   struct header *header_table[H_max];
   MBuffer *mbuf;
   msg_start_fn msg_start; // Pointer to function for reading message boundaries
+  OmlBinStreamState *bin_streams; // Delta-decoding state for msg_start, OMB_MAX_STREAMS long
 
   SockEvtSource *recv_event;
   Socket*     recv_socket;
@@ -208,6 +208,7 @@ proxy_message_loop (const char *client_id, Client *client, void *buf, size_t siz
     client->state = C_DATA;
     break;
   case C_DATA:
+    msg.streams = client->bin_streams;
     result = client->msg_start (&msg, mbuf);
     if (result == -1) {
       logerror ("'%s': protocol error in received message\n", client_id);
@@ -0,0 +1,335 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file backpressure.c
+ * \brief Stop reading from clients whose samples are not inserted fast enough.
+ *
+ * The memory used by the samples each client has waiting in an IngestQueue is
+ * charged to its IngestAccount. After processing data from a client, its
+ * channel is deactivated, so the EventLoop stops reading from its socket, if
+ *  - its own samples use more than client_memory_budget,
+ *  - all queued samples use more than server_memory_budget, or
+ *  - the IngestQueue of its Database is more than half full.
+ * The client's TCP window then fills up, and it eventually stops sending,
+ * rather than having the server buffer its data, or block the whole EventLoop
+ * thread on a full queue.
+ *
+ * Paused clients are resumed once all of these are back below half of their
+ * limit. As samples are inserted by the writer threads, but channels can only
+ * be reactivated by the thread running their EventLoop, writer threads wake
+ * each EventLoop with paused clients up through a socketpair(2), which it
+ * reads like any other channel.
+ *
+ * The number of pauses of each client, and the time it spent paused, are
+ * reported when it is resumed, and when it disconnects.
+ *
+ * \see ingest_account_bytes, ingest_set_drain_hook, eventloop_socket_activate
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_eventloop.h"
+#include "mem.h"
+#include "database.h"
+#include "ingest.h"
+#include "monitoring_server.h"
+#include "client_handler.h"
+#include "backpressure.h"
+
+/** Memory budget of the samples of one client waiting to be inserted [kB], 0 for no limit */
+int client_memory_budget = DEFAULT_CLIENT_MEMORY_BUDGET;
+/** Memory budget of all samples waiting to be inserted [kB], 0 for no limit */
+int server_memory_budget = DEFAULT_SERVER_MEMORY_BUDGET;
+
+/** Proportion of the IngestQueue of a Database in use above which its clients are paused */
+#define QUEUE_LOAD_PAUSE 0.5
+
+/** Paused clients of the EventLoop of one thread */
+typedef struct PausedList {
+  /** Paused ClientHandlers, linked through paused_next */
+  ClientHandler *clients;
+  /** Number of ClientHandlers in clients, also read by writer threads */
+  int npaused;
+  /** Non zero if a wake-up message has been sent and not processed yet */
+  int wake_pending;
+  /** Wake-up socketpair; fds[0] is read by the EventLoop, fds[1] written by writer threads */
+  int fds[2];
+  /** Next PausedList in the list of all threads */
+  struct PausedList *next;
+} PausedList;
+
+/** PausedList of the current thread, created on its first pause */
+static __thread PausedList *paused = NULL;
+
+/** PausedLists of all threads; they are never freed, as writer threads may still use them */
+static PausedList *lists = NULL;
+/** Lock protecting lists */
+static pthread_mutex_t lists_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Number of paused clients in all threads */
+static int paused_clients = 0;
+
+/** Get the current time on CLOCK_MONOTONIC [s] */
+static double
+monotonic_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Report the pauses of a client to the monitoring OML server.
+ *
+ * \param self ClientHandler to report on
+ */
+static void
+backpressure_report(ClientHandler *self)
+{
+#ifndef NOOML /* For unit tests */
+  const size_t ADDR_SZ = socket_get_addr_sz(self->socket);
+  char addr[ADDR_SZ];
+  socket_get_peer_addr(self->socket, addr, ADDR_SZ);
+  uint16_t port = socket_get_port(self->socket);
+  const char *oml_id = self->sender_name ? self->sender_name : "";
+  const char *domain = self->database ? self->database->name : "";
+  const char *app_name = self->app_name ? self->app_name : "";
+  backpressure_report_inject(addr, port, oml_id, domain, app_name, self->pauses,
+      backpressure_paused_time(self), ingest_account_bytes(self->account));
+#endif
+}
+
+/** Decide whether a client should be paused, or can be resumed.
+ *
+ * \param self ClientHandler to check
+ * \param scale proportion of the limits to check against: 1 to pause, 0.5 to resume
+ * \return non zero if any of the limits is exceeded
+ */
+static int
+backpressure_exceeded(ClientHandler *self, double scale)
+{
+  if (client_memory_budget > 0 &&
+      ingest_account_bytes(self->account) > scale * client_memory_budget * 1024.) {
+    return 1;
+  }
+  if (server_memory_budget > 0 &&
+      ingest_queued_bytes() > scale * server_memory_budget * 1024.) {
+    return 1;
+  }
+  if (self->database && self->database->ingest &&
+      ingest_queue_load(self->database->ingest) > scale * QUEUE_LOAD_PAUSE) {
+    return 1;
+  }
+  return 0;
+}
+
+/** Resume reading from a paused client, and remove it from the current thread's PausedList.
+ *
+ * \param self paused ClientHandler
+ */
+static void
+backpressure_resume(ClientHandler *self)
+{
+  ClientHandler **p;
+
+  for (p = &paused->clients; *p && *p != self; p = &(*p)->paused_next);
+  if (*p) {
+    *p = self->paused_next;
+  }
+  self->paused_next = NULL;
+  self->paused = 0;
+  self->paused_time += monotonic_s() - self->paused_since;
+  __atomic_sub_fetch(&paused->npaused, 1, __ATOMIC_SEQ_CST);
+  __atomic_sub_fetch(&paused_clients, 1, __ATOMIC_SEQ_CST);
+}
+
+/** Callback called when writer threads wake an EventLoop up.
+ *
+ * Resume all paused clients whose samples have been drained enough.
+ *
+ * \copydetails o_el_read_socket_callback
+ */
+static void
+backpressure_on_wake(SockEvtSource *source, void *handle, void *buf, int buf_size)
+{
+  ClientHandler *ch, *next;
+  (void)source;
+  (void)handle;
+  (void)buf;
+  (void)buf_size;
+
+  /* Clear first, so any insertion from now on wakes us up again */
+  __atomic_store_n(&paused->wake_pending, 0, __ATOMIC_SEQ_CST);
+
+  for (ch = paused->clients; ch; ch = next) {
+    next = ch->paused_next;
+    if (!backpressure_exceeded(ch, 0.5)) {
+      backpressure_resume(ch);
+      eventloop_socket_activate(ch->event, 1);
+      logdebug("%s: Resuming, after %u pauses for %.3fs in total\n",
+          ch->name, ch->pauses, backpressure_paused_time(ch));
+      backpressure_report(ch);
+    }
+  }
+}
+
+/** Create the PausedList of the current thread, and register its wake-up channel.
+ *
+ * \return 0 on success, -1 otherwise
+ */
+static int
+backpressure_thread_setup(void)
+{
+  PausedList *self = oml_malloc(sizeof(PausedList));
+
+  if (!self) {
+    return -1;
+  }
+  memset(self, 0, sizeof(*self));
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, self->fds)) {
+    logerror("Backpressure: Cannot create wake-up socketpair: %s\n", strerror(errno));
+    oml_free(self);
+    return -1;
+  }
+  fcntl(self->fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(self->fds[1], F_SETFL, O_NONBLOCK);
+  eventloop_on_read_in_fd("backpressure", self->fds[0], backpressure_on_wake, NULL, self);
+
+  pthread_mutex_lock(&lists_lock);
+  self->next = lists;
+  lists = self;
+  pthread_mutex_unlock(&lists_lock);
+
+  paused = self;
+  return 0;
+}
+
+/** Wake up the EventLoops with paused clients, after samples have been inserted.
+ *
+ * This is called from the writer threads. Only one wake-up message is sent to
+ * each EventLoop until it has processed it.
+ *
+ * \see ingest_set_drain_hook
+ */
+static void
+backpressure_drain(void)
+{
+  PausedList *l;
+
+  if (!__atomic_load_n(&paused_clients, __ATOMIC_SEQ_CST)) {
+    return;
+  }
+
+  pthread_mutex_lock(&lists_lock);
+  for (l = lists; l; l = l->next) {
+    if (__atomic_load_n(&l->npaused, __ATOMIC_SEQ_CST) &&
+        !__atomic_exchange_n(&l->wake_pending, 1, __ATOMIC_SEQ_CST)) {
+      /* A full socketpair already has a wake-up message in it */
+      if (send(l->fds[1], "w", 1, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+          EAGAIN != errno && EWOULDBLOCK != errno) {
+        logwarn("Backpressure: Cannot wake EventLoop up: %s\n", strerror(errno));
+      }
+    }
+  }
+  pthread_mutex_unlock(&lists_lock);
+}
+
+/** Set up the resumption of paused clients when samples are inserted.
+ *
+ * \see ingest_set_drain_hook
+ */
+void
+backpressure_setup(void)
+{
+  ingest_set_drain_hook(backpressure_drain);
+}
+
+/** Stop reading from a client if its samples are not inserted fast enough.
+ *
+ * This must be called from the thread running the client's EventLoop, after
+ * processing its data. Only clients with an IngestAccount are paused.
+ *
+ * \param self ClientHandler to check
+ * \see backpressure_exceeded
+ */
+void
+backpressure_check(ClientHandler *self)
+{
+  if (!self->account || self->paused || !self->event ||
+      !backpressure_exceeded(self, 1.)) {
+    return;
+  }
+  if (!paused && backpressure_thread_setup()) {
+    return;
+  }
+
+  self->paused = 1;
+  self->pauses++;
+  self->paused_since = monotonic_s();
+  self->paused_next = paused->clients;
+  paused->clients = self;
+  __atomic_add_fetch(&paused->npaused, 1, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&paused_clients, 1, __ATOMIC_SEQ_CST);
+  eventloop_socket_activate(self->event, 0);
+  logdebug("%s: Pausing, with %zu bytes of samples queued\n",
+      self->name, ingest_account_bytes(self->account));
+
+  /* The samples may have been drained before the writer could see we are paused */
+  if (!backpressure_exceeded(self, 0.5)) {
+    backpressure_resume(self);
+    eventloop_socket_activate(self->event, 1);
+  }
+}
+
+/** Forget a client which is being freed, and report its pauses.
+ *
+ * \param self ClientHandler being freed
+ */
+void
+backpressure_release(ClientHandler *self)
+{
+  if (self->paused) {
+    backpressure_resume(self);
+  }
+  if (self->pauses) {
+    loginfo("%s: Paused %u times, for %.3fs in total, as its samples were not inserted fast enough\n",
+        self->name, self->pauses, self->paused_time);
+    backpressure_report(self);
+  }
+}
+
+/** Get the total time a client spent paused.
+ *
+ * \param self ClientHandler to check
+ * \return the time during which reading from the client was paused, including the current pause [s]
+ */
+double
+backpressure_paused_time(ClientHandler *self)
+{
+  return self->paused_time + (self->paused ? monotonic_s() - self->paused_since : 0);
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file backpressure.h
+ * \brief Interface to stop reading from clients whose samples are not inserted fast enough.
+ */
+#ifndef BACKPRESSURE_H_
+#define BACKPRESSURE_H_
+
+#include "client_handler.h"
+
+/** Default memory budget of the samples of one client waiting to be inserted [kB] */
+#define DEFAULT_CLIENT_MEMORY_BUDGET 8192
+/** Default memory budget of all samples waiting to be inserted [kB] */
+#define DEFAULT_SERVER_MEMORY_BUDGET 262144
+
+extern int client_memory_budget;
+extern int server_memory_budget;
+
+void backpressure_setup(void);
+void backpressure_check(ClientHandler *self);
+void backpressure_release(ClientHandler *self);
+double backpressure_paused_time(ClientHandler *self);
+
+#endif /*BACKPRESSURE_H_*/
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -11,12 +11,18 @@
  * \brief The client handler receives callbacks from the eventloop and processes messages in either OML's text or binary formats.
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #include "oml2/oml_writer.h"
 #include "ocomm/o_log.h"
@@ -32,8 +38,11 @@
 #include "binary.h"
 #include "schema.h"
 #include "client_handler.h"
+#include "backpressure.h"
 
 #define DEF_TABLE_COUNT 10
+/** Size of the intermediate buffer for decompressed data */
+#define INFLATE_CHUNK 16384
 
 /* XXX: This cannot be static anymore if we want to test it... */
 void
@@ -42,6 +51,11 @@ client_callback(SockEvtSource* source, void* handle, void* buf, int buf_size);
 static void
 status_callback(SockEvtSource* source, SocketStatus status, int errcode, void* handle);
 
+#ifdef HAVE_LIBZ
+static void
+client_handler_stop_inflate(ClientHandler* self);
+#endif
+
   const char *
 client_state_to_s (CState state)
 {
@@ -213,8 +227,12 @@ client_handler_new(Socket* new_sock)
   self->content = C_TEXT_DATA;
   self->mbuf = mbuf_create ();
   self->socket = new_sock;
+  self->account = ingest_account_new ();
   self->event = eventloop_on_read_in_channel(new_sock, client_callback,
       status_callback, (void*)self);
+  /* Avoid copying all received data from the EventLoop's own buffer */
+  eventloop_socket_set_mbuf(self->event, self->mbuf);
+  self->direct_read = 1;
   strncpy (self->name, self->event->name, MAX_STRING_SIZE);
 
   const char *event = "Connect";
@@ -226,6 +244,9 @@ client_handler_new(Socket* new_sock)
 
 void client_handler_free (ClientHandler* self)
 {
+  backpressure_release (self);
+  /* Samples still queued keep the account until they are inserted */
+  ingest_account_release (self->account);
   if (self->event)
     eventloop_socket_release (self->event);
   if (self->database)
@@ -236,6 +257,11 @@ void client_handler_free (ClientHandler* self)
     oml_free (self->tables);
   if (self->seqno_offsets)
     oml_free (self->seqno_offsets);
+  if (self->bin_streams)
+    oml_free (self->bin_streams);
+#ifdef HAVE_LIBZ
+  client_handler_stop_inflate (self);
+#endif
   mbuf_destroy (self->mbuf);
   int i, j;
   for (i = 0; i < self->table_count; i++) {
@@ -345,6 +371,137 @@ process_schema(ClientHandler* self, char* value)
   }
 }
 
+#ifdef HAVE_LIBZ
+/** Stop decompressing data from the client, and free the decompressor.
+ *
+ * \param self ClientHandler, with or without an active inflater
+ * \see client_handler_start_inflate
+ */
+static void
+client_handler_stop_inflate(ClientHandler* self)
+{
+  if (self->inflater) {
+    inflateEnd(self->inflater);
+    oml_free(self->inflater);
+    self->inflater = NULL;
+  }
+}
+
+/** Allocate memory for zlib, so it is accounted for with the rest \see oml_malloc */
+static voidpf
+client_handler_zalloc(voidpf opaque, uInt items, uInt size)
+{
+  (void)opaque;
+  return oml_malloc((size_t)items * size);
+}
+
+/** Free memory allocated by client_handler_zalloc \see oml_free */
+static void
+client_handler_zfree(voidpf opaque, voidpf address)
+{
+  (void)opaque;
+  oml_free(address);
+}
+
+/** Inflate data compressed by the client into its MBuffer.
+ *
+ * \param self ClientHandler with an active inflater
+ * \param buf pointer to the compressed data
+ * \param size length of the compressed data
+ * \return 0 on success, -1 on error
+ * \see client_handler_start_inflate
+ */
+static int
+client_handler_inflate(ClientHandler* self, uint8_t* buf, size_t size)
+{
+  uint8_t chunk[INFLATE_CHUNK];
+  z_stream *strm = self->inflater;
+  int ret;
+
+  strm->next_in = buf;
+  strm->avail_in = size;
+  do {
+    strm->next_out = chunk;
+    strm->avail_out = sizeof(chunk);
+    ret = inflate(strm, Z_NO_FLUSH);
+    if (Z_STREAM_END == ret) {
+      /* Allow a new stream to follow */
+      inflateReset(strm);
+    } else if (Z_OK != ret && Z_BUF_ERROR != ret) {
+      logerror("%s: Cannot decompress data: %s\n", self->name,
+          strm->msg ? strm->msg : "unknown error");
+      return -1;
+    }
+    if (mbuf_write(self->mbuf, chunk, sizeof(chunk) - strm->avail_out) < 0) {
+      logerror("%s: Failed to write decompressed data into message buffer\n",
+          self->name);
+      return -1;
+    }
+  } while (strm->avail_in > 0 || 0 == strm->avail_out);
+
+  return 0;
+}
+
+/** Start decompressing all data received from the client.
+ *
+ * The data remaining in the MBuffer after the current read pointer is
+ * compressed, so it is taken out and inflated back into the MBuffer.
+ *
+ * \param self ClientHandler which received an `encapsulation: deflate` header
+ * \return 0 on success, -1 on error
+ * \see client_handler_inflate
+ */
+static int
+client_handler_start_inflate(ClientHandler* self)
+{
+  MBuffer *mbuf = self->mbuf;
+  uint8_t *pending = NULL;
+  z_stream *strm;
+  size_t len;
+  int ret = 0;
+
+  if (!(strm = oml_malloc(sizeof(z_stream)))) {
+    logerror("%s: Cannot allocate decompressor\n", self->name);
+    return -1;
+  }
+  memset(strm, 0, sizeof(z_stream));
+  strm->zalloc = client_handler_zalloc;
+  strm->zfree = client_handler_zfree;
+  /* Raw DEFLATE (negative window bits), without the zlib wrapper */
+  if (Z_OK != inflateInit2(strm, -MAX_WBITS)) {
+    logerror("%s: Cannot initialise decompression\n", self->name);
+    oml_free(strm);
+    return -1;
+  }
+  self->inflater = strm;
+
+  if (self->direct_read) {
+    /* Further data needs to be inflated before going into the MBuffer */
+    eventloop_socket_set_mbuf(self->event, NULL);
+    self->direct_read = 0;
+  }
+
+  mbuf_consume_message(mbuf);
+  len = mbuf_rd_remaining(mbuf);
+  if (len > 0) {
+    if (!(pending = oml_malloc(len))) {
+      logerror("%s: Cannot allocate %zu bytes for data to decompress\n", self->name, len);
+      client_handler_stop_inflate(self);
+      return -1;
+    }
+    memcpy(pending, mbuf_rdptr(mbuf), len);
+    mbuf_reset_write(mbuf);
+    ret = client_handler_inflate(self, pending, len);
+    oml_free(pending);
+  }
+
+  if (ret) {
+    client_handler_stop_inflate(self);
+  }
+  return ret;
+}
+#endif /* HAVE_LIBZ */
+
 /** \privatesection Process a single key/value pair contained in the header.
  *
  * XXX: This function actively does text protocol interpretation, see #1088
@@ -464,6 +621,7 @@ process_meta(ClientHandler* self, char* key, char* value)
        */
 
       start_time = atoi(value);
+      database_lock(self->database);
       if (self->database->start_time == 0) {
         // seed it with a time in the past
         self->database->start_time = start_time;// - 100;
@@ -472,6 +630,7 @@ process_meta(ClientHandler* self, char* key, char* value)
         self->database->set_metadata (self->database, "start_time", s);
       }
       self->time_offset = start_time - self->database->start_time;
+      database_unlock(self->database);
       return 0;
     }
 
@@ -488,7 +647,7 @@ process_meta(ClientHandler* self, char* key, char* value)
       return -2;
 
     } else {
-      self->sender_id = self->database->add_sender_id(self->database, value);
+      self->sender_id = database_add_sender_id(self->database, value);
       self->sender_name = oml_strndup (value, strlen (value));
       return 0;
     }
@@ -534,6 +693,32 @@ process_meta(ClientHandler* self, char* key, char* value)
       return -2;
     }
 
+  } else if (strcmp(key, "encapsulation") == 0) {
+    if (self->state != C_HEADER || self->inflater) {
+      logwarn("%s: Meta '%s' is only valid once in the headers, ignoring\n",
+          self->name, key);
+      return -1;
+
+    } else if (strcmp(value, "deflate") == 0) {
+#ifdef HAVE_LIBZ
+      logdebug("%s: Decompressing data from now on\n", self->name);
+      if (client_handler_start_inflate(self)) {
+        self->state = C_PROTOCOL_ERROR;
+        return -2;
+      }
+      return 0;
+#else
+      logerror("%s: Compressed data is not supported, as the server was built without zlib\n", self->name);
+      self->state = C_PROTOCOL_ERROR;
+      return -2;
+#endif
+
+    } else {
+      logerror("%s: Unknown encapsulation '%s'\n", self->name, value);
+      self->state = C_PROTOCOL_ERROR;
+      return -2;
+    }
+
   } else {
     /* Unknown key, let the caller deal with it */
     return 1;
@@ -635,9 +820,10 @@ process_header(ClientHandler* self, MBuffer* mbuf)
  * into the storage backend.
  * \param self ClientHandler
  * \param header OmlBinaryHeader of the message
+ * \return 1 if the sample was read from the MBuffer, 0 otherwise
  * \see process_bin_message, unmarshal_init
  */
-static void
+static int
 process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
 {
   double ts;
@@ -657,7 +843,7 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
   if (header->stream < 0 || table_index >= self->table_count) {
     logwarn("%s(bin): Table index %d out of bounds, discarding sample %d\n",
         self->name, table_index, seqno);
-    return;
+    return 0;
   }
 
   ts += self->time_offset;
@@ -673,7 +859,7 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
       self->tables[table_index] = table;
     } else {
       logerror("%s(bin): Undefined table index %d\n", self->name, table_index);
-      return;
+      return 0;
     }
   }
 
@@ -688,11 +874,11 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
   if (count<-100) {
     logerror("%s(bin): An error occured during unmarshalling (%d)\n",
         self->name, count);
-    return;
+    return 0;
   } else if (schema->nfields != count) {
     logerror("%s(bin): Data item number mismatch for schema '%s' (expected %d, got %d)\n",
         self->name, schema->name, schema->nfields, count - 3);
-    return;
+    return 0;
   }
   mbuf_consume_message (mbuf);
 
@@ -714,7 +900,7 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
     }
     if (ki<0 || vi<0 || si<0) {
       logerror("%s(bin): Trying to process metadata from a schema without 'subject', 'key' or 'value' fields\n", self->name);
-      return;
+      return 1;
 
     } else if (oml_value_get_type(&v[si]) != OML_STRING_VALUE ) {
       logwarn("%s(bin): Expecting metadata, but subject is not a string (%d), ignoring\n",
@@ -737,14 +923,54 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
           omlc_get_string_ptr(*oml_value_get_value(&v[ki])),
           omlc_get_string_ptr(*oml_value_get_value(&v[vi]))) <= 0) {
       logdebug("%s(bin): No need to store metadata separately\n", self->name);
-      return;
+      return 1;
     }
   }
 
   logdebug("%s(bin): Inserting data into table index %d '%s' (seqno=%d, ts=%f)\n",
       self->name, table_index, table->schema->name, seqno, ts);
-  self->database->insert(self->database, table, self->sender_id, header->seqno,
+  database_insert_from(self->database, self->account, table, self->sender_id, header->seqno,
       ts, self->values_vectors[table_index], count);
+  return 1;
+}
+
+/** Process all the rows of a batch message.
+ *
+ * Each row is read with unmarshal_batch_row, then processed as a separate
+ * sample by process_bin_data_message. If a row cannot be processed, the rest
+ * of the message is skipped.
+ *
+ * \param self ClientHandler
+ * \param header OmlBinaryHeader of the message, as returned by unmarshal_init2
+ * \see process_bin_message, process_bin_data_message, unmarshal_batch_row, \ref omspbinbatch
+ */
+static void
+process_bin_batch_message(ClientHandler* self, OmlBinaryHeader* header)
+{
+  MBuffer* mbuf = self->mbuf;
+  /* Packet headers are 5 bytes long, or 7 for long packets */
+  size_t end = mbuf_message_offset(mbuf) + header->length +
+    (OMB_BATCH_P == header->type ? 5 : 7);
+  int i;
+
+  for (i = 0; i < header->rows; i++) {
+    if (unmarshal_batch_row(mbuf, header, self->bin_streams)) {
+      logerror("%s(bin): Could not read row %d of %d in batch for table index %d\n",
+          self->name, i + 1, header->rows, header->stream);
+      break;
+    } else if (!process_bin_data_message(self, header)) {
+      break;
+    }
+  }
+
+  if (i < header->rows) {
+    logwarn("%s(bin): Discarding %d rows of batch for table index %d\n",
+        self->name, header->rows - i, header->stream);
+    if (mbuf_read_offset(mbuf) < end) {
+      mbuf_read_skip(mbuf, end - mbuf_read_offset(mbuf));
+    }
+    mbuf_consume_message(mbuf);
+  }
 }
 
 /** Read binary data from an MBuffer
@@ -773,7 +999,13 @@ process_bin_message(ClientHandler* self, MBuffer* mbuf)
     return 0;
   }
 
-  res = unmarshal_init(mbuf, &header);
+  if (NULL == self->bin_streams &&
+      NULL == (self->bin_streams = oml_calloc(OMB_MAX_STREAMS, sizeof(OmlBinStreamState)))) {
+    logerror("%s(bin): Cannot allocate decoding state\n", self->name);
+    return 0;
+  }
+
+  res = unmarshal_init2(mbuf, &header, self->bin_streams);
   if (res == 0) {
     logwarn("%s(bin): Could not find message header\n", self->name);
     return 0;
@@ -786,10 +1018,18 @@ process_bin_message(ClientHandler* self, MBuffer* mbuf)
   switch (header.type) {
   case OMB_DATA_P:
   case OMB_LDATA_P:
+  case OMB_CDATA_P:
+  case OMB_LCDATA_P:
     process_bin_data_message(self, &header);
     if (self->state != C_BINARY_DATA)
       return 0;
     break;
+  case OMB_BATCH_P:
+  case OMB_LBATCH_P:
+    process_bin_batch_message(self, &header);
+    if (self->state != C_BINARY_DATA)
+      return 0;
+    break;
   default:
     logwarn("%s(bin): Ignoring unsupported message type '%d'\n", self->name, header.type);
     /* XXX: Assume we could read the full header, just skip it
@@ -918,7 +1158,7 @@ process_text_data_message(ClientHandler* self, char** msg, int count)
 
   logdebug("%s(txt): Inserting data into table index %d '%s' (seqno=%d, ts=%f)\n",
       self->name, table_index, table->schema->name, seqno, ts);
-  self->database->insert(self->database, table, self->sender_id, seqno,
+  database_insert_from(self->database, self->account, table, self->sender_id, seqno,
       ts, self->values_vectors[table_index], count - 3); /* Ignore first 3 elements */
 }
 
@@ -981,8 +1221,9 @@ process_text_message(ClientHandler* self, MBuffer* mbuf)
 /** * Callback function called when the socket receive some data
  * \param source the socket event
  * \param handle the client handler
- * \param buf data received from the socket
+ * \param buf data received from the socket; already in the MBuffer if self->direct_read is set
  * \param bufsize the size of the data set from the socket
+ * \see eventloop_socket_set_mbuf
  */
   void
 client_callback(SockEvtSource* source, void* handle, void* buf, int buf_size)
@@ -1003,9 +1244,15 @@ client_callback(SockEvtSource* source, void* handle, void* buf, int buf_size)
     oml_free(in);
   }
 
-  int result = mbuf_write (mbuf, buf, buf_size);
+#ifdef HAVE_LIBZ
+  if (self->inflater) {
+    if (client_handler_inflate(self, buf, buf_size) < 0) {
+      self->state = C_PROTOCOL_ERROR;
+    }
 
-  if (result == -1) {
+  } else
+#endif
+  if (!self->direct_read && mbuf_write (mbuf, buf, buf_size) == -1) {
     logerror("%s: Failed to write message from client into message buffer\n",
         source->name);
     return;
@@ -1052,6 +1299,9 @@ process:
   // move remaining buffer content to beginning
   mbuf_repack_message (mbuf);
   logdebug2("%s: Buffer repacked to %d bytes\n", source->name, mbuf_fill(mbuf));
+
+  // stop reading if our samples are not inserted fast enough
+  backpressure_check (self);
 }
 /** Callback function called when the status of the socket change
  * \param source the socket event
@@ -28,8 +28,10 @@
 #include <ocomm/o_eventloop.h>
 #include <oml2/oml_writer.h>
 #include <mbuf.h>
+#include <marshal.h>
 
 #include "database.h"
+#include "ingest.h"
 
 #define MAX_PROTOCOL_VERSION OML_PROTOCOL_VERSION
 #define MIN_PROTOCOL_VERSION 1
@@ -64,9 +66,23 @@ typedef struct _clientHandler {
   Socket*     socket;
   SockEvtSource *event;
   MBuffer* mbuf;
+  int         direct_read;  // if set, the EventLoop receives data directly
+                            // into mbuf before calling client_callback
 
   time_t      time_offset;  // value to add to remote ts to
                             // sync time across all connections
+
+  OmlBinStreamState *bin_streams; // delta-decoding state of compact binary
+                                  // messages, OMB_MAX_STREAMS long
+
+  struct z_stream_s* inflater; // decompressor for encapsulated data, or NULL
+
+  IngestAccount* account;   // memory used by this client's queued samples
+  int         paused;       // if set, data is not read from the socket \see backpressure_check
+  double      paused_since; // monotonic time at which the current pause started [s]
+  double      paused_time;  // total time of the previous pauses [s]
+  unsigned int pauses;      // number of times reading was paused
+  struct _clientHandler *paused_next; // next paused ClientHandler of this thread
 } ClientHandler;
 
 ClientHandler* client_handler_new (Socket* new_sock);
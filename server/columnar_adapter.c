@@ -0,0 +1,1469 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file columnar_adapter.c
+ * \brief Adapter code for the append-only columnar database backend.
+ *
+ * Each database is a directory, DATA-DIR/DATABASE.col, containing
+ *
+ * - _experiment_metadata: key-value pairs, one per line, separated by a tab;
+ * - _senders: names and IDs of the senders, in the same format;
+ * - one subdirectory per measurement table.
+ *
+ * A table directory contains a manifest, holding the schema of the table (as
+ * output by schema_to_meta()) and the number of committed samples, and one
+ * or two segment files per column, OML columns (oml_sender_id, oml_seq,
+ * oml_ts_client and oml_ts_server) included.  Fixed-width values are stored
+ * back to back in COLUMN.dat, in host byte order: int32 and uint32 as 4
+ * bytes, int64, uint64, guid and double as 8, and bool as 1.  Strings, blobs
+ * and vectors (as their raw elements) are stored in a heap, COLUMN.dat, and
+ * the offset of the end of each value in the heap is stored in COLUMN.off, as
+ * an 8-byte integer.
+ *
+ * Segment files are only ever appended to, through a window mapped in
+ * memory. Committing syncs them to disk, then updates the manifest; when a
+ * table is reopened, anything written after the last commit is discarded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "mstring.h"
+#include "oml_value.h"
+#include "oml_util.h"
+#include "schema.h"
+#include "database.h"
+#include "table_descr.h"
+#include "sqlite_adapter.h"
+#include "columnar_adapter.h"
+
+static char backend_name[] = "columnar";
+/** Commit samples at most that many milliseconds after receiving them */
+int columnar_commit_latency = COL_DEFAULT_COMMIT_LATENCY;
+
+/** Number of segment files currently open, in all databases */
+static long col_open_segments = 0;
+/** Number of segment files above which tables are suspended before reopening others
+ * \see col_insert */
+static long col_max_open_segments = 512;
+
+/** Columns stored before those of the schema in every table */
+static struct {
+  const char *name;
+  OmlValueT type;
+} col_oml_columns[] = {
+  { "oml_sender_id", OML_INT32_VALUE },
+  { "oml_seq", OML_INT32_VALUE },
+  { "oml_ts_client", OML_DOUBLE_VALUE },
+  { "oml_ts_server", OML_DOUBLE_VALUE },
+};
+
+/* Functions needed by the Database struct */
+static OmlValueT col_type_to_oml (const char *s);
+static const char *col_oml_to_type (OmlValueT T);
+static int col_stmt(Database* db, const char* stmt);
+static void col_release(Database* db);
+static int col_table_create (Database* db, DbTable* table, int shallow);
+static int col_table_create_meta (Database *db, const char *name);
+static int col_table_free (Database *database, DbTable* table);
+static char *col_prepared_var(Database *db, unsigned int order);
+static MString* col_prepare(Database *db, DbTable* table);
+static int col_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count);
+static int col_flush(Database *db);
+static char* col_get_metadata (Database* database, const char* key);
+static int col_set_metadata (Database* database, const char* key, const char* value);
+static int col_add_sender_id(Database* database, const char* sender_id);
+static char* col_get_uri(Database *db, char *uri, size_t size);
+static TableDescr* col_get_table_list (Database *database, int *num_tables);
+
+/** Setup the columnar backend.
+ *
+ * Databases are created in the same directory as SQLite3 ones.
+ *
+ * \return 0 on success, -1 otherwise
+ *
+ * \see database_setup_backend, sq3_dbdir_setup
+ */
+int
+col_backend_setup (void)
+{
+  struct rlimit rl;
+
+  sq3_dbdir_setup ();
+
+  /* See sq3_backend_setup() about the use of access(2) */
+  if (access (sqlite_database_dir, R_OK | W_OK | X_OK) == -1) {
+    logerror ("columnar: Can't access database directory %s: %s\n",
+         sqlite_database_dir, strerror (errno));
+    return -1;
+  }
+
+  /* Leave file descriptors for clients and other databases */
+  if (!getrlimit (RLIMIT_NOFILE, &rl) && rl.rlim_cur != RLIM_INFINITY && (long)rl.rlim_cur / 2 > 0) {
+    col_max_open_segments = rl.rlim_cur / 2;
+  }
+
+  loginfo ("columnar: Creating columnar databases in %s\n", sqlite_database_dir);
+
+  return 0;
+}
+
+/** Mapping from stored to OML types; the backend uses OML's own names.
+ * \see db_adapter_type_to_oml, oml_type_from_s
+ */
+static OmlValueT
+col_type_to_oml (const char *type)
+{
+  return oml_type_from_s (type);
+}
+
+/** Mapping from OML to stored types; the backend uses OML's own names.
+ * \see db_adapter_oml_to_type, oml_type_to_s
+ */
+static const char*
+col_oml_to_type (OmlValueT type)
+{
+  return oml_type_to_s (type);
+}
+
+/** Size of the stored values of a type.
+ *
+ * \param type OmlValueT of the values
+ * \return the size of one value [B], or 0 if values have a variable size
+ */
+static size_t
+col_type_width (OmlValueT type)
+{
+  switch (type) {
+  case OML_LONG_VALUE:
+  case OML_INT32_VALUE:
+  case OML_UINT32_VALUE:
+    return 4;
+  case OML_INT64_VALUE:
+  case OML_UINT64_VALUE:
+  case OML_GUID_VALUE:
+  case OML_DOUBLE_VALUE:
+    return 8;
+  case OML_BOOL_VALUE:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/** There is no SQL in this backend.
+ * \see db_adapter_stmt
+ */
+static int
+col_stmt(Database* db, const char* stmt)
+{
+  logerror("columnar:%s: Cannot execute SQL statement '%s'\n", db->name, stmt);
+  return -1;
+}
+
+/** There are no prepared statements in this backend.
+ * \see db_adapter_prepared_var
+ */
+static char*
+col_prepared_var(Database *db, unsigned int order)
+{
+  (void)db;
+  (void)order;
+  return NULL;
+}
+
+/** There are no prepared statements in this backend.
+ * \see db_adapter_prepare
+ */
+static MString*
+col_prepare(Database *db, DbTable* table)
+{
+  (void)db;
+  (void)table;
+  return NULL;
+}
+
+/** Read a whole text file.
+ *
+ * \param path path to the file
+ * \return an MString with the contents of the file, to be mstring_delete()d by the caller, or NULL with errno set
+ */
+static MString*
+col_read_file (const char *path)
+{
+  char buf[4096];
+  size_t n;
+  MString *s;
+  FILE *f = fopen (path, "r");
+
+  if (!f) {
+    return NULL;
+  }
+  s = mstring_create ();
+  while ((n = fread (buf, 1, sizeof (buf) - 1, f)) > 0) {
+    buf[n] = '\0';
+    mstring_cat (s, buf);
+  }
+  if (ferror (f)) {
+    mstring_delete (s);
+    s = NULL;
+  }
+  fclose (f);
+  return s;
+}
+
+/** Write a file atomically, by writing and syncing a temporary file, and renaming it.
+ *
+ * \param path path to the file
+ * \param contents text to write
+ * \return 0 on success, -1 otherwise, with errno set
+ */
+static int
+col_write_file (const char *path, const char *contents)
+{
+  MString *tmp = mstring_create ();
+  FILE *f = NULL;
+  int ret = -1;
+
+  mstring_sprintf (tmp, "%s.tmp", path);
+  if ((f = fopen (mstring_buf (tmp), "w")) &&
+      fputs (contents, f) >= 0 &&
+      !fflush (f) &&
+      !fsync (fileno (f))) {
+    ret = 0;
+  }
+  if (f && fclose (f)) {
+    ret = -1;
+  }
+  if (!ret && rename (mstring_buf (tmp), path)) {
+    ret = -1;
+  }
+  mstring_delete (tmp);
+  return ret;
+}
+
+/** Append a string to an MString, escaping backslashes, tabs and newlines.
+ *
+ * \param out MString to append to
+ * \param s string to escape
+ * \return 0 on success, -1 otherwise
+ * \see col_unescape
+ */
+static int
+col_escape (MString *out, const char *s)
+{
+  char c[3] = { '\\', '\0', '\0' };
+  const char *p;
+
+  for (p = s; *p; p++) {
+    switch (*p) {
+    case '\\': c[1] = '\\'; break;
+    case '\t': c[1] = 't'; break;
+    case '\n': c[1] = 'n'; break;
+    default: c[1] = '\0';
+    }
+    if (c[1]) {
+      if (mstring_cat (out, c)) { return -1; }
+    } else if (mstring_sprintf (out, "%c", *p)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/** Unescape a string in place.
+ *
+ * \param s string escaped by col_escape
+ * \return s
+ * \see col_escape
+ */
+static char*
+col_unescape (char *s)
+{
+  char *p = s, *q = s;
+
+  while (*p) {
+    if (*p == '\\' && p[1]) {
+      p++;
+      *q++ = *p == 't' ? '\t' : *p == 'n' ? '\n' : *p;
+      p++;
+    } else {
+      *q++ = *p++;
+    }
+  }
+  *q = '\0';
+  return s;
+}
+
+/** Find a pair in a list.
+ *
+ * \param list first ColPair of the list
+ * \param key key to look for
+ * \return the ColPair for key, or NULL if not found
+ */
+static ColPair*
+col_pair_find (ColPair *list, const char *key)
+{
+  for (; list; list = list->next) {
+    if (!strcmp (list->key, key)) {
+      return list;
+    }
+  }
+  return NULL;
+}
+
+/** Add a pair in front of a list.
+ *
+ * \param list pointer to the first ColPair of the list, updated
+ * \param key key of the new pair, copied
+ * \param value value of the new pair, copied
+ * \return the new ColPair
+ */
+static ColPair*
+col_pair_add (ColPair **list, const char *key, const char *value)
+{
+  ColPair *pair = oml_malloc (sizeof (ColPair));
+
+  pair->key = oml_strndup (key, strlen (key));
+  pair->value = oml_strndup (value, strlen (value));
+  pair->next = *list;
+  *list = pair;
+  return pair;
+}
+
+/** Free a list of pairs.
+ * \param list first ColPair of the list
+ */
+static void
+col_pair_list_free (ColPair *list)
+{
+  ColPair *next;
+
+  for (; list; list = next) {
+    next = list->next;
+    oml_free (list->key);
+    oml_free (list->value);
+    oml_free (list);
+  }
+}
+
+/** Load a list of pairs from a file.
+ *
+ * A missing file is an empty list.
+ *
+ * \param path path to the file
+ * \param[out] list pointer to the first ColPair of the list, updated
+ * \return 0 on success, -1 otherwise, with errno set
+ */
+static int
+col_pair_list_load (const char *path, ColPair **list)
+{
+  MString *contents = col_read_file (path);
+  char *line, *next, *tab;
+
+  if (!contents) {
+    return errno == ENOENT ? 0 : -1;
+  }
+  for (line = mstring_buf (contents); *line; line = next) {
+    if ((next = strchr (line, '\n'))) {
+      *next++ = '\0';
+    } else {
+      next = line + strlen (line);
+    }
+    if ((tab = strchr (line, '\t'))) {
+      *tab++ = '\0';
+      col_pair_add (list, col_unescape (line), col_unescape (tab));
+    }
+  }
+  mstring_delete (contents);
+  return 0;
+}
+
+/** Append a pair to an MString, in the format of the metadata and senders files.
+ *
+ * \param out MString to append to
+ * \param pair ColPair to append
+ * \return 0 on success, -1 otherwise
+ */
+static int
+col_pair_format (MString *out, ColPair *pair)
+{
+  return (col_escape (out, pair->key) || mstring_cat (out, "\t") ||
+      col_escape (out, pair->value) || mstring_cat (out, "\n")) ? -1 : 0;
+}
+
+/** Open a segment file, dropping anything beyond its committed size.
+ *
+ * \param seg ColSegment to initialise
+ * \param path path to the file, created if needed
+ * \param used committed size of the file [B]
+ * \return 0 on success, -1 otherwise
+ */
+static int
+col_segment_open (ColSegment *seg, const char *path, off_t used)
+{
+  struct stat st;
+
+  seg->path = oml_strndup (path, strlen (path));
+  seg->map = NULL;
+  seg->base = 0;
+  seg->size = seg->used = used;
+  if ((seg->fd = open (path, O_RDWR | O_CREAT, 0644)) < 0) {
+    logerror ("columnar: Could not open segment file %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+  if (fstat (seg->fd, &st)) {
+    logerror ("columnar: Could not stat segment file %s: %s\n", path, strerror (errno));
+
+  } else if (st.st_size < used) {
+    logerror ("columnar: Segment file %s is truncated (%jd bytes, %jd expected)\n",
+        path, (intmax_t)st.st_size, (intmax_t)used);
+
+  } else if (st.st_size > used && ftruncate (seg->fd, used)) {
+    logerror ("columnar: Could not drop uncommitted data from segment file %s: %s\n",
+        path, strerror (errno));
+
+  } else {
+    __atomic_fetch_add (&col_open_segments, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  close (seg->fd);
+  seg->fd = -1;
+  return -1;
+}
+
+/** Reopen a segment file closed by col_segment_close.
+ *
+ * \param seg ColSegment to reopen
+ * \return 0 on success, -1 otherwise, with errno set
+ */
+static int
+col_segment_reopen (ColSegment *seg)
+{
+  if ((seg->fd = open (seg->path, O_RDWR)) < 0) {
+    return -1;
+  }
+  __atomic_fetch_add (&col_open_segments, 1, __ATOMIC_RELAXED);
+  /* The file was trimmed when closed */
+  seg->size = seg->used;
+  return 0;
+}
+
+/** Map the window of a segment file where the next bytes will be appended.
+ *
+ * The file is reopened if needed, and extended to cover the whole window.
+ *
+ * \param seg ColSegment to map
+ * \return 0 on success, -1 otherwise, with errno set
+ */
+static int
+col_segment_map (ColSegment *seg)
+{
+  off_t base = seg->used - seg->used % COL_SEGMENT_WINDOW;
+  void *map;
+
+  if (seg->fd < 0 && col_segment_reopen (seg)) {
+    return -1;
+  }
+  if (seg->map) {
+    munmap (seg->map, COL_SEGMENT_WINDOW);
+    seg->map = NULL;
+  }
+  if (seg->size < base + COL_SEGMENT_WINDOW) {
+    if (ftruncate (seg->fd, base + COL_SEGMENT_WINDOW)) {
+      return -1;
+    }
+    seg->size = base + COL_SEGMENT_WINDOW;
+  }
+  map = mmap (NULL, COL_SEGMENT_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, base);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+  seg->map = map;
+  seg->base = base;
+  return 0;
+}
+
+/** Append data to a segment file.
+ *
+ * \param seg ColSegment to append to
+ * \param buf data to append
+ * \param len length of buf [B]
+ * \return 0 on success, -1 otherwise, with errno set
+ */
+static int
+col_segment_append (ColSegment *seg, const void *buf, size_t len)
+{
+  const char *p = buf;
+  size_t n;
+
+  while (len > 0) {
+    if (!seg->map || seg->used >= seg->base + COL_SEGMENT_WINDOW) {
+      if (col_segment_map (seg)) {
+        return -1;
+      }
+    }
+    n = seg->base + COL_SEGMENT_WINDOW - seg->used;
+    if (n > len) {
+      n = len;
+    }
+    memcpy (seg->map + (seg->used - seg->base), p, n);
+    seg->used += n;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/** Forget the data appended to a segment file after a given size.
+ *
+ * \param seg ColSegment to rewind
+ * \param used size to go back to [B]
+ */
+static void
+col_segment_rewind (ColSegment *seg, off_t used)
+{
+  seg->used = used;
+  if (seg->map && used < seg->base) {
+    munmap (seg->map, COL_SEGMENT_WINDOW);
+    seg->map = NULL;
+  }
+}
+
+/** Write the contents of a segment file to disk.
+ *
+ * \param seg ColSegment to sync
+ * \return 0 on success, -1 otherwise, with errno set
+ */
+static int
+col_segment_sync (ColSegment *seg)
+{
+  if (seg->fd < 0) {
+    return 0;
+  }
+  if (seg->map && msync (seg->map, COL_SEGMENT_WINDOW, MS_SYNC)) {
+    return -1;
+  }
+  return fsync (seg->fd);
+}
+
+/** Close a segment file, trimming it to the data written.
+ *
+ * The segment can be appended to again, which reopens the file.
+ *
+ * \param seg ColSegment to close
+ */
+static void
+col_segment_close (ColSegment *seg)
+{
+  if (seg->fd < 0) {
+    return;
+  }
+  if (seg->map) {
+    munmap (seg->map, COL_SEGMENT_WINDOW);
+    seg->map = NULL;
+  }
+  if (seg->size > seg->used && ftruncate (seg->fd, seg->used)) {
+    logwarn ("columnar: Could not trim segment file: %s\n", strerror (errno));
+  }
+  close (seg->fd);
+  seg->fd = -1;
+  __atomic_fetch_sub (&col_open_segments, 1, __ATOMIC_RELAXED);
+}
+
+/** Append a value to a column.
+ *
+ * \param col ColColumn to append to
+ * \param buf value to append
+ * \param len length of buf, which must be col->width for fixed-width columns [B]
+ * \return 0 on success, -1 otherwise, with errno set
+ */
+static int
+col_column_append (ColColumn *col, const void *buf, size_t len)
+{
+  uint64_t end;
+
+  if (col_segment_append (&col->data, buf, len)) {
+    return -1;
+  }
+  if (col->width) {
+    return 0;
+  }
+  end = col->data.used;
+  return col_segment_append (&col->offsets, &end, sizeof (end));
+}
+
+/** Append an OmlValue to a column.
+ *
+ * \param col ColColumn to append to
+ * \param v OmlValue of the type of the column
+ * \return 0 on success, -1 otherwise, with errno set
+ */
+static int
+col_column_append_value (ColColumn *col, OmlValue *v)
+{
+  OmlValueU *u = oml_value_get_value (v);
+  const char *s;
+  union {
+    int32_t i32;
+    uint32_t u32;
+    int64_t i64;
+    uint64_t u64;
+    double d;
+    uint8_t b;
+  } x;
+
+  switch (col->type) {
+  case OML_LONG_VALUE:   x.i32 = (int32_t)omlc_get_long (*u); break;
+  case OML_INT32_VALUE:  x.i32 = omlc_get_int32 (*u); break;
+  case OML_UINT32_VALUE: x.u32 = omlc_get_uint32 (*u); break;
+  case OML_INT64_VALUE:  x.i64 = omlc_get_int64 (*u); break;
+  case OML_UINT64_VALUE: x.u64 = omlc_get_uint64 (*u); break;
+  case OML_GUID_VALUE:   x.u64 = omlc_get_guid (*u); break;
+  case OML_DOUBLE_VALUE: x.d = omlc_get_double (*u); break;
+  case OML_BOOL_VALUE:   x.b = omlc_get_bool (*u) ? 1 : 0; break;
+
+  case OML_STRING_VALUE:
+    s = omlc_get_string_ptr (*u);
+    return col_column_append (col, s, s ? strlen (s) : 0);
+  case OML_BLOB_VALUE:
+    return col_column_append (col, omlc_get_blob_ptr (*u), omlc_get_blob_length (*u));
+  case OML_VECTOR_DOUBLE_VALUE:
+  case OML_VECTOR_INT32_VALUE:
+  case OML_VECTOR_UINT32_VALUE:
+  case OML_VECTOR_INT64_VALUE:
+  case OML_VECTOR_UINT64_VALUE:
+  case OML_VECTOR_BOOL_VALUE:
+    return col_column_append (col, omlc_get_vector_ptr (*u), omlc_get_vector_length (*u));
+
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+  return col_column_append (col, &x, col->width);
+}
+
+/** Read the manifest of a table.
+ *
+ * \param path path to the manifest
+ * \param[out] meta if not NULL, set to an oml_malloc'd copy of the schema of the table
+ * \param[out] rows if not NULL, set to the number of committed samples
+ * \return 0 on success, -1 otherwise
+ */
+static int
+col_read_manifest (const char *path, char **meta, uint64_t *rows)
+{
+  MString *contents = col_read_file (path);
+  char *line, *next;
+  int have_meta = 0, have_rows = 0;
+
+  if (!contents) {
+    return -1;
+  }
+  for (line = mstring_buf (contents); *line; line = next) {
+    if ((next = strchr (line, '\n'))) {
+      *next++ = '\0';
+    } else {
+      next = line + strlen (line);
+    }
+    if (!strncmp (line, "schema ", 7)) {
+      if (meta) {
+        *meta = oml_strndup (line + 7, strlen (line + 7));
+      }
+      have_meta = 1;
+    } else if (!strncmp (line, "rows ", 5)) {
+      if (rows) {
+        *rows = strtoull (line + 5, NULL, 10);
+      }
+      have_rows = 1;
+    }
+  }
+  mstring_delete (contents);
+
+  if (!(have_meta && have_rows)) {
+    if (meta && have_meta) {
+      oml_free (*meta);
+      *meta = NULL;
+    }
+    return -1;
+  }
+  return 0;
+}
+
+/** Write the manifest of a table.
+ *
+ * \param path directory of the table
+ * \param schema schema of the table
+ * \param rows number of committed samples
+ * \return 0 on success, -1 otherwise, with errno set
+ */
+static int
+col_write_manifest (const char *path, const struct schema *schema, uint64_t rows)
+{
+  MString *manifest = mstring_create (), *contents = mstring_create ();
+  char *meta = schema_to_meta (schema);
+  int ret;
+
+  mstring_sprintf (manifest, "%s/" COL_MANIFEST, path);
+  mstring_sprintf (contents, "schema %s\nrows %" PRIu64 "\n", meta, rows);
+  ret = col_write_file (mstring_buf (manifest), mstring_buf (contents));
+
+  oml_free (meta);
+  mstring_delete (contents);
+  mstring_delete (manifest);
+  return ret;
+}
+
+/** Close the segment files of a table, until more samples are appended to it.
+ *
+ * This keeps the number of open files down in databases with many tables.
+ *
+ * \param coltable ColTable to suspend
+ */
+static void
+col_table_suspend (ColTable *coltable)
+{
+  int i;
+
+  for (i = 0; i < coltable->ncolumns; i++) {
+    col_segment_close (&coltable->columns[i].data);
+    col_segment_close (&coltable->columns[i].offsets);
+  }
+}
+
+/** Check whether the segment files of a table are closed.
+ * \param coltable ColTable to check
+ * \return 1 if no segment file is open, 0 otherwise
+ * \see col_table_suspend
+ */
+static int
+col_table_suspended (ColTable *coltable)
+{
+  int i;
+
+  for (i = 0; i < coltable->ncolumns; i++) {
+    if (coltable->columns[i].data.fd >= 0 || coltable->columns[i].offsets.fd >= 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/** Close the segment files of a table, and free it.
+ * \param coltable ColTable to close
+ */
+static void
+col_table_close (ColTable *coltable)
+{
+  int i;
+
+  col_table_suspend (coltable);
+  for (i = 0; i < coltable->ncolumns; i++) {
+    if (coltable->columns[i].data.path) { oml_free (coltable->columns[i].data.path); }
+    if (coltable->columns[i].offsets.path) { oml_free (coltable->columns[i].offsets.path); }
+  }
+  oml_free (coltable->columns);
+  oml_free (coltable->path);
+  oml_free (coltable);
+}
+
+/** Open the segment files of a table, with a given number of committed samples.
+ *
+ * \param path directory of the table
+ * \param schema schema of the table
+ * \param rows number of committed samples
+ * \return a new ColTable, or NULL on error
+ */
+static ColTable*
+col_table_open (const char *path, const struct schema *schema, uint64_t rows)
+{
+  ColTable *coltable = oml_malloc (sizeof (ColTable));
+  MString *file = mstring_create ();
+  ColColumn *col;
+  uint64_t end;
+  int i;
+
+  coltable->path = oml_strndup (path, strlen (path));
+  coltable->ncolumns = LENGTH (col_oml_columns) + schema->nfields;
+  coltable->columns = oml_malloc (coltable->ncolumns * sizeof (ColColumn));
+  coltable->nrows = coltable->committed = rows;
+  coltable->nsegments = 0;
+
+  for (i = 0; i < coltable->ncolumns; i++) {
+    coltable->columns[i].data.path = coltable->columns[i].offsets.path = NULL;
+    coltable->columns[i].data.fd = coltable->columns[i].offsets.fd = -1;
+  }
+
+  for (i = 0; i < coltable->ncolumns; i++) {
+    col = &coltable->columns[i];
+    if (i < (int)LENGTH (col_oml_columns)) {
+      col->name = col_oml_columns[i].name;
+      col->type = col_oml_columns[i].type;
+    } else {
+      col->name = schema->fields[i - LENGTH (col_oml_columns)].name;
+      col->type = schema->fields[i - LENGTH (col_oml_columns)].type;
+    }
+    col->width = col_type_width (col->type);
+    col->end = 0;
+    coltable->nsegments += col->width ? 1 : 2;
+
+    if (!col->width) {
+      mstring_set (file, "");
+      mstring_sprintf (file, "%s/%s.off", path, col->name);
+      if (col_segment_open (&col->offsets, mstring_buf (file), rows * sizeof (end))) {
+        goto fail_exit;
+      }
+      if (rows > 0) {
+        if (pread (col->offsets.fd, &end, sizeof (end), (rows - 1) * sizeof (end)) != sizeof (end)) {
+          logerror ("columnar: Could not read the size of the heap from %s: %s\n",
+              mstring_buf (file), strerror (errno));
+          goto fail_exit;
+        }
+        col->end = end;
+      }
+    }
+
+    mstring_set (file, "");
+    mstring_sprintf (file, "%s/%s.dat", path, col->name);
+    if (col_segment_open (&col->data, mstring_buf (file),
+          col->width ? rows * col->width : (uint64_t)col->end)) {
+      goto fail_exit;
+    }
+  }
+
+  /* Files are reopened when samples are appended */
+  col_table_suspend (coltable);
+  mstring_delete (file);
+  return coltable;
+
+fail_exit:
+  mstring_delete (file);
+  col_table_close (coltable);
+  return NULL;
+}
+
+/** Write the samples of a table to disk, and record them in its manifest.
+ *
+ * \param db Database containing the table
+ * \param table DbTable with a ColTable handle
+ * \return 0 on success, -1 otherwise
+ */
+static int
+col_table_commit (Database *db, DbTable *table)
+{
+  ColTable *coltable = (ColTable*)table->handle;
+  int i;
+
+  if (coltable->nrows == coltable->committed) {
+    return 0;
+  }
+  for (i = 0; i < coltable->ncolumns; i++) {
+    if (col_segment_sync (&coltable->columns[i].data) ||
+        (!coltable->columns[i].width && col_segment_sync (&coltable->columns[i].offsets))) {
+      logerror ("columnar:%s: Could not sync column '%s' of table '%s': %s\n",
+          db->name, coltable->columns[i].name, table->schema->name, strerror (errno));
+      return -1;
+    }
+  }
+  if (col_write_manifest (coltable->path, table->schema, coltable->nrows)) {
+    logerror ("columnar:%s: Could not update the manifest of table '%s': %s\n",
+        db->name, table->schema->name, strerror (errno));
+    return -1;
+  }
+  logdebug2 ("columnar:%s: Committed %" PRIu64 " samples to table '%s'\n",
+      db->name, coltable->nrows - coltable->committed, table->schema->name);
+  coltable->committed = coltable->nrows;
+  return 0;
+}
+
+/** Commit the samples of all tables.
+ *
+ * Tables which did not receive any sample since the previous commit are
+ * suspended, so only the files of active tables are kept open.
+ *
+ * \param db Database to commit
+ * \return 0 on success, -1 otherwise
+ * \see col_table_commit, col_table_suspend
+ */
+static int
+col_commit(Database *db)
+{
+  ColDB *coldb = (ColDB*)db->handle;
+  ColTable *coltable;
+  DbTable *table;
+  int ret = 0;
+
+  for (table = db->first_table; table; table = table->next) {
+    if (!(coltable = (ColTable*)table->handle)) {
+      continue;
+    }
+    if (coltable->nrows == coltable->committed) {
+      col_table_suspend (coltable);
+    } else if (col_table_commit(db, table)) {
+      ret = -1;
+    }
+  }
+  coldb->txn_start = 0;
+
+  return ret;
+}
+
+/** Commit the samples of all tables, and suspend them all.
+ *
+ * This is done early when too many segment files are open.  Tables which
+ * could not be committed are left open, so their files are synced by the
+ * next commit.
+ *
+ * \param db Database to suspend
+ * \return 0 on success, -1 otherwise
+ * \see col_commit, col_table_suspend
+ */
+static int
+col_suspend(Database *db)
+{
+  ColTable *coltable;
+  DbTable *table;
+  int ret = col_commit (db);
+
+  for (table = db->first_table; table; table = table->next) {
+    if ((coltable = (ColTable*)table->handle) && coltable->nrows == coltable->committed) {
+      col_table_suspend (coltable);
+    }
+  }
+  return ret;
+}
+
+/** Create a columnar database and adapter structures
+ * \see db_adapter_create
+ */
+/* This function is exposed to the rest of the code for backend initialisation */
+int
+col_create_database(Database* db)
+{
+  ColDB *self = oml_malloc (sizeof (ColDB));
+  MString *path = mstring_create ();
+  ColPair *sender;
+  int id;
+
+  mstring_sprintf (path, "%s/%s.col", sqlite_database_dir, db->name);
+  loginfo ("columnar:%s: Opening database at '%s'\n", db->name, mstring_buf (path));
+  if (mkdir (mstring_buf (path), 0755) && errno != EEXIST) {
+    logerror ("columnar:%s: Can't create database directory: %s\n", db->name, strerror (errno));
+    goto fail_exit;
+  }
+  self->path = oml_strndup (mstring_buf (path), mstring_len (path));
+
+  mstring_cat (path, "/_experiment_metadata");
+  if (col_pair_list_load (mstring_buf (path), &self->metadata)) {
+    logerror ("columnar:%s: Could not read metadata: %s\n", db->name, strerror (errno));
+    goto fail_exit;
+  }
+  mstring_set (path, self->path);
+  mstring_cat (path, "/_senders");
+  if (col_pair_list_load (mstring_buf (path), &self->senders)) {
+    logerror ("columnar:%s: Could not read senders: %s\n", db->name, strerror (errno));
+    goto fail_exit;
+  }
+  for (sender = self->senders; sender; sender = sender->next) {
+    id = atoi (sender->value);
+    if (id > self->sender_cnt) {
+      self->sender_cnt = id;
+    }
+  }
+  mstring_delete (path);
+
+  db->backend_name = backend_name;
+  db->o2t = col_oml_to_type;
+  db->t2o = col_type_to_oml;
+  db->stmt = col_stmt;
+  db->table_create = col_table_create;
+  db->table_create_meta = col_table_create_meta;
+  db->table_free = col_table_free;
+  db->release = col_release;
+  db->prepared_var = col_prepared_var;
+  db->prepare = col_prepare;
+  db->insert = col_insert;
+  db->flush = col_flush;
+  db->add_sender_id = col_add_sender_id;
+  db->set_metadata = col_set_metadata;
+  db->get_metadata = col_get_metadata;
+  db->get_uri = col_get_uri;
+  db->get_table_list = col_get_table_list;
+
+  db->handle = self;
+  return 0;
+
+fail_exit:
+  col_pair_list_free (self->metadata);
+  col_pair_list_free (self->senders);
+  if (self->path) { oml_free (self->path); }
+  oml_free (self);
+  mstring_delete (path);
+  return -1;
+}
+
+/** Release the columnar database.
+ * \see db_adapter_release
+ */
+static void
+col_release(Database* db)
+{
+  ColDB *self = (ColDB*)db->handle;
+
+  /* Tables have already been committed and freed, see col_table_free */
+  if (self->senders_file) {
+    fclose (self->senders_file);
+  }
+  col_pair_list_free (self->metadata);
+  col_pair_list_free (self->senders);
+  oml_free (self->path);
+  oml_free (self);
+  db->handle = NULL;
+}
+
+/** Create the directory, manifest and segment files of a table.
+ * \see db_adapter_table_create
+ */
+static int
+col_table_create (Database* db, DbTable* table, int shallow)
+{
+  ColDB *coldb;
+  MString *path = NULL, *key = NULL;
+  char *meta = NULL;
+  uint64_t rows = 0;
+
+  if (db == NULL) {
+      logwarn("columnar: Tried to create a table in a NULL database\n");
+      return -1;
+  }
+  if (table == NULL) {
+    logwarn("columnar:%s: Tried to create a table from a NULL definition\n", db->name);
+    return -1;
+  }
+  if (table->schema == NULL) {
+    logwarn("columnar:%s: No schema defined for table, cannot create\n", db->name);
+    return -1;
+  }
+  if (strchr (table->schema->name, '/') || table->schema->name[0] == '.') {
+    logerror("columnar:%s: Invalid table name '%s'\n", db->name, table->schema->name);
+    return -1;
+  }
+  coldb = (ColDB*)db->handle;
+
+  path = mstring_create ();
+  mstring_sprintf (path, "%s/%s", coldb->path, table->schema->name);
+
+  if (!shallow) {
+    /* The directory may be left over from a failed creation, without a manifest */
+    if (mkdir (mstring_buf (path), 0755) && errno != EEXIST) {
+      logerror("columnar:%s: Could not create directory for table '%s': %s\n",
+          db->name, table->schema->name, strerror (errno));
+      goto fail_exit;
+    }
+    if (col_write_manifest (mstring_buf (path), table->schema, 0)) {
+      logerror("columnar:%s: Could not write manifest for table '%s': %s\n",
+          db->name, table->schema->name, strerror (errno));
+      goto fail_exit;
+    }
+
+    /* Also record the schema where other backends do */
+    key = mstring_create ();
+    mstring_sprintf (key, "table_%s", table->schema->name);
+    meta = schema_to_meta (table->schema);
+    col_set_metadata (db, mstring_buf (key), meta);
+    oml_free (meta);
+    mstring_delete (key);
+
+  } else {
+    mstring_cat (path, "/" COL_MANIFEST);
+    if (col_read_manifest (mstring_buf (path), NULL, &rows)) {
+      logerror("columnar:%s: Could not read manifest for table '%s'\n",
+          db->name, table->schema->name);
+      goto fail_exit;
+    }
+    mstring_set (path, "");
+    mstring_sprintf (path, "%s/%s", coldb->path, table->schema->name);
+  }
+
+  if (table->handle != NULL) {
+    logwarn("columnar:%s: BUG: Recreating ColTable handle for table %s\n",
+        db->name, table->schema->name);
+  }
+  if (!(table->handle = col_table_open (mstring_buf (path), table->schema, rows))) {
+    logerror("columnar:%s: Could not open the columns of table '%s'\n",
+        db->name, table->schema->name);
+    goto fail_exit;
+  }
+  logdebug("columnar:%s: Opened table '%s' with %" PRIu64 " samples\n",
+      db->name, table->schema->name, rows);
+
+  mstring_delete (path);
+  return 0;
+
+fail_exit:
+  mstring_delete (path);
+  return -1;
+}
+
+/** Create an empty metadata or senders file
+ * \see db_adapter_table_create_meta
+ */
+static int
+col_table_create_meta (Database *db, const char *name)
+{
+  ColDB *coldb = (ColDB*)db->handle;
+  MString *path = mstring_create ();
+  int fd;
+
+  mstring_sprintf (path, "%s/%s", coldb->path, name);
+  logdebug("columnar:%s: Creating default table %s\n", db->name, name);
+  fd = open (mstring_buf (path), O_WRONLY | O_CREAT, 0644);
+  if (fd < 0) {
+    logerror("columnar:%s: Could not create %s: %s\n",
+        db->name, mstring_buf (path), strerror (errno));
+  } else {
+    close (fd);
+  }
+  mstring_delete (path);
+  return fd < 0 ? -1 : 0;
+}
+
+/** Commit the samples of a table, and close its segment files
+ * \see db_adapter_table_free
+ */
+static int
+col_table_free (Database *database, DbTable* table)
+{
+  ColTable *coltable = (ColTable*)table->handle;
+  int ret = 0;
+
+  if (coltable) {
+    ret = col_table_commit (database, table);
+    /* Segment files are trimmed to what was written, committed or not */
+    col_table_close (coltable);
+    table->handle = NULL;
+  }
+  return ret;
+}
+
+/** Append a sample to the columns of a table.
+ *
+ * The sample is committed, with all others, at the latest
+ * columnar_commit_latency after the oldest uncommitted one was received.
+ *
+ * \see db_adapter_insert, col_commit
+ */
+static int
+col_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count)
+{
+  ColDB *coldb = (ColDB*)db->handle;
+  ColTable *coltable = (ColTable*)table->handle;
+  struct schema *schema = table->schema;
+  ColColumn *col = coltable->columns;
+  double time_stamp_server, now;
+  int32_t sender = sender_id, seq = seq_no;
+  int i;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  now = tv.tv_sec + 0.000001 * tv.tv_usec;
+  time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
+
+  if (schema->nfields != value_count) {
+    logerror ("columnar:%s: Failed to insert %d values into table '%s' with %d columns\n",
+        db->name, value_count, table->schema->name, schema->nfields);
+    return -1;
+  }
+  for (i = 0; i < schema->nfields; i++) {
+    if (oml_value_get_type(&values[i]) != schema->fields[i].type) {
+      const char *expected = oml_type_to_s (schema->fields[i].type);
+      const char *received = oml_type_to_s (oml_value_get_type(&values[i]));
+      logerror("columnar:%s: Value %d type mismatch for table '%s'\n", db->name, i, table->schema->name);
+      logdebug("columnar:%s: -> Column name='%s', type=%s, but trying to insert a %s\n",
+          db->name, schema->fields[i].name, expected, received);
+      return -1;
+    }
+  }
+
+  if (col_table_suspended (coltable) &&
+      __atomic_load_n (&col_open_segments, __ATOMIC_RELAXED) + coltable->nsegments > col_max_open_segments) {
+    logdebug("columnar:%s: Too many open segment files, committing and suspending all tables\n", db->name);
+    col_suspend (db);
+  }
+
+  if (col_column_append (&col[0], &sender, sizeof (sender)) ||
+      col_column_append (&col[1], &seq, sizeof (seq)) ||
+      col_column_append (&col[2], &time_stamp, sizeof (time_stamp)) ||
+      col_column_append (&col[3], &time_stamp_server, sizeof (time_stamp_server))) {
+    i = -1;
+  } else {
+    for (i = 0; i < value_count; i++) {
+      if (col_column_append_value (&col[LENGTH (col_oml_columns) + i], &values[i])) {
+        break;
+      }
+    }
+  }
+
+  if (i < value_count) {
+    logerror("columnar:%s: Could not append sample %d to table '%s': %s\n",
+        db->name, seq_no, table->schema->name, strerror (errno));
+    /* Keep all columns the same length */
+    for (i = 0; i < coltable->ncolumns; i++) {
+      if (col[i].width) {
+        col_segment_rewind (&col[i].data, coltable->nrows * col[i].width);
+      } else {
+        col_segment_rewind (&col[i].data, col[i].end);
+        col_segment_rewind (&col[i].offsets, coltable->nrows * sizeof (uint64_t));
+      }
+    }
+    return -1;
+  }
+
+  for (i = 0; i < coltable->ncolumns; i++) {
+    col[i].end = col[i].data.used;
+  }
+  coltable->nrows++;
+
+  if (!coldb->txn_start) {
+    coldb->txn_start = now;
+  }
+  if ((now - coldb->txn_start) * 1000 >= columnar_commit_latency) {
+    return col_commit(db);
+  }
+  return 0;
+}
+
+/** Commit samples which have been waiting for too long.
+ * \see db_adapter_flush, col_commit
+ */
+static int
+col_flush(Database *db)
+{
+  ColDB *coldb = (ColDB*)db->handle;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  if (coldb->txn_start &&
+      (tv.tv_sec + 0.000001 * tv.tv_usec - coldb->txn_start) * 1000 >= columnar_commit_latency) {
+    return col_commit(db);
+  }
+  return 0;
+}
+
+/** Get data from the metadata file
+ * \see db_adapter_get_metadata
+ */
+static char*
+col_get_metadata (Database* database, const char* key)
+{
+  ColDB *coldb = (ColDB*)database->handle;
+  ColPair *pair;
+  char *value = NULL;
+
+  database_lock (database);
+  if ((pair = col_pair_find (coldb->metadata, key))) {
+    value = oml_strndup (pair->value, strlen (pair->value));
+  }
+  database_unlock (database);
+  return value;
+}
+
+/** Set data in the metadata file, rewriting it
+ * \see db_adapter_set_metadata
+ */
+static int
+col_set_metadata (Database* database, const char* key, const char* value)
+{
+  ColDB *coldb = (ColDB*)database->handle;
+  MString *path = mstring_create (), *contents = mstring_create ();
+  ColPair *pair;
+  int ret = 0;
+
+  database_lock (database);
+  if ((pair = col_pair_find (coldb->metadata, key))) {
+    oml_free (pair->value);
+    pair->value = oml_strndup (value, strlen (value));
+  } else {
+    col_pair_add (&coldb->metadata, key, value);
+  }
+
+  for (pair = coldb->metadata; pair; pair = pair->next) {
+    if (col_pair_format (contents, pair)) {
+      ret = -1;
+    }
+  }
+  mstring_sprintf (path, "%s/_experiment_metadata", coldb->path);
+  if (ret || col_write_file (mstring_buf (path), mstring_buf (contents))) {
+    logwarn("columnar:%s: Could not write metadata %s='%s': %s\n",
+        database->name, key, value, strerror (errno));
+    ret = -1;
+  }
+  database_unlock (database);
+
+  mstring_delete (contents);
+  mstring_delete (path);
+  return ret;
+}
+
+/** Add a new sender to the database, returning its index.
+ *
+ * New senders are appended to the senders file.
+ *
+ * \see db_add_sender_id
+ */
+static int
+col_add_sender_id(Database* database, const char* sender_id)
+{
+  ColDB *coldb = (ColDB*)database->handle;
+  MString *path, *line;
+  ColPair *pair;
+  char id[16];
+  int index;
+
+  database_lock (database);
+  if ((pair = col_pair_find (coldb->senders, sender_id))) {
+    index = atoi (pair->value);
+    database_unlock (database);
+    return index;
+  }
+
+  index = ++coldb->sender_cnt;
+  snprintf (id, sizeof (id), "%d", index);
+  pair = col_pair_add (&coldb->senders, sender_id, id);
+
+  if (!coldb->senders_file) {
+    path = mstring_create ();
+    mstring_sprintf (path, "%s/_senders", coldb->path);
+    coldb->senders_file = fopen (mstring_buf (path), "a");
+    mstring_delete (path);
+  }
+  line = mstring_create ();
+  if (!coldb->senders_file || col_pair_format (line, pair) ||
+      fputs (mstring_buf (line), coldb->senders_file) < 0 ||
+      fflush (coldb->senders_file)) {
+    logwarn("columnar:%s: Could not record sender '%s' with ID %d: %s\n",
+        database->name, sender_id, index, strerror (errno));
+  }
+  mstring_delete (line);
+  database_unlock (database);
+
+  return index;
+}
+
+/** Build a URI for this database.
+ *
+ * URI is of the form file:PATH/DATABASE.col
+ *
+ * \see db_adapter_get_uri
+ */
+static char*
+col_get_uri(Database *db, char *uri, size_t size)
+{
+  char fullpath[PATH_MAX+1];
+
+  /* Don't use db->handle, this is also called once the database is released */
+  if (!realpath (sqlite_database_dir, fullpath) ||
+      snprintf(uri, size, "file:%s/%s.col", fullpath, db->name) >= size) {
+    return NULL;
+  }
+  return uri;
+}
+
+/** Get a list of tables from the directory of a columnar database
+ *
+ * Tables are the subdirectories with a readable manifest.
+ *
+ * \see db_adapter_get_table_list
+ */
+static TableDescr*
+col_get_table_list (Database *database, int *num_tables)
+{
+  ColDB *self = (ColDB*)database->handle;
+  TableDescr *tables = NULL, *t;
+  MString *path;
+  DIR *dir;
+  struct dirent *ent;
+  struct stat st;
+  struct schema *schema;
+  char *meta;
+
+  *num_tables = 0;
+  if (!(dir = opendir (self->path))) {
+    logerror("columnar:%s: Could not list tables in %s: %s\n",
+        database->name, self->path, strerror (errno));
+    *num_tables = -1;
+    return NULL;
+  }
+
+  path = mstring_create ();
+  while ((ent = readdir (dir))) {
+    if (ent->d_name[0] == '.') {
+      continue;
+    }
+    mstring_set (path, "");
+    mstring_sprintf (path, "%s/%s", self->path, ent->d_name);
+    if (stat (mstring_buf (path), &st)) {
+      continue;
+    }
+
+    t = NULL;
+    if (S_ISREG (st.st_mode) &&
+        (!strcmp (ent->d_name, "_senders") || !strcmp (ent->d_name, "_experiment_metadata"))) {
+      /* Create phony entries for these so database_init() doesn't try to create them */
+      t = table_descr_new (ent->d_name, NULL);
+
+    } else if (S_ISDIR (st.st_mode)) {
+      mstring_cat (path, "/" COL_MANIFEST);
+      meta = NULL;
+      if (col_read_manifest (mstring_buf (path), &meta, NULL)) {
+        logwarn("columnar:%s: Could not read manifest for table %s, ignoring it\n",
+            database->name, ent->d_name);
+
+      } else if (!(schema = schema_from_meta (meta))) {
+        logwarn("columnar:%s: Could not parse schema '%s' for table %s, ignoring it\n",
+            database->name, meta, ent->d_name);
+
+      } else if (!(t = table_descr_new (ent->d_name, schema))) {
+        schema_free (schema);
+      }
+      if (meta) { oml_free (meta); }
+    }
+
+    if (t) {
+      t->next = tables;
+      tables = t;
+      (*num_tables)++;
+    }
+  }
+  mstring_delete (path);
+  closedir (dir);
+
+  return tables;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,88 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file columnar_adapter.h
+ * \brief Interface to the append-only columnar database backend.
+ */
+#ifndef COLUMNAR_ADAPTER_H_
+#define COLUMNAR_ADAPTER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "database.h"
+
+/** Default maximum time samples wait before being committed [ms] */
+#define COL_DEFAULT_COMMIT_LATENCY 1000
+/** Size of the window of a segment file mapped in memory at once [B]; must be a multiple of the page size */
+#define COL_SEGMENT_WINDOW (1 << 20)
+
+/** Name of the file holding the schema and committed size of a table */
+#define COL_MANIFEST "manifest"
+
+/** An append-only file, written through a window mapped in memory, and only open while in use */
+typedef struct ColSegment {
+  char*   path;     // path to the file, or NULL if not used
+  int     fd;       // file descriptor, or -1 if closed
+  char*   map;      // mapping of COL_SEGMENT_WINDOW bytes of the file from base, or NULL
+  off_t   base;     // offset of the mapping in the file
+  off_t   size;     // current size of the file, possibly beyond used
+  off_t   used;     // number of bytes written to the file
+} ColSegment;
+
+/** One column of a table, stored in its own segment files */
+typedef struct ColColumn {
+  const char* name;   // name of the column, not owned
+  OmlValueT   type;   // OML type of the values
+  size_t      width;  // size of a value [B], or 0 if values are stored in a heap
+  ColSegment  data;   // NAME.dat: fixed-width values, or heap of variable-size values
+  ColSegment  offsets;// NAME.off: end offset in the heap of each value (uint64_t), if width is 0
+  off_t       end;    // size of the heap after the last complete sample
+} ColColumn;
+
+typedef struct ColTable {
+  char*       path;       // directory holding the files of the table
+  int         ncolumns;   // number of columns, OML ones included
+  ColColumn*  columns;    // oml_sender_id, oml_seq, oml_ts_client, oml_ts_server, then the schema's
+  int         nsegments;  // number of segment files of the columns
+  uint64_t    nrows;      // number of samples written
+  uint64_t    committed;  // number of samples recorded in the manifest
+} ColTable;
+
+/** A key-value pair, from the metadata or senders files */
+typedef struct ColPair {
+  char*           key;
+  char*           value;
+  struct ColPair* next;
+} ColPair;
+
+typedef struct ColDB {
+  char*     path;       // directory holding the database
+  ColPair*  metadata;   // contents of _experiment_metadata
+  ColPair*  senders;    // contents of _senders, mapping names to IDs
+  int       sender_cnt; // highest sender ID in use
+  FILE*     senders_file; // _senders, opened for appending, or NULL
+  double    txn_start;  // time at which the oldest uncommitted sample was received [s], or 0
+} ColDB;
+
+extern int columnar_commit_latency;
+
+int col_backend_setup (void);
+int col_create_database (Database* db);
+
+#endif /*COLUMNAR_ADAPTER_H_*/
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -51,6 +51,7 @@
 #include "config.h"
 #endif
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
@@ -64,7 +65,9 @@
 #include "mstring.h"
 #include "database.h"
 #include "hook.h"
+#include "ingest.h"
 #include "sqlite_adapter.h"
+#include "columnar_adapter.h"
 
 #if HAVE_LIBPQ
 #include <libpq-fe.h>
@@ -76,6 +79,34 @@
 #define DEF_COLUMN_COUNT 1
 #define DEF_TABLE_COUNT 1
 
+/** Initial number of buckets of a NameIndex; must be a power of 2 */
+#define NAME_INDEX_BUCKETS 16
+
+/** An object registered in a NameIndex */
+typedef struct NameIndexEntry {
+  /** Name under which the object is indexed, owned by the entry */
+  char *name;
+  /** Indexed object (Database or DbTable), or sender ID */
+  union {
+    void *ptr;
+    int id;
+  } value;
+  /** Next entry in the same bucket */
+  struct NameIndexEntry *next;
+} NameIndexEntry;
+
+/** A hash table of objects, keyed by name
+ * \see name_index_find, name_index_add, name_index_remove
+ */
+typedef struct NameIndex {
+  /** Chains of entries, by hash of their name */
+  NameIndexEntry **buckets;
+  /** Number of buckets; a power of 2 */
+  size_t nbuckets;
+  /** Number of entries */
+  size_t count;
+} NameIndex;
+
 static struct db_backend
 {
   const char * const name;
@@ -83,6 +114,7 @@ static struct db_backend
 } backends [] =
   {
     { "sqlite", sq3_create_database },
+    { "columnar", col_create_database },
 #if HAVE_LIBPQ
     { "postgresql", psql_create_database },
 #endif
@@ -93,6 +125,174 @@ static struct db_backend
 char* dbbackend = DEFAULT_DB_BACKEND;
 
 static Database *first_db = NULL;
+/** Index of the databases in the first_db list, by name */
+static NameIndex *databases = NULL;
+/** Protects the list of databases starting at first_db, its index, and their ref_count and state */
+static pthread_mutex_t databases_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Signalled, with databases_lock held, when a database leaves the DB_OPENING or DB_CLOSING state */
+static pthread_cond_t databases_cond = PTHREAD_COND_INITIALIZER;
+
+/** Hash a name, with 32-bit FNV-1a.
+ *
+ * \param name string to hash
+ * \return the hash of name
+ */
+static uint32_t
+name_index_hash (const char *name)
+{
+  uint32_t h = 2166136261u;
+
+  for (; *name; name++) {
+    h ^= (unsigned char)*name;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/** Create an empty NameIndex.
+ *
+ * \return a new NameIndex, to be freed with name_index_free, or NULL on error
+ */
+static NameIndex*
+name_index_new (void)
+{
+  NameIndex *self = oml_malloc (sizeof (NameIndex));
+
+  if (!self) {
+    return NULL;
+  }
+  self->nbuckets = NAME_INDEX_BUCKETS;
+  if (!(self->buckets = oml_calloc (self->nbuckets, sizeof (NameIndexEntry*)))) {
+    oml_free (self);
+    return NULL;
+  }
+  return self;
+}
+
+/** Free a NameIndex, but not the indexed objects.
+ * \param self NameIndex to free; nothing is done if NULL
+ */
+static void
+name_index_free (NameIndex *self)
+{
+  NameIndexEntry *e, *next;
+  size_t i;
+
+  if (!self) {
+    return;
+  }
+  for (i = 0; i < self->nbuckets; i++) {
+    for (e = self->buckets[i]; e; e = next) {
+      next = e->next;
+      oml_free (e->name);
+      oml_free (e);
+    }
+  }
+  oml_free (self->buckets);
+  oml_free (self);
+}
+
+/** Look an object up by name.
+ *
+ * \param self NameIndex to search
+ * \param name name to look for
+ * \return the NameIndexEntry for name, or NULL if not found
+ */
+static NameIndexEntry*
+name_index_find (NameIndex *self, const char *name)
+{
+  NameIndexEntry *e;
+
+  if (!self) {
+    return NULL;
+  }
+  for (e = self->buckets[name_index_hash (name) & (self->nbuckets - 1)]; e; e = e->next) {
+    if (!strcmp (e->name, name)) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+/** Double the number of buckets of a NameIndex.
+ *
+ * If memory cannot be allocated, the NameIndex keeps working, with longer chains.
+ *
+ * \param self NameIndex to grow
+ */
+static void
+name_index_grow (NameIndex *self)
+{
+  size_t i, nbuckets = self->nbuckets * 2;
+  NameIndexEntry **buckets, *e, *next;
+
+  if (!(buckets = oml_calloc (nbuckets, sizeof (NameIndexEntry*)))) {
+    return;
+  }
+  for (i = 0; i < self->nbuckets; i++) {
+    for (e = self->buckets[i]; e; e = next) {
+      next = e->next;
+      e->next = buckets[name_index_hash (e->name) & (nbuckets - 1)];
+      buckets[name_index_hash (e->name) & (nbuckets - 1)] = e;
+    }
+  }
+  oml_free (self->buckets);
+  self->buckets = buckets;
+  self->nbuckets = nbuckets;
+}
+
+/** Add an entry to a NameIndex.
+ *
+ * The name must not already be in the index.
+ *
+ * \param self NameIndex to add to
+ * \param name name of the new entry, copied
+ * \return the new NameIndexEntry, whose value is to be set by the caller, or NULL on error
+ */
+static NameIndexEntry*
+name_index_add (NameIndex *self, const char *name)
+{
+  NameIndexEntry *e, **bucket;
+
+  if (!self || !(e = oml_malloc (sizeof (NameIndexEntry)))) {
+    return NULL;
+  }
+  if (!(e->name = oml_strndup (name, strlen (name)))) {
+    oml_free (e);
+    return NULL;
+  }
+  if (++self->count > self->nbuckets) {
+    name_index_grow (self);
+  }
+  bucket = &self->buckets[name_index_hash (name) & (self->nbuckets - 1)];
+  e->next = *bucket;
+  *bucket = e;
+  return e;
+}
+
+/** Remove an entry from a NameIndex.
+ *
+ * \param self NameIndex to remove from
+ * \param name name of the entry to remove; nothing is done if not found
+ */
+static void
+name_index_remove (NameIndex *self, const char *name)
+{
+  NameIndexEntry **p, *e;
+
+  if (!self) {
+    return;
+  }
+  for (p = &self->buckets[name_index_hash (name) & (self->nbuckets - 1)]; (e = *p); p = &e->next) {
+    if (!strcmp (e->name, name)) {
+      *p = e->next;
+      oml_free (e->name);
+      oml_free (e);
+      self->count--;
+      return;
+    }
+  }
+}
 
 /** Get the list of valid database backends.
  *
@@ -125,7 +325,7 @@ database_valid_backends ()
  * \param backend name of the selected backend
  * \return 0 on success, -1 otherwise
  *
- * \see sq3_backend_setup, psql_backend_setup
+ * \see sq3_backend_setup, col_backend_setup, psql_backend_setup
  */
 int
 database_setup_backend (const char* backend)
@@ -140,6 +340,8 @@ database_setup_backend (const char* backend)
 
   if (!strcmp (backend, "sqlite")) {
     if(sq3_backend_setup ()) return -1;
+  } else if (!strcmp (backend, "columnar")) {
+    if(col_backend_setup ()) return -1;
 #if HAVE_LIBPQ
   } else if (!strcmp (backend, "postgresql")) {
     if(psql_backend_setup ()) return -1;
@@ -207,39 +409,98 @@ database_create_function (const char *backend)
  *
  * If no database with this name exists, a new one is created.
  *
+ * This function can be called concurrently from multiple threads; a database
+ * is only ever created once. The index of databases is only locked to look the
+ * name up, so the backend of a new database is created without delaying the
+ * clients of other databases; other clients of the same database wait until
+ * it is ready (or is completely closed, if it was being released).
+ *
  * \param name name of the database to find
- * \return a pointer to the database
+ * \return a pointer to the database, or NULL on error
+ *
+ * \see database_release
  */
 Database*
 database_find (const char* name)
 {
-  Database* db = first_db;
-  while (db != NULL) {
-    if (!strcmp(name, db->name)) {
-      loginfo ("%s: Database already open (%d client%s)\n",
-                name, db->ref_count, db->ref_count>1?"s":"");
-      db->ref_count++;
-      return db;
+  pthread_mutexattr_t attr;
+  NameIndexEntry *e;
+  Database* db;
+  int last;
+
+  pthread_mutex_lock(&databases_lock);
+  if (!databases && !(databases = name_index_new())) {
+    logerror("%s: Could not allocate index of databases\n", name);
+    pthread_mutex_unlock(&databases_lock);
+    return NULL;
+  }
+  while ((e = name_index_find(databases, name)) &&
+      ((Database*)e->value.ptr)->state == DB_CLOSING) {
+    pthread_cond_wait(&databases_cond, &databases_lock);
+  }
+  if (e) {
+    db = e->value.ptr;
+    db->ref_count++;
+    while (db->state == DB_OPENING) {
+      pthread_cond_wait(&databases_cond, &databases_lock);
     }
-    db = db->next;
+    if (db->state == DB_FAILED) {
+      /* The creator has already removed it from the index */
+      last = (--db->ref_count == 0);
+      pthread_mutex_unlock(&databases_lock);
+      logerror("%s: Database could not be opened\n", name);
+      if (last) {
+        pthread_mutex_destroy(&db->lock);
+        oml_free(db);
+      }
+      return NULL;
+    }
+    loginfo ("%s: Database already open (%d client%s)\n",
+        name, db->ref_count - 1, db->ref_count>2?"s":"");
+    pthread_mutex_unlock(&databases_lock);
+    return db;
   }
 
   // need to create a new one
   Database *self = oml_malloc(sizeof(Database));
+  if (!self) {
+    logerror("%s: Could not allocate database\n", name);
+    pthread_mutex_unlock(&databases_lock);
+    return NULL;
+  }
   logdebug("%s: Creating or opening database\n", name);
-  strncpy(self->name, name, MAX_DB_NAME_SIZE);
+  strncpy(self->name, name, MAX_DB_NAME_SIZE - 1);
   self->ref_count = 1;
+  self->state = DB_OPENING;
   self->create = database_create_function (dbbackend);
-
-  if (self->create (self)) {
+  self->tables = name_index_new();
+  self->senders = name_index_new();
+  if (!self->tables || !self->senders || !(e = name_index_add(databases, self->name))) {
+    logerror("%s: Could not allocate indexes for database\n", name);
+    name_index_free(self->tables);
+    name_index_free(self->senders);
     oml_free(self);
+    pthread_mutex_unlock(&databases_lock);
     return NULL;
   }
+  e->value.ptr = self;
+
+  /* Recursive, so table creation can happen while data is being processed */
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&self->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  /* Other clients of this database wait for DB_OPEN; those of others go on */
+  pthread_mutex_unlock(&databases_lock);
+
+  if (self->create (self)) {
+    goto fail_exit;
+  }
 
   if (database_init (self) == -1) {
-    database_release(self);
-    oml_free (self);
-    return NULL;
+    self->release (self);
+    goto fail_exit;
   }
 
   char *start_time_str = self->get_metadata (self, "start_time");
@@ -255,16 +516,49 @@ database_find (const char* name)
     logdebug("%s: Retrieved start-time = %lu\n", name, self->start_time);
   }
 
+  if (ingest_queue_size > 0 &&
+      !(self->ingest = ingest_queue_new(self, ingest_queue_size))) {
+    logwarn("%s: Inserting samples synchronously\n", name);
+  }
+
   // hook this one into the list of active databases
+  pthread_mutex_lock(&databases_lock);
+  self->state = DB_OPEN;
   self->next = first_db;
   first_db = self;
+  pthread_cond_broadcast(&databases_cond);
+  pthread_mutex_unlock(&databases_lock);
 
   return self;
+
+fail_exit:
+  name_index_free(self->tables);
+  name_index_free(self->senders);
+  self->tables = self->senders = NULL;
+
+  /* Clients waiting for this database give up, and the last one frees it */
+  pthread_mutex_lock(&databases_lock);
+  name_index_remove(databases, self->name);
+  self->state = DB_FAILED;
+  last = (--self->ref_count == 0);
+  pthread_cond_broadcast(&databases_cond);
+  pthread_mutex_unlock(&databases_lock);
+
+  if (last) {
+    pthread_mutex_destroy(&self->lock);
+    oml_free(self);
+  }
+  return NULL;
 }
 /** One client no longer uses this database.
  * If this was the last client checking out, close database.
+ *
+ * The database is closed without holding the lock of the index of databases,
+ * but stays in it as DB_CLOSING until then, so it is not reopened before
+ * its queued samples have been inserted.
+ *
  * \param self the database to release
- * \see db_adapter_release
+ * \see db_adapter_release, database_find
  */
 void
 database_release(Database* self)
@@ -273,7 +567,11 @@ database_release(Database* self)
     logerror("NONE: Trying to release a NULL database.\n");
     return;
   }
-  if (--self->ref_count > 0) return; // still in use
+  pthread_mutex_lock(&databases_lock);
+  if (--self->ref_count > 0) { // still in use
+    pthread_mutex_unlock(&databases_lock);
+    return;
+  }
 
   // unlink DB
   Database* db_p = first_db;
@@ -284,12 +582,19 @@ database_release(Database* self)
   }
   if (db_p == NULL) {
     logerror("%s:  Trying to release an unknown database\n", self->name);
+    pthread_mutex_unlock(&databases_lock);
     return;
   }
   if (prev_p == NULL)
     first_db = self->next; // was first
   else
     prev_p->next = self->next;
+  self->state = DB_CLOSING;
+  pthread_mutex_unlock(&databases_lock);
+
+  /* Flush the queued samples before tearing the tables down */
+  ingest_queue_free(self->ingest);
+  self->ingest = NULL;
 
   // no longer needed
   DbTable* t_p = self->first_table;
@@ -301,18 +606,28 @@ database_release(Database* self)
     database_table_free(self, t_p);
     t_p = t;
   }
+  self->first_table = NULL;
+  name_index_free(self->tables);
+  name_index_free(self->senders);
 
   loginfo ("%s: Closing database\n", self->name);
   self->release (self);
 
   database_hook_send_event(self, HOOK_CMD_DBCLOSED);
 
+  /* Let clients waiting to reopen it proceed */
+  pthread_mutex_lock(&databases_lock);
+  name_index_remove(databases, self->name);
+  pthread_cond_broadcast(&databases_cond);
+  pthread_mutex_unlock(&databases_lock);
+
+  pthread_mutex_destroy(&self->lock);
   oml_free(self);
 }
 
 /** Close all open databases
  *
- * Useful when exiting.
+ * Useful when exiting, once no other thread uses any database.
  */
 void
 database_cleanup()
@@ -326,21 +641,173 @@ database_cleanup()
     database_release(db);
     db = next;
   }
+
+  pthread_mutex_lock(&databases_lock);
+  if (!first_db) {
+    name_index_free(databases);
+    databases = NULL;
+  }
+  pthread_mutex_unlock(&databases_lock);
 }
 
-/*
- * Find the table with matching "name".  Return NULL if not found.
+/** Get exclusive use of a database, e.g., to insert a batch of samples.
+ *
+ * The lock is recursive, and must be released as many times as it was taken.
+ *
+ * \param database Database to lock; nothing is done if NULL
+ * \see database_unlock
+ */
+void
+database_lock(Database *database)
+{
+  if (database) {
+    pthread_mutex_lock(&database->lock);
+  }
+}
+
+/** Release a database previously locked with database_lock.
+ *
+ * \param database Database to unlock; nothing is done if NULL
+ * \see database_lock
+ */
+void
+database_unlock(Database *database)
+{
+  if (database) {
+    pthread_mutex_unlock(&database->lock);
+  }
+}
+
+/** Find the table with matching name.
+ *
+ * If several tables have that name, the most recently created is returned.
+ *
+ * \param database Database to search
+ * \param name name of the table
+ * \return the DbTable, or NULL if not found
  */
 DbTable*
 database_find_table (Database *database, const char *name)
 {
-  DbTable *table = database->first_table;
-  while (table) {
-    if (!strcmp (table->schema->name, name))
-      return table;
-    table = table->next;
+  NameIndexEntry *e;
+  DbTable *table = NULL;
+
+  database_lock(database);
+  if ((e = name_index_find (database->tables, name))) {
+    table = e->value.ptr;
   }
-  return NULL;
+  database_unlock(database);
+  return table;
+}
+
+/** Remove a table from the list and index of a database, without freeing it.
+ *
+ * \param database Database containing the table
+ * \param table DbTable to remove
+ * \see database_create_table
+ */
+static void
+database_unlink_table (Database *database, DbTable *table)
+{
+  DbTable **p, *t;
+  NameIndexEntry *e;
+
+  for (p = &database->first_table; *p && *p != table; p = &(*p)->next);
+  if (*p) {
+    *p = table->next;
+  }
+
+  e = name_index_find (database->tables, table->schema->name);
+  if (e && e->value.ptr == table) {
+    /* Fall back to the next most recent table by that name, if any */
+    for (t = database->first_table; t && strcmp (t->schema->name, table->schema->name); t = t->next);
+    if (t) {
+      e->value.ptr = t;
+    } else {
+      name_index_remove (database->tables, table->schema->name);
+    }
+  }
+}
+
+/** Get an ID for a sender of a database.
+ *
+ * IDs are cached, so the backend is only asked once for each sender while the
+ * database is open. The Database is locked while doing so.
+ *
+ * \param database Database the sender is sending to
+ * \param name name of the sender
+ * \return the ID of the sender
+ * \see db_add_sender_id
+ */
+int
+database_add_sender_id (Database *database, const char *name)
+{
+  NameIndexEntry *e;
+  int id;
+
+  database_lock(database);
+  if ((e = name_index_find (database->senders, name))) {
+    id = e->value.id;
+
+  } else {
+    id = database->add_sender_id (database, name);
+    /* Only cache valid IDs; the semantic backends have none */
+    if (id >= 0 && (e = name_index_add (database->senders, name))) {
+      e->value.id = id;
+    }
+  }
+  database_unlock(database);
+
+  return id;
+}
+
+/** Insert a sample into a table of a database.
+ *
+ * \copydetails database_insert_from
+ * \see database_insert_from
+ */
+int
+database_insert(Database *database, DbTable* table, int sender_id, int seq_no,
+    double time_stamp, OmlValue* values, int value_count)
+{
+  return database_insert_from(database, NULL, table, sender_id, seq_no,
+      time_stamp, values, value_count);
+}
+
+/** Insert a sample into a table of a database, charging its memory to an IngestAccount.
+ *
+ * If the database has an IngestQueue, the sample is copied into it, and
+ * inserted later by its writer thread; otherwise, it is inserted immediately,
+ * with the database locked. Either way, samples are inserted in the order in
+ * which this function is called.
+ *
+ * While the sample is queued, the memory it uses is charged to account, which
+ * lets the caller stop reading from a client whose samples pile up.
+ *
+ * The caller must not hold the database lock, as it may have to wait for the
+ * writer thread to make room in the queue.
+ *
+ * \param account IngestAccount to charge the queued sample to, or NULL
+ * \copydetails db_adapter_insert
+ * \see ingest_queue_push, db_adapter_insert, backpressure_check
+ */
+int
+database_insert_from(Database *database, struct IngestAccount *account, DbTable* table,
+    int sender_id, int seq_no, double time_stamp, OmlValue* values, int value_count)
+{
+  int ret;
+
+  if (database->ingest) {
+    return ingest_queue_push(database->ingest, account, table, sender_id, seq_no,
+        time_stamp, values, value_count);
+  }
+
+  database_lock(database);
+  ret = database->insert(database, table, sender_id, seq_no,
+      time_stamp, values, value_count);
+  database_unlock(database);
+
+  return ret;
 }
 
 /** Create the adapter structure for a table.
@@ -364,6 +831,7 @@ database_find_table (Database *database, const char *name)
 DbTable*
 database_create_table (Database *database, const struct schema *schema)
 {
+  NameIndexEntry *e;
   DbTable *table = oml_malloc (sizeof (DbTable));
   if (!table)
     return NULL;
@@ -372,28 +840,24 @@ database_create_table (Database *database, const struct schema *schema)
     oml_free (table);
     return NULL;
   }
+  /* The most recent table by that name is the one found, as in the list */
+  if (!(e = name_index_find (database->tables, schema->name)) &&
+      !(e = name_index_add (database->tables, schema->name))) {
+    schema_free (table->schema);
+    oml_free (table);
+    return NULL;
+  }
+  e->value.ptr = table;
   table->next = database->first_table;
   database->first_table = table;
   return table;
 }
 
-/** Search a Database's registered DbTables for one matchng the given schema.
- *
- * If none is found, the table is created. If one is found, but the schema
- * differs, try to append a number to the name (up to MAX_TABLE_RENAME), create
- * that table, and update the schema.
- *
- * If the table search/creation is successful, the returned DbTable is already
- * added to the list of the Database.
- *
- * \param database Database to search
- * \param schema schema structure for the table to add
- * \return a newly created DbTable for that table, or NULL on error
- *
- * \see MAX_TABLE_RENAME, database_create_table
+/** Search for or create a table, with the database already locked.
+ * \copydetails database_find_or_create_table
  */
-DbTable*
-database_find_or_create_table(Database *database, struct schema *schema)
+static DbTable*
+find_or_create_table(Database *database, struct schema *schema)
 {
   if (database == NULL) return NULL;
   if (schema == NULL) return NULL;
@@ -456,21 +920,41 @@ database_find_or_create_table(Database *database, struct schema *schema)
   if (database->table_create (database, table, 0)) {
     logerror ("%s: Couldn't create table '%s'\n", database->name, schema->name);
     /* Unlink the table from the experiment's list */
-    DbTable* t = database->first_table;
-    if (t == table)
-      database->first_table = t->next;
-    else {
-      while (t && t->next != table)
-        t = t->next;
-      if (t && t->next)
-        t->next = t->next->next;
-    }
+    database_unlink_table (database, table);
     database_table_free (database, table);
     return NULL;
   }
   return table;
 }
 
+/** Search a Database's registered DbTables for one matchng the given schema.
+ *
+ * If none is found, the table is created. If one is found, but the schema
+ * differs, try to append a number to the name (up to MAX_TABLE_RENAME), create
+ * that table, and update the schema.
+ *
+ * If the table search/creation is successful, the returned DbTable is already
+ * added to the list of the Database. The Database is locked while doing so.
+ *
+ * \param database Database to search
+ * \param schema schema structure for the table to add
+ * \return a newly created DbTable for that table, or NULL on error
+ *
+ * \see MAX_TABLE_RENAME, database_create_table, database_lock
+ */
+DbTable*
+database_find_or_create_table(Database *database, struct schema *schema)
+{
+  DbTable *table;
+
+  if (database == NULL) return NULL;
+  database_lock(database);
+  table = find_or_create_table(database, schema);
+  database_unlock(database);
+
+  return table;
+}
+
 /*
  * Destroy a table in a database, by free all allocated data
  * structures.  Does not release the table in the backend adapter.
@@ -541,6 +1025,7 @@ database_init (Database *database)
         if (database->table_create (database, table, 1) == -1) {
           logwarn ("%s: Failed to create adapter structures for table '%s'\n",
                    database->name, td->name);
+          database_unlink_table (database, table);
           database_table_free (database, table);
         }
       }
@@ -13,6 +13,8 @@
 #ifndef DATABASE_H_
 #define DATABASE_H_
 
+#include <pthread.h>
+
 #include "oml2/omlc.h"
 #include "mstring.h"
 #include "table_descr.h"
@@ -36,6 +38,9 @@
 
 struct Database;
 struct DbTable;
+struct IngestQueue;
+struct IngestAccount;
+struct NameIndex;
 typedef struct DbTable DbTable;
 typedef struct Database Database;
 
@@ -128,6 +133,17 @@ typedef MString* (*db_adapter_prepare)(Database *db, DbTable* table);
  */
 typedef int (*db_adapter_insert)(Database *db, DbTable* table, int sender_id, int seq_no, double time_stamp, OmlValue* values, int value_count);
 
+/** Write out samples buffered by the backend, if they have been waiting for too long.
+ *
+ * This is called periodically while no new samples are being inserted, so
+ * backends delaying inserts or commits can honour their latency limits. It
+ * is optional, and can be left NULL.
+ *
+ * \param db Database to flush
+ * \return 0 on success, -1 otherwise
+ */
+typedef int (*db_adapter_flush)(Database *db);
+
 /** Get data from the metadata table
  *
  * The returned string should be oml_free'd by the caller when no longer needed.
@@ -193,6 +209,15 @@ struct DbTable {
   struct DbTable* next;
 };
 
+/** Stage of the life of a Database, while it is in the index of databases
+ * \see database_find, database_release */
+typedef enum _dbstate {
+  DB_OPENING,     // being created by its first client; others wait
+  DB_OPEN,        // ready to use
+  DB_FAILED,      // could not be created; the last waiter frees it
+  DB_CLOSING,     // being torn down; a new client waits before reopening it
+} DatabaseState;
+
 /** An open and active database, with manipulations functions from its backend */
 struct Database{
   /** Name of this database */
@@ -202,8 +227,19 @@ struct Database{
 
   /** Number of active clients */
   int        ref_count;
+  /** Whether the backend is ready to use, protected by the lock of the index of databases \see DatabaseState */
+  DatabaseState state;
+  /** Recursive lock serialising the use of this database by concurrent clients
+   * \see database_lock, database_unlock */
+  pthread_mutex_t lock;
+  /** Queue of samples waiting to be inserted, or NULL to insert them immediately \see database_insert */
+  struct IngestQueue *ingest;
   /** Pointer to the first data table */
   DbTable*   first_table;
+  /** Index of the data tables by name \see database_find_table */
+  struct NameIndex *tables;
+  /** Cache of the IDs of the senders by name \see database_add_sender_id */
+  struct NameIndex *senders;
   /** Experiment start time */
   time_t     start_time;
   /** Opaque pointer to database implementation handle */
@@ -234,6 +270,8 @@ struct Database{
   db_adapter_prepared_var prepared_var;
   /** Pointer to function to insert data in a table \see db_adapter_insert */
   db_adapter_insert  insert;
+  /** Pointer to function to write out buffered samples, or NULL \see db_adapter_flush */
+  db_adapter_flush   flush;
   /** Pointer to function to get data from the metadata table \see db_adapter_get_metadata */
   db_adapter_get_metadata get_metadata;
   /** Pointer to function to set data in the metadata table \see db_adapter_set_metadata*/
@@ -264,11 +302,17 @@ Database *database_find(const char* name);
 int database_init (Database *self);
 void database_release(Database* database);
 void database_cleanup();
+void database_lock(Database *database);
+void database_unlock(Database *database);
+
+int database_add_sender_id(Database *database, const char *name);
 
 DbTable *database_find_table(Database* database, const char* name);
 DbTable *database_find_or_create_table(Database *database, struct schema *schema);
 DbTable *database_create_table (Database *database, const struct schema *schema);
 void     database_table_free(Database *database, DbTable* table);
+int      database_insert(Database *database, DbTable* table, int sender_id, int seq_no, double time_stamp, OmlValue* values, int value_count);
+int      database_insert_from(Database *database, struct IngestAccount *account, DbTable* table, int sender_id, int seq_no, double time_stamp, OmlValue* values, int value_count);
 
 MString *database_make_sql_insert (Database *db, DbTable* table);
 
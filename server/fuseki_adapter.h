@@ -15,6 +15,7 @@
 
 #include "../lib/ocomm/ocomm/o_socket.h"
 #include "database.h"
+#include "sparql.h"
 #include <oml2/oml_out_stream.h>
 #include <curl/curl.h>
 
@@ -26,10 +27,14 @@ typedef struct SemDB {
   CURL*     conn;
   int       sender_cnt;
   time_t    last_commit;
+  SparqlPipeline* pipeline; // update requests in flight
 } SemDB;
 
 typedef struct SemTable {
   MString* insert_stmt;  // prepared insert statement
+  SparqlTemplate* tmpl;  // insert_stmt split around its placeholders, or NULL if empty
+  MString* batch;        // update request for the samples waiting to be sent
+  int      nrows;        // number of samples in batch
 } SemTable;
 
 int fuseki_backend_setup (void);
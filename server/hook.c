@@ -17,6 +17,7 @@
 #include <sys/stat.h>
 #include <sys/select.h>
 #include <signal.h>
+#include <pthread.h>
 
 #include "ocomm/o_log.h"
 
@@ -32,6 +33,8 @@ char* hook = NULL;
 static int hookpipe[] = {-1, -1};
 /** PID of the event hook script */
 static int hookpid = -1;
+/** Serialises commands written to the event hook by concurrent threads */
+static pthread_mutex_t hook_write_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /** Clean up the pipes openned for the event hook */
 static void
@@ -162,7 +165,7 @@ hook_enabled(void) {
  * 
  * This function writes commands into the pipe connected to the event hook's
  * stdin. It takes the same parameters as write(2), but skips the file
- * descriptor.
+ * descriptor. Commands from different threads are not interleaved.
  *
  * \param buf buffer from which +count+ bytes of data will be read out andwritten into event hook's +stdin+
  * \param count the number of bytes from +buf+ to write into the hook's +stdin+
@@ -175,7 +178,9 @@ hook_write (const void *buf, size_t count)
   if (-1 == hookpipe[1])
     return -1;
   logdebug("hook: Sending command fd %d: '%s'\n", hookpipe[1], buf);
+  pthread_mutex_lock(&hook_write_lock);
   n = write(hookpipe[1], buf, count);
+  pthread_mutex_unlock(&hook_write_lock);
   return n;
 }
 
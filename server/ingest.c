@@ -0,0 +1,656 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file ingest.c
+ * \brief Decouple the parsing of client data from its insertion into a Database.
+ *
+ * Each Database can have an IngestQueue, served by its own writer thread.
+ * Client threads push decoded samples (table, sender, sequence number,
+ * timestamp and values) into the queue, and carry on reading from the
+ * network, while the writer thread inserts them into the backend, in the
+ * order they were pushed.
+ *
+ * The queue is bounded: a client pushing into a full queue waits for the
+ * writer thread to catch up. Samples are copied into IngestRows which are
+ * recycled, along with the storage of their string and blob values, rather
+ * than freed once inserted.
+ *
+ * The memory used by queued samples is also accounted for, in total and, for
+ * samples pushed with an IngestAccount, per client, so clients can stop
+ * reading from the network before the queue is full. A drain hook is called
+ * by writer threads after inserting samples, so they can resume.
+ *
+ * The writer thread takes the Database lock while inserting, so it does not
+ * compete with the clients for the backend. Conversely, clients must not hold
+ * that lock while pushing samples.
+ *
+ * \see database_insert, database_lock, backpressure_check
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "oml_value.h"
+#include "database.h"
+#include "monitoring_server.h"
+#include "ingest.h"
+
+/** A decoded sample waiting to be inserted */
+typedef struct IngestRow {
+  /** Table to insert the sample into */
+  DbTable *table;
+  /** Sender ID of the client */
+  int sender_id;
+  /** Sequence number of the sample */
+  int seq_no;
+  /** Timestamp of the sample, already adjusted to the Database's start time */
+  double time_stamp;
+  /** Values of the sample */
+  OmlValue *values;
+  /** Number of values in use */
+  int value_count;
+  /** Number of values allocated */
+  int values_size;
+  /** Account charged for the sample while it is queued, or NULL */
+  IngestAccount *account;
+  /** Approximate memory used by the sample [B] */
+  size_t bytes;
+  /** Next row in the queue or the pool */
+  struct IngestRow *next;
+} IngestRow;
+
+/** A bounded queue of samples, and the thread inserting them into a Database */
+struct IngestQueue {
+  /** Database into which the samples are inserted */
+  Database *db;
+  /** Writer thread */
+  pthread_t thread;
+
+  /** Protects all the fields below */
+  pthread_mutex_t lock;
+  /** Signalled when samples are pushed, or the queue is stopping */
+  pthread_cond_t not_empty;
+  /** Signalled when rows are returned to the pool */
+  pthread_cond_t not_full;
+
+  /** First queued row, next to be inserted */
+  IngestRow *head;
+  /** Last queued row */
+  IngestRow *tail;
+  /** Rows available for reuse */
+  IngestRow *pool;
+  /** Number of queued rows */
+  int depth;
+  /** Number of rows either queued, or being inserted by the writer thread */
+  int used;
+  /** Maximum value of used */
+  int size;
+  /** Set when the queue should be drained and the thread stopped */
+  int stopping;
+
+  /** Largest depth since the last report */
+  int max_depth;
+  /** Samples inserted since the last report */
+  uint64_t inserted;
+  /** Number of times clients waited for room since the last report */
+  uint32_t waits;
+};
+
+/** Memory used by the samples queued on behalf of one client.
+ *
+ * The client holds a reference, and so does each of its queued samples, so
+ * the account can outlive the client.
+ */
+struct IngestAccount {
+  /** Memory used by the queued samples [B]; updated atomically */
+  size_t bytes;
+  /** Number of references; updated atomically */
+  int refs;
+};
+
+/** Maximum number of samples queued for each Database; 0 inserts synchronously */
+int ingest_queue_size = DEFAULT_INGEST_QUEUE_SIZE;
+
+/** Memory used by the samples queued in all IngestQueues [B]; updated atomically */
+static size_t queued_bytes = 0;
+/** Function called by writer threads after inserting samples \see ingest_set_drain_hook */
+static void (*drain_hook)(void) = NULL;
+
+static void* ingest_thread_start(void *handle);
+
+/** Get the current time on CLOCK_MONOTONIC [s] */
+static double
+monotonic_s(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** Create an IngestQueue for a Database, and start its writer thread.
+ *
+ * \param db Database into which samples will be inserted
+ * \param size maximum number of samples queued at any time
+ * \return a pointer to the new IngestQueue, or NULL if size is not positive or on error
+ * \see ingest_queue_free, ingest_queue_push
+ */
+IngestQueue*
+ingest_queue_new(Database *db, int size)
+{
+  IngestQueue *self;
+
+  if (size <= 0) {
+    return NULL;
+  }
+  if (!(self = oml_malloc(sizeof(IngestQueue)))) {
+    return NULL;
+  }
+  memset(self, 0, sizeof(IngestQueue));
+  self->db = db;
+  self->size = size;
+  pthread_mutex_init(&self->lock, NULL);
+  pthread_cond_init(&self->not_empty, NULL);
+  pthread_cond_init(&self->not_full, NULL);
+
+  if ((errno = pthread_create(&self->thread, NULL, ingest_thread_start, self))) {
+    logerror("%s: Cannot start ingest thread: %s\n", db->name, strerror(errno));
+    pthread_cond_destroy(&self->not_full);
+    pthread_cond_destroy(&self->not_empty);
+    pthread_mutex_destroy(&self->lock);
+    oml_free(self);
+    return NULL;
+  }
+
+  logdebug("%s: Queueing up to %d samples for insertion\n", db->name, size);
+  return self;
+}
+
+/** Free a list of IngestRows.
+ *
+ * \param row first IngestRow of the list
+ */
+static void
+ingest_rows_free(IngestRow *row)
+{
+  IngestRow *next;
+
+  while (row) {
+    next = row->next;
+    oml_value_array_reset(row->values, row->values_size);
+    oml_free(row->values);
+    oml_free(row);
+    row = next;
+  }
+}
+
+/** Insert all queued samples, stop the writer thread, and free an IngestQueue.
+ *
+ * The caller must not hold the Database lock, which the writer thread needs
+ * to finish its work.
+ *
+ * \param self IngestQueue to free
+ * \see ingest_queue_new
+ */
+void
+ingest_queue_free(IngestQueue *self)
+{
+  if (!self) {
+    return;
+  }
+
+  pthread_mutex_lock(&self->lock);
+  self->stopping = 1;
+  pthread_cond_signal(&self->not_empty);
+  pthread_mutex_unlock(&self->lock);
+  pthread_join(self->thread, NULL);
+
+  ingest_rows_free(self->head);
+  ingest_rows_free(self->pool);
+  pthread_cond_destroy(&self->not_full);
+  pthread_cond_destroy(&self->not_empty);
+  pthread_mutex_destroy(&self->lock);
+  oml_free(self);
+}
+
+/** Get an IngestRow from the pool, or allocate a new one.
+ *
+ * If self->size rows are already in use, wait for the writer thread to
+ * return some to the pool.
+ *
+ * This assumes that the current thread holds the self->lock, which may be
+ * released while waiting.
+ *
+ * \param self IngestQueue to take an IngestRow from
+ * \return an unqueued IngestRow, or NULL on error
+ */
+static IngestRow*
+ingest_row_get(IngestQueue *self)
+{
+  IngestRow *row;
+
+  if (self->used >= self->size) {
+    self->waits++;
+    logdebug2("%s: Ingest queue full (%d samples), waiting\n", self->db->name, self->used);
+    while (self->used >= self->size && !self->stopping) {
+      pthread_cond_wait(&self->not_full, &self->lock);
+    }
+  }
+
+  if ((row = self->pool)) {
+    self->pool = row->next;
+  } else if ((row = oml_malloc(sizeof(IngestRow)))) {
+    memset(row, 0, sizeof(IngestRow));
+  } else {
+    logerror("%s: Cannot allocate memory for queued sample\n", self->db->name);
+    return NULL;
+  }
+  row->next = NULL;
+  self->used++;
+
+  return row;
+}
+
+/** Copy a sample into an IngestRow.
+ *
+ * \param row IngestRow to fill
+ * \param values OmlValue array to copy
+ * \param value_count number of values
+ * \return 0 on success, -1 otherwise
+ */
+static int
+ingest_row_set_values(IngestRow *row, OmlValue *values, int value_count)
+{
+  OmlValue *new_values;
+  int i;
+
+  if (value_count > row->values_size) {
+    if (!(new_values = oml_realloc(row->values, value_count * sizeof(OmlValue)))) {
+      return -1;
+    }
+    oml_value_array_init(&new_values[row->values_size], value_count - row->values_size);
+    row->values = new_values;
+    row->values_size = value_count;
+  }
+
+  for (i = 0; i < value_count; i++) {
+    if (oml_value_duplicate(&row->values[i], &values[i])) {
+      return -1;
+    }
+  }
+  row->value_count = value_count;
+
+  return 0;
+}
+
+/** Estimate the memory used by a queued sample.
+ *
+ * \param values OmlValue array of the sample
+ * \param value_count number of values
+ * \return the approximate size of the IngestRow and its values [B]
+ */
+static size_t
+ingest_sample_bytes(OmlValue *values, int value_count)
+{
+  size_t bytes = sizeof(IngestRow) + value_count * sizeof(OmlValue);
+  OmlValueU *u;
+  int i;
+
+  for (i = 0; i < value_count; i++) {
+    u = oml_value_get_value(&values[i]);
+    switch(oml_value_get_type(&values[i])) {
+    case OML_STRING_VALUE:
+      bytes += omlc_get_string_length(*u);
+      break;
+    case OML_BLOB_VALUE:
+      bytes += omlc_get_blob_length(*u);
+      break;
+    case OML_VECTOR_DOUBLE_VALUE:
+    case OML_VECTOR_INT32_VALUE:
+    case OML_VECTOR_UINT32_VALUE:
+    case OML_VECTOR_INT64_VALUE:
+    case OML_VECTOR_UINT64_VALUE:
+    case OML_VECTOR_BOOL_VALUE:
+      bytes += omlc_get_vector_length(*u);
+      break;
+    default:
+      break;
+    }
+  }
+  return bytes;
+}
+
+/** Queue a sample for insertion into the IngestQueue's Database.
+ *
+ * The values are copied, and can be reused by the caller as soon as this
+ * function returns. If the queue is full, wait for the writer thread to make
+ * room.
+ *
+ * The caller must not hold the Database lock.
+ *
+ * \param self IngestQueue to push the sample into
+ * \param account IngestAccount charged for the sample until it is inserted, or NULL
+ * \copydetails db_adapter_insert
+ * \see database_insert_from
+ */
+int
+ingest_queue_push(IngestQueue *self, IngestAccount *account, DbTable *table,
+    int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count)
+{
+  IngestRow *row;
+
+  pthread_mutex_lock(&self->lock);
+  if (!(row = ingest_row_get(self))) {
+    pthread_mutex_unlock(&self->lock);
+    return -1;
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  /* The row is not reachable from the queue yet, fill it without the lock */
+  row->table = table;
+  row->sender_id = sender_id;
+  row->seq_no = seq_no;
+  row->time_stamp = time_stamp;
+  if (ingest_row_set_values(row, values, value_count)) {
+    logerror("%s: Cannot copy sample %d for table '%s'\n",
+        self->db->name, seq_no, table->schema->name);
+    pthread_mutex_lock(&self->lock);
+    row->next = self->pool;
+    self->pool = row;
+    self->used--;
+    pthread_cond_signal(&self->not_full);
+    pthread_mutex_unlock(&self->lock);
+    return -1;
+  }
+
+  row->bytes = ingest_sample_bytes(values, value_count);
+  __atomic_add_fetch(&queued_bytes, row->bytes, __ATOMIC_SEQ_CST);
+  if ((row->account = account)) {
+    __atomic_add_fetch(&account->refs, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&account->bytes, row->bytes, __ATOMIC_SEQ_CST);
+  }
+
+  pthread_mutex_lock(&self->lock);
+  if (self->tail) {
+    self->tail->next = row;
+  } else {
+    self->head = row;
+  }
+  self->tail = row;
+  if (++self->depth > self->max_depth) {
+    self->max_depth = self->depth;
+  }
+  pthread_cond_signal(&self->not_empty);
+  pthread_mutex_unlock(&self->lock);
+
+  return 0;
+}
+
+/** Get the proportion of an IngestQueue's capacity in use.
+ *
+ * The value is read without locking, and may already be out of date.
+ *
+ * \param self IngestQueue to check
+ * \return the number of samples queued or being inserted, relative to the size of the queue
+ */
+double
+ingest_queue_load(IngestQueue *self)
+{
+  return (double)__atomic_load_n(&self->used, __ATOMIC_SEQ_CST) / self->size;
+}
+
+/** Create an IngestAccount, with a reference held by the caller.
+ *
+ * \return a new IngestAccount, or NULL on error
+ * \see ingest_account_release, ingest_queue_push
+ */
+IngestAccount*
+ingest_account_new(void)
+{
+  IngestAccount *self = oml_malloc(sizeof(IngestAccount));
+
+  if (self) {
+    self->bytes = 0;
+    self->refs = 1;
+  }
+  return self;
+}
+
+/** Release the caller's reference to an IngestAccount.
+ *
+ * The account is freed once the last of the samples charged to it has been
+ * inserted.
+ *
+ * \param self IngestAccount to release, can be NULL
+ */
+void
+ingest_account_release(IngestAccount *self)
+{
+  if (self && !__atomic_sub_fetch(&self->refs, 1, __ATOMIC_ACQ_REL)) {
+    oml_free(self);
+  }
+}
+
+/** Get the memory used by the samples queued with an IngestAccount.
+ *
+ * \param self IngestAccount to check
+ * \return the approximate memory used by the samples charged to the account [B]
+ */
+size_t
+ingest_account_bytes(IngestAccount *self)
+{
+  return __atomic_load_n(&self->bytes, __ATOMIC_SEQ_CST);
+}
+
+/** Get the memory used by the samples queued in all IngestQueues.
+ *
+ * \return the approximate memory used by all queued samples [B]
+ */
+size_t
+ingest_queued_bytes(void)
+{
+  return __atomic_load_n(&queued_bytes, __ATOMIC_SEQ_CST);
+}
+
+/** Set a function to call after samples have been inserted.
+ *
+ * The hook is called from the writer threads, without holding any lock, once
+ * the memory used by the inserted samples has been released from their
+ * IngestAccounts and the total.
+ *
+ * \param hook function to call, or NULL
+ * \see ingest_queued_bytes, ingest_account_bytes
+ */
+void
+ingest_set_drain_hook(void (*hook)(void))
+{
+  drain_hook = hook;
+}
+
+/** Release the memory charged for inserted samples from their IngestAccounts, and the total.
+ *
+ * Consecutive samples charged to the same account are settled at once.
+ *
+ * \param row first IngestRow of a list of inserted samples
+ */
+static void
+ingest_rows_settle(IngestRow *row)
+{
+  IngestAccount *account = NULL, *last = NULL;
+  size_t bytes = 0, total = 0;
+  int refs = 0;
+
+  for (; row; row = row->next) {
+    total += row->bytes;
+    if (row->account != account) {
+      last = account;
+      account = row->account;
+      if (last) {
+        __atomic_sub_fetch(&last->bytes, bytes, __ATOMIC_SEQ_CST);
+        if (!__atomic_sub_fetch(&last->refs, refs, __ATOMIC_ACQ_REL)) {
+          oml_free(last);
+        }
+      }
+      bytes = 0;
+      refs = 0;
+    }
+    bytes += row->bytes;
+    refs++;
+    row->account = NULL;
+  }
+  if (account) {
+    __atomic_sub_fetch(&account->bytes, bytes, __ATOMIC_SEQ_CST);
+    if (!__atomic_sub_fetch(&account->refs, refs, __ATOMIC_ACQ_REL)) {
+      oml_free(account);
+    }
+  }
+  __atomic_sub_fetch(&queued_bytes, total, __ATOMIC_SEQ_CST);
+}
+
+/** Report the state of an IngestQueue, and reset the statistics.
+ *
+ * This assumes that the current thread holds the self->lock.
+ *
+ * \param self IngestQueue to report on
+ * \param latency total time spent inserting samples since the last report [s]
+ * \param max_latency longest time spent inserting a single sample since the last report [s]
+ * \see ingest_report_inject
+ */
+static void
+ingest_queue_report(IngestQueue *self, double latency, double max_latency)
+{
+  double mean = self->inserted ? latency / self->inserted : 0.;
+
+  logdebug("%s: Inserted %" PRIu64 " samples (%.6fs/sample, max %.6fs); %d queued, at most %d, %u waits\n",
+      self->db->name, self->inserted, mean, max_latency, self->depth, self->max_depth, self->waits);
+#ifndef NOOML /* For unit tests */
+  ingest_report_inject(self->db->name, self->depth, self->max_depth, self->waits,
+      self->inserted, mean, max_latency);
+#endif
+
+  self->max_depth = self->depth;
+  self->inserted = 0;
+  self->waits = 0;
+}
+
+/** Main function of the writer thread of an IngestQueue.
+ *
+ * Takes all the queued rows at once, and inserts them into the Database
+ * while holding its lock, but not that of the queue, so clients can keep
+ * pushing samples meanwhile. The rows are then returned to the pool.
+ *
+ * When no samples are queued, the backend's flush function, if any, is called
+ * about every INGEST_REPORT_INTERVAL. Once the queue is stopping, the
+ * remaining rows are inserted before the thread exits.
+ *
+ * \param handle pointer to the IngestQueue
+ * \return NULL
+ */
+static void*
+ingest_thread_start(void *handle)
+{
+  IngestQueue *self = (IngestQueue*)handle;
+  Database *db = self->db;
+  IngestRow *rows, *last, *row;
+  struct timespec deadline;
+  double start, elapsed, latency = 0., max_latency = 0., next_report;
+  int n;
+
+  next_report = monotonic_s() + INGEST_REPORT_INTERVAL;
+
+  pthread_mutex_lock(&self->lock);
+  while (1) {
+    if (!self->head && !self->stopping) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += INGEST_REPORT_INTERVAL;
+      pthread_cond_timedwait(&self->not_empty, &self->lock, &deadline);
+    }
+
+    if (monotonic_s() >= next_report) {
+      if (self->inserted || self->depth) {
+        ingest_queue_report(self, latency, max_latency);
+      }
+      latency = max_latency = 0.;
+      next_report = monotonic_s() + INGEST_REPORT_INTERVAL;
+    }
+
+    if (!self->head) {
+      if (self->stopping) {
+        break;
+      }
+      if (db->flush) {
+        /* Idle, let the backend write out what it has been holding back */
+        pthread_mutex_unlock(&self->lock);
+        database_lock(db);
+        db->flush(db);
+        database_unlock(db);
+        pthread_mutex_lock(&self->lock);
+      }
+      continue;
+    }
+
+    rows = self->head;
+    self->head = self->tail = NULL;
+    self->depth = 0;
+    pthread_mutex_unlock(&self->lock);
+
+    n = 0;
+    last = rows;
+    database_lock(db);
+    for (row = rows; row; row = row->next) {
+      start = monotonic_s();
+      db->insert(db, row->table, row->sender_id, row->seq_no,
+          row->time_stamp, row->values, row->value_count);
+      elapsed = monotonic_s() - start;
+      latency += elapsed;
+      if (elapsed > max_latency) {
+        max_latency = elapsed;
+      }
+      last = row;
+      n++;
+    }
+    database_unlock(db);
+
+    ingest_rows_settle(rows);
+
+    pthread_mutex_lock(&self->lock);
+    last->next = self->pool;
+    self->pool = rows;
+    self->used -= n;
+    self->inserted += n;
+    pthread_cond_broadcast(&self->not_full);
+
+    if (drain_hook) {
+      /* Once all the state it may check has been updated */
+      pthread_mutex_unlock(&self->lock);
+      drain_hook();
+      pthread_mutex_lock(&self->lock);
+    }
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  return NULL;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,51 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file ingest.h
+ * \brief Interface to the queues of decoded samples waiting to be inserted into a Database.
+ */
+#ifndef INGEST_H_
+#define INGEST_H_
+
+#include "oml2/omlc.h"
+#include "database.h"
+
+/** Default maximum number of samples queued for insertion into one Database */
+#define DEFAULT_INGEST_QUEUE_SIZE 4096
+
+/** Interval between reports of the state of an IngestQueue [s] */
+#define INGEST_REPORT_INTERVAL 1
+
+typedef struct IngestQueue IngestQueue;
+typedef struct IngestAccount IngestAccount;
+
+extern int ingest_queue_size;
+
+IngestQueue *ingest_queue_new(Database *db, int size);
+void ingest_queue_free(IngestQueue *self);
+int ingest_queue_push(IngestQueue *self, IngestAccount *account, DbTable *table,
+    int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count);
+double ingest_queue_load(IngestQueue *self);
+
+IngestAccount *ingest_account_new(void);
+void ingest_account_release(IngestAccount *self);
+size_t ingest_account_bytes(IngestAccount *self);
+size_t ingest_queued_bytes(void);
+void ingest_set_drain_hook(void (*hook)(void));
+
+#endif /*INGEST_H_*/
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -82,6 +82,43 @@ client_event_inject(const char* address, uint32_t port, const char* oml_id, cons
   }
 }
 
+/** Inject a report on the queue of samples waiting to be inserted into a database.
+ *
+ * \param database name of the database
+ * \param depth number of samples currently queued
+ * \param max_depth largest number of samples queued since the last report
+ * \param waits number of times clients waited for room in the queue since the last report
+ * \param inserted number of samples inserted since the last report
+ * \param latency mean time taken to insert one sample since the last report [s]
+ * \param max_latency longest time taken to insert one sample since the last report [s]
+ */
+void
+ingest_report_inject(const char* database, uint32_t depth, uint32_t max_depth, uint32_t waits, uint64_t inserted, double latency, double max_latency)
+{
+  if(oml_enabled) {
+    oml_inject_ingest(g_oml_mps_oml2_server->ingest, database, depth, max_depth, waits, inserted, latency, max_latency);
+  }
+}
+
+/** Inject a report on the pauses in reading from a client into the monitoring OML server.
+ *
+ * \param address pointer to the client IP address string
+ * \param port    client port number
+ * \param oml_id  pointer to a string containing the client OML ID.
+ * \param domain  pointer to a string containing the client domain.
+ * \param appname pointer to a string containing the client appname.
+ * \param pauses  number of times reading from the client was paused
+ * \param paused  total time during which reading from the client was paused [s]
+ * \param queued  memory used by the client's samples waiting to be inserted [B]
+ */
+void
+backpressure_report_inject(const char* address, uint32_t port, const char* oml_id, const char* domain, const char* appname, uint32_t pauses, double paused, uint64_t queued)
+{
+  if(oml_enabled) {
+    oml_inject_backpressure(g_oml_mps_oml2_server->backpressure, address, port, oml_id, domain, appname, pauses, paused, queued);
+  }
+}
+
 /*
  Local Variables:
  mode: C
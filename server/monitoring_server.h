@@ -18,6 +18,10 @@ void oml_cleanup(void);
 
 void client_event_inject(const char* address, uint32_t port, const char* oml_id, const char* domain, const char* appname, const char* event, const char* message);
 
+void ingest_report_inject(const char* database, uint32_t depth, uint32_t max_depth, uint32_t waits, uint64_t inserted, double latency, double max_latency);
+
+void backpressure_report_inject(const char* address, uint32_t port, const char* oml_id, const char* domain, const char* appname, uint32_t pauses, double paused, uint64_t queued);
+
 #endif /*MONITORING_SERVER_H_*/
 
 /*
@@ -45,6 +45,9 @@
 #include "hook.h"
 #include "client_handler.h"
 #include "database.h"
+#include "ingest.h"
+#include "backpressure.h"
+#include "reactor.h"
 #include "sqlite_adapter.h"
 #include "monitoring_server.h"
 #include "fuseki_adapter.h"
@@ -88,18 +91,26 @@ die (const char *fmt, ...)
 static char* listen_service = DEFAULT_PORT_STR;
 static int log_level = O_LOG_INFO;
 static int socket_timeout = 60;
+static int read_budget = 262144;
+static int nthreads = 1;
 static char* logfile_name = NULL;
 static char* uidstr = NULL;
 static char* gidstr = NULL;
 
 extern char* dbbackend;
 extern char *sqlite_database_dir;
+extern int sqlite_batch_rows;
+extern int sqlite_commit_rows;
+extern int sqlite_commit_bytes;
+extern int sqlite_commit_latency;
+extern int columnar_commit_latency;
 #if HAVE_LIBPQ
 extern char *pg_host;
 extern char *pg_port;
 extern char *pg_user;
 extern char *pg_pass;
 extern char *pg_conninfo;
+extern int pg_copy_rows;
 #endif /* HAVE_LIBPQ */
 extern char *fus_host;
 extern char *fus_port;
@@ -108,18 +119,26 @@ extern char *vir_host;
 extern char *vir_port;
 extern char *vir_user;
 extern char *vir_pass;
+extern int sparql_batch_rows;
+extern int sparql_requests;
 
 struct poptOption options[] = {
   POPT_AUTOHELP
   { "listen", 'l', POPT_ARG_STRING, &listen_service, 0, "Service to listen for TCP based clients", DEFAULT_PORT_STR},
   { "backend", 'b', POPT_ARG_STRING, &dbbackend, 0, "Database server backend", DEFAULT_DB_BACKEND},
-  { "data-dir", 'D', POPT_ARG_STRING, &sqlite_database_dir, 0, "Directory to store database files (sqlite)", "DIR" },
+  { "data-dir", 'D', POPT_ARG_STRING, &sqlite_database_dir, 0, "Directory to store database files (sqlite, columnar)", "DIR" },
+  { "sqlite-batch-rows", '\0', POPT_ARG_INT, &sqlite_batch_rows, 0, "Number of samples inserted at once into each table (sqlite)", "64" },
+  { "sqlite-commit-rows", '\0', POPT_ARG_INT, &sqlite_commit_rows, 0, "Commit after that many samples, 0 for no limit (sqlite)", "0" },
+  { "sqlite-commit-bytes", '\0', POPT_ARG_INT, &sqlite_commit_bytes, 0, "Commit after that many bytes of samples, 0 for no limit (sqlite)", "0" },
+  { "sqlite-commit-latency", '\0', POPT_ARG_INT, &sqlite_commit_latency, 0, "Commit samples at most that many milliseconds after receiving them (sqlite)", "1000" },
+  { "columnar-commit-latency", '\0', POPT_ARG_INT, &columnar_commit_latency, 0, "Commit samples at most that many milliseconds after receiving them (columnar)", "1000" },
 #if HAVE_LIBPQ
   { "pg-host", '\0', POPT_ARG_STRING, &pg_host, 0, "PostgreSQL server host to connect to", DEFAULT_PG_HOST },
   { "pg-port", '\0', POPT_ARG_STRING, &pg_port, 0, "PostgreSQL server port to connect to", DEFAULT_PG_PORT },
   { "pg-user", '\0', POPT_ARG_STRING, &pg_user, 0, "PostgreSQL user to connect as", DEFAULT_PG_USER },
   { "pg-pass", '\0', POPT_ARG_STRING, &pg_pass, 'p', "Password of the PostgreSQL user", DEFAULT_PG_PASS },
   { "pg-connect", '\0', POPT_ARG_STRING, &pg_conninfo, 'c', "PostgreSQL connection info string", "\"" DEFAULT_PG_CONNINFO "\""},
+  { "pg-copy-rows", '\0', POPT_ARG_INT, &pg_copy_rows, 0, "Number of samples sent at once to each table with COPY, 1 to disable (psql)", "1" },
 #endif
   { "fus-host", '\0', POPT_ARG_STRING, &fus_host, 0, "Fuseki server host to connect to", DEFAULT_FUS_HOST },
   { "fus-port", '\0', POPT_ARG_STRING, &fus_port, 0, "Fuseki server port to connect to", DEFAULT_FUS_PORT },
@@ -128,10 +147,17 @@ struct poptOption options[] = {
   { "vir-pass", '\0', POPT_ARG_STRING, &vir_pass, 0, "Virtuoso server pass to connect to", DEFAULT_VIR_PASS },
   { "vir-host", '\0', POPT_ARG_STRING, &vir_host, 0, "Database server host to connect to", DEFAULT_VIR_HOST },
   { "vir-port", '\0', POPT_ARG_STRING, &vir_port, 0, "Database server port to connect to", DEFAULT_VIR_PORT },
+  { "sparql-batch-rows", '\0', POPT_ARG_INT, &sparql_batch_rows, 0, "Number of samples sent at once to each table (fuseki, virtuoso)", "256" },
+  { "sparql-requests", '\0', POPT_ARG_INT, &sparql_requests, 0, "Maximum number of update requests in flight (fuseki, virtuoso)", "4" },
   { "user", '\0', POPT_ARG_STRING, &uidstr, 0, "Change server's user id", "UID" },
   { "group", '\0', POPT_ARG_STRING, &gidstr, 0, "Change server's group id", "GID" },
   { "event-hook", 'H', POPT_ARG_STRING, &hook, 0, "Path to an event hook taking input on stdin", "HOOK" },
   { "timeout", 't', POPT_ARG_INT, &socket_timeout, 0, "Timeout after which idle receiving sockets are cleaned up to avoid resource exhaustion", "60"  },
+  { "read-budget", '\0', POPT_ARG_INT, &read_budget, 0, "Maximum number of bytes read from one client before serving others, 0 for no limit", "262144"  },
+  { "ingest-queue", '\0', POPT_ARG_INT, &ingest_queue_size, 0, "Maximum number of samples waiting to be inserted into each database, 0 to insert them synchronously", "4096"  },
+  { "client-memory", '\0', POPT_ARG_INT, &client_memory_budget, 0, "Stop reading from a client while its samples waiting to be inserted use more than that many kB, 0 for no limit", "8192"  },
+  { "server-memory", '\0', POPT_ARG_INT, &server_memory_budget, 0, "Stop reading from clients while all samples waiting to be inserted use more than that many kB, 0 for no limit", "262144"  },
+  { "threads", '\0', POPT_ARG_INT, &nthreads, 0, "Number of threads serving clients; above 1, the main thread only accepts connections", "1"  },
   { "debug-level", 'd', POPT_ARG_INT, &log_level, 0, "Increase debug level", "{1 .. 4}"  },
   { "logfile", '\0', POPT_ARG_STRING, &logfile_name, 0, "File to log to", DEFAULT_LOG_FILE },
   { "version", 'v', POPT_ARG_NONE, NULL, 'v', "Print version information and exit", NULL },
@@ -185,6 +211,7 @@ static void sighandler(int signum)
     break;
   case SIGUSR1:
     eventloop_report(O_LOG_INFO);
+    reactor_report();
     break;
   default:
     logwarn("Received unhandled signal %d\n", signum);
@@ -273,7 +300,8 @@ static void drop_privileges (const char *uidstr, const char *gidstr)
 
 /** Callback called when a new connection is received on the listening Socket.
  *
- * This function creates a ClientHandler to manage the data from this Socket.
+ * This function creates a ClientHandler to manage the data from this Socket,
+ * or hands the Socket over to a reactor thread which will do so, if any.
  * The listening Socket would have been created using socket_server_new().
  *
  * \param new_sock Socket object created by accept()ing the connection
@@ -285,13 +313,16 @@ static void drop_privileges (const char *uidstr, const char *gidstr)
 static void on_connect(Socket* new_sock, void* handle)
 {
   (void)handle;
+  if (!reactor_dispatch(new_sock)) {
+    return;
+  }
   (void)client_handler_new(new_sock);
   logdebug("%s: New client connected\n", new_sock->name);
 }
 
 int main(int argc, const char **argv)
 {
-  int c;
+  int c, reason;
 #ifdef HAVE_LIBPQ
   char *pass_replace = "--pg-pass=WITHHELD", *conninfo_replace = "--pg-connect=WITHHELD";
 #endif
@@ -373,6 +404,7 @@ int main(int argc, const char **argv)
 
   eventloop_init();
   eventloop_set_socket_timeout(socket_timeout);
+  eventloop_set_read_budget(read_budget > 0 ? read_budget : 0);
 
   Socket* server_sock;
   server_sock = socket_server_new("server", NULL, listen_service, on_connect, NULL);
@@ -392,7 +424,16 @@ int main(int argc, const char **argv)
 
   hook_setup();
 
-  eventloop_run();
+  backpressure_setup();
+
+  if (nthreads > 1 &&
+      reactor_start(nthreads, socket_timeout, read_budget > 0 ? read_budget : 0)) {
+    die("Failed to start %d threads\n", nthreads);
+  }
+
+  reason = eventloop_run();
+
+  reactor_stop(reason);
 
   signal_cleanup();
 
@@ -28,6 +28,7 @@
 #include "mstring.h"
 #include "guid.h"
 #include "json.h"
+#include "htonll.h"
 #include "oml_value.h"
 #include "oml_util.h"
 #include "database.h"
@@ -41,6 +42,10 @@ char *pg_port = DEFAULT_PG_PORT;
 char *pg_user = DEFAULT_PG_USER;
 char *pg_pass = DEFAULT_PG_PASS;
 char *pg_conninfo = DEFAULT_PG_CONNINFO;
+int pg_copy_rows = DEFAULT_PG_COPY_ROWS;
+
+/** Signature and flags/extension fields opening binary COPY data */
+static const char copy_header[] = "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0";
 
 /** Mapping between OML and PostgreSQL data types
  * \see psql_type_to_oml, psql_oml_to_type
@@ -77,6 +82,7 @@ static int psql_table_create (Database* db, DbTable* table, int shallow);
 static int psql_table_free (Database *database, DbTable* table);
 static char *psql_prepared_var(Database *db, unsigned int order);
 static int psql_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count);
+static int psql_flush(Database *db);
 static char* psql_get_key_value (Database* database, const char* table, const char* key_column, const char* value_column, const char* key);
 static int psql_set_key_value (Database* database, const char* table, const char* key_column, const char* value_column, const char* key, const char* value);
 static char* psql_get_metadata (Database* database, const char* key);
@@ -89,6 +95,9 @@ static MString* psql_prepare_conninfo(const char *database, const char *host, co
 static char* psql_get_sender_id (Database* database, const char* name);
 static int psql_set_sender_id (Database* database, const char* name, int id);
 static void psql_receive_notice(void *arg, const PGresult *res);
+static int psql_table_prepare_copy (Database *db, DbTable *table);
+static int psql_table_copy (Database *db, DbTable *table);
+static int psql_insert_row(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, double time_stamp_server, OmlValue *values);
 
 MString* psql_prepare (Database *db, DbTable* table);
 
@@ -311,6 +320,7 @@ psql_create_database(Database* db)
   PsqlDB* self = (PsqlDB*)oml_malloc(sizeof(PsqlDB));
   self->conn = conn;
   self->last_commit = time (NULL);
+  self->copy_buf = mbuf_create ();
 
   db->backend_name = backend_name;
   db->o2t = psql_oml_to_type;
@@ -324,6 +334,7 @@ psql_create_database(Database* db)
   db->table_free = psql_table_free;
   db->prepare = psql_prepare;
   db->insert = psql_insert;
+  db->flush = psql_flush;
   db->add_sender_id = psql_add_sender_id;
   db->get_metadata = psql_get_metadata;
   db->set_metadata = psql_set_metadata;
@@ -356,6 +367,7 @@ psql_release(Database* db)
   PsqlDB* self = (PsqlDB*)db->handle;
   dba_end_transaction (db);
   PQfinish(self->conn);
+  if (self->copy_buf) { mbuf_destroy (self->copy_buf); }
   oml_free(self);
   db->handle = NULL;
 }
@@ -453,6 +465,11 @@ psql_table_create (Database *db, DbTable *table, int shallow)
 
   psqltable->insert_stmt = insert_name;
 
+  if (pg_copy_rows > 1 && psqldb->copy_buf && psql_table_prepare_copy (db, table)) {
+    logwarn("psql:%s: Inserting samples into table '%s' one by one\n",
+        db->name, table->schema->name);
+  }
+
   if (insert) { mstring_delete (insert); }
   return 0;
 
@@ -463,18 +480,98 @@ fail_exit:
   return -1;
 }
 
+/** Prepare the COPY statement for a table, and the buffer of samples for it.
+ *
+ * \param db Database containing the table
+ * \param table DbTable with a PsqlTable handle
+ * \return 0 on success, -1 otherwise, in which case samples are inserted one by one
+ * \see psql_table_copy
+ */
+static int
+psql_table_prepare_copy (Database *db, DbTable *table)
+{
+  PsqlTable *psqltable = (PsqlTable*)table->handle;
+  MString *mstr;
+  int i, n = 0;
+
+  if (!(mstr = mstring_create ())) {
+    return -1;
+  }
+  n += mstring_sprintf (mstr,
+      "COPY \"%s\" (\"oml_sender_id\", \"oml_seq\", \"oml_ts_client\", \"oml_ts_server\"",
+      table->schema->name);
+  for (i = 0; i < table->schema->nfields; i++) {
+    n += mstring_sprintf (mstr, ", \"%s\"", table->schema->fields[i].name);
+  }
+  n += mstring_cat (mstr, ") FROM STDIN WITH BINARY;");
+  if (n != 0) {
+    mstring_delete (mstr);
+    return -1;
+  }
+
+  psqltable->rows = oml_calloc (pg_copy_rows, sizeof(PsqlRow));
+  for (i = 0; psqltable->rows && i < pg_copy_rows; i++) {
+    if (!(psqltable->rows[i].values = oml_calloc (table->schema->nfields, sizeof(OmlValue)))) {
+      break;
+    }
+  }
+  if (!psqltable->rows || i < pg_copy_rows) {
+    logerror("psql:%s: Could not allocate buffer for %d samples of table '%s'\n",
+        db->name, pg_copy_rows, table->schema->name);
+    while (psqltable->rows && i-- > 0) {
+      oml_free (psqltable->rows[i].values);
+    }
+    oml_free (psqltable->rows);
+    psqltable->rows = NULL;
+    mstring_delete (mstr);
+    return -1;
+  }
+
+  psqltable->copy_stmt = mstr;
+  psqltable->copy_size = pg_copy_rows;
+  psqltable->nrows = 0;
+  return 0;
+}
+
+/** Free the buffer of samples of a table, and stop using COPY for it.
+ * \param table DbTable with a PsqlTable handle
+ */
+static void
+psql_table_free_copy (DbTable *table)
+{
+  PsqlTable *psqltable = (PsqlTable*)table->handle;
+  int i;
+
+  if (psqltable->rows) {
+    for (i = 0; i < psqltable->copy_size; i++) {
+      oml_value_array_reset (psqltable->rows[i].values, table->schema->nfields);
+      oml_free (psqltable->rows[i].values);
+    }
+    oml_free (psqltable->rows);
+    psqltable->rows = NULL;
+  }
+  if (psqltable->copy_stmt) {
+    mstring_delete (psqltable->copy_stmt);
+    psqltable->copy_stmt = NULL;
+  }
+  psqltable->copy_size = 0;
+  psqltable->nrows = 0;
+}
+
 /** Free a PostgreSQL table
  *
- * Parameter database is ignored in this implementation
+ * Samples still waiting for a COPY are sent first.
  *
  * \see db_adapter_table_free
  */
 static int
 psql_table_free (Database *database, DbTable *table)
 {
-  (void)database;
   PsqlTable *psqltable = (PsqlTable*)table->handle;
   if (psqltable) {
+    /* Don't lose the samples still waiting for a COPY */
+    psql_table_copy (database, table);
+    psql_table_free_copy (table);
     mstring_delete (psqltable->insert_stmt);
     oml_free (psqltable);
   }
@@ -573,17 +670,23 @@ psql_prepare (Database *db, DbTable* table)
   return NULL;
 }
 
-/** Insert value in the PostgreSQL database.
- * \see db_adapter_insert
+/** Insert one sample with the table's prepared statement.
+ *
+ * \param db Database containing the table
+ * \param table DbTable to insert into
+ * \param sender_id, seq_no, time_stamp, time_stamp_server metadata of the sample
+ * \param values OmlValue array, one per field of the table's schema
+ * \return 0 on success, -1 otherwise
+ * \see psql_insert
  */
 static int
-psql_insert(Database* db, DbTable* table, int sender_id, int seq_no, double time_stamp, OmlValue* values, int value_count)
+psql_insert_row(Database* db, DbTable* table, int sender_id, int seq_no, double time_stamp, double time_stamp_server, OmlValue* values)
 {
   PsqlDB* psqldb = (PsqlDB*)db->handle;
   PsqlTable* psqltable = (PsqlTable*)table->handle;
   PGresult* res;
   int i;
-  double time_stamp_server;
+  int value_count = table->schema->nfields;
   const char* insert_stmt = mstring_buf (psqltable->insert_stmt);
   unsigned char *escaped_blob;
   size_t len=MAX_DIGITS;
@@ -609,17 +712,6 @@ psql_insert(Database* db, DbTable* table, int sender_id, int seq_no, double time
   paramLength[2] = 0;
   paramFormat[2] = 0;
 
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
-
-  if (tv.tv_sec > psqldb->last_commit) {
-    if (dba_reopen_transaction (db) == -1) {
-      return -1;
-    }
-    psqldb->last_commit = tv.tv_sec;
-  }
-
   snprintf(paramValues[3], MAX_DIGITS, "%.14e",time_stamp_server);
   paramLength[3] = 0;
   paramFormat[3] = 0;
@@ -729,6 +821,394 @@ psql_insert(Database* db, DbTable* table, int sender_id, int seq_no, double time
   return 0;
 }
 
+/** Append a 16-bit integer to binary COPY data.
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_int16(MBuffer *mbuf, int16_t value)
+{
+  uint16_t n = htons ((uint16_t)value);
+  return mbuf_write (mbuf, (uint8_t*)&n, sizeof(n));
+}
+
+/** Append a 32-bit integer to binary COPY data.
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_int32(MBuffer *mbuf, int32_t value)
+{
+  uint32_t n = htonl ((uint32_t)value);
+  return mbuf_write (mbuf, (uint8_t*)&n, sizeof(n));
+}
+
+/** Append a 64-bit integer to binary COPY data.
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_int64(MBuffer *mbuf, int64_t value)
+{
+  uint64_t n = htonll ((uint64_t)value);
+  return mbuf_write (mbuf, (uint8_t*)&n, sizeof(n));
+}
+
+/** Append an INT4 field to binary COPY data.
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_int4_field(MBuffer *mbuf, int32_t value)
+{
+  return psql_copy_put_int32 (mbuf, 4) || psql_copy_put_int32 (mbuf, value) ? -1 : 0;
+}
+
+/** Append an INT8 field to binary COPY data.
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_int8_field(MBuffer *mbuf, int64_t value)
+{
+  return psql_copy_put_int32 (mbuf, 8) || psql_copy_put_int64 (mbuf, value) ? -1 : 0;
+}
+
+/** Append a FLOAT8 field to binary COPY data.
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_float8_field(MBuffer *mbuf, double value)
+{
+  int64_t n;
+  memcpy (&n, &value, sizeof(n));
+  return psql_copy_put_int8_field (mbuf, n);
+}
+
+/** Append a variable-length (TEXT, BYTEA) field to binary COPY data.
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_bytes_field(MBuffer *mbuf, const void *data, size_t len)
+{
+  return psql_copy_put_int32 (mbuf, (int32_t)len) || mbuf_write (mbuf, data, len) ? -1 : 0;
+}
+
+/** Append a sample to binary COPY data.
+ *
+ * Each value is encoded in the binary format of the column type given by
+ * psql_type_pair, so the server can store it without parsing it.
+ *
+ * \param db Database containing the table
+ * \param table DbTable the sample belongs to
+ * \param mbuf MBuffer to append the tuple to
+ * \param row PsqlRow to encode
+ * \return 0 on success, -1 otherwise, including when a value cannot be stored in its column
+ * \see psql_copy_encode
+ */
+static int
+psql_copy_put_row(Database *db, DbTable *table, MBuffer *mbuf, PsqlRow *row)
+{
+  struct schema *schema = table->schema;
+  OmlValue *v = row->values;
+  OmlValueU *u;
+  char *json = NULL;
+  ssize_t json_len = 0;
+  int i, ret;
+
+  ret = psql_copy_put_int16 (mbuf, (int16_t)(schema->nfields + 4)) ||
+    psql_copy_put_int4_field (mbuf, row->sender_id) ||
+    psql_copy_put_int4_field (mbuf, row->seq_no) ||
+    psql_copy_put_float8_field (mbuf, row->time_stamp) ||
+    psql_copy_put_float8_field (mbuf, row->time_stamp_server);
+
+  for (i = 0; !ret && i < schema->nfields; i++, v++) {
+    u = oml_value_get_value(v);
+    switch (schema->fields[i].type) {
+    case OML_LONG_VALUE:   ret = psql_copy_put_int4_field (mbuf, (int32_t)omlc_get_long(*u)); break;
+    case OML_INT32_VALUE:  ret = psql_copy_put_int4_field (mbuf, omlc_get_int32(*u)); break;
+    case OML_UINT32_VALUE: ret = psql_copy_put_int8_field (mbuf, omlc_get_uint32(*u)); break;
+    case OML_INT64_VALUE:  ret = psql_copy_put_int8_field (mbuf, omlc_get_int64(*u)); break;
+    case OML_UINT64_VALUE:
+      if (omlc_get_uint64(*u) > INT64_MAX) {
+        /* Out of the range of BIGINT; the prepared INSERT reports the error for this sample only */
+        logdebug("psql:%s: Cannot COPY value %" PRIu64 " of col '%s' of table '%s' as a BIGINT\n",
+            db->name, omlc_get_uint64(*u), schema->fields[i].name, schema->name);
+        ret = -1;
+      } else {
+        ret = psql_copy_put_int8_field (mbuf, (int64_t)omlc_get_uint64(*u));
+      }
+      break;
+    case OML_DOUBLE_VALUE: ret = psql_copy_put_float8_field (mbuf, omlc_get_double(*u)); break;
+    case OML_BOOL_VALUE:
+      ret = psql_copy_put_bytes_field (mbuf, omlc_get_bool(*u) ? "\1" : "\0", 1);
+      break;
+    case OML_STRING_VALUE:
+      ret = psql_copy_put_bytes_field (mbuf, omlc_get_string_ptr(*u), strlen (omlc_get_string_ptr(*u)));
+      break;
+    case OML_BLOB_VALUE:
+      ret = psql_copy_put_bytes_field (mbuf, omlc_get_blob_ptr(*u), omlc_get_blob_length(*u));
+      break;
+    case OML_GUID_VALUE:
+      if (omlc_get_guid(*u) != OMLC_GUID_NULL) {
+        ret = psql_copy_put_int8_field (mbuf, (int64_t)omlc_get_guid(*u));
+      } else {
+        ret = psql_copy_put_int32 (mbuf, -1); /* NULL */
+      }
+      break;
+
+    case OML_VECTOR_DOUBLE_VALUE:
+      json_len = vector_double_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+      break;
+    case OML_VECTOR_INT32_VALUE:
+      json_len = vector_int32_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+      break;
+    case OML_VECTOR_UINT32_VALUE:
+      json_len = vector_uint32_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+      break;
+    case OML_VECTOR_INT64_VALUE:
+      json_len = vector_int64_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+      break;
+    case OML_VECTOR_UINT64_VALUE:
+      json_len = vector_uint64_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+      break;
+    case OML_VECTOR_BOOL_VALUE:
+      json_len = vector_bool_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+      break;
+
+    default:
+      logerror("psql:%s: Unknown type %d in col '%s' of table '%s'; this is probably a bug\n",
+          db->name, schema->fields[i].type, schema->fields[i].name, schema->name);
+      ret = -1;
+    }
+
+    if (json) {
+      ret = json_len < 0 || psql_copy_put_bytes_field (mbuf, json, json_len);
+      oml_free (json);
+      json = NULL;
+    }
+  }
+
+  return ret ? -1 : 0;
+}
+
+/** Encode samples of a table as a complete binary COPY.
+ *
+ * \param db Database containing the table
+ * \param table DbTable the samples belong to
+ * \param mbuf MBuffer to write the COPY data into, after clearing it
+ * \param rows array of PsqlRow to encode
+ * \param nrows number of elements in rows
+ * \return 0 on success, -1 otherwise
+ * \see psql_copy_put_row, psql_table_copy
+ */
+int
+psql_copy_encode(Database *db, DbTable *table, MBuffer *mbuf, PsqlRow *rows, int nrows)
+{
+  int i, ret;
+
+  mbuf_clear2 (mbuf, 0);
+  ret = mbuf_write (mbuf, (const uint8_t*)copy_header, sizeof(copy_header) - 1);
+  for (i = 0; !ret && i < nrows; i++) {
+    ret = psql_copy_put_row (db, table, mbuf, &rows[i]);
+  }
+  if (!ret) {
+    ret = psql_copy_put_int16 (mbuf, -1); /* End of data */
+  }
+
+  return ret ? -1 : 0;
+}
+
+/** Send binary COPY data for a table to the server.
+ *
+ * \param psqldb PsqlDB to send the data on
+ * \param stmt COPY FROM STDIN statement
+ * \param mbuf MBuffer containing the whole COPY data
+ * \return 0 on success, -1 otherwise
+ * \see PQputCopyData, PQputCopyEnd
+ */
+static int
+psql_copy_send(PsqlDB *psqldb, const char *stmt, MBuffer *mbuf)
+{
+  PGresult *res;
+  int ret = 0;
+
+  logdebug2("psql: Will execute '%s' with %zuB of data\n", stmt, mbuf_fill (mbuf));
+  res = PQexec (psqldb->conn, stmt);
+  if (PQresultStatus (res) != PGRES_COPY_IN) {
+    PQclear (res);
+    return -1;
+  }
+  PQclear (res);
+
+  if (PQputCopyData (psqldb->conn, (const char*)mbuf_rdptr (mbuf), (int)mbuf_fill (mbuf)) != 1) {
+    ret = -1;
+  }
+  if (PQputCopyEnd (psqldb->conn, ret ? "incomplete data" : NULL) != 1) {
+    ret = -1;
+  }
+  while ((res = PQgetResult (psqldb->conn))) {
+    if (PQresultStatus (res) != PGRES_COMMAND_OK) {
+      ret = -1;
+    }
+    PQclear (res);
+  }
+
+  return ret;
+}
+
+/** Send all samples waiting for a table to the server in a single COPY.
+ *
+ * The COPY runs within a savepoint, so that, if it fails, the samples can
+ * still be inserted one by one with the prepared statement without aborting
+ * the current transaction.
+ *
+ * \param db Database containing the table
+ * \param table DbTable to send the samples of
+ * \return 0 on success, -1 if any sample could not be inserted
+ * \see psql_insert, psql_table_prepare_copy
+ */
+static int
+psql_table_copy (Database *db, DbTable *table)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+  PsqlTable *psqltable = (PsqlTable*)table->handle;
+  MBuffer *mbuf = psqldb->copy_buf;
+  PsqlRow *row;
+  int i, ret = 0;
+
+  if (psqltable->nrows <= 0) {
+    return 0;
+  }
+
+  ret = psql_copy_encode (db, table, mbuf, psqltable->rows, psqltable->nrows);
+  if (!ret && !(ret = sql_stmt (psqldb, "SAVEPOINT omlcopy;"))) {
+    if (!(ret = psql_copy_send (psqldb, mstring_buf (psqltable->copy_stmt), mbuf))) {
+      sql_stmt (psqldb, "RELEASE SAVEPOINT omlcopy;");
+    } else {
+      logwarn("psql:%s: Could not COPY %d samples into table '%s', inserting them one by one: %s", /* PQerrorMessage strings already have '\n' */
+          db->name, psqltable->nrows, table->schema->name, PQerrorMessage (psqldb->conn));
+      sql_stmt (psqldb, "ROLLBACK TO SAVEPOINT omlcopy;");
+    }
+  }
+
+  if (ret) {
+    ret = 0;
+    for (i = 0; i < psqltable->nrows; i++) {
+      row = &psqltable->rows[i];
+      if (psql_insert_row (db, table, row->sender_id, row->seq_no, row->time_stamp,
+            row->time_stamp_server, row->values)) {
+        ret = -1;
+      }
+    }
+  }
+  psqltable->nrows = 0;
+
+  return ret;
+}
+
+/** Commit the current transaction, after sending all buffered samples.
+ *
+ * \param db Database to commit
+ * \return 0 on success, -1 otherwise
+ * \see dba_reopen_transaction, psql_table_copy
+ */
+static int
+psql_commit(Database *db)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+  DbTable *table;
+  int ret = 0;
+
+  for (table = db->first_table; table; table = table->next) {
+    if (table->handle && psql_table_copy (db, table)) {
+      ret = -1;
+    }
+  }
+  if (dba_reopen_transaction (db) == -1) {
+    ret = -1;
+  }
+  psqldb->txn_rows = 0;
+
+  return ret;
+}
+
+/** Insert value in the PostgreSQL database.
+ *
+ * If the table uses COPY, the sample is copied into its buffer, which is only
+ * sent once full, or when the transaction is committed, at most every
+ * second.
+ *
+ * \see db_adapter_insert, psql_table_copy, psql_commit
+ */
+static int
+psql_insert(Database* db, DbTable* table, int sender_id, int seq_no, double time_stamp, OmlValue* values, int value_count)
+{
+  PsqlDB* psqldb = (PsqlDB*)db->handle;
+  PsqlTable* psqltable = (PsqlTable*)table->handle;
+  struct schema *schema = table->schema;
+  PsqlRow *row;
+  double time_stamp_server;
+  int i;
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
+
+  if (tv.tv_sec > psqldb->last_commit) {
+    if (psql_commit (db) == -1) {
+      return -1;
+    }
+    psqldb->last_commit = tv.tv_sec;
+  }
+
+  if (schema->nfields != value_count) {
+    logerror("psql:%s: Failed to insert %d values into table '%s' with %d columns\n",
+        db->name, value_count, schema->name, schema->nfields);
+    return -1;
+  }
+  for (i = 0; i < value_count; i++) {
+    if (oml_value_get_type(&values[i]) != schema->fields[i].type) {
+      logerror("psql:%s: Value %d type mismatch for table '%s'\n", db->name, i, schema->name);
+      return -1;
+    }
+  }
+
+  psqldb->txn_rows++;
+  if (!psqltable->rows) {
+    return psql_insert_row (db, table, sender_id, seq_no, time_stamp, time_stamp_server, values);
+  }
+
+  row = &psqltable->rows[psqltable->nrows];
+  for (i = 0; i < value_count; i++) {
+    if (oml_value_duplicate(&row->values[i], &values[i])) {
+      logerror("psql:%s: Could not buffer value %d of sample %d for table '%s'\n",
+          db->name, i, seq_no, schema->name);
+      return -1;
+    }
+  }
+  row->sender_id = sender_id;
+  row->seq_no = seq_no;
+  row->time_stamp = time_stamp;
+  row->time_stamp_server = time_stamp_server;
+  if (++psqltable->nrows == psqltable->copy_size) {
+    return psql_table_copy (db, table);
+  }
+
+  return 0;
+}
+
+/** Send and commit buffered samples which have been waiting for too long.
+ * \see db_adapter_flush, psql_commit
+ */
+static int
+psql_flush(Database *db)
+{
+  PsqlDB* psqldb = (PsqlDB*)db->handle;
+  time_t now = time (NULL);
+
+  if (psqldb->txn_rows > 0 && now > psqldb->last_commit) {
+    psqldb->last_commit = now;
+    return psql_commit (db);
+  }
+  return 0;
+}
+
 /** Do a key-value style select on a database table.
  *
  * FIXME: Not using prepared statements (#168)
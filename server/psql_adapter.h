@@ -12,6 +12,7 @@
 #define PSQL_ADAPTER_H_
 
 #include <libpq-fe.h>
+#include "mbuf.h"
 #include "database.h"
 
 #define DEFAULT_PG_HOST "localhost"
@@ -19,19 +20,39 @@
 #define DEFAULT_PG_USER "oml"
 #define DEFAULT_PG_PASS ""
 #define DEFAULT_PG_CONNINFO ""
+/** Default number of samples sent to a table in one COPY; 1 disables COPY */
+#define DEFAULT_PG_COPY_ROWS 1
 
 typedef struct PsqlDB {
   PGconn *conn;
   int sender_cnt;
   time_t last_commit;
+  int txn_rows;      /* Number of samples inserted or buffered since the last commit */
+  MBuffer *copy_buf; /* Binary COPY data being encoded, reused across tables */
 } PsqlDB;
 
+/** A sample waiting to be sent to the server in a COPY */
+typedef struct PsqlRow {
+  int sender_id;
+  int seq_no;
+  double time_stamp;
+  double time_stamp_server;
+  OmlValue *values; /* One per field of the table's schema */
+} PsqlRow;
+
 typedef struct PsqlTable {
   MString *insert_stmt; /* Named statement for inserting into this table */
+  MString *copy_stmt;   /* COPY FROM STDIN statement for this table, or NULL if COPY is not used */
+  PsqlRow *rows;        /* Samples waiting for the next COPY, copy_size long */
+  int copy_size;        /* Maximum number of samples sent in one COPY */
+  int nrows;            /* Number of samples waiting in rows */
 } PsqlTable;
 
+extern int pg_copy_rows;
+
 int psql_backend_setup ();
 int psql_create_database (Database* db);
+int psql_copy_encode(Database *db, DbTable *table, MBuffer *mbuf, PsqlRow *rows, int nrows);
 
 #endif /*PSQL_ADAPTER_H_*/
 
@@ -0,0 +1,327 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file reactor.c
+ * \brief Distribute client connections across multiple EventLoop threads.
+ *
+ * When reactor threads are started, the main thread only accepts new
+ * connections, and hands each new Socket over to one of the reactor threads,
+ * in a round-robin fashion. Each reactor thread runs its own EventLoop, in
+ * which it creates the ClientHandler for that Socket, and serves it until it
+ * disconnects. All the data from one client is therefore processed, in order,
+ * by a single thread; Databases shared by clients of different threads are
+ * locked while in use.
+ *
+ * Messages are passed to a reactor thread through a datagram socketpair(2),
+ * which its EventLoop reads like any other channel.
+ *
+ * \see database_lock, eventloop_on_read_in_fd
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_socket.h"
+#include "ocomm/o_eventloop.h"
+#include "mem.h"
+#include "client_handler.h"
+#include "reactor.h"
+
+/** Commands which can be sent to a reactor thread */
+typedef enum {
+  /** Create a ClientHandler for a newly accepted Socket */
+  REACTOR_ADD_CLIENT,
+  /** Log a summary of resource usage */
+  REACTOR_REPORT,
+  /** Close all connections and exit */
+  REACTOR_TERMINATE,
+} ReactorCommand;
+
+/** Message sent to a reactor thread, as a single datagram */
+typedef struct {
+  /** Command to execute */
+  ReactorCommand cmd;
+  /** Socket to serve, for REACTOR_ADD_CLIENT */
+  Socket *socket;
+  /** Reason to pass to eventloop_terminate, for REACTOR_TERMINATE */
+  int reason;
+} ReactorMessage;
+
+/** A thread running its own EventLoop */
+typedef struct {
+  /** Name of this reactor, used for logging */
+  char name[32];
+  /** Thread running the EventLoop */
+  pthread_t thread;
+  /** Message socketpair; fds[0] is read by the reactor, fds[1] written by the main thread */
+  int fds[2];
+} Reactor;
+
+/** Array of running reactor threads */
+static Reactor *reactors = NULL;
+/** Number of elements in reactors */
+static int nreactors = 0;
+/** Index of the reactor to which the next client will be dispatched */
+static int next_reactor = 0;
+
+/** EventLoop settings applied in each reactor thread */
+static unsigned int reactor_socket_timeout;
+static size_t reactor_read_budget;
+
+/** Send a message to a reactor thread.
+ *
+ * This only uses send(2), and can therefore be called from a signal handler.
+ *
+ * \param self Reactor to send the message to
+ * \param msg ReactorMessage to send
+ * \return 0 on success, -1 otherwise, with errno set accordingly
+ */
+static int
+reactor_send(Reactor *self, ReactorMessage *msg)
+{
+  ssize_t len;
+
+  do {
+    len = send(self->fds[1], msg, sizeof(*msg), 0);
+  } while (len < 0 && EINTR == errno);
+
+  return (len == (ssize_t)sizeof(*msg)) ? 0 : -1;
+}
+
+/** Callback called when a message is received by a reactor thread.
+ *
+ * \copydetails o_el_read_socket_callback
+ */
+static void
+reactor_on_message(SockEvtSource *source, void *handle, void *buf, int buf_size)
+{
+  Reactor *self = (Reactor*)handle;
+  ReactorMessage msg;
+
+  if (buf_size != sizeof(msg)) {
+    logwarn("%s: Ignoring message of unexpected size %d\n", self->name, buf_size);
+    return;
+  }
+  memcpy(&msg, buf, sizeof(msg));
+
+  switch (msg.cmd) {
+  case REACTOR_ADD_CLIENT:
+    if (!client_handler_new(msg.socket)) {
+      logerror("%s: Cannot create ClientHandler for %s\n", self->name, msg.socket->name);
+      socket_free(msg.socket);
+      break;
+    }
+    logdebug("%s: New client connected to %s\n", msg.socket->name, self->name);
+    break;
+
+  case REACTOR_REPORT:
+    loginfo("%s: Reporting\n", self->name);
+    eventloop_report(O_LOG_INFO);
+    break;
+
+  case REACTOR_TERMINATE:
+    logdebug("%s: Terminating\n", self->name);
+    /* This channel has no OComm Socket to shut down */
+    eventloop_socket_release(source);
+    eventloop_terminate(msg.reason);
+    break;
+
+  default:
+    logwarn("%s: Unknown command %d\n", self->name, msg.cmd);
+  }
+}
+
+/** Main function of a reactor thread.
+ *
+ * \param arg pointer to the Reactor for this thread
+ * \return NULL
+ */
+static void*
+reactor_run(void *arg)
+{
+  Reactor *self = (Reactor*)arg;
+
+  eventloop_init();
+  eventloop_set_socket_timeout(reactor_socket_timeout);
+  eventloop_set_read_budget(reactor_read_budget);
+  eventloop_on_read_in_fd(self->name, self->fds[0], reactor_on_message, NULL, self);
+
+  logdebug("%s: Started\n", self->name);
+  eventloop_run();
+  logdebug("%s: Stopped\n", self->name);
+
+  return NULL;
+}
+
+/** Start reactor threads, to which new clients can then be dispatched.
+ *
+ * All signals are blocked in the reactor threads, so they are handled by the
+ * main thread.
+ *
+ * \param nthreads number of threads to start
+ * \param socket_timeout idle timeout of client sockets, in seconds \see eventloop_set_socket_timeout
+ * \param read_budget read budget of client sockets \see eventloop_set_read_budget
+ * \return 0 on success, -1 otherwise; no thread is left running on error
+ *
+ * \see reactor_dispatch, reactor_stop
+ */
+int
+reactor_start(int nthreads, unsigned int socket_timeout, size_t read_budget)
+{
+  sigset_t all, old;
+  Reactor *r;
+  int i, ret = 0;
+
+  if (nthreads < 1 || reactors) {
+    logerror("Reactors: Cannot start %d threads\n", nthreads);
+    return -1;
+  }
+  reactor_socket_timeout = socket_timeout;
+  reactor_read_budget = read_budget;
+  reactors = oml_malloc(nthreads * sizeof(Reactor));
+  if (!reactors) {
+    return -1;
+  }
+
+  /* Threads inherit the signal mask of their creator */
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+
+  for (i = 0; i < nthreads; i++) {
+    r = &reactors[i];
+    snprintf(r->name, sizeof(r->name), "reactor%d", i);
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, r->fds)) {
+      logerror("%s: Cannot create message socketpair: %s\n", r->name, strerror(errno));
+      ret = -1;
+      break;
+    }
+    if ((errno = pthread_create(&r->thread, NULL, reactor_run, r))) {
+      logerror("%s: Cannot create thread: %s\n", r->name, strerror(errno));
+      close(r->fds[0]);
+      close(r->fds[1]);
+      ret = -1;
+      break;
+    }
+    nreactors++;
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  if (ret) {
+    reactor_stop(1);
+  } else {
+    loginfo("Reactors: Serving clients from %d threads\n", nreactors);
+  }
+  return ret;
+}
+
+/** Hand a newly accepted Socket over to one of the reactor threads.
+ *
+ * The reactor thread creates the ClientHandler for this Socket, and processes
+ * all its data from then on.
+ *
+ * \param socket Socket of a new client
+ * \return 0 on success, -1 if no reactor thread was started, or on error; the caller is still responsible for the Socket in this case
+ *
+ * \see client_handler_new
+ */
+int
+reactor_dispatch(Socket *socket)
+{
+  ReactorMessage msg;
+  Reactor *r;
+
+  if (!nreactors) {
+    return -1;
+  }
+  memset(&msg, 0, sizeof(msg));
+  msg.cmd = REACTOR_ADD_CLIENT;
+  msg.socket = socket;
+
+  r = &reactors[next_reactor];
+  next_reactor = (next_reactor + 1) % nreactors;
+  if (reactor_send(r, &msg)) {
+    logerror("%s: Cannot dispatch client %s: %s\n", r->name, socket->name, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/** Ask all reactor threads to log a summary of their resource usage.
+ *
+ * This can be called from a signal handler.
+ *
+ * \see eventloop_report
+ */
+void
+reactor_report(void)
+{
+  ReactorMessage msg;
+  int i;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.cmd = REACTOR_REPORT;
+  for (i = 0; i < nreactors; i++) {
+    reactor_send(&reactors[i], &msg);
+  }
+}
+
+/** Terminate all reactor threads, and wait for them to exit.
+ *
+ * The connections of all clients are closed, as with eventloop_terminate().
+ *
+ * \param reason a non-zero reason for stopping the threads' EventLoops
+ * \see eventloop_terminate
+ */
+void
+reactor_stop(int reason)
+{
+  ReactorMessage msg;
+  int i;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.cmd = REACTOR_TERMINATE;
+  msg.reason = reason;
+
+  for (i = 0; i < nreactors; i++) {
+    if (reactor_send(&reactors[i], &msg)) {
+      logerror("%s: Cannot request termination: %s\n", reactors[i].name, strerror(errno));
+      pthread_cancel(reactors[i].thread);
+    }
+  }
+  for (i = 0; i < nreactors; i++) {
+    pthread_join(reactors[i].thread, NULL);
+    close(reactors[i].fds[0]);
+    close(reactors[i].fds[1]);
+  }
+
+  nreactors = 0;
+  next_reactor = 0;
+  oml_free(reactors);
+  reactors = NULL;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,34 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file reactor.h
+ * \brief Interface to distribute client connections across EventLoop threads.
+ */
+#ifndef REACTOR_H_
+#define REACTOR_H_
+
+#include <stddef.h>
+
+#include "ocomm/o_socket.h"
+
+int reactor_start(int nthreads, unsigned int socket_timeout, size_t read_budget);
+int reactor_dispatch(Socket *socket);
+void reactor_report(void);
+void reactor_stop(int reason);
+
+#endif /*REACTOR_H_*/
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
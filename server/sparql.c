@@ -0,0 +1,542 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file sparql.c
+ * \brief Build SPARQL updates for batches of samples, and send them over HTTP.
+ *
+ * The semantic backends describe how to insert a sample into a table with an
+ * update template, in which the values of the sample are replaced by
+ * placeholders. A SparqlTemplate splits the template around its placeholders
+ * once, so that the text for a sample is built in a single pass, and the
+ * text for many samples can be appended to the same request.
+ *
+ * A SparqlPipeline sends these requests with the curl multi interface,
+ * keeping up to sparql_requests of them in flight, so the backend can carry
+ * on batching samples while the endpoint processes previous requests.
+ *
+ * \see fuseki_adapter.c, virtuoso_adapter.c
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <curl/curl.h>
+
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "mstring.h"
+#include "json.h"
+#include "oml_value.h"
+#include "database.h"
+#include "sparql.h"
+
+/* Cannot be static due to the way the server sets its parameters */
+int sparql_batch_rows = DEFAULT_SPARQL_BATCH_ROWS;
+int sparql_requests = DEFAULT_SPARQL_REQUESTS;
+
+/** Special values of SparqlSegment::value */
+enum {
+  SPARQL_END = -1,      /**< no value, last segment */
+  SPARQL_SEQ_NO = -2,   /**< sequence number of the sample */
+  SPARQL_TS_CLIENT = -3 /**< timestamp of the sample on the client */
+};
+
+/** Literal text of a template, followed by a placeholder */
+typedef struct SparqlSegment {
+  const char *text;   /**< start of the text, in SparqlTemplate::stmt */
+  size_t length;      /**< length of the text */
+  int value;          /**< index of the field replacing the placeholder, or one of SPARQL_END, SPARQL_SEQ_NO, SPARQL_TS_CLIENT */
+} SparqlSegment;
+
+/** An update template, split around its placeholders */
+struct SparqlTemplate {
+  char *stmt;                 /**< copy of the template */
+  SparqlSegment *segments;    /**< segments of stmt, the last one being SPARQL_END */
+  int nsegments;              /**< number of segments */
+};
+
+/** Update requests to a SPARQL endpoint */
+struct SparqlPipeline {
+  char *name;       /**< prefix for log messages */
+  CURL *curl;       /**< handle with the URL, callbacks and credentials of the endpoint */
+  char *field;      /**< name of the form field containing the update */
+  CURLM *multi;     /**< multi handle running the requests */
+  CURL **idle;      /**< easy handles not in use, sparql_requests long */
+  int nidle;        /**< number of handles in idle */
+  int size;         /**< maximum number of requests in flight */
+  int inflight;     /**< number of requests in flight */
+  uint64_t requests;/**< number of requests sent */
+  uint64_t bytes;   /**< size of the requests sent */
+  int errors;       /**< number of failed requests */
+  int unreported;   /**< number of failed requests not reported yet \see sparql_pipeline_poll */
+};
+
+static int sparql_pipeline_progress(SparqlPipeline *self, int timeout);
+
+/** Identify the value replacing a placeholder.
+ *
+ * \param name name of the placeholder, without delimiters
+ * \param length length of name
+ * \return the value for SparqlSegment::value, or SPARQL_END if the placeholder is unknown
+ */
+static int
+sparql_placeholder(const char *name, size_t length)
+{
+  char *end;
+  long n;
+
+  if (length < 6 || strncmp(name, "value_", 6)) {
+    return SPARQL_END;
+  }
+  name += 6;
+  length -= 6;
+  if (length == 3 && !strncmp(name, "seq", 3)) {
+    return SPARQL_SEQ_NO;
+  } else if (length == 2 && !strncmp(name, "tc", 2)) {
+    return SPARQL_TS_CLIENT;
+  }
+  n = strtol(name, &end, 10);
+  if (length == 0 || end != name + length || n < 0 || n > INT16_MAX) {
+    return SPARQL_END;
+  }
+  return (int)n;
+}
+
+/** Split an update template around its placeholders.
+ *
+ * Unknown placeholders are kept as literal text.
+ *
+ * \param stmt update template, as prepared by the backend
+ * \return a new SparqlTemplate, or NULL if stmt is empty or on error
+ * \see sparql_template_free, sparql_template_append
+ */
+SparqlTemplate*
+sparql_template_new(const char *stmt)
+{
+  SparqlTemplate *self;
+  const size_t dlen = strlen(SPARQL_VAR_DELIM);
+  const char *p, *start, *var, *end;
+  int n, value;
+
+  if (!stmt || !*stmt) {
+    return NULL;
+  }
+
+  /* Upper bound for the number of segments */
+  for (n = 1, p = stmt; (p = strstr(p, SPARQL_VAR_DELIM)); p += dlen, n++);
+
+  if (!(self = oml_malloc(sizeof(SparqlTemplate))) ||
+      !(self->stmt = oml_strndup(stmt, strlen(stmt))) ||
+      !(self->segments = oml_calloc(n, sizeof(SparqlSegment)))) {
+    logerror("sparql: Could not allocate update template\n");
+    sparql_template_free(self);
+    return NULL;
+  }
+
+  start = p = self->stmt;
+  while ((var = strstr(p, SPARQL_VAR_DELIM)) && (end = strstr(var + dlen, SPARQL_VAR_DELIM))) {
+    value = sparql_placeholder(var + dlen, end - var - dlen);
+    if (value == SPARQL_END) {
+      /* Not a placeholder, keep looking from the closing delimiter */
+      p = end;
+      continue;
+    }
+    self->segments[self->nsegments].text = start;
+    self->segments[self->nsegments].length = var - start;
+    self->segments[self->nsegments].value = value;
+    self->nsegments++;
+    start = p = end + dlen;
+  }
+  self->segments[self->nsegments].text = start;
+  self->segments[self->nsegments].length = strlen(start);
+  self->segments[self->nsegments].value = SPARQL_END;
+  self->nsegments++;
+
+  return self;
+}
+
+/** Free a SparqlTemplate.
+ * \param self SparqlTemplate to free, can be NULL
+ */
+void
+sparql_template_free(SparqlTemplate *self)
+{
+  if (self) {
+    if (self->stmt) { oml_free(self->stmt); }
+    if (self->segments) { oml_free(self->segments); }
+    oml_free(self);
+  }
+}
+
+/** Append the literal of a value to an update.
+ *
+ * \param out MString to append to
+ * \param db Database, to get the type names from
+ * \param v OmlValue to render
+ * \return 0 on success, -1 otherwise
+ */
+static int
+sparql_append_value(MString *out, Database *db, OmlValue *v)
+{
+  OmlValueU *u = oml_value_get_value(v);
+  const char *type = db->o2t(oml_value_get_type(v));
+  char *json = NULL;
+  ssize_t json_sz = -2;
+  int res = 0;
+
+  switch (oml_value_get_type(v)) {
+  case OML_DOUBLE_VALUE:
+    res = mstring_sprintf(out, "\"%lf\"^^%s", omlc_get_double(*u), type);
+    break;
+  case OML_LONG_VALUE:
+    res = mstring_sprintf(out, "\"%ld\"^^%s", (long)omlc_get_long(*u), type);
+    break;
+  case OML_INT32_VALUE:
+    res = mstring_sprintf(out, "\"%" PRId32 "\"^^%s", omlc_get_int32(*u), type);
+    break;
+  case OML_UINT32_VALUE:
+    res = mstring_sprintf(out, "\"%" PRIu32 "\"^^%s", omlc_get_uint32(*u), type);
+    break;
+  case OML_INT64_VALUE:
+    res = mstring_sprintf(out, "\"%" PRId64 "\"^^%s", omlc_get_int64(*u), type);
+    break;
+  case OML_UINT64_VALUE:
+    res = mstring_sprintf(out, "\"%" PRIu64 "\"^^%s", omlc_get_uint64(*u), type);
+    break;
+  case OML_STRING_VALUE:
+    res = mstring_sprintf(out, "\"%s\"^^%s", omlc_get_string_ptr(*u), type);
+    break;
+  case OML_GUID_VALUE:
+    if (omlc_get_guid(*u) != UINT64_C(0)) {
+      res = mstring_sprintf(out, "\"%" PRIu64 "\"^^%s", omlc_get_uint64(*u), type);
+    } else {
+      res = mstring_sprintf(out, "\"\"^^%s", type);
+    }
+    break;
+  case OML_BOOL_VALUE:
+    res = mstring_sprintf(out, "\"%s\"^^%s", omlc_get_bool(*u) ? "true" : "false", type);
+    break;
+
+  case OML_VECTOR_DOUBLE_VALUE:
+    json_sz = vector_double_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+    break;
+  case OML_VECTOR_INT32_VALUE:
+    json_sz = vector_int32_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+    break;
+  case OML_VECTOR_UINT32_VALUE:
+    json_sz = vector_uint32_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+    break;
+  case OML_VECTOR_INT64_VALUE:
+    json_sz = vector_int64_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+    break;
+  case OML_VECTOR_UINT64_VALUE:
+    json_sz = vector_uint64_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+    break;
+  case OML_VECTOR_BOOL_VALUE:
+    json_sz = vector_bool_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &json);
+    break;
+
+  default:
+    /* Blobs are not supported */
+    return -1;
+  }
+
+  if (json_sz != -2) {
+    res = mstring_sprintf(out, "\"%s\"^^%s", json_sz != -1 ? json : "", type);
+    if (json) { oml_free(json); }
+  }
+
+  return res;
+}
+
+/** Append the update for a sample to a request.
+ *
+ * \param self SparqlTemplate of the table
+ * \param out MString to append to
+ * \param prefix text to append before the update, such as a separator from the previous one, can be NULL
+ * \param db Database containing the table
+ * \param table DbTable the sample belongs to
+ * \param seq_no sequence number of the sample
+ * \param time_stamp timestamp of the sample on the client
+ * \param values OmlValue array, one per field of the table's schema, with the right types
+ * \return 0 on success, -1 otherwise, in which case out is left unchanged
+ */
+int
+sparql_template_append(SparqlTemplate *self, MString *out, const char *prefix,
+    Database *db, DbTable *table, int seq_no, double time_stamp, OmlValue *values)
+{
+  SparqlSegment *s;
+  size_t mark = out->length;
+  int i, res = 0;
+
+  if (prefix) {
+    res = mstring_cat(out, prefix);
+  }
+
+  for (i = 0; !res && i < self->nsegments; i++) {
+    s = &self->segments[i];
+    if (s->length) {
+      res += mstring_sprintf(out, "%.*s", (int)s->length, s->text);
+    }
+
+    if (s->value == SPARQL_SEQ_NO) {
+      res += mstring_sprintf(out, "\"%d\"^^xsd:integer", seq_no);
+    } else if (s->value == SPARQL_TS_CLIENT) {
+      res += mstring_sprintf(out, "\"%.14e\"^^xsd:double", time_stamp);
+    } else if (s->value >= table->schema->nfields) {
+      logerror("%s:%s: Template for table '%s' refers to missing field %d\n",
+          db->backend_name, db->name, table->schema->name, s->value);
+      res = -1;
+    } else if (s->value >= 0 && sparql_append_value(out, db, &values[s->value])) {
+      logerror("%s:%s: Could not bind column '%s'\n",
+          db->backend_name, db->name, table->schema->fields[s->value].name);
+      res = -1;
+    }
+  }
+
+  if (res) {
+    /* Drop the partial update */
+    out->length = mark;
+    out->buf[mark] = '\0';
+    return -1;
+  }
+  return 0;
+}
+
+/** Create a pipeline of update requests to a SPARQL endpoint.
+ *
+ * \param curl handle with the URL, callbacks and credentials of the endpoint set; it is duplicated for each request in flight, and still owned by the caller
+ * \param field name of the form field carrying the update ("update" or "query")
+ * \param name prefix for log messages
+ * \return a new SparqlPipeline, or NULL on error
+ * \see sparql_pipeline_free, sparql_pipeline_send
+ */
+SparqlPipeline*
+sparql_pipeline_new(CURL *curl, const char *field, const char *name)
+{
+  SparqlPipeline *self = oml_malloc(sizeof(SparqlPipeline));
+
+  if (!self) {
+    return NULL;
+  }
+  self->curl = curl;
+  self->size = sparql_requests > 0 ? sparql_requests : 1;
+  self->name = oml_strndup(name, strlen(name));
+  self->field = oml_strndup(field, strlen(field));
+  self->idle = oml_calloc(self->size, sizeof(CURL*));
+  self->multi = curl_multi_init();
+  if (!self->name || !self->field || !self->idle || !self->multi) {
+    logerror("%s: Could not create SPARQL request pipeline\n", name);
+    sparql_pipeline_free(self);
+    return NULL;
+  }
+
+  return self;
+}
+
+/** Wait for all requests in flight, and free a SparqlPipeline.
+ * \param self SparqlPipeline to free, can be NULL
+ */
+void
+sparql_pipeline_free(SparqlPipeline *self)
+{
+  if (!self) {
+    return;
+  }
+
+  if (self->multi) {
+    sparql_pipeline_wait(self);
+  }
+  logdebug("%s: Sent %" PRIu64 " SPARQL update requests (%" PRIu64 "B), %d failed\n",
+      self->name, self->requests, self->bytes, self->errors);
+
+  while (self->nidle > 0) {
+    curl_easy_cleanup(self->idle[--self->nidle]);
+  }
+  if (self->multi) { curl_multi_cleanup(self->multi); }
+  if (self->idle) { oml_free(self->idle); }
+  if (self->field) { oml_free(self->field); }
+  if (self->name) { oml_free(self->name); }
+  oml_free(self);
+}
+
+/** Send an update request, without waiting for its completion.
+ *
+ * If sparql_requests requests are already in flight, wait for one of them
+ * to complete first.
+ *
+ * \param self SparqlPipeline to send the request on
+ * \param update SPARQL update
+ * \param len length of update
+ * \return 0 if the request was started, -1 otherwise
+ * \see sparql_pipeline_poll
+ */
+int
+sparql_pipeline_send(SparqlPipeline *self, const char *update, size_t len)
+{
+  MString *body;
+  CURL *easy;
+  char *data;
+  int ret = -1;
+
+  while (self->inflight >= self->size) {
+    if (sparql_pipeline_progress(self, 1000)) {
+      return -1;
+    }
+  }
+
+  if (self->nidle > 0) {
+    easy = self->idle[--self->nidle];
+  } else if (!(easy = curl_easy_duphandle(self->curl))) {
+    logerror("%s: Could not create handle for SPARQL update request\n", self->name);
+    return -1;
+  }
+
+  body = mstring_create();
+  data = curl_easy_escape(easy, update, (int)len);
+  if (body && data && !mstring_sprintf(body, "%s=%s", self->field, data)) {
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)mstring_len(body));
+    curl_easy_setopt(easy, CURLOPT_COPYPOSTFIELDS, mstring_buf(body));
+    if (curl_multi_add_handle(self->multi, easy) == CURLM_OK) {
+      logdebug2("%s: Sending %zuB SPARQL update request (%d in flight)\n",
+          self->name, mstring_len(body), self->inflight);
+      self->inflight++;
+      self->requests++;
+      self->bytes += mstring_len(body);
+      ret = 0;
+    }
+  }
+  if (ret) {
+    logerror("%s: Could not send %zuB SPARQL update request\n", self->name, len);
+    curl_easy_cleanup(easy);
+  }
+  if (data) { curl_free(data); }
+  if (body) { mstring_delete(body); }
+
+  /* Get the request going */
+  sparql_pipeline_progress(self, 0);
+
+  return ret;
+}
+
+/** Make progress on the requests in flight, and report those which failed.
+ *
+ * Failures are only reported once, whether the requests completed during
+ * this call, or earlier, e.g., while sparql_pipeline_send was waiting for a
+ * request slot.
+ *
+ * \param self SparqlPipeline to poll
+ * \param timeout maximum time to wait for activity if no request has completed [ms], 0 not to wait
+ * \return 0 if no request failed since the last report, -1 if some did, or -2 if the pipeline itself failed
+ * \see sparql_pipeline_wait
+ */
+int
+sparql_pipeline_poll(SparqlPipeline *self, int timeout)
+{
+  int ret = sparql_pipeline_progress(self, timeout);
+
+  if (self->unreported > 0) {
+    self->unreported = 0;
+    if (!ret) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+/** Wait for all the requests in flight to complete, and report those which failed.
+ *
+ * \param self SparqlPipeline to wait for
+ * \return 0 if no request failed since the last report, -1 if some did, or -2 if the pipeline itself failed
+ * \see sparql_pipeline_poll
+ */
+int
+sparql_pipeline_wait(SparqlPipeline *self)
+{
+  while (self->inflight > 0) {
+    if (sparql_pipeline_progress(self, 1000)) {
+      return -2;
+    }
+  }
+  return sparql_pipeline_poll(self, 0);
+}
+
+/** Make progress on the requests in flight, and collect their results.
+ *
+ * Failed requests are counted in SparqlPipeline::unreported.
+ *
+ * \param self SparqlPipeline to poll
+ * \param timeout maximum time to wait for activity if no request has completed [ms], 0 not to wait
+ * \return 0 on success, or -2 if the pipeline itself failed
+ */
+static int
+sparql_pipeline_progress(SparqlPipeline *self, int timeout)
+{
+  CURLMcode mc;
+  CURLMsg *msg;
+  CURLcode result;
+  CURL *easy;
+  long http_code = 0;
+  int running = 0, n, failed;
+
+  mc = curl_multi_perform(self->multi, &running);
+  if (mc == CURLM_OK && timeout > 0 && running > 0 && running == self->inflight) {
+    mc = curl_multi_wait(self->multi, NULL, 0, timeout, &n);
+    if (mc == CURLM_OK) {
+      mc = curl_multi_perform(self->multi, &running);
+    }
+  }
+  if (mc != CURLM_OK) {
+    logerror("%s: Error running SPARQL update requests: %s\n", self->name, curl_multi_strerror(mc));
+    return -2;
+  }
+
+  while ((msg = curl_multi_info_read(self->multi, &n))) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    easy = msg->easy_handle;
+    result = msg->data.result;
+    failed = 0;
+
+    if (result != CURLE_OK) {
+      logerror("%s: Semantic insertion failed: %s\n", self->name, curl_easy_strerror(result));
+      failed = 1;
+    } else {
+      curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &http_code);
+      if (http_code < 200L || http_code >= 300L) {
+        logerror("%s: Semantic insertion failed. HTTP code status: %ld\n", self->name, http_code);
+        failed = 1;
+      }
+    }
+    if (failed) {
+      self->errors++;
+      self->unreported++;
+    }
+
+    curl_multi_remove_handle(self->multi, easy);
+    self->inflight--;
+    if (self->nidle < self->size) {
+      self->idle[self->nidle++] = easy;
+    } else {
+      curl_easy_cleanup(easy);
+    }
+  }
+
+  return 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file sparql.h
+ * \brief Interface to the SPARQL update templates and request pipelines shared by the semantic backends.
+ */
+#ifndef SPARQL_H_
+#define SPARQL_H_
+
+#include <curl/curl.h>
+
+#include "oml2/omlc.h"
+#include "mstring.h"
+#include "database.h"
+
+/** Default maximum number of samples sent to a table in one update request */
+#define DEFAULT_SPARQL_BATCH_ROWS 256
+/** Default maximum number of update requests in flight to one endpoint */
+#define DEFAULT_SPARQL_REQUESTS 4
+
+/** Delimiter of the placeholders in update templates */
+#define SPARQL_VAR_DELIM "#?#"
+/** Placeholder for the sequence number of the sample */
+#define REPLACE_SEQ SPARQL_VAR_DELIM "value_seq" SPARQL_VAR_DELIM
+/** Placeholder for the timestamp of the sample on the client */
+#define REPLACE_TC SPARQL_VAR_DELIM "value_tc" SPARQL_VAR_DELIM
+/** Placeholder for the value of field N (0-based) is SPARQL_VAR_DELIM "value_N" SPARQL_VAR_DELIM */
+
+typedef struct SparqlTemplate SparqlTemplate;
+typedef struct SparqlPipeline SparqlPipeline;
+
+extern int sparql_batch_rows;
+extern int sparql_requests;
+
+SparqlTemplate *sparql_template_new(const char *stmt);
+void sparql_template_free(SparqlTemplate *self);
+int sparql_template_append(SparqlTemplate *self, MString *out, const char *prefix,
+    Database *db, DbTable *table, int seq_no, double time_stamp, OmlValue *values);
+
+SparqlPipeline *sparql_pipeline_new(CURL *curl, const char *field, const char *name);
+void sparql_pipeline_free(SparqlPipeline *self);
+int sparql_pipeline_send(SparqlPipeline *self, const char *update, size_t len);
+int sparql_pipeline_poll(SparqlPipeline *self, int timeout);
+int sparql_pipeline_wait(SparqlPipeline *self);
+
+#endif /*SPARQL_H_*/
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
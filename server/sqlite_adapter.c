@@ -38,6 +38,14 @@
 static char backend_name[] = "sqlite";
 /* Cannot be static due to testsuite */
 char *sqlite_database_dir = NULL;
+/** Number of samples inserted at once by multi-row INSERT statements; 1 inserts them one by one */
+int sqlite_batch_rows = SQ3_DEFAULT_BATCH_ROWS;
+/** Commit once that many samples have been received, 0 for no limit */
+int sqlite_commit_rows = 0;
+/** Commit once that many bytes of samples have been received, 0 for no limit */
+int sqlite_commit_bytes = 0;
+/** Commit samples at most that many milliseconds after receiving them */
+int sqlite_commit_latency = SQ3_DEFAULT_COMMIT_LATENCY;
 
 /** Mapping between OML and SQLite3 data types
  * \see sq3_type_to_oml, sq3_oml_to_type
@@ -79,6 +87,7 @@ static int sq3_table_free (Database *database, DbTable* table);
 static char *sq3_prepared_var(Database *db, unsigned int order);
 static MString* sq3_prepare(Database *db, DbTable* table);
 static int sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count);
+static int sq3_flush(Database *db);
 static char* sq3_get_key_value (Database* database, const char* table, const char* key_column, const char* value_column, const char* key);
 static int sq3_set_key_value (Database* database, const char* table, const char* key_column, const char* value_column, const char* key, const char* value);
 static char* sq3_get_metadata (Database* database, const char* key);
@@ -92,6 +101,8 @@ static int sq3_set_sender_id (Database* database, const char* name, int id);
 static int sq3_get_max_value (Database* database, const char* table, const char* column_name, const char* where_column, const char* where_value);
 static int sq3_get_max_sender_id (Database* database);
 
+static int sq3_table_flush (Database *db, DbTable *table);
+
 MString* database_make_sql_insert (Database *db, DbTable* table);
 
 /** Work out which directory to put sqlite databases in, and set
@@ -246,7 +257,6 @@ sq3_create_database(Database* db)
 
   Sq3DB* self = oml_malloc(sizeof(Sq3DB));
   self->conn = conn;
-  self->last_commit = time (NULL);
   db->backend_name = backend_name;
   db->o2t = sq3_oml_to_type;
   db->t2o = sq3_type_to_oml;
@@ -258,6 +268,7 @@ sq3_create_database(Database* db)
   db->prepared_var = sq3_prepared_var;
   db->prepare = sq3_prepare;
   db->insert = sq3_insert;
+  db->flush = sq3_flush;
   db->add_sender_id = sq3_add_sender_id;
   db->set_metadata = sq3_set_metadata;
   db->get_metadata = sq3_get_metadata;
@@ -286,6 +297,88 @@ sq3_release(Database* db)
   db->handle = NULL;
 }
 
+/** Prepare a multi-row INSERT statement, and the buffer of samples for it.
+ *
+ * The statement inserts up to sqlite_batch_rows samples at once, as long as
+ * the total number of variables stays within SQLite's limits. Nothing is done
+ * if that is not more than one sample.
+ *
+ * \param db Database containing the table
+ * \param table DbTable with an Sq3Table handle
+ * \return 0 on success (even if no statement was needed), -1 otherwise
+ * \see sq3_prepare, sq3_table_flush
+ */
+static int
+sq3_table_prepare_batch (Database *db, DbTable *table)
+{
+  Sq3DB *sq3db = (Sq3DB*)db->handle;
+  Sq3Table *sq3table = (Sq3Table*)table->handle;
+  MString *mstr;
+  int ncols = table->schema->nfields + 4;
+  int nrows = sqlite_batch_rows;
+  int i, j, n = 0;
+
+  if (nrows > sqlite3_limit(sq3db->conn, SQLITE_LIMIT_VARIABLE_NUMBER, -1) / ncols) {
+    nrows = sqlite3_limit(sq3db->conn, SQLITE_LIMIT_VARIABLE_NUMBER, -1) / ncols;
+  }
+  if (nrows <= 1) {
+    return 0;
+  }
+
+  if (!(mstr = mstring_create ())) {
+    return -1;
+  }
+  n += mstring_sprintf (mstr,
+      "INSERT INTO \"%s\" (\"oml_sender_id\", \"oml_seq\", \"oml_ts_client\", \"oml_ts_server\"",
+      table->schema->name);
+  for (i = 0; i < table->schema->nfields; i++) {
+    n += mstring_sprintf (mstr, ", \"%s\"", table->schema->fields[i].name);
+  }
+  n += mstring_cat (mstr, ") VALUES ");
+  for (i = 0; i < nrows; i++) {
+    n += mstring_cat (mstr, i ? ", (?" : "(?");
+    for (j = 1; j < ncols; j++) {
+      n += mstring_cat (mstr, ", ?");
+    }
+    n += mstring_cat (mstr, ")");
+  }
+  n += mstring_cat (mstr, ";");
+
+  if (n != 0 ||
+      sqlite3_prepare_v2(sq3db->conn, mstring_buf(mstr), -1,
+        &sq3table->batch_stmt, 0) != SQLITE_OK) {
+    logerror("sqlite:%s: Could not prepare %d-row statement for table '%s': %s\n",
+        db->name, nrows, table->schema->name, sqlite3_errmsg(sq3db->conn));
+    mstring_delete (mstr);
+    return -1;
+  }
+  mstring_delete (mstr);
+
+  sq3table->rows = oml_calloc (nrows, sizeof(Sq3Row));
+  for (i = 0; sq3table->rows && i < nrows; i++) {
+    if (!(sq3table->rows[i].values = oml_calloc (table->schema->nfields, sizeof(OmlValue)))) {
+      break;
+    }
+  }
+  if (!sq3table->rows || i < nrows) {
+    logerror("sqlite:%s: Could not allocate buffer for %d samples of table '%s'\n",
+        db->name, nrows, table->schema->name);
+    while (sq3table->rows && i-- > 0) {
+      oml_free (sq3table->rows[i].values);
+    }
+    oml_free (sq3table->rows);
+    sq3table->rows = NULL;
+    sqlite3_finalize (sq3table->batch_stmt);
+    sq3table->batch_stmt = NULL;
+    return -1;
+  }
+  sq3table->batch_size = nrows;
+
+  logdebug2("sqlite:%s: Inserting samples into table '%s' by %d\n",
+      db->name, table->schema->name, nrows);
+  return 0;
+}
+
 /** Create the adapter structures required for the SQLite3 adapter
  * \see db_adapter_table_create
  */
@@ -341,6 +434,11 @@ sq3_table_create (Database* db, DbTable* table, int shallow)
     goto fail_exit;
   }
 
+  if (sq3_table_prepare_batch (db, table)) {
+    logwarn("sqlite:%s: Inserting samples one by one into table '%s'\n",
+        db->name, table->schema->name);
+  }
+
   if (insert) { mstring_delete (insert); }
   return 0;
 
@@ -352,22 +450,31 @@ sq3_table_create (Database* db, DbTable* table, int shallow)
 
 /** Free an SQLite3 table
  *
- * Parameter database is ignored in this implementation
+ * Samples still waiting for a multi-row INSERT are inserted first.
  *
  * \see db_adapter_table_free, sqlite3_finalize
  */
 static int
 sq3_table_free (Database *database, DbTable* table)
 {
-  (void)database;
   Sq3Table* sq3table = (Sq3Table*)table->handle;
-  int ret = 0;
+  int i, ret = 0;
   if (sq3table) {
+    /* Don't lose the samples still waiting for a multi-row INSERT */
+    sq3_table_flush (database, table);
     ret = sqlite3_finalize (sq3table->insert_stmt);
     if (ret != SQLITE_OK) {
       logwarn("sqlite:%s: Couldn't finalise statement for table '%s' (database error)\n",
           database->name, table->schema->name);
     }
+    if (sq3table->batch_stmt) {
+      sqlite3_finalize (sq3table->batch_stmt);
+      for (i = 0; i < sq3table->batch_size; i++) {
+        oml_value_array_reset (sq3table->rows[i].values, table->schema->nfields);
+        oml_free (sq3table->rows[i].values);
+      }
+      oml_free (sq3table->rows);
+    }
     oml_free (sq3table);
   }
   return ret;
@@ -463,50 +570,48 @@ sq3_prepare (Database *db, DbTable* table)
   return NULL;
 }
 
-/** Insert value in the SQLite3 database.
- * \see db_adapter_insert
- * XXX: This function actively does text protocol interpretation, see #1088
+/** Bind one sample to the variables of a prepared INSERT statement.
+ *
+ * The types of the values are assumed to have been checked against the
+ * schema of the table.
+ *
+ * \param db Database containing the table
+ * \param table DbTable into which the sample is inserted
+ * \param stmt prepared statement to bind the sample to
+ * \param idx index of the first variable for this sample in stmt
+ * \param sender_id sender ID
+ * \param seq_no sequence number
+ * \param time_stamp timestamp of the sample, from the client
+ * \param time_stamp_server timestamp of the reception of the sample
+ * \param values OmlValue array of the sample, matching the schema of the table
+ * \return 0 on success, -1 otherwise; the statement needs to be reset either way
+ * \see sq3_insert, sq3_table_flush
  */
 static int
-sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count)
+sq3_bind_sample(Database *db, DbTable *table, sqlite3_stmt *stmt, int idx,
+    int sender_id, int seq_no, double time_stamp, double time_stamp_server, OmlValue *values)
 {
   Sq3DB* sq3db = (Sq3DB*)db->handle;
-  Sq3Table* sq3table = (Sq3Table*)table->handle;
   int i;
-  double time_stamp_server;
-  sqlite3_stmt* stmt = sq3table->insert_stmt;
   char *json = NULL;
   ssize_t json_sz;
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
-
-  if (tv.tv_sec > sq3db->last_commit) {
-    if (dba_reopen_transaction (db) == -1) {
-      return -1;
-    }
-    sq3db->last_commit = tv.tv_sec;
-  }
-
-  //  o_log(O_LOG_DEBUG2, "sq3_insert(%s): insert row %d \n",
-  //        table->schema->name, seq_no);
 
-  if (sqlite3_bind_int(stmt, 1, sender_id) != SQLITE_OK) {
+  if (sqlite3_bind_int(stmt, idx, sender_id) != SQLITE_OK) {
     logerror("sqlite:%s: Could not bind 'oml_sender_id' in table '%s': %s\n",
         db->name, table->schema->name,
         sqlite3_errmsg(sq3db->conn));
   }
-  if (sqlite3_bind_int(stmt, 2, seq_no) != SQLITE_OK) {
+  if (sqlite3_bind_int(stmt, idx + 1, seq_no) != SQLITE_OK) {
     logerror("sqlite:%s: Could not bind 'oml_seq' in table '%s': %s\n",
         db->name, table->schema->name,
         sqlite3_errmsg(sq3db->conn));
   }
-  if (sqlite3_bind_double(stmt, 3, time_stamp) != SQLITE_OK) {
+  if (sqlite3_bind_double(stmt, idx + 2, time_stamp) != SQLITE_OK) {
     logerror("sqlite:%s: Could not bind 'oml_ts_client' in table '%s': %s\n",
         db->name, table->schema->name,
         sqlite3_errmsg(sq3db->conn));
   }
-  if (sqlite3_bind_double(stmt, 4, time_stamp_server) != SQLITE_OK) {
+  if (sqlite3_bind_double(stmt, idx + 3, time_stamp_server) != SQLITE_OK) {
     logerror("sqlite:%s: Could not bind 'oml_ts_server' in table '%s': %s\n",
         db->name, table->schema->name,
         sqlite3_errmsg(sq3db->conn));
@@ -514,24 +619,9 @@ sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_
 
   OmlValue* v = values;
   struct schema *schema = table->schema;
-  if (schema->nfields != value_count) {
-    logerror ("sqlite:%s: Failed to insert %d values into table '%s' with %d columns\n",
-        db->name, value_count, table->schema->name, schema->nfields);
-    sqlite3_reset (stmt);
-    return -1;
-  }
-  for (i = 0; i < schema->nfields; i++, v++) {
-    if (oml_value_get_type(v) != schema->fields[i].type) {
-      const char *expected = oml_type_to_s (schema->fields[i].type);
-      const char *received = oml_type_to_s (oml_value_get_type(v));
-      logerror("sqlite:%s: Value %d type mismatch for table '%s'\n", db->name, i, table->schema->name);
-      logdebug("sqlite:%s: -> Column name='%s', type=%s, but trying to insert a %s\n",
-          db->name, schema->fields[i].name, expected, received);
-      sqlite3_reset (stmt);
-      return -1;
-    }
+  idx += 4;
+  for (i = 0; i < schema->nfields; i++, v++, idx++) {
     int res;
-    int idx = i + 5;
     switch (schema->fields[i].type) {
     case OML_DOUBLE_VALUE:
       res = sqlite3_bind_double(stmt, idx, omlc_get_double(*oml_value_get_value(v)));
@@ -633,24 +723,261 @@ sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_
     default:
       logerror("sqlite:%s: Unknown type %d in col '%s' of table '%s; this is probably a bug'\n",
           db->name, schema->fields[i].type, schema->fields[i].name, table->schema->name);
-      sqlite3_reset (stmt);
       return -1;
     }
     if (res != SQLITE_OK) {
       logerror("sqlite:%s: Could not bind column '%s': %s\n",
           db->name, schema->fields[i].name, sqlite3_errmsg(sq3db->conn));
-      sqlite3_reset (stmt);
       return -1;
     }
   }
 
-  if (sqlite3_step(stmt) != SQLITE_DONE) {
-    logerror("sqlite:%s: Could not step SQL statement: %s\n",
-        db->name, sqlite3_errmsg(sq3db->conn));
+  return 0;
+}
+
+/** Insert the samples waiting for a multi-row INSERT into an SQLite3 table.
+ *
+ * If the buffer is full, all samples are inserted with the table's multi-row
+ * statement; otherwise, or if that fails, they are inserted one by one.
+ *
+ * \param db Database containing the table
+ * \param table DbTable to flush
+ * \return 0 on success, -1 if any sample could not be inserted
+ * \see sq3_insert, sq3_table_prepare_batch
+ */
+static int
+sq3_table_flush (Database *db, DbTable *table)
+{
+  Sq3DB* sq3db = (Sq3DB*)db->handle;
+  Sq3Table* sq3table = (Sq3Table*)table->handle;
+  sqlite3_stmt* stmt = sq3table->batch_stmt;
+  Sq3Row *row;
+  int i, ret = 0;
+  int ncols = table->schema->nfields + 4;
+
+  if (sq3table->nrows <= 0) {
+    return 0;
+  }
+
+  if (sq3table->nrows == sq3table->batch_size) {
+    for (i = 0; i < sq3table->nrows; i++) {
+      row = &sq3table->rows[i];
+      if (sq3_bind_sample(db, table, stmt, i * ncols + 1, row->sender_id, row->seq_no,
+            row->time_stamp, row->time_stamp_server, row->values)) {
+        break;
+      }
+    }
+    if (i == sq3table->nrows && sqlite3_step(stmt) == SQLITE_DONE) {
+      sqlite3_reset(stmt);
+      sq3table->nrows = 0;
+      return 0;
+    }
+    logwarn("sqlite:%s: Could not insert %d samples at once into table '%s', retrying one by one: %s\n",
+        db->name, sq3table->nrows, table->schema->name, sqlite3_errmsg(sq3db->conn));
     sqlite3_reset(stmt);
+  }
+
+  stmt = sq3table->insert_stmt;
+  for (i = 0; i < sq3table->nrows; i++) {
+    row = &sq3table->rows[i];
+    if (sq3_bind_sample(db, table, stmt, 1, row->sender_id, row->seq_no,
+          row->time_stamp, row->time_stamp_server, row->values)) {
+      ret = -1;
+    } else if (sqlite3_step(stmt) != SQLITE_DONE) {
+      logerror("sqlite:%s: Could not step SQL statement: %s\n",
+          db->name, sqlite3_errmsg(sq3db->conn));
+      ret = -1;
+    }
+    sqlite3_reset(stmt);
+  }
+  sq3table->nrows = 0;
+
+  return ret;
+}
+
+/** Approximate the storage size of a sample, for the commit policy.
+ *
+ * \param values OmlValue array of the sample
+ * \param value_count number of values
+ * \return an estimate of the number of bytes the sample adds to the database
+ * \see sqlite_commit_bytes
+ */
+static size_t
+sq3_sample_size(OmlValue *values, int value_count)
+{
+  /* oml_sender_id, oml_seq, oml_ts_client and oml_ts_server */
+  size_t size = 24;
+  int i;
+
+  for (i = 0; i < value_count; i++) {
+    switch (oml_value_get_type(&values[i])) {
+    case OML_STRING_VALUE:
+      size += omlc_get_string_length(*oml_value_get_value(&values[i]));
+      break;
+    case OML_BLOB_VALUE:
+      size += omlc_get_blob_length(*oml_value_get_value(&values[i]));
+      break;
+    case OML_VECTOR_DOUBLE_VALUE:
+    case OML_VECTOR_INT32_VALUE:
+    case OML_VECTOR_UINT32_VALUE:
+    case OML_VECTOR_INT64_VALUE:
+    case OML_VECTOR_UINT64_VALUE:
+    case OML_VECTOR_BOOL_VALUE:
+      size += 8 * values[i].value.vectorValue.nof_elts;
+      break;
+    default:
+      size += 8;
+      break;
+    }
+  }
+
+  return size;
+}
+
+/** Commit the current transaction, after inserting all buffered samples.
+ *
+ * \param db Database to commit
+ * \return 0 on success, -1 otherwise
+ * \see dba_reopen_transaction, sq3_table_flush
+ */
+static int
+sq3_commit(Database *db)
+{
+  Sq3DB* sq3db = (Sq3DB*)db->handle;
+  DbTable *table;
+  int ret = 0;
+
+  for (table = db->first_table; table; table = table->next) {
+    if (table->handle && sq3_table_flush(db, table)) {
+      ret = -1;
+    }
+  }
+  logdebug2("sqlite:%s: Committing %d samples (~%zuB)\n",
+      db->name, sq3db->txn_rows, sq3db->txn_bytes);
+  if (dba_reopen_transaction (db) == -1) {
+    ret = -1;
+  }
+  sq3db->txn_start = 0;
+  sq3db->txn_rows = 0;
+  sq3db->txn_bytes = 0;
+
+  return ret;
+}
+
+/** Decide whether the current transaction should be committed.
+ *
+ * \param sq3db Sq3DB to check
+ * \param now current time [s]
+ * \return 1 if any of the sqlite_commit_* limits has been reached, 0 otherwise
+ */
+static int
+sq3_commit_due(Sq3DB *sq3db, double now)
+{
+  return sq3db->txn_rows > 0 &&
+    ((sqlite_commit_rows > 0 && sq3db->txn_rows >= sqlite_commit_rows) ||
+     (sqlite_commit_bytes > 0 && sq3db->txn_bytes >= (size_t)sqlite_commit_bytes) ||
+     (now - sq3db->txn_start) * 1000 >= sqlite_commit_latency);
+}
+
+/** Insert value in the SQLite3 database.
+ *
+ * If the table has a multi-row INSERT statement, the sample is copied into
+ * its buffer, which is only inserted once full, or when the transaction is
+ * committed. The transaction is committed as soon as any of the
+ * sqlite_commit_rows, sqlite_commit_bytes or sqlite_commit_latency limits is
+ * reached.
+ *
+ * \see db_adapter_insert, sq3_table_flush, sq3_commit
+ * XXX: This function actively does text protocol interpretation, see #1088
+ */
+static int
+sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count)
+{
+  Sq3DB* sq3db = (Sq3DB*)db->handle;
+  Sq3Table* sq3table = (Sq3Table*)table->handle;
+  struct schema *schema = table->schema;
+  sqlite3_stmt* stmt = sq3table->insert_stmt;
+  Sq3Row *row;
+  double time_stamp_server, now;
+  int i, ret = 0;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  now = tv.tv_sec + 0.000001 * tv.tv_usec;
+  time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
+
+  //  o_log(O_LOG_DEBUG2, "sq3_insert(%s): insert row %d \n",
+  //        table->schema->name, seq_no);
+
+  if (schema->nfields != value_count) {
+    logerror ("sqlite:%s: Failed to insert %d values into table '%s' with %d columns\n",
+        db->name, value_count, table->schema->name, schema->nfields);
     return -1;
   }
-  return sqlite3_reset(stmt);
+  for (i = 0; i < schema->nfields; i++) {
+    if (oml_value_get_type(&values[i]) != schema->fields[i].type) {
+      const char *expected = oml_type_to_s (schema->fields[i].type);
+      const char *received = oml_type_to_s (oml_value_get_type(&values[i]));
+      logerror("sqlite:%s: Value %d type mismatch for table '%s'\n", db->name, i, table->schema->name);
+      logdebug("sqlite:%s: -> Column name='%s', type=%s, but trying to insert a %s\n",
+          db->name, schema->fields[i].name, expected, received);
+      return -1;
+    }
+  }
+
+  if (sq3table->batch_stmt) {
+    row = &sq3table->rows[sq3table->nrows];
+    for (i = 0; i < value_count; i++) {
+      if (oml_value_duplicate(&row->values[i], &values[i])) {
+        logerror("sqlite:%s: Could not buffer value %d of sample %d for table '%s'\n",
+            db->name, i, seq_no, table->schema->name);
+        return -1;
+      }
+    }
+    row->sender_id = sender_id;
+    row->seq_no = seq_no;
+    row->time_stamp = time_stamp;
+    row->time_stamp_server = time_stamp_server;
+    if (++sq3table->nrows == sq3table->batch_size) {
+      ret = sq3_table_flush(db, table);
+    }
+
+  } else {
+    if (sq3_bind_sample(db, table, stmt, 1, sender_id, seq_no, time_stamp,
+          time_stamp_server, values)) {
+      ret = -1;
+    } else if (sqlite3_step(stmt) != SQLITE_DONE) {
+      logerror("sqlite:%s: Could not step SQL statement: %s\n",
+          db->name, sqlite3_errmsg(sq3db->conn));
+      ret = -1;
+    }
+    sqlite3_reset(stmt);
+  }
+
+  if (!sq3db->txn_rows) {
+    sq3db->txn_start = now;
+  }
+  sq3db->txn_rows++;
+  sq3db->txn_bytes += sq3_sample_size(values, value_count);
+  if (sq3_commit_due(sq3db, now) && sq3_commit(db)) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+/** Commit buffered samples which have been waiting for too long.
+ * \see db_adapter_flush, sq3_commit
+ */
+static int
+sq3_flush(Database *db)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  if (sq3_commit_due((Sq3DB*)db->handle, tv.tv_sec + 0.000001 * tv.tv_usec)) {
+    return sq3_commit(db);
+  }
+  return 0;
 }
 
 /** Do a key-value style select on a database table.
@@ -13,16 +13,43 @@
 #include <sqlite3.h>
 #include "database.h"
 
+/** Default number of samples inserted at once by a multi-row INSERT statement */
+#define SQ3_DEFAULT_BATCH_ROWS 64
+/** Default maximum time samples wait before being committed [ms] */
+#define SQ3_DEFAULT_COMMIT_LATENCY 1000
+
 typedef struct Sq3DB {
   sqlite3*  conn;
   int       sender_cnt;
-  time_t    last_commit;
+  double    txn_start;  // time at which the oldest uncommitted sample was received [s], or 0
+  int       txn_rows;   // number of samples in the current transaction
+  size_t    txn_bytes;  // approximate size of the samples in the current transaction
 } Sq3DB;
 
+/** A sample waiting to be inserted by a multi-row INSERT statement */
+typedef struct Sq3Row {
+  int       sender_id;
+  int       seq_no;
+  double    time_stamp;
+  double    time_stamp_server;
+  OmlValue* values;     // one per field of the table's schema
+} Sq3Row;
+
 typedef struct Sq3Table {
   sqlite3_stmt* insert_stmt;  // prepared insert statement
+  sqlite3_stmt* batch_stmt;   // prepared insert statement for batch_size rows, or NULL
+  int           batch_size;   // number of rows inserted at once by batch_stmt
+  Sq3Row*       rows;         // samples waiting for batch_stmt, batch_size long
+  int           nrows;        // number of samples waiting in rows
 } Sq3Table;
 
+extern char *sqlite_database_dir;
+extern int sqlite_batch_rows;
+extern int sqlite_commit_rows;
+extern int sqlite_commit_bytes;
+extern int sqlite_commit_latency;
+
+void sq3_dbdir_setup (void);
 int sq3_backend_setup (void);
 int sq3_create_database (Database* db);
 
@@ -81,6 +81,8 @@ static void sem_release(Database* db);
 static char* sem_prepared_var(Database *db, unsigned int order);
 static MString* sem_prepare(Database *db, DbTable* table);                     // TODO
 static int sem_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count); // TODO
+static int sem_flush(Database *db);
+static int sem_table_send (Database *db, DbTable *table);
 static /*char**/int sem_add_sender_id(Database* database, const char* sender_id);    // TODO
 static int sem_set_metadata (Database* database, const char* key, const char* value); // TODO
 static char* sem_get_metadata (Database* database, const char* key);          // TODO
@@ -108,12 +110,6 @@ char *vir_pass = DEFAULT_VIR_PASS;
 
 #define MAXLINE 4096
 #define MAXSUB  2000
-/* Definition of the token to replace by sequence number */
-#define REPLACE_SEQ "#?#value_seq#?#"
-/* Definition of the token to replace by time of the server */
-#define REPLACE_TS "#?#value_ts#?#" 
-/* Definition of the token to replace by time of the server */
-#define REPLACE_TC "#?#value_tc#?#"
 
 /**
  * This function generates a new socket that connects with virtuoso backend and send some data
@@ -148,11 +144,19 @@ virtuoso_create_database(Database* db)
   curl_easy_setopt(curl, CURLOPT_URL, mstring_buf(mstr));
   curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &logwrite_vir);
   curl_easy_setopt(curl, CURLOPT_USERPWD, mstring_buf(userpw));
-  mstring_delete (mstr);
   mstring_delete (userpw);
   VirDB* self = oml_malloc(sizeof(VirDB));
   self->conn = curl;//conn;
   self->last_commit = time (NULL);
+  mstring_set(mstr, "");
+  mstring_sprintf(mstr, "virtuoso:%s", db->name);
+  self->pipeline = sparql_pipeline_new(curl, "query", mstring_buf(mstr));
+  mstring_delete (mstr);
+  if (!self->pipeline) {
+    curl_easy_cleanup(curl);
+    oml_free(self);
+    return -1;
+  }
   db->semantic = 1;
   db->backend_name = backend_name;
   db->o2t = sem_oml_to_type;
@@ -165,6 +169,7 @@ virtuoso_create_database(Database* db)
   db->prepared_var = sem_prepared_var;
   db->prepare = sem_prepare;
   db->insert = sem_insert;
+  db->flush = sem_flush;
   db->add_sender_id = sem_add_sender_id;
   db->set_metadata = sem_set_metadata;
   db->get_metadata = sem_get_metadata;
@@ -274,6 +279,8 @@ sem_table_create (Database* db, DbTable* table, int shallow)
       goto fail_exit;
     }
     ((VirTable*)table->handle)->insert_stmt = insert;
+    semtable->tmpl = sparql_template_new(mstring_buf(insert));
+    semtable->batch = mstring_create();
   }
   //if (insert) { mstring_delete (insert); }
   return 0;
@@ -293,11 +300,16 @@ sem_table_create (Database* db, DbTable* table, int shallow)
 static int
 sem_table_free (Database *database, DbTable* table)
 {
-  (void)database;
   VirTable* semtable = (VirTable*)table->handle;
   int ret = 0;
-  if (semtable)
+  if (semtable) {
+    /* Don't lose the samples still waiting to be sent */
+    ret = sem_table_send (database, table);
+    sparql_template_free (semtable->tmpl);
+    if (semtable->batch) { mstring_delete (semtable->batch); }
+    if (semtable->insert_stmt) { mstring_delete (semtable->insert_stmt); }
     oml_free (semtable);
+  }
   return ret;
 }
 
@@ -309,6 +321,7 @@ sem_release(Database* db)
 {
   VirDB* self = (VirDB*)db->handle;
   dba_end_transaction (db);
+  sparql_pipeline_free(self->pipeline);
   curl_easy_cleanup(self->conn);
   curl_global_cleanup();
   oml_free(self);
@@ -423,9 +436,9 @@ sem_prepare(Database *db, DbTable* table)
       v++;
     }
   }
+  /* The triples of several samples share the same INSERT, see sem_insert */
   if (mstring_buf(insert)&&mstring_buf(insert)[0])
-      n += mstring_sprintf(mstr,"%s\nINSERT\n{\n\tGRAPH <http://%s:%s/%s>\n\t{\n%s\t}\n}",
-        HEADER_INSERT,vir_host,vir_port,db->name,mstring_buf(insert));
+      n += mstring_sprintf(mstr,"%s",mstring_buf(insert));
   if (n != 0)
     goto fail_exit;
   return mstr;
@@ -434,232 +447,142 @@ sem_prepare(Database *db, DbTable* table)
   return NULL;
 }
 
-/** Insert value in the SQLite3 database.
- * \see db_adapter_insert
- * XXX: This function actively does text protocol interpretation, see #1088
+/** Send the samples batched for a table in a single update request.
+ *
+ * \param db Database containing the table
+ * \param table DbTable to send the samples of
+ * \return 0 on success, -1 otherwise
+ * \see sem_insert, sparql_pipeline_send
  */
 static int
-sem_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *v, int value_count)
+sem_table_send (Database *db, DbTable *table)
 {
   VirDB* semdb = (VirDB*)db->handle;
   VirTable* semtable = (VirTable*)table->handle;
-  
-  if (semtable && semtable->insert_stmt) {
-    int i, res = 0;
-    long http_code;
-    char* tok = NULL, *old_tok = NULL,*pvar;
-    char *json = NULL;
-    ssize_t json_sz;
-    char* stmt = xstrdup(mstring_buf(semtable->insert_stmt));
-    MString *stmtend = mstring_create (), *stmtdata = mstring_create ();
-    double time_stamp_server;
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
-
-    if (tv.tv_sec > semdb->last_commit) {
-      if (dba_reopen_transaction (db) == -1) {
-        mstring_delete(stmtdata);
-        return -1;
-      }
-      semdb->last_commit = tv.tv_sec;
+  int ret = -1;
+
+  if (!semtable || semtable->nrows <= 0) {
+    return 0;
+  }
+  if (!mstring_cat(semtable->batch, "\t}\n}")) {
+    ret = sparql_pipeline_send(semdb->pipeline, mstring_buf(semtable->batch), mstring_len(semtable->batch));
+  }
+  mstring_set(semtable->batch, "");
+  semtable->nrows = 0;
+
+  return ret;
+}
+
+/** Send the samples batched for all tables.
+ *
+ * \param db Database to commit
+ * \return 0 on success, -1 otherwise
+ * \see sem_table_send
+ */
+static int
+sem_commit (Database *db)
+{
+  DbTable *table;
+  int ret = 0;
+
+  for (table = db->first_table; table; table = table->next) {
+    if (sem_table_send (db, table)) {
+      ret = -1;
     }
+  }
+  if (dba_reopen_transaction (db) == -1) {
+    ret = -1;
+  }
 
-    if (stmtend == NULL) {
-      logerror("%d: Failed to create managed string for preparing SQL INSERT statement\n",
-          db->backend_name);
-      mstring_delete(stmtdata);
-      return -1;
+  return ret;
+}
+
+/** Insert value in the Virtuoso database.
+ *
+ * The triples for the sample are appended to those batched for the table,
+ * which are sent in a single INSERT once sparql_batch_rows are waiting, or
+ * at most every second. Requests are not waited for, unless
+ * sparql_requests are already in flight.
+ *
+ * \see db_adapter_insert, sem_table_send, sparql_template_append
+ */
+static int
+sem_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *v, int value_count)
+{
+  VirDB* semdb = (VirDB*)db->handle;
+  VirTable* semtable = (VirTable*)table->handle;
+  struct schema *schema = table->schema;
+  int i, ret = 0;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+
+  if (tv.tv_sec > semdb->last_commit) {
+    if (sem_commit (db) == -1) {
+      ret = -1;
     }
-    struct schema *schema = table->schema;
-    if (schema->nfields != value_count) {
-      logerror ("virtuoso:%s: Failed to insert %d values into table '%s' with %d columns\n",
-          db->name, value_count, table->schema->name, schema->nfields);
-      oml_free(stmt);
-      mstring_delete(stmtend);
-      mstring_delete(stmtdata);
+    semdb->last_commit = tv.tv_sec;
+  }
+
+  if (!semtable || !semtable->tmpl) {
+    /* No concepts defined for this table */
+    return ret;
+  }
+
+  if (schema->nfields != value_count) {
+    logerror ("virtuoso:%s: Failed to insert %d values into table '%s' with %d columns\n",
+        db->name, value_count, table->schema->name, schema->nfields);
+    return -1;
+  }
+  for (i = 0; i < schema->nfields; i++) {
+    if (oml_value_get_type(v+i) != schema->fields[i].type) {
+      const char *expected = oml_type_to_s (schema->fields[i].type);
+      const char *received = oml_type_to_s (oml_value_get_type(v+i));
+      logerror("virtuoso:%s: Value %d type mismatch for table '%s'\n", db->name, i, table->schema->name);
+      logdebug("virtuoso:%s: -> Column name='%s', type=%s, but trying to insert a %s\n",
+          db->name, schema->fields[i].name, expected, received);
       return -1;
     }
-    old_tok = stmt;
-    // Asign sequence index to the Measurement
-    if ((tok = strstr(old_tok, REPLACE_SEQ))) {
-        *tok = '\0';
-        res += mstring_sprintf(stmtend, "%s\"%d\"^^xsd:integer", old_tok, seq_no);
-        old_tok = tok+strlen(REPLACE_SEQ);
-    }
-    if ((tok = strstr(old_tok, REPLACE_TC))) {
-        *tok = '\0';
-        res += mstring_sprintf(stmtend, "%s\"%d\"^^xsd:double", old_tok, time_stamp);
-        old_tok = tok+strlen(REPLACE_TC);
-    }
-    pvar = sem_prepared_var(db,0);
-    for (i = 0; i < schema->nfields;i++) {
-      if ((tok = strstr(old_tok, pvar))) {
-        if (oml_value_get_type(v+i) != schema->fields[i].type) {
-          const char *expected = oml_type_to_s (schema->fields[i].type);
-          const char *received = oml_type_to_s (oml_value_get_type(v));
-          logerror("virtuoso:%s: Value %d type mismatch for table '%s'\n", db->name, i, table->schema->name);
-          logdebug("virtuoso:%s: -> Column name='%s', type=%s, but trying to insert a %s\n",
-              db->name, schema->fields[i].name, expected, received);
-          oml_free(pvar);
-          oml_free(stmt);
-          mstring_delete(stmtend);
-          mstring_delete(stmtdata);
-          return -1;
-        }
-        *tok = '\0';
-        switch (schema->fields[i].type) {
-        case OML_DOUBLE_VALUE:
-          res += mstring_sprintf(stmtend, "%s\"%lf\"^^%s", old_tok, omlc_get_double(*oml_value_get_value(v+i)), sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_LONG_VALUE:
-          res += mstring_sprintf(stmtend, "%s\"%ld\"^^%s", old_tok, (long)omlc_get_long(*oml_value_get_value(v+i)), sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_INT32_VALUE:
-          res += mstring_sprintf(stmtend, "%s\"%d\"^^%s", old_tok, (int32_t)omlc_get_int32(*oml_value_get_value(v+i)), sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_UINT32_VALUE:
-          res += mstring_sprintf(stmtend, "%s\"%d\"^^%s", old_tok, (uint32_t)omlc_get_uint32(*oml_value_get_value(v+i)), sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_INT64_VALUE:
-          res += mstring_sprintf(stmtend, "%s\"%ld\"^^%s", old_tok, (int64_t)omlc_get_int64(*oml_value_get_value(v+i)), sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_UINT64_VALUE:
-          if (omlc_get_uint64(*oml_value_get_value(v+i)) > (uint64_t)9223372036854775808ull) {
-            logwarn("virtuoso:%s: Trying to store value %" PRIu64 " (>2^63) in column '%s' of table '%s', this might lead to a loss of resolution\n",
-                db->name, (uint64_t)omlc_get_uint64(*oml_value_get_value(v+i)), schema->fields[i].name, table->schema->name);
-          }
-          res += mstring_sprintf(stmtend, "%s\"%lu\"^^%s", old_tok, (uint64_t)omlc_get_uint64(*oml_value_get_value(v+i)), sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_STRING_VALUE:
-          res += mstring_sprintf(stmtend, "%s\"%s\"^^%s", old_tok, omlc_get_string_ptr(*oml_value_get_value(v+i)), sem_oml_to_type (schema->fields[i].type));
-          break;
-    // Not supported
-    //    case OML_BLOB_VALUE:
-    //      break;
-        case OML_GUID_VALUE:
-          if(omlc_get_guid(*oml_value_get_value(v+i)) != UINT64_C(0)) {
-            res += mstring_sprintf(stmtend, "%s\"%lu\"^^%s", old_tok, (uint64_t)omlc_get_uint64(*oml_value_get_value(v+i)), sem_oml_to_type (schema->fields[i].type));
-          } else {
-            res += mstring_sprintf(stmtend, "%s\"\"^^%s", old_tok, sem_oml_to_type (schema->fields[i].type));
-          }
-          break;
-
-        case OML_BOOL_VALUE:
-          res += mstring_sprintf(stmtend, "%s\"%s\"^^%s", old_tok, (int)omlc_get_bool(*oml_value_get_value(v+i))?"true":"false", sem_oml_to_type (schema->fields[i].type));
-          break;
-
-        case OML_VECTOR_DOUBLE_VALUE:
-          json = NULL;
-          json_sz = vector_double_to_json((v+i)->value.vectorValue.ptr, (v+i)->value.vectorValue.nof_elts, &json);
-          if(-1 != json_sz)
-          {
-            res += mstring_sprintf(stmtend, "%s\"%s\"^^%s", old_tok, json, sem_oml_to_type (schema->fields[i].type));
-            oml_free(json);
-          }
-          else
-            res += mstring_sprintf(stmtend, "%s\"\"^^%s", old_tok, sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_VECTOR_INT32_VALUE:
-          json = NULL;
-          json_sz = vector_int32_to_json((v+i)->value.vectorValue.ptr, (v+i)->value.vectorValue.nof_elts, &json);
-          if(-1 != json_sz)
-          {
-            res += mstring_sprintf(stmtend, "%s\"%s\"^^%s", old_tok, json, sem_oml_to_type (schema->fields[i].type));
-            oml_free(json);
-          }
-          else
-            res += mstring_sprintf(stmtend, "%s\"\"^^%s", old_tok, sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_VECTOR_UINT32_VALUE:
-          json = NULL;
-          json_sz = vector_uint32_to_json((v+i)->value.vectorValue.ptr, (v+i)->value.vectorValue.nof_elts, &json);
-          if(-1 != json_sz)
-          {
-            res += mstring_sprintf(stmtend, "%s\"%s\"^^%s", old_tok, json, sem_oml_to_type (schema->fields[i].type));
-            oml_free(json);
-          }
-          else
-            res += mstring_sprintf(stmtend, "%s\"\"^^%s", old_tok, sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_VECTOR_INT64_VALUE:
-          json = NULL;
-          json_sz = vector_int64_to_json((v+i)->value.vectorValue.ptr, (v+i)->value.vectorValue.nof_elts, &json);
-          if(-1 != json_sz)
-          {
-            res += mstring_sprintf(stmtend, "%s\"%s\"^^%s", old_tok, json, sem_oml_to_type (schema->fields[i].type));
-            oml_free(json);
-          }
-          else
-            res += mstring_sprintf(stmtend, "%s\"\"^^%s", old_tok, sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_VECTOR_UINT64_VALUE:
-          json = NULL;
-          json_sz = vector_uint64_to_json((v+i)->value.vectorValue.ptr, (v+i)->value.vectorValue.nof_elts, &json);
-          if(-1 != json_sz)
-          {
-            res += mstring_sprintf(stmtend, "%s\"%s\"^^%s", old_tok, json, sem_oml_to_type (schema->fields[i].type));
-            oml_free(json);
-          }
-          else
-            res += mstring_sprintf(stmtend, "%s\"\"^^%s", old_tok, sem_oml_to_type (schema->fields[i].type));
-          break;
-        case OML_VECTOR_BOOL_VALUE:
-          json = NULL;
-          json_sz = vector_bool_to_json((v+i)->value.vectorValue.ptr, (v+i)->value.vectorValue.nof_elts, &json);
-          if(-1 != json_sz)
-          {
-            res += mstring_sprintf(stmtend, "%s\"%s\"^^%s", old_tok, json, sem_oml_to_type (schema->fields[i].type));
-            oml_free(json);
-          }
-          else
-            res += mstring_sprintf(stmtend, "%s\"\"^^%s", old_tok, sem_oml_to_type (schema->fields[i].type));
-          break;
-        default:
-          logerror("virtuoso:%s: Unknown type %d in col '%s' of table '%s; this is probably a bug'\n",
-              db->name, schema->fields[i].type, schema->fields[i].name, table->schema->name);
-          oml_free(stmt);
-          mstring_delete(stmtend);
-          mstring_delete(stmtdata);
-          return -1;
-        }
-        if (res != 0) {
-          logerror("virtuoso:%s: Could not bind column '%s'\n",
-              db->name, schema->fields[i].name);
-          oml_free(stmt);
-          mstring_delete(stmtend);
-          mstring_delete(stmtdata);
-          return -1;
-        }
-        old_tok = tok+strlen(pvar); // go to next segment
-      }
-      oml_free(pvar);
-      pvar = sem_prepared_var(db,i+1);
-    }
-    oml_free(pvar);
-    res += mstring_sprintf(stmtend, "%s", old_tok);
-    if (old_tok != stmt)
-    {
-        char*data=curl_easy_escape(semdb->conn,mstring_buf(stmtend),strlen(mstring_buf(stmtend)));
-        res += mstring_sprintf(stmtdata,"query=%s",data);
-        curl_easy_setopt(semdb->conn, CURLOPT_POSTFIELDS, mstring_buf(stmtdata));
-        curl_free(data);
-        res = curl_easy_perform(semdb->conn);
-        /* Check for errors */ 
-        if (res != CURLE_OK)
-          logerror("virtuoso:%s: Semantic insertion failed: %s\n",db->name,curl_easy_strerror(res));
-        curl_easy_getinfo (semdb->conn, CURLINFO_RESPONSE_CODE, &http_code);
-        if (http_code != 200L)
-        {
-          logerror("virtuoso:%s: Semantic insertion failed. HTTP code status: %ld\n",db->name,http_code);
-          logdebug3("virtuoso:%s: %s\n",db->name,mstring_buf(stmtdata));
-        }
-    }
-    oml_free(stmt);
-    mstring_delete(stmtdata);
-    mstring_delete(stmtend);
   }
-  return 0;
+
+  if (!semtable->nrows) {
+    mstring_set(semtable->batch, "");
+    mstring_sprintf(semtable->batch, "%s\nINSERT\n{\n\tGRAPH <http://%s:%s/%s>\n\t{\n",
+        HEADER_INSERT,vir_host,vir_port,db->name);
+  }
+  if (sparql_template_append(semtable->tmpl, semtable->batch, NULL,
+        db, table, seq_no, time_stamp, v)) {
+    return -1;
+  }
+  if (++semtable->nrows >= sparql_batch_rows) {
+    return sem_table_send (db, table);
+  }
+
+  /* Make progress on the requests in flight */
+  if (sparql_pipeline_poll(semdb->pipeline, 0)) {
+    ret = -1;
+  }
+
+  return ret;
+}
+
+/** Send batched samples which have been waiting for too long.
+ * \see db_adapter_flush, sem_commit
+ */
+static int
+sem_flush(Database *db)
+{
+  VirDB* semdb = (VirDB*)db->handle;
+  time_t now = time (NULL);
+  int ret = 0;
+
+  if (now > semdb->last_commit) {
+    semdb->last_commit = now;
+    ret = sem_commit (db);
+  }
+  if (sparql_pipeline_poll(semdb->pipeline, 0)) {
+    ret = -1;
+  }
+  return ret;
 }
 
 /** Add a new sender to the database, returning its index.
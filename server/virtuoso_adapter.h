@@ -15,6 +15,7 @@
 
 #include "../lib/ocomm/ocomm/o_socket.h"
 #include "database.h"
+#include "sparql.h"
 #include <oml2/oml_out_stream.h>
 #include <curl/curl.h>
 
@@ -29,10 +30,14 @@ typedef struct VirDB {
   CURL*     conn;
   int       sender_cnt;
   time_t    last_commit;
+  SparqlPipeline* pipeline; // update requests in flight
 } VirDB;
 
 typedef struct VirTable {
   MString* insert_stmt;  // prepared insert statement
+  SparqlTemplate* tmpl;  // insert_stmt split around its placeholders, or NULL if empty
+  MString* batch;        // update request for the samples waiting to be sent
+  int      nrows;        // number of samples in batch
 } VirTable;
 
 int virtuoso_backend_setup (void);
@@ -0,0 +1,129 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file connectbench.c
+ * \brief Measure the cost of a storm of client connections to a large experiment.
+ *
+ * NDBS other databases, and one experiment database with NTABLES tables, are
+ * created in a temporary directory. NCONNECTS connections are then simulated,
+ * doing what the server does when processing the headers of a client: looking
+ * the database up by name, getting an ID for the sender (one of NSENDERS),
+ * and looking up the tables of its NSTREAMS streams, before releasing the
+ * database. The connection rate is printed.
+ *
+ *   connectbench [NTABLES [NCONNECTS [BACKEND]]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ocomm/o_log.h"
+#include "schema.h"
+#include "database.h"
+#include "ingest.h"
+
+#define NDBS 256
+#define NTABLES 4096
+#define NCONNECTS 100000
+#define NSENDERS 1024
+#define NSTREAMS 4
+
+extern char *dbbackend;
+extern char *sqlite_database_dir;
+
+/** Get the current monotonic time, in ns */
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+main (int argc, char **argv)
+{
+  int ntables = argc > 1 ? atoi (argv[1]) : NTABLES;
+  int nconnects = argc > 2 ? atoi (argv[2]) : NCONNECTS;
+  char dir[] = "/tmp/connectbench.XXXXXX";
+  char name[96], cmd[64];
+  struct schema **schemas;
+  Database *db, *dbs[NDBS];
+  double start, elapsed;
+  int i, j;
+
+  o_set_log_level (O_LOG_ERROR);
+  if (!mkdtemp (dir)) {
+    perror ("mkdtemp");
+    return 1;
+  }
+  dbbackend = argc > 3 ? argv[3] : "sqlite";
+  sqlite_database_dir = dir;
+  ingest_queue_size = 0;
+  if (database_setup_backend (dbbackend)) {
+    return 1;
+  }
+
+  for (i = 0; i < NDBS; i++) {
+    snprintf (name, sizeof (name), "other%d", i);
+    dbs[i] = database_find (name);
+  }
+
+  /* Keep the experiment open, as long-lived clients would */
+  if (!(db = database_find ("experiment"))) {
+    return 1;
+  }
+  schemas = malloc (ntables * sizeof (struct schema*));
+  for (i = 0; i < ntables; i++) {
+    snprintf (name, sizeof (name), "%d app_mp%d value:double seq:uint32 label:string", i + 1, i);
+    schemas[i] = schema_from_meta (name);
+    if (!database_find_or_create_table (db, schemas[i])) {
+      fprintf (stderr, "Could not create table %d\n", i);
+      return 1;
+    }
+  }
+
+  start = now_ns ();
+  for (i = 0; i < nconnects; i++) {
+    Database *cdb = database_find ("experiment");
+    snprintf (name, sizeof (name), "node%d", i % NSENDERS);
+    database_add_sender_id (cdb, name);
+    for (j = 0; j < NSTREAMS; j++) {
+      database_find_or_create_table (cdb, schemas[(i * NSTREAMS + j) % ntables]);
+    }
+    database_release (cdb);
+  }
+  elapsed = now_ns () - start;
+
+  printf ("%s: %d connections with %d streams to %d tables (%d databases open): %.0f connections/s, %.2f us each\n",
+      dbbackend, nconnects, NSTREAMS, ntables, NDBS + 1,
+      nconnects / (elapsed / 1e9), elapsed / 1e3 / nconnects);
+
+  database_release (db);
+  for (i = 0; i < NDBS; i++) {
+    database_release (dbs[i]);
+  }
+  for (i = 0; i < ntables; i++) {
+    schema_free (schemas[i]);
+  }
+  free (schemas);
+
+  snprintf (cmd, sizeof (cmd), "rm -rf %s", dir);
+  return system (cmd) ? 1 : 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,158 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file eventloopbench.c
+ * \brief Measure the cost of dispatching events with many idle connections.
+ *
+ * NIDLE idle and NHOT busy connections (socketpair(2)s) are registered with
+ * the OComm EventLoop, as the server would for its clients. Each busy
+ * connection plays ping-pong: every byte read from it triggers the write of
+ * a new one at the other end. The average wall-clock time spent per event,
+ * until NEVENTS have been processed, is printed.
+ *
+ * The backend is the default one (epoll(7) where available); setting
+ * OML_EVENTLOOP=poll in the environment forces poll(3), for comparison. A
+ * different number of idle connections and events can be given as
+ * arguments. The file descriptor limit may need to be raised for large NIDLE.
+ *
+ *   [OML_EVENTLOOP=poll] eventloopbench [NIDLE [NEVENTS]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_socket.h"
+#include "ocomm/o_eventloop.h"
+
+#define NIDLE 5000
+#define NHOT 8
+#define NEVENTS 1000000
+
+/** A minimal Socket around one end of a socketpair(2) */
+typedef struct {
+  char* name;
+  o_socket_sendto sendto;
+  o_get_sockfd get_sockfd;
+
+  int fd;
+  /** Other end of the socketpair */
+  int peer;
+  SockEvtSource *source;
+} PairSocket;
+
+static PairSocket *sockets;
+static unsigned long nsockets, nevents, events;
+
+static int
+pair_socket_get_sockfd (Socket *socket)
+{
+  return ((PairSocket*)socket)->fd;
+}
+
+/** Get the current monotonic time, in ns */
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Bounce data back to a busy connection, until enough events have been seen */
+static void
+on_data (SockEvtSource *source, void *handle, void *buf, int buflen)
+{
+  PairSocket *s = (PairSocket*)handle;
+  unsigned long i;
+  (void)source;
+  (void)buf;
+  (void)buflen;
+
+  if (++events < nevents) {
+    if (write (s->peer, "x", 1) < 1) {
+      perror ("write");
+    }
+
+  } else {
+    /* Deactivate all channels first, as PairSockets are not real OComm Sockets */
+    for (i = 0; i < nsockets; i++) {
+      eventloop_socket_release (sockets[i].source);
+    }
+    eventloop_terminate (1);
+  }
+}
+
+int
+main (int argc, const char **argv)
+{
+  const char *backend = getenv ("OML_EVENTLOOP");
+  unsigned long nidle = NIDLE, i;
+  double start, elapsed;
+  int fds[2];
+
+  if (argc > 1) {
+    nidle = strtoul (argv[1], NULL, 10);
+  }
+  nevents = (argc > 2) ? strtoul (argv[2], NULL, 10) : NEVENTS;
+  o_set_log_level (O_LOG_ERROR);
+
+  eventloop_init ();
+  eventloop_set_socket_timeout (0);
+
+  nsockets = nidle + NHOT;
+  sockets = calloc (nsockets, sizeof (PairSocket));
+  for (i = 0; i < nsockets; i++) {
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds)) {
+      perror ("socketpair");
+      fprintf (stderr, "Only created %lu/%lu connections\n", i, nsockets);
+      return 1;
+    }
+    sockets[i].name = (i < NHOT) ? "hot" : "idle";
+    sockets[i].get_sockfd = pair_socket_get_sockfd;
+    sockets[i].fd = fds[0];
+    sockets[i].peer = fds[1];
+    sockets[i].source = eventloop_on_read_in_channel ((Socket*)&sockets[i], on_data, NULL,
+        &sockets[i]);
+  }
+
+  printf ("# %lu events per run\n", nevents);
+  printf ("# backend\tidle\tbusy\tns/event\n");
+
+  for (i = 0; i < NHOT; i++) {
+    if (write (sockets[i].peer, "x", 1) < 1) {
+      perror ("write");
+    }
+  }
+  start = now_ns ();
+  eventloop_run ();
+  elapsed = now_ns () - start;
+
+  printf ("%s\t%lu\t%d\t%.1f\n", backend ? backend : "default", nidle, NHOT, elapsed / events);
+
+  for (i = 0; i < nsockets; i++) {
+    close (sockets[i].fd);
+    close (sockets[i].peer);
+  }
+  free (sockets);
+
+  return 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,210 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file ingestbench.c
+ * \brief Measure the throughput of the EventLoop's read path into an MBuffer.
+ *
+ * A child process writes NBYTES of text measurements into a socketpair(2) as
+ * fast as it can, while the OComm EventLoop reads them into an MBuffer, and
+ * splits them into lines, as the server's client_callback would. The data is
+ * either received in small chunks which are copied into the MBuffer by the
+ * read callback (copy), or directly into the MBuffer (direct), with a few
+ * different read budgets. The throughput, and the number of read callbacks
+ * per MB of data, are printed.
+ *
+ * A different number of bytes, multiple of 64, can be given as the only
+ * argument.
+ *
+ *   ingestbench [NBYTES]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_socket.h"
+#include "ocomm/o_eventloop.h"
+#include "mbuf.h"
+
+#define NBYTES (256 * 1024 * 1024)
+/** Size of the writes into the socket */
+#define WRITE_SIZE 65536
+
+#define LENGTH(a) (sizeof (a) / sizeof (a[0]))
+
+/** A minimal Socket around one end of a socketpair(2) */
+typedef struct {
+  char* name;
+  o_socket_sendto sendto;
+  o_get_sockfd get_sockfd;
+
+  int fd;
+  MBuffer *mbuf;
+  int direct;
+
+  unsigned long callbacks;
+  unsigned long lines;
+} PairSocket;
+
+static int
+pair_socket_get_sockfd (Socket *socket)
+{
+  return ((PairSocket*)socket)->fd;
+}
+
+/** Get the current monotonic time, in ns */
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Write nbytes of text samples into fd, then close it */
+static void
+write_samples (int fd, size_t nbytes)
+{
+  char buf[WRITE_SIZE];
+  size_t i, sent;
+  ssize_t len;
+  int n;
+
+  /* 64-byte lines, padded with spaces */
+  for (i = 0; i < sizeof (buf); i += 64) {
+    memset (buf + i, ' ', 63);
+    n = snprintf (buf + i, 63, "%f\t1\t%zu\t%zu", 1.0 + i / 64, i / 64 + 1, i * 10);
+    buf[i + n] = '\t';
+    buf[i + 63] = '\n';
+  }
+  for (sent = 0; sent < nbytes; sent += len) {
+    if ((len = write (fd, buf, (nbytes - sent < sizeof (buf)) ? nbytes - sent : sizeof (buf))) < 0) {
+      perror ("write");
+      break;
+    }
+  }
+  close (fd);
+}
+
+/** Append data to the MBuffer if needed, and split it into lines */
+static void
+on_data (SockEvtSource *source, void *handle, void *buf, int buflen)
+{
+  PairSocket *s = (PairSocket*)handle;
+  MBuffer *mbuf = s->mbuf;
+  size_t len;
+  (void)source;
+
+  s->callbacks++;
+  if (!s->direct && mbuf_write (mbuf, buf, buflen) < 0) {
+    fprintf (stderr, "Cannot write into MBuffer\n");
+    return;
+  }
+  while ((len = mbuf_find (mbuf, '\n')) != (size_t)-1) {
+    mbuf_read_skip (mbuf, len + 1);
+    mbuf_consume_message (mbuf);
+    s->lines++;
+  }
+  mbuf_repack_message (mbuf);
+}
+
+static void
+on_status (SockEvtSource *source, SocketStatus status, int error, void *handle)
+{
+  (void)error;
+  (void)handle;
+  if (SOCKET_CONN_CLOSED == status) {
+    eventloop_socket_release (source);
+    eventloop_stop (1);
+  }
+}
+
+int
+main (int argc, const char **argv)
+{
+  /* Read budgets for direct reads; -1 stands for copying data */
+  long budgets[] = { -1, 16384, 262144, 0 };
+  size_t nbytes = NBYTES;
+  double start, elapsed;
+  unsigned int i;
+  PairSocket s;
+  SockEvtSource *source;
+  int fds[2];
+  pid_t pid;
+
+  if (argc > 1) {
+    nbytes = strtoul (argv[1], NULL, 10);
+  }
+  o_set_log_level (O_LOG_ERROR);
+
+  eventloop_init ();
+  eventloop_set_socket_timeout (0);
+
+  printf ("# %zu bytes per run\n", nbytes);
+  printf ("# mode\tbudget\tMB/s\tcallbacks/MB\n");
+
+  for (i = 0; i < LENGTH (budgets); i++) {
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds)) {
+      perror ("socketpair");
+      return 1;
+    }
+    memset (&s, 0, sizeof (s));
+    s.name = "ingest";
+    s.get_sockfd = pair_socket_get_sockfd;
+    s.fd = fds[0];
+    s.mbuf = mbuf_create ();
+    s.direct = budgets[i] >= 0;
+
+    source = eventloop_on_read_in_channel ((Socket*)&s, on_data, on_status, &s);
+    if (s.direct) {
+      eventloop_set_read_budget (budgets[i]);
+      eventloop_socket_set_mbuf (source, s.mbuf);
+    }
+
+    start = now_ns ();
+    if (!(pid = fork ())) {
+      close (fds[0]);
+      write_samples (fds[1], nbytes);
+      _exit (0);
+    }
+    close (fds[1]);
+    eventloop_run ();
+    elapsed = now_ns () - start;
+    waitpid (pid, NULL, 0);
+
+    if (s.lines != nbytes / 64) {
+      fprintf (stderr, "Only received %lu/%zu lines\n", s.lines, nbytes / 64);
+      return 1;
+    }
+    if (s.direct) {
+      printf ("direct\t%ld", budgets[i]);
+    } else {
+      printf ("copy\t-");
+    }
+    printf ("\t%.0f\t%.1f\n", nbytes / elapsed * 1e3, s.callbacks / (nbytes / 1048576.));
+
+    close (fds[0]);
+    mbuf_destroy (s.mbuf);
+  }
+
+  return 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file injectbench.c
+ * \brief Measure the per-sample cost of omlc_inject and omlc_inject_batch.
+ *
+ * For each batch size from 1 to MAX_BATCH (in powers of 2), inject NSAMPLES
+ * samples of a 3-field MP using omlc_inject_batch, and print the average
+ * wall-clock time spent per sample. The first line is the reference, using
+ * omlc_inject on each sample.
+ *
+ * All --oml-* options are passed to liboml2; by default, the output is
+ * written to /dev/null. A different number of samples can be given as the
+ * only other argument.
+ *
+ *   injectbench [NSAMPLES] [--oml-collect URI] [--oml-...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oml2/omlc.h"
+
+#define NSAMPLES 262144
+#define MAX_BATCH 1024
+
+static OmlMPDef mp_def[] = {
+  { "seq", OML_UINT32_VALUE, NULL },
+  { "value", OML_DOUBLE_VALUE, NULL },
+  { "bytes", OML_UINT64_VALUE, NULL },
+  { NULL, (OmlValueT)0, NULL }
+};
+#define NFIELDS 3
+
+#define LENGTH(a) (sizeof (a) / sizeof (a[0]))
+
+/** Get the current monotonic time, in ns */
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Fill rows with nrows samples, starting at sequence number seq */
+static void
+fill_rows (OmlValueU *rows, unsigned int nrows, uint32_t seq)
+{
+  unsigned int i;
+  for (i = 0; i < nrows; i++, seq++) {
+    omlc_set_uint32 (rows[i * NFIELDS], seq);
+    omlc_set_double (rows[i * NFIELDS + 1], seq * 0.5);
+    omlc_set_uint64 (rows[i * NFIELDS + 2], (uint64_t)seq << 10);
+  }
+}
+
+int
+main (int argc, const char **argv)
+{
+  const char *def_argv[] = {
+    "--oml-id", "injectbench",
+    "--oml-domain", "injectbench",
+    "--oml-collect", "file:/dev/null",
+    "--oml-bufsize", "1048576" };
+  const char **oml_argv;
+  OmlValueU rows[MAX_BATCH * NFIELDS];
+  unsigned long nsamples = NSAMPLES, n;
+  unsigned int batch;
+  int oml_argc, i;
+  double start, elapsed;
+  OmlMP *mp;
+
+  /* Prepend the defaults, so they can be overridden from the command line */
+  oml_argv = malloc ((argc + LENGTH (def_argv)) * sizeof (char*));
+  oml_argv[0] = argv[0];
+  memcpy (oml_argv + 1, def_argv, sizeof (def_argv));
+  for (i = 1, oml_argc = 1 + LENGTH (def_argv); i < argc; i++) {
+    if (!strncmp (argv[i], "--oml-", 6)) {
+      oml_argv[oml_argc++] = argv[i];
+      if (i + 1 < argc && strncmp (argv[i + 1], "--", 2)) {
+        oml_argv[oml_argc++] = argv[++i];
+      }
+    } else {
+      nsamples = strtoul (argv[i], NULL, 10);
+    }
+  }
+
+  if (omlc_init ("injectbench", &oml_argc, oml_argv, NULL)) {
+    fprintf (stderr, "Could not initialise OML\n");
+    return 1;
+  }
+  if (!(mp = omlc_add_mp ("bench", mp_def))) {
+    fprintf (stderr, "Could not add MP\n");
+    return 1;
+  }
+  if (omlc_start ()) {
+    fprintf (stderr, "Could not start OML\n");
+    return 1;
+  }
+
+  omlc_zero_array (rows, MAX_BATCH * NFIELDS);
+
+  printf ("# %lu samples per run\n", nsamples);
+  printf ("# batch\tns/sample\n");
+
+  start = now_ns ();
+  for (n = 0; n < nsamples; n++) {
+    fill_rows (rows, 1, n);
+    omlc_inject (mp, rows);
+  }
+  elapsed = now_ns () - start;
+  printf ("inject\t%.1f\n", elapsed / nsamples);
+
+  for (batch = 1; batch <= MAX_BATCH; batch *= 2) {
+    start = now_ns ();
+    for (n = 0; n + batch <= nsamples; n += batch) {
+      fill_rows (rows, batch, n);
+      omlc_inject_batch (mp, rows, batch);
+    }
+    elapsed = now_ns () - start;
+    printf ("%u\t%.1f\n", batch, elapsed / n);
+  }
+
+  omlc_close ();
+  free (oml_argv);
+
+  return 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -10,7 +10,12 @@
 /** \file  check_liboml2_api.c
  * \brief Test the user-visible OML API.
  */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <check.h>
 
 #include "ocomm/o_log.h"
@@ -20,6 +25,8 @@
 #include "oml_value.h"
 #include "validate.h"
 #include "client.h"
+#include "mbuf.h"
+#include "marshal.h"
 
 typedef struct
 {
@@ -224,6 +231,696 @@ START_TEST(test_api_metadata)
 }
 END_TEST
 
+static OmlMPDef ring_mpdef [] = {
+  { "thread", OML_UINT32_VALUE, NULL },
+  { "seq", OML_UINT32_VALUE, NULL },
+  { NULL, (OmlValueT)0, NULL }
+};
+
+START_TEST(test_api_inject_batch)
+{
+  OmlMP *mp;
+  OmlValueU rows[2 * 100];
+  uint32_t i, thread, seq, last_seq = 0;
+  int schema = -1, s, received = 0;
+  char buf[1024];
+  FILE *fp;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_api_inject_batch");
+
+  unlink("test_api_inject_batch");
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("batch", ring_mpdef);
+  fail_if(mp == NULL, "Failed to add MP");
+
+  omlc_zero_array(rows, 2 * 100);
+  for (i = 0; i < 100; i++) {
+    omlc_set_uint32(rows[2 * i], 0);
+    omlc_set_uint32(rows[2 * i + 1], i + 1);
+  }
+
+  fail_unless(omlc_inject_batch(mp, rows, 100),
+      "omlc_inject_batch() succeeded before omlc_start was called");
+  fail_if(omlc_start(), "Error starting OML");
+  fail_unless(omlc_inject_batch(NULL, rows, 100), "omlc_inject_batch() accepted a NULL MP");
+  fail_if(omlc_inject_batch(mp, rows, 0), "omlc_inject_batch() failed for an empty batch");
+  fail_if(omlc_inject_batch(mp, rows, 100), "omlc_inject_batch() failed");
+
+  fail_if(omlc_close(), "Error closing OML");
+
+  fp = fopen("test_api_inject_batch", "r");
+  fail_unless(fp != NULL, "Output file test_api_inject_batch missing");
+  while(fgets(buf, sizeof(buf), fp)) {
+    if (!strncmp(buf, "schema: ", 8) && strstr(buf, "_batch thread:uint32 seq:uint32")) {
+      schema = atoi(buf + 8);
+
+    } else if (schema >= 0 &&
+        sscanf(buf, "%*f\t%d\t%*u\t%u\t%u", &s, &thread, &seq) == 3 && s == schema) {
+      fail_unless(seq == last_seq + 1, "Sample %u received after %u", seq, last_seq);
+      last_seq = seq;
+      received++;
+    }
+  }
+  fclose(fp);
+
+  fail_unless(received == 100, "Received %d samples out of 100", received);
+}
+END_TEST
+
+static OmlMPDef row_mpdef [] = {
+  { "seq", OML_UINT32_VALUE, NULL },
+  { "label", OML_STRING_VALUE, NULL },
+  { "payload", OML_BLOB_VALUE, NULL },
+  { "weight", OML_DOUBLE_VALUE, NULL },
+  { NULL, (OmlValueT)0, NULL }
+};
+
+START_TEST(test_api_row)
+{
+  OmlMP *mp_row, *mp_inject;
+  OmlRow *row;
+  OmlValueU v[4];
+  char label[32], payload[16];
+  char buf[1024], *data;
+  char *rows[10], *injected[10];
+  int schema_row = -1, schema_inject = -1, s, nrows = 0, ninjected = 0, i;
+  FILE *fp;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_api_row");
+
+  unlink("test_api_row");
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL), "Error initialising OML");
+  mp_row = omlc_add_mp("row", row_mpdef);
+  mp_inject = omlc_add_mp("inject", row_mpdef);
+  fail_if(mp_row == NULL || mp_inject == NULL, "Failed to add MPs");
+
+  fail_unless(omlc_row_begin(mp_row) == NULL, "omlc_row_begin() succeeded before omlc_start was called");
+  fail_if(omlc_start(), "Error starting OML");
+  fail_unless(omlc_row_begin(NULL) == NULL, "omlc_row_begin() accepted a NULL MP");
+  fail_unless(omlc_row_commit(NULL), "omlc_row_commit() accepted a NULL row");
+
+  omlc_zero_array(v, 4);
+  for (i = 0; i < 10; i++) {
+    /* Reuse the same storage for all samples, as it is not copied */
+    snprintf(label, sizeof(label), "sample\t%d", i);
+    memset(payload, 'a' + i, sizeof(payload));
+
+    row = omlc_row_begin(mp_row);
+    fail_if(row == NULL, "omlc_row_begin() failed");
+    fail_unless(omlc_row_set_int32(row, 0, i), "Set an int32 into a uint32 field");
+    fail_unless(omlc_row_set_uint32(row, 4, i), "Set a field past the end of the MP");
+    fail_unless(omlc_row_set_vector(row, 3, &i, 1), "Set a vector into a double field");
+    fail_if(omlc_row_set_uint32(row, 0, i), "Cannot set uint32 field");
+    fail_if(omlc_row_set_string(row, 1, label), "Cannot set string field");
+    if (i % 2) {
+      /* Leave the other fields unset every other sample */
+      fail_if(omlc_row_set_blob(row, 2, payload, sizeof(payload)), "Cannot set blob field");
+      fail_if(omlc_row_set_double(row, 3, i / 2.), "Cannot set double field");
+    }
+    fail_if(omlc_row_commit(row), "omlc_row_commit() failed");
+    fail_unless(omlc_row_commit(row), "omlc_row_commit() succeeded twice");
+
+    omlc_set_uint32(v[0], i);
+    omlc_set_const_string(v[1], label);
+    omlc_set_blob_ptr(v[2], i % 2 ? payload : NULL);
+    omlc_set_blob_length(v[2], i % 2 ? sizeof(payload) : 0);
+    omlc_set_double(v[3], i % 2 ? i / 2. : 0.);
+    fail_if(omlc_inject(mp_inject, v), "omlc_inject() failed");
+  }
+
+  fail_if(omlc_close(), "Error closing OML");
+
+  fp = fopen("test_api_row", "r");
+  fail_unless(fp != NULL, "Output file test_api_row missing");
+  while(fgets(buf, sizeof(buf), fp)) {
+    if (!strncmp(buf, "schema: ", 8) && strstr(buf, "_row seq:uint32")) {
+      schema_row = atoi(buf + 8);
+
+    } else if (!strncmp(buf, "schema: ", 8) && strstr(buf, "_inject seq:uint32")) {
+      schema_inject = atoi(buf + 8);
+
+    } else if (sscanf(buf, "%*f\t%d\t%*u\t", &s) == 1) {
+      /* Compare everything after the timestamp, schema and sequence number */
+      data = strchr(strchr(strchr(buf, '\t') + 1, '\t') + 1, '\t');
+      if (s == schema_row && nrows < 10) {
+        rows[nrows++] = strdup(data);
+      } else if (s == schema_inject && ninjected < 10) {
+        injected[ninjected++] = strdup(data);
+      }
+    }
+  }
+  fclose(fp);
+
+  fail_unless(nrows == 10, "Received %d rows out of 10", nrows);
+  fail_unless(ninjected == 10, "Received %d injected samples out of 10", ninjected);
+  for (i = 0; i < 10; i++) {
+    fail_if(strcmp(rows[i], injected[i]), "Row '%s' differs from injected sample '%s'", rows[i], injected[i]);
+    free(rows[i]);
+    free(injected[i]);
+  }
+}
+END_TEST
+
+START_TEST(test_api_protocol_batch)
+{
+  OmlMP *mp;
+  OmlValueU v[2];
+  OmlValue values[2], other[16];
+  OmlBinStreamState states[OMB_MAX_STREAMS];
+  OmlBinaryHeader header;
+  MBuffer *mbuf = mbuf_create();
+  uint32_t i, last_seq = 0;
+  int schema = -1, received = 0, batches = 0, r;
+  char buf[65536], *data;
+  size_t len;
+  FILE *fp;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  const char* argv[] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_protocol_batch",
+    "--oml-binary",
+    "--oml-protocol", "8",
+    "--oml-log-level", "2"};
+  int argc = 12;
+
+  unlink("test_api_protocol_batch");
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("proto", ring_mpdef);
+  fail_if(mp == NULL, "Failed to add MP");
+  fail_if(omlc_start(), "Error starting OML");
+
+  omlc_zero_array(v, 2);
+  for (i = 0; i < 100; i++) {
+    omlc_set_uint32(v[0], 0);
+    omlc_set_uint32(v[1], i + 1);
+    fail_if(omlc_inject(mp, v), "Injection of sample %d failed", i + 1);
+  }
+
+  fail_if(omlc_close(), "Error closing OML");
+
+  fp = fopen("test_api_protocol_batch", "r");
+  fail_unless(fp != NULL, "Output file test_api_protocol_batch missing");
+  len = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[len] = 0;
+
+  fail_unless(strstr(buf, "protocol: 8\n") != NULL, "Protocol 8 not advertised");
+  data = strstr(buf, "\n\n");
+  fail_unless(data != NULL, "End of headers not found");
+  data += 2;
+  for (r = 0; r < (int)len && buf + r < data; ) {
+    char *eol = strchr(buf + r, '\n');
+    if (!strncmp(buf + r, "schema: ", 8) && strstr(buf + r, "_proto thread:uint32 seq:uint32") < eol) {
+      schema = atoi(buf + r + 8);
+    }
+    r = eol - buf + 1;
+  }
+  fail_unless(schema > 0, "Schema for MP not found");
+
+  memset(states, 0, sizeof(states));
+  oml_value_array_init(values, 2);
+  oml_value_array_init(other, LENGTH(other));
+  mbuf_write(mbuf, (uint8_t*)data, len - (data - buf));
+  while (unmarshal_init2(mbuf, &header, states) == 1) {
+    if (header.stream != schema) {
+      /* Metadata and instrumentation */
+      for (r = 0; r < header.rows; r++) {
+        fail_if(header.type == OMB_BATCH_P && unmarshal_batch_row(mbuf, &header, states),
+            "Cannot read row %d of batch for stream %d", r, header.stream);
+        fail_unless(unmarshal_values(mbuf, &header, other, LENGTH(other)) > 0,
+            "Cannot read sample for stream %d", header.stream);
+      }
+      mbuf_consume_message(mbuf);
+      continue;
+    }
+
+    fail_unless(header.type == OMB_BATCH_P, "Sample for MP not in a batch (type %d)", header.type);
+    batches++;
+    for (r = 0; r < header.rows; r++) {
+      fail_if(unmarshal_batch_row(mbuf, &header, states), "Cannot read row %d of batch", r);
+      fail_unless(unmarshal_values(mbuf, &header, values, 2) == 2, "Cannot read values of row %d", r);
+      fail_unless((uint32_t)header.seqno == last_seq + 1,
+          "Sample %d received after %u", header.seqno, last_seq);
+      fail_unless(omlc_get_uint32(*oml_value_get_value(&values[1])) == (uint32_t)header.seqno,
+          "Sample %d contains %u", header.seqno, omlc_get_uint32(*oml_value_get_value(&values[1])));
+      last_seq = header.seqno;
+      received++;
+    }
+    mbuf_consume_message(mbuf);
+  }
+  oml_value_array_reset(values, 2);
+  oml_value_array_reset(other, LENGTH(other));
+  mbuf_destroy(mbuf);
+
+  fail_unless(received == 100, "Received %d samples out of 100", received);
+  fail_unless(batches < received, "%d batches for %d samples", batches, received);
+}
+END_TEST
+
+#define INTERVAL_MPS 20
+#define INTERVAL_PERIODS 10
+
+START_TEST(test_api_interval)
+{
+  OmlMP *mp[INTERVAL_MPS];
+  OmlValueU v[2];
+  static char names[INTERVAL_MPS][16];
+  int i, j, schema, count[INTERVAL_MPS], first_schema = -1;
+  double ts, first_ts[INTERVAL_MPS], last_ts[INTERVAL_MPS];
+  char buf[1024];
+  FILE *fp;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  const char* argv[] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_interval",
+    "--oml-interval", "0.1",
+    "--oml-log-level", "2"};
+  int argc = 11;
+
+  unlink("test_api_interval");
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL), "Error initialising OML");
+  for (i = 0; i < INTERVAL_MPS; i++) {
+    snprintf(names[i], sizeof(names[i]), "interval%d", i);
+    mp[i] = omlc_add_mp(names[i], ring_mpdef);
+    fail_if(mp[i] == NULL, "Failed to add MP %s", names[i]);
+    count[i] = 0;
+  }
+  fail_if(omlc_start(), "Error starting OML");
+
+  omlc_zero_array(v, 2);
+  for (j = 0; j < INTERVAL_PERIODS * 10; j++) {
+    for (i = 0; i < INTERVAL_MPS; i++) {
+      omlc_set_uint32(v[0], i);
+      omlc_set_uint32(v[1], j);
+      omlc_inject(mp[i], v);
+    }
+    usleep(10000);
+  }
+
+  /* Periodic reports are produced without any further injection */
+  usleep(50000);
+  fail_if(omlc_close(), "Error closing OML");
+
+  fp = fopen("test_api_interval", "r");
+  fail_unless(fp != NULL, "Output file test_api_interval missing");
+  while(fgets(buf, sizeof(buf), fp)) {
+    if (!strncmp(buf, "schema: ", 8) && strstr(buf, "_interval0 ")) {
+      first_schema = atoi(buf + 8);
+
+    } else if (first_schema >= 0 && sscanf(buf, "%lf\t%d", &ts, &schema) == 2 &&
+        schema >= first_schema && schema < first_schema + INTERVAL_MPS) {
+      i = schema - first_schema;
+      if (!count[i]++) {
+        first_ts[i] = ts;
+      }
+      last_ts[i] = ts;
+    }
+  }
+  fclose(fp);
+
+  for (i = 0; i < INTERVAL_MPS; i++) {
+    /* The last report is the partial sample reported by omlc_close */
+    fail_unless(count[i] >= INTERVAL_PERIODS && count[i] <= INTERVAL_PERIODS + 2,
+        "MS %d reported %d times in %d periods", i, count[i], INTERVAL_PERIODS);
+    /* Absolute deadlines: no drift accumulated over the periods */
+    fail_unless(fabs(last_ts[i] - first_ts[i] - (count[i] - 1) * 0.1) < 0.05 ||
+        fabs(last_ts[i] - first_ts[i] - (count[i] - 2) * 0.1) < 0.05,
+        "MS %d drifted: %d reports in %fs", i, count[i], last_ts[i] - first_ts[i]);
+  }
+}
+END_TEST
+
+#define RING_THREADS 4
+#define RING_INJECTS 1000
+/** Size of a batch larger than an injection ring */
+#define RING_BATCH 3000
+
+typedef struct {
+  OmlMP *mp;
+  uint32_t id;
+  int injected;
+} RingInjector;
+
+static void*
+ring_injector_start(void *arg)
+{
+  RingInjector *inj = (RingInjector*)arg;
+  OmlValueU v[2];
+  uint32_t seq;
+
+  omlc_zero_array(v, 2);
+  omlc_set_uint32(v[0], inj->id);
+  for (seq = 1; seq <= RING_INJECTS; seq++) {
+    omlc_set_uint32(v[1], seq);
+    if (!omlc_inject(inj->mp, v)) {
+      inj->injected++;
+    }
+  }
+  return NULL;
+}
+
+START_TEST(test_api_inject_ring)
+{
+  OmlMP *mp;
+  RingInjector inj[RING_THREADS];
+  pthread_t threads[RING_THREADS];
+  OmlValueU rows[2 * RING_BATCH];
+  uint32_t last_seq[RING_THREADS + 1], thread, seq;
+  int i, schema = -1, s, received = 0, injected = 0, res;
+  char buf[1024];
+  FILE *fp;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  const char* argv[] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_inject_ring",
+    "--oml-inject-mode", "ring",
+    "--oml-bufsize", "1000000", /* Make sure the BufferedWriter doesn't drop anything */
+    "--oml-log-level", "2"};
+  int argc = 13;
+
+  unlink("test_api_inject_ring");
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL), "Error initialising OML");
+  fail_unless(argc == 1, "--oml-inject-mode was not removed from the command line");
+  fail_unless(omlc_instance->inject_mode == IM_Ring, "Ring injection mode not selected");
+
+  mp = omlc_add_mp("ring", ring_mpdef);
+  fail_if(mp == NULL, "Failed to add MP");
+  fail_if(omlc_start(), "Error starting OML");
+
+  for (i = 0; i < RING_THREADS; i++) {
+    inj[i].mp = mp;
+    inj[i].id = i;
+    inj[i].injected = 0;
+    pthread_create(&threads[i], NULL, ring_injector_start, &inj[i]);
+  }
+  for (i = 0; i < RING_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    injected += inj[i].injected;
+    last_seq[i] = 0;
+  }
+  fail_if(injected == 0, "No sample could be queued");
+
+  /* Samples of a batch which do not fit in the ring are dropped, not the rest
+   * of the batch; this thread's ring is drained independently of the others */
+  last_seq[RING_THREADS] = 0;
+  omlc_zero_array(rows, 2 * RING_BATCH);
+  for (i = 0; i < RING_BATCH; i++) {
+    omlc_set_uint32(rows[2 * i], RING_THREADS);
+    omlc_set_uint32(rows[2 * i + 1], i + 1);
+  }
+  res = omlc_inject_batch(mp, rows, RING_BATCH);
+  fail_unless(res <= 0 && res > -RING_BATCH, "Invalid result for a batch of %d samples: %d", RING_BATCH, res);
+  injected += RING_BATCH + res;
+
+  fail_if(omlc_close(), "Error closing OML");
+
+  fp = fopen("test_api_inject_ring", "r");
+  fail_unless(fp != NULL, "Output file test_api_inject_ring missing");
+  while(fgets(buf, sizeof(buf), fp)) {
+    if (!strncmp(buf, "schema: ", 8) && strstr(buf, "_ring thread:uint32 seq:uint32")) {
+      schema = atoi(buf + 8);
+
+    } else if (schema >= 0 &&
+        sscanf(buf, "%*f\t%d\t%*u\t%u\t%u", &s, &thread, &seq) == 3 && s == schema) {
+      fail_unless(thread <= RING_THREADS, "Unexpected thread id %u", thread);
+      fail_unless(seq > last_seq[thread],
+          "Sample %u from thread %u received after %u", seq, thread, last_seq[thread]);
+      last_seq[thread] = seq;
+      received++;
+    }
+  }
+  fclose(fp);
+
+  fail_unless(received == injected, "Received %d samples, but %d were queued", received, injected);
+}
+END_TEST
+
+static OmlMPDef shared_mpdef [] = {
+  { "seq", OML_UINT32_VALUE, NULL },
+  { "label", OML_STRING_VALUE, NULL },
+  { "half", OML_DOUBLE_VALUE, NULL },
+  { NULL, (OmlValueT)0, NULL }
+};
+
+/** Protocols tested with writers sharing their encoding */
+static int shared_protocols[] = { 5, OMB_COMPACT_PROTOCOL, OMB_BATCH_PROTOCOL };
+
+#define SHARED_SAMPLES 40
+/** Sample after which a writer is added */
+#define SHARED_LATE 10
+/** Sample from which the samples go through the filters */
+#define SHARED_FILTERED 20
+
+/** Read the samples of a stream written by a binary writer, and check their values.
+ *
+ * \param file file written by the writer
+ * \param stream index of the stream
+ * \param[out] ts timestamps of the samples, by sequence number
+ * \return the sequence number of the first sample, or -1 if none was found
+ */
+static int
+read_shared_bin(const char *file, int stream, double *ts)
+{
+  OmlValue values[LENGTH(shared_mpdef) - 1], other[16];
+  OmlBinStreamState states[OMB_MAX_STREAMS];
+  OmlBinaryHeader header;
+  MBuffer *mbuf = mbuf_create();
+  char buf[65536], *data, label[32];
+  int r, first = -1, last = 0, batched;
+  size_t len;
+  FILE *fp;
+
+  fp = fopen(file, "r");
+  fail_unless(fp != NULL, "Output file %s missing", file);
+  len = fread(buf, 1, sizeof(buf) - 1, fp);
+  fclose(fp);
+  buf[len] = 0;
+  data = strstr(buf, "\n\n");
+  fail_unless(data != NULL, "End of headers not found in %s", file);
+  data += 2;
+
+  memset(states, 0, sizeof(states));
+  oml_value_array_init(values, LENGTH(values));
+  oml_value_array_init(other, LENGTH(other));
+  mbuf_write(mbuf, (uint8_t*)data, len - (data - buf));
+  while (unmarshal_init2(mbuf, &header, states) == 1) {
+    batched = (OMB_BATCH_P == header.type || OMB_LBATCH_P == header.type);
+    for (r = 0; r < header.rows; r++) {
+      fail_if(batched && unmarshal_batch_row(mbuf, &header, states),
+          "%s: cannot read row %d of batch for stream %d", file, r, header.stream);
+      if (header.stream != stream) {
+        /* Metadata and instrumentation */
+        fail_unless(unmarshal_values(mbuf, &header, other, LENGTH(other)) > 0,
+            "%s: cannot read sample for stream %d", file, header.stream);
+        continue;
+      }
+
+      fail_unless(unmarshal_values(mbuf, &header, values, LENGTH(values)) == LENGTH(values),
+          "%s: cannot read values of sample %d", file, header.seqno);
+      fail_unless(first < 0 || header.seqno == last + 1,
+          "%s: sample %d received after %d", file, header.seqno, last);
+      fail_unless(header.seqno > 0 && header.seqno <= SHARED_SAMPLES,
+          "%s: unexpected sample %d", file, header.seqno);
+      snprintf(label, sizeof(label), "sample %d", header.seqno);
+      fail_unless(omlc_get_uint32(*oml_value_get_value(&values[0])) == (uint32_t)header.seqno &&
+          !strcmp(omlc_get_string_ptr(*oml_value_get_value(&values[1])), label) &&
+          omlc_get_double(*oml_value_get_value(&values[2])) == header.seqno * 0.5,
+          "%s: invalid values for sample %d", file, header.seqno);
+      if (first < 0) {
+        first = header.seqno;
+      }
+      last = header.seqno;
+      ts[last] = header.timestamp;
+    }
+    mbuf_consume_message(mbuf);
+  }
+  fail_unless(last == SHARED_SAMPLES, "%s: last sample is %d, expected %d", file, last, SHARED_SAMPLES);
+
+  oml_value_array_reset(values, LENGTH(values));
+  oml_value_array_reset(other, LENGTH(other));
+  mbuf_destroy(mbuf);
+  return first;
+}
+
+/** Read a whole file into an oml_malloc'd buffer */
+static char*
+read_shared_file(const char *file, size_t *len)
+{
+  char *buf = oml_malloc(65536);
+  FILE *fp = fopen(file, "r");
+
+  fail_unless(buf != NULL && fp != NULL, "Output file %s missing", file);
+  *len = fread(buf, 1, 65535, fp);
+  buf[*len] = 0;
+  fclose(fp);
+  return buf;
+}
+
+/** Check that writers sharing the encoding of the samples of an MS output the
+ * same data as writers marshalling them on their own, each with its own
+ * sequence of headers, delta-encoded against what it sent itself */
+START_TEST(test_api_shared_encoding)
+{
+  enum { BIN0, BIN1, BIN_REF, TXT0, TXT1, TXT_REF, BIN_LATE, BIN_LATE_REF, NWRITERS };
+  const char *kind[NWRITERS] = { "bin0", "bin1", "binref", "txt0", "txt1", "txtref", "binlate", "binlateref" };
+  OmlWriter *w[NWRITERS];
+  char files[NWRITERS][64], proto[4], label[32];
+  double ts[NWRITERS][SHARED_SAMPLES + 1];
+  char *text[3];
+  size_t len[3];
+  OmlMStream *ms;
+  OmlMP *mp;
+  OmlValueU v[3];
+  int i, first, stream, samples = 0;
+  char *line;
+
+  o_set_log_level (2);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(proto, sizeof(proto), "%d", shared_protocols[_i]);
+  for (i = 0; i < NWRITERS; i++) {
+    snprintf(files[i], sizeof(files[i]), "test_api_shared_encoding_%d_%s", shared_protocols[_i], kind[i]);
+    unlink(files[i]);
+  }
+  const char* argv[] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_shared_encoding",
+    "--oml-samples", "1",
+    "--oml-protocol", proto,
+    "--oml-bufsize", "1000000", /* Make sure the BufferedWriters don't drop anything */
+    "--oml-log-level", "2"};
+  int argc = 15;
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("shared", shared_mpdef);
+  fail_if(mp == NULL, "Failed to add MP");
+
+  /* As a configuration file would, with several collection points */
+  for (i = 0; i < NWRITERS; i++) {
+    char uri[80];
+    snprintf(uri, sizeof(uri), "file:%s", files[i]);
+    w[i] = create_writer(uri, (i >= TXT0 && i <= TXT_REF) ? SE_Text : SE_Binary);
+    fail_if(w[i] == NULL, "Cannot create writer %s", uri);
+  }
+  /* The reference writers marshal samples on their own */
+  w[BIN_REF]->encode = NULL;
+  w[TXT_REF]->encode = NULL;
+  w[BIN_LATE_REF]->encode = NULL;
+
+  omlc_instance->default_writer = w[BIN0];
+  ms = oml_mp_get_default_ms(mp);
+  fail_if(ms == NULL, "Cannot create default MS");
+  for (i = BIN1; i <= TXT_REF; i++) {
+    fail_if(oml_ms_add_writer(ms, w[i]), "Cannot add writer %s", kind[i]);
+  }
+  fail_if(omlc_start(), "Error starting OML");
+  stream = ms->index;
+
+  omlc_zero_array(v, 3);
+  for (i = 1; i <= SHARED_SAMPLES; i++) {
+    if (SHARED_LATE + 1 == i) {
+      /* These writers start delta-encoding headers from this sample */
+      fail_if(oml_ms_add_writer(ms, w[BIN_LATE]), "Cannot add late writer");
+      fail_if(oml_ms_add_writer(ms, w[BIN_LATE_REF]), "Cannot add late reference writer");
+    } else if (SHARED_FILTERED + 1 == i) {
+      /* Have the filters output their results one by one, rather than
+       * marshalling the injected sample as is */
+      ms->passthrough = -1;
+    }
+    snprintf(label, sizeof(label), "sample %d", i);
+    omlc_set_uint32(v[0], i);
+    omlc_set_const_string(v[1], label);
+    omlc_set_double(v[2], i * 0.5);
+    fail_if(omlc_inject(mp, v), "Injection of sample %d failed", i);
+  }
+
+  fail_if(omlc_close(), "Error closing OML");
+
+  /* Binary writers all output all samples, at the same time as the reference */
+  for (i = BIN0; i <= BIN_REF; i++) {
+    first = read_shared_bin(files[i], stream, ts[i]);
+    fail_unless(first == 1, "%s: first sample is %d, expected 1", files[i], first);
+  }
+  for (i = BIN_LATE; i <= BIN_LATE_REF; i++) {
+    first = read_shared_bin(files[i], stream, ts[i]);
+    fail_unless(first == SHARED_LATE + 1, "%s: first sample is %d, expected %d",
+        files[i], first, SHARED_LATE + 1);
+  }
+  for (i = 1; i <= SHARED_SAMPLES; i++) {
+    fail_unless(ts[BIN0][i] == ts[BIN_REF][i] && ts[BIN1][i] == ts[BIN_REF][i],
+        "Timestamps of sample %d differ: %f, %f, expected %f", i, ts[BIN0][i], ts[BIN1][i], ts[BIN_REF][i]);
+    fail_unless(i <= SHARED_LATE ||
+        (ts[BIN_LATE][i] == ts[BIN_REF][i] && ts[BIN_LATE_REF][i] == ts[BIN_REF][i]),
+        "Timestamps of sample %d differ for late writers: %f, %f, expected %f",
+        i, ts[BIN_LATE][i], ts[BIN_LATE_REF][i], ts[BIN_REF][i]);
+  }
+
+  /* Full packets do not depend on what was sent before; the default writer
+   * also gets the instrumentation streams */
+  if (shared_protocols[_i] < OMB_COMPACT_PROTOCOL) {
+    int pairs[][2] = { { BIN1, BIN_REF }, { BIN_LATE, BIN_LATE_REF } };
+    for (i = 0; i < (int)LENGTH(pairs); i++) {
+      text[0] = read_shared_file(files[pairs[i][0]], &len[0]);
+      text[1] = read_shared_file(files[pairs[i][1]], &len[1]);
+      fail_unless(len[0] == len[1] && !memcmp(text[0], text[1], len[0]),
+          "%s differs from %s", files[pairs[i][0]], files[pairs[i][1]]);
+      oml_free(text[0]);
+      oml_free(text[1]);
+    }
+  }
+
+  /* Text writers all output the same */
+  for (i = 0; i < 3; i++) {
+    text[i] = read_shared_file(files[TXT0 + i], &len[i]);
+  }
+  fail_unless(len[0] == len[2] && !memcmp(text[0], text[2], len[0]),
+      "%s differs from %s", files[TXT0], files[TXT_REF]);
+  fail_unless(len[1] == len[2] && !memcmp(text[1], text[2], len[1]),
+      "%s differs from %s", files[TXT1], files[TXT_REF]);
+  line = strstr(text[2], "\n\n");
+  fail_unless(line != NULL, "End of headers not found in %s", files[TXT_REF]);
+  for (line += 2; line && *line; line = strchr(line, '\n') ? strchr(line, '\n') + 1 : NULL) {
+    int s, seq;
+    if (sscanf(line, "%*f\t%d\t%d\t", &s, &seq) == 2 && s == stream) {
+      fail_unless(seq == ++samples, "%s: sample %d received after %d", files[TXT_REF], seq, samples - 1);
+    }
+  }
+  fail_unless(samples == SHARED_SAMPLES, "%s: received %d samples out of %d",
+      files[TXT_REF], samples, SHARED_SAMPLES);
+  for (i = 0; i < 3; i++) {
+    oml_free(text[i]);
+  }
+}
+END_TEST
+
 Suite*
 api_suite (void)
 {
@@ -239,6 +936,12 @@ api_suite (void)
   TCase* tc_api_func = tcase_create("ApiFunctions");
   tcase_add_test(tc_api_func, test_api_basic);
   tcase_add_test(tc_api_func, test_api_metadata);
+  tcase_add_test(tc_api_func, test_api_inject_batch);
+  tcase_add_test(tc_api_func, test_api_row);
+  tcase_add_test(tc_api_func, test_api_inject_ring);
+  tcase_add_test(tc_api_func, test_api_protocol_batch);
+  tcase_add_test(tc_api_func, test_api_interval);
+  tcase_add_loop_test(tc_api_func, test_api_shared_encoding, 0, LENGTH(shared_protocols));
   suite_add_tcase (s, tc_api_func);
 
   return s;
@@ -142,6 +142,63 @@ START_TEST (test_config_empty_collect)
 }
 END_TEST
 
+/** Check that the spill and overflow attributes of <collect /> are accepted, and set up a spill file */
+START_TEST (test_config_spill)
+{
+  OmlMP *mp;
+  OmlValueU v[2];
+  char buf[1024];
+  char config[] = "<omlc domain='check_liboml2_config' id='test_config_spill'>\n"
+                  "  <collect url='file:test_config_spill' encoding='text'"
+                  " spill='test_config_spill.spill' spill-quota='1M' spill-sync='2' overflow='drop-newest' />\n"
+                  "</omlc>";
+  int datafound = 0;
+  FILE *fp;
+
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_config_spill");
+  argv[1] = "--oml-config";
+  argv[2] = "test_config_spill.xml";
+  argc = 3;
+
+  fp = fopen (argv[2], "w");
+  fail_unless(fp != NULL, "Could not create configuration file %s: %s", argv[2], strerror(errno));
+  fail_unless(fwrite(config, sizeof(config), 1, fp) == 1,
+      "Could not write configuration in file %s: %s", argv[2], strerror(errno));
+  fclose(fp);
+
+  unlink("test_config_spill");
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL),
+      "Could not initialise OML");
+  mp = omlc_add_mp(__FUNCTION__, mp_def);
+  fail_if(mp==NULL, "Could not add MP");
+  fail_if(omlc_start(), "Could not start OML");
+  fail_unless(access("test_config_spill.spill", F_OK) == 0, "Spill file not created");
+
+  omlc_set_uint32(v[0], 1);
+  omlc_set_uint32(v[1], 2);
+
+  fail_if(omlc_inject(mp, v), "Injection failed");
+
+  omlc_close();
+  fail_unless(access("test_config_spill.spill", F_OK) < 0, "Empty spill file not removed");
+
+  fp = fopen(__FUNCTION__, "r");
+  fail_unless(fp != NULL, "Output file %s missing", __FUNCTION__);
+
+  while(fgets(buf, sizeof(buf), fp) && !datafound) {
+    if (strstr(buf, "\t1\t2\n")) {
+        datafound = 1;
+    }
+  }
+  fail_unless(datafound, "Injected sample not found");
+
+  fclose(fp);
+}
+END_TEST
+
 /** Check that multiple <collect /> do not trigger a "Measurement stream 'd_lin' already exists" error (#1154) */
 START_TEST (test_config_multi_collect)
 {
@@ -231,6 +288,7 @@ config_suite (void)
   tcase_add_test (tc_config, test_config_metadata);
   tcase_add_test (tc_config, test_config_empty_collect);
   tcase_add_test (tc_config, test_config_multi_collect);
+  tcase_add_test (tc_config, test_config_spill);
 
   suite_add_tcase (s, tc_config);
 
@@ -23,6 +23,7 @@
 
 #define _GNU_SOURCE  /* For NAN */
 #include <math.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <check.h>
@@ -35,7 +36,9 @@
 #include "filter/stddev_filter.h"
 #include "filter/sum_filter.h"
 #include "filter/delta_filter.h"
+#include "filter/quantile_filter.h"
 #include "oml2/oml_writer.h"
+#include "oml_value.h"
 #include "check_util.h"
 
 typedef struct OmlAvgFilterInstanceData AvgInstanceData;
@@ -44,6 +47,7 @@ typedef struct OmlHistFilterInstanceData HistInstanceData;
 typedef struct OmlStddevFilterInstanceData StddevInstanceData;
 typedef struct OmlSumFilterInstanceData SumInstanceData;
 typedef struct OmlDeltaFilterInstanceData DeltaInstanceData;
+typedef struct OmlQuantileFilterInstanceData QuantileInstanceData;
 
 
 /* Fixtures */
@@ -210,7 +214,6 @@ END_TEST
 /********************************************************************************/
 
 
-# if 0
 START_TEST (test_filter_hist_create)
 {
   /*
@@ -218,6 +221,7 @@ START_TEST (test_filter_hist_create)
    */
   OmlFilter* f = NULL;
   HistInstanceData* data = NULL;
+  int i;
 
   f = create_filter ("histogram", "histograminst", OML_INT32_VALUE, NULL, 2);
 
@@ -226,19 +230,147 @@ START_TEST (test_filter_hist_create)
 
   fail_unless (f->index == 2);
   fail_unless (f->input_type == OML_INT32_VALUE);
+  fail_unless (f->output_count == 1);
+  fail_unless (f->definition[0].type == OML_VECTOR_UINT64_VALUE);
 
   data = (HistInstanceData*)f->instance_data;
 
-  /* Sample count should be 0; accumulator, min and max should NaN. */
-  fail_unless (isnan(instdata->sample_sum));
-  fail_unless (instdata->sample_count == 0);
-  fail_unless (isnan(instdata->sample_min), "Initial min val should be %f, but actually was %f", NAN, instdata->sample_min);
-  fail_unless (isnan(instdata->sample_max), "Initial min val should be %f, but actually was %f", NAN, instdata->sample_max);
+  /* Default boundaries, and all buckets (including under- and overflow) empty */
+  fail_unless (data->sample_count == 0);
+  fail_unless (data->min == HISTOGRAM_DEFAULT_MIN);
+  fail_unless (data->max == HISTOGRAM_DEFAULT_MAX);
+  fail_unless (data->buckets == HISTOGRAM_DEFAULT_BUCKETS);
+  fail_unless (data->scale == HISTOGRAM_LINEAR);
+  for (i = 0; i < data->buckets + 2; i++) {
+    fail_unless (data->counts[i] == 0, "Bucket %d not empty: %" PRIu64, i, data->counts[i]);
+  }
+
+  fail_unless (destroy_filter(f) == NULL);
+}
+END_TEST
+
+/** Set a property of a filter, as parse_filter_properties would */
+static int
+hist_set (OmlFilter* f, const char* name, const char* type, const char* value)
+{
+  OmlValue v;
+  int ret;
+
+  oml_value_init (&v);
+  fail_if (oml_value_from_typed_s (&v, type, value), "Cannot parse %s '%s'", type, value);
+  ret = f->set (f, name, &v);
+  oml_value_reset (&v);
+
+  return ret;
+}
+
+/** OmlWriter keeping the last values output to it */
+typedef struct {
+  OmlWriter writer;
+  OmlValue* values;
+  int count;
+} HistTestWriter;
+
+static int
+hist_writer_out (OmlWriter* writer, OmlValue* values, int value_count)
+{
+  ((HistTestWriter*)writer)->values = values;
+  ((HistTestWriter*)writer)->count = value_count;
+  return 0;
+}
+
+/** Feed n samples to a histogram filter, and check the counts it outputs
+ *
+ * \param f histogram filter
+ * \param type type of the samples
+ * \param input array of n samples of C type matching type
+ * \param n number of samples
+ * \param expected array of nbuckets expected counts, including under- and overflow
+ * \param nbuckets length of expected
+ */
+static void
+run_hist_test (OmlFilter* f, OmlValueT type, void* input, int n, uint64_t* expected, int nbuckets)
+{
+  TestVector* v_input = make_test_vector (input, type, n);
+  HistTestWriter w;
+  OmlValue v;
+  uint64_t *counts;
+  int i, j;
+
+  memset (&w, 0, sizeof (w));
+  w.writer.out = hist_writer_out;
+  oml_value_init (&v);
+  oml_value_set_type (&v, type);
+
+  /* Second pass checks that newwindow empties all buckets */
+  for (j = 0; j < 2; j++) {
+    for (i = 0; j == 0 && i < n; i++) {
+      v.value = v_input->vector[i];
+      fail_unless (f->input (f, &v) == 0);
+    }
+    f->output (f, &w.writer);
+    f->newwindow (f);
+
+    fail_unless (w.count == 1);
+    fail_unless (oml_value_get_type (&w.values[0]) == OML_VECTOR_UINT64_VALUE);
+    fail_unless (omlc_get_vector_nof_elts (*oml_value_get_value (&w.values[0])) == (size_t)nbuckets,
+        "Expected %d buckets, got %zu", nbuckets, omlc_get_vector_nof_elts (*oml_value_get_value (&w.values[0])));
+    counts = (uint64_t*)omlc_get_vector_ptr (*oml_value_get_value (&w.values[0]));
+    for (i = 0; i < nbuckets; i++) {
+      fail_unless (counts[i] == (j ? 0 : expected[i]),
+          "Pass %d: bucket %d has %" PRIu64 " samples instead of %" PRIu64,
+          j, i, counts[i], j ? 0 : expected[i]);
+    }
+  }
+  /* The vector was not copied */
+  memset (&v, 0, sizeof (v));
+}
+
+START_TEST (test_filter_hist_linear)
+{
+  /*
+   * Check that samples are counted in the right linear bucket
+   */
+  int32_t input [] = { -3, 0, 1, 2, 3, 9, 10, 42 };
+  /* Below 0, five buckets 2 wide, and above 10 */
+  uint64_t output [] = { 1, 2, 2, 0, 0, 1, 2 };
+  OmlFilter* f = create_filter ("histogram", "histograminst", OML_INT32_VALUE, NULL, 2);
+
+  fail_if (f == NULL);
+  /* Properties can be given in any order */
+  fail_unless (hist_set (f, "max", "double", "10") == 0);
+  fail_unless (hist_set (f, "buckets", "uint32", "5") == 0);
+  fail_unless (hist_set (f, "min", "int32", "0") == 0);
+  fail_unless (hist_set (f, "scale", "string", "cubic") == -1);
+  fail_unless (hist_set (f, "buckets", "uint32", "0") == -1);
+
+  run_hist_test (f, OML_INT32_VALUE, input, LENGTH (input), output, LENGTH (output));
+
+  fail_unless (destroy_filter(f) == NULL);
+}
+END_TEST
+
+START_TEST (test_filter_hist_log)
+{
+  /*
+   * Check that samples are counted in the right logarithmic bucket
+   */
+  double input [] = { 0., -1., NAN, 0.5, 1., 9.99, 20., 500., 1000., 1e6 };
+  /* Below 1 (including NaN), [1, 10[, [10, 100[, [100, 1000[, and above 1000 */
+  uint64_t output [] = { 4, 2, 1, 1, 2 };
+  OmlFilter* f = create_filter ("histogram", "histograminst", OML_DOUBLE_VALUE, NULL, 2);
+
+  fail_if (f == NULL);
+  fail_unless (hist_set (f, "scale", "string", "log") == 0);
+  fail_unless (hist_set (f, "min", "double", "1") == 0);
+  fail_unless (hist_set (f, "max", "double", "1000") == 0);
+  fail_unless (hist_set (f, "buckets", "int32", "3") == 0);
+
+  run_hist_test (f, OML_DOUBLE_VALUE, input, LENGTH (input), output, LENGTH (output));
 
   fail_unless (destroy_filter(f) == NULL);
 }
 END_TEST
-#endif
 
 /********************************************************************************/
 /*                          STDDEV FILTER TESTS                                 */
@@ -433,6 +565,101 @@ START_TEST (test_filter_delta_output)
 }
 END_TEST
 
+/********************************************************************************/
+/*                         QUANTILE FILTER TESTS                                */
+/********************************************************************************/
+
+START_TEST (test_filter_quantile_create)
+{
+  /*
+   * Create a quantile filter and check that it was correctly initialized.
+   */
+  OmlFilter* f = NULL;
+  QuantileInstanceData* data = NULL;
+
+  f = create_filter ("quantile", "quantileinst", OML_INT32_VALUE, NULL, 2);
+
+  fail_if (f == NULL, "Filter creation failed for `quantile' filter");
+  fail_if (f->instance_data == NULL, "Filter instance data is NULL");
+
+  fail_unless (f->index == 2);
+  fail_unless (f->input_type == OML_INT32_VALUE);
+  fail_unless (f->output_count == 2);
+  fail_unless (f->definition[0].type == OML_VECTOR_DOUBLE_VALUE);
+  fail_unless (f->definition[1].type == OML_BLOB_VALUE);
+
+  data = (QuantileInstanceData*)f->instance_data;
+
+  fail_unless (data->nquantiles == 4);
+  fail_unless (data->quantiles[0] == 0.5);
+  fail_unless (data->quantiles[3] == 0.999);
+  fail_unless (data->sketch->accuracy == DDSKETCH_DEFAULT_ACCURACY);
+  fail_unless (data->sketch->max_bins == DDSKETCH_DEFAULT_BINS);
+  fail_unless (ddsketch_count (data->sketch) == 0);
+
+  fail_unless (destroy_filter(f) == NULL);
+}
+END_TEST
+
+START_TEST (test_filter_quantile_output)
+{
+  /*
+   * Check the quantiles output by a quantile filter, and its serialised sketch
+   */
+  double expected [] = { 1., 500., 990., 1000. };
+  OmlFilter* f = create_filter ("quantile", "quantileinst", OML_UINT32_VALUE, NULL, 2);
+  HistTestWriter w;
+  OmlValue v;
+  DDSketch* sketch;
+  double* quantiles;
+  int i, j;
+
+  fail_if (f == NULL);
+  fail_unless (hist_set (f, "quantiles", "string", "0, 0.5 0.99,1") == 0);
+  fail_unless (hist_set (f, "bins", "uint32", "1024") == 0);
+  fail_unless (hist_set (f, "accuracy", "double", "0.005") == 0);
+  fail_unless (hist_set (f, "quantiles", "string", "0.5 1.5") == -1);
+  fail_unless (hist_set (f, "accuracy", "double", "1") == -1);
+
+  memset (&w, 0, sizeof (w));
+  w.writer.out = hist_writer_out;
+  oml_value_init (&v);
+
+  /* Second pass checks that newwindow empties the sketch */
+  for (j = 0; j < 2; j++) {
+    for (i = 1; j == 0 && i <= 1000; i++) {
+      oml_value_set_type (&v, OML_UINT32_VALUE);
+      omlc_set_uint32 (*oml_value_get_value (&v), i);
+      fail_unless (f->input (f, &v) == 0);
+    }
+    f->output (f, &w.writer);
+    f->newwindow (f);
+
+    fail_unless (w.count == 2);
+    fail_unless (omlc_get_vector_nof_elts (*oml_value_get_value (&w.values[0])) == LENGTH (expected));
+    quantiles = (double*)omlc_get_vector_ptr (*oml_value_get_value (&w.values[0]));
+    for (i = 0; i < (int)LENGTH (expected); i++) {
+      if (j) {
+        fail_unless (isnan (quantiles[i]), "Quantile %d of an empty window is %g", i, quantiles[i]);
+      } else {
+        fail_unless (fabs (quantiles[i] - expected[i]) <= 0.005 * expected[i],
+            "Quantile %d is %g instead of %g", i, quantiles[i], expected[i]);
+      }
+    }
+
+    sketch = ddsketch_decode (omlc_get_blob_ptr (*oml_value_get_value (&w.values[1])),
+        omlc_get_blob_length (*oml_value_get_value (&w.values[1])), 1024);
+    fail_if (sketch == NULL, "Could not decode sketch");
+    fail_unless (ddsketch_count (sketch) == (j ? 0 : 1000));
+    fail_unless (j || ddsketch_quantile (sketch, 0.99) == quantiles[2]);
+    ddsketch_free (sketch);
+  }
+
+  oml_value_reset (&v);
+  fail_unless (destroy_filter(f) == NULL);
+}
+END_TEST
+
 /********************************************************************************/
 /*                         MAIN TEST SUITE                                      */
 /********************************************************************************/
@@ -446,19 +673,21 @@ filters_suite (void)
   TCase* tc_filter = tcase_create ("FilterCore");
   TCase* tc_filter_avg = tcase_create ("FilterAverage");
   TCase* tc_filter_first = tcase_create ("FilterFirst");
-  //  TCase* tc_filter_hist = tcase_create ("FilterHistogram");
+  TCase* tc_filter_hist = tcase_create ("FilterHistogram");
   TCase* tc_filter_stddev = tcase_create ("FilterStddev");
   TCase* tc_filter_sum = tcase_create ("FilterSum");
   TCase* tc_filter_delta= tcase_create ("FilterDelta");
+  TCase* tc_filter_quantile = tcase_create ("FilterQuantile");
 
   /* Setup fixtures */
   tcase_add_checked_fixture (tc_filter,       filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_avg,   filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_first, filter_setup, filter_teardown);
-  //tcase_add_checked_fixture (tc_filter_hist,  filter_setup, filter_teardown);
+  tcase_add_checked_fixture (tc_filter_hist,  filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_stddev,filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_sum,filter_setup, filter_teardown);
   tcase_add_checked_fixture (tc_filter_delta,filter_setup, filter_teardown);
+  tcase_add_checked_fixture (tc_filter_quantile,filter_setup, filter_teardown);
 
   /* Add tests to test case "FilterCore" */
   tcase_add_test (tc_filter, test_filter_create);
@@ -471,7 +700,9 @@ filters_suite (void)
   tcase_add_test (tc_filter_first, test_filter_first_create);
 
   /* Add tests to test case "FilterHistogram" */
-  //tcase_add_test (tc_filter_hist, test_filter_hist_create);
+  tcase_add_test (tc_filter_hist, test_filter_hist_create);
+  tcase_add_test (tc_filter_hist, test_filter_hist_linear);
+  tcase_add_test (tc_filter_hist, test_filter_hist_log);
 
   /* Add tests to test case "FilterStddev" */
   tcase_add_test (tc_filter_stddev, test_filter_stddev_create);
@@ -486,14 +717,19 @@ filters_suite (void)
   tcase_add_test (tc_filter_delta, test_filter_delta_create);
   tcase_add_test (tc_filter_delta, test_filter_delta_output);
 
+  /* Add tests to test case "FilterQuantile" */
+  tcase_add_test (tc_filter_quantile, test_filter_quantile_create);
+  tcase_add_test (tc_filter_quantile, test_filter_quantile_output);
+
   /* Add the test cases to this test suite */
   suite_add_tcase (s, tc_filter);
   suite_add_tcase (s, tc_filter_avg);
   suite_add_tcase (s, tc_filter_first);
-  //suite_add_tcase (s, tc_filter_hist);
+  suite_add_tcase (s, tc_filter_hist);
   suite_add_tcase (s, tc_filter_stddev);
   suite_add_tcase (s, tc_filter_sum);
   suite_add_tcase (s, tc_filter_delta);
+  suite_add_tcase (s, tc_filter_quantile);
 
   return s;
 }
@@ -243,6 +243,32 @@ START_TEST (test_mbuf_write_null)
 }
 END_TEST
 
+START_TEST (test_mbuf_write_skip)
+{
+  char s[] = "abcdefgh";
+  MBuffer* mbuf = mbuf_create ();
+  size_t len = strlen (s);
+
+  fail_if (mbuf_write_skip (NULL, 1) != -1);
+
+  /* Data written directly at the write pointer, as recv(2) would */
+  fail_if (mbuf_check_resize (mbuf, 2 * mbuf->length) != 0);
+  memcpy (mbuf_wrptr (mbuf), s, len);
+  fail_unless (mbuf_write_skip (mbuf, len) == 0);
+  fail_unless (mbuf_fill (mbuf) == len);
+  fail_unless (mbuf_rd_remaining (mbuf) == len);
+  fail_unless (mbuf->wrptr == mbuf->base + len);
+  fail_unless (mbuf->wr_remaining == mbuf->length - len);
+  fail_if (memcmp (mbuf_rdptr (mbuf), s, len));
+
+  /* Cannot account for more than the remaining space */
+  fail_unless (mbuf_write_skip (mbuf, mbuf->wr_remaining + 1) == -1);
+  fail_unless (mbuf_fill (mbuf) == len);
+
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
 START_TEST (test_mbuf_read)
 {
   char s[8192];
@@ -632,6 +658,7 @@ mbuf_suite (void)
   tcase_add_test (tc_mbuf, test_mbuf_resize_contents);
   tcase_add_test (tc_mbuf, test_mbuf_write);
   tcase_add_test (tc_mbuf, test_mbuf_write_null);
+  tcase_add_test (tc_mbuf, test_mbuf_write_skip);
   tcase_add_test (tc_mbuf, test_mbuf_read);
   tcase_add_test (tc_mbuf, test_mbuf_read_null);
   tcase_add_test (tc_mbuf, test_mbuf_begin_read);
@@ -27,11 +27,17 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 #include <check.h>
 
 #include "mbuf.h"
 #include "client.h"
 #include "oml_util.h"
+#include "buffered_writer.h"
 
 /*
 START_TEST (test_bw_create)
@@ -113,22 +119,595 @@ START_TEST (test_fw_create_buffered)
 }
 END_TEST
 
+#define BW_THREADS 4
+#define BW_INJECTS 500
+#define SLOW_SINK_DELAY 100000
+#define MAX_INJECT_DELAY (SLOW_SINK_DELAY / 2)
+
+/** An OmlOutStream taking SLOW_SINK_DELAY us to write each chunk */
+typedef struct {
+  oml_outs_write_f write;
+  oml_outs_close_f close;
+  char *dest;
+
+  pthread_mutex_t lock;
+  uint32_t last_seq[BW_THREADS];
+  int received;
+  int reordered;
+} SlowOutStream;
+
+static size_t
+slow_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length)
+{
+  SlowOutStream *self = (SlowOutStream*)hdl;
+  uint32_t *msg = (uint32_t*)buffer;
+  size_t i;
+
+  usleep(SLOW_SINK_DELAY);
+
+  pthread_mutex_lock(&self->lock);
+  for (i = 0; i < length / (2 * sizeof(uint32_t)); i++, msg += 2) {
+    if (msg[1] <= self->last_seq[msg[0]]) {
+      self->reordered++;
+    }
+    self->last_seq[msg[0]] = msg[1];
+    self->received++;
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  return length;
+}
+
+static int
+slow_stream_close(OmlOutStream* hdl)
+{
+  (void)hdl;
+  return 0;
+}
+
+typedef struct {
+  BufferedWriterHdl bw;
+  uint32_t id;
+  long max_delay; /* us */
+} BwInjector;
+
+static void*
+bw_injector_start(void *arg)
+{
+  BwInjector *inj = (BwInjector*)arg;
+  struct timeval start, end;
+  uint32_t msg[2];
+  MBuffer *mbuf;
+  long delay;
+
+  msg[0] = inj->id;
+  for (msg[1] = 1; msg[1] <= BW_INJECTS; msg[1]++) {
+    gettimeofday(&start, NULL);
+    if ((mbuf = bw_get_write_buf(inj->bw, 1))) {
+      mbuf_write(mbuf, (uint8_t*)msg, sizeof(msg));
+      mbuf_begin_write(mbuf);
+      bw_msgcount_add(inj->bw, 1);
+      bw_unlock_buf(inj->bw);
+    }
+    gettimeofday(&end, NULL);
+
+    delay = (end.tv_sec - start.tv_sec) * 1000000 + end.tv_usec - start.tv_usec;
+    if (delay > inj->max_delay) {
+      inj->max_delay = delay;
+    }
+    usleep(1000);
+  }
+  return NULL;
+}
+
+START_TEST (test_bw_slow_stream)
+{
+  int i, lost = 0;
+  SlowOutStream os;
+  BwInjector inj[BW_THREADS];
+  pthread_t threads[BW_THREADS];
+  BufferedWriterHdl bw;
+
+  memset(&os, 0, sizeof(os));
+  os.write = slow_stream_write;
+  os.close = slow_stream_close;
+  os.dest = "slow";
+  pthread_mutex_init(&os.lock, NULL);
+
+  bw = bw_create((OmlOutStream*)&os, 8 * 512, 512);
+  fail_if(bw == NULL, "Cannot create BufferedWriter");
+
+  for (i = 0; i < BW_THREADS; i++) {
+    inj[i].bw = bw;
+    inj[i].id = i;
+    inj[i].max_delay = 0;
+    pthread_create(&threads[i], NULL, bw_injector_start, &inj[i]);
+  }
+  for (i = 0; i < BW_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+    fail_unless(inj[i].max_delay < MAX_INJECT_DELAY,
+        "Injection in thread %d blocked for %ldus behind a %dus write",
+        i, inj[i].max_delay, SLOW_SINK_DELAY);
+  }
+
+  lost = bw_nlost_reset(bw);
+  bw_close(bw);
+
+  fail_unless(os.reordered == 0, "%d messages were received out of order", os.reordered);
+  fail_unless(os.received + lost == BW_THREADS * BW_INJECTS,
+      "%d messages received and %d lost, out of %d",
+      os.received, lost, BW_THREADS * BW_INJECTS);
+}
+END_TEST
+
+#define SPILL_FILE "check_liboml2_spill.tmp"
+#define SPILL_INJECTS 2000
+
+/** An OmlOutStream failing all writes while it is down */
+typedef struct {
+  oml_outs_write_f write;
+  oml_outs_close_f close;
+  char *dest;
+
+  volatile int down;
+  uint32_t last_seq;
+  uint32_t first_missing;
+  int received;
+  int reordered;
+} FlakyOutStream;
+
+static size_t
+flaky_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length)
+{
+  FlakyOutStream *self = (FlakyOutStream*)hdl;
+  uint32_t *msg = (uint32_t*)buffer;
+  size_t i;
+
+  if (self->down) {
+    return 0;
+  }
+
+  for (i = 0; i < length / (2 * sizeof(uint32_t)); i++, msg += 2) {
+    if (msg[1] <= self->last_seq) {
+      self->reordered++;
+    } else if (msg[1] > self->last_seq + 1 && !self->first_missing) {
+      self->first_missing = self->last_seq + 1;
+    }
+    self->last_seq = msg[1];
+    self->received++;
+  }
+
+  return length;
+}
+
+/** Initialise a FlakyOutStream, initially down */
+static void
+flaky_stream_init(FlakyOutStream *os)
+{
+  memset(os, 0, sizeof(*os));
+  os->write = flaky_stream_write;
+  os->close = slow_stream_close;
+  os->dest = "flaky";
+  os->down = 1;
+}
+
+/** Write messages with sequence numbers 1 to n into a BufferedWriter
+ *
+ * \return the number of messages for which no buffer was returned
+ */
+static int
+bw_inject_seq(BufferedWriterHdl bw, uint32_t n)
+{
+  uint32_t msg[2];
+  MBuffer *mbuf;
+  int nobuf = 0;
+
+  msg[0] = 0;
+  for (msg[1] = 1; msg[1] <= n; msg[1]++) {
+    if ((mbuf = bw_get_write_buf(bw, 1))) {
+      mbuf_write(mbuf, (uint8_t*)msg, sizeof(msg));
+      mbuf_begin_write(mbuf);
+      bw_msgcount_add(bw, 1);
+      bw_unlock_buf(bw);
+    } else {
+      nobuf++;
+    }
+  }
+  return nobuf;
+}
+
+/** Inject SPILL_INJECTS messages into a BufferedWriter spilling up to quota
+ * while its stream is down, then bring the stream back up.
+ *
+ * \return the number of lost messages
+ */
+static int
+run_bw_spill(FlakyOutStream *os, size_t quota)
+{
+  BufferedWriterHdl bw;
+  int lost;
+
+  flaky_stream_init(os);
+
+  /* Room for 128 messages in memory */
+  bw = bw_create((OmlOutStream*)os, 4 * 256, 256);
+  fail_if(bw == NULL, "Cannot create BufferedWriter");
+  fail_if(bw_set_spill(bw, SPILL_FILE, quota, 4), "Cannot set up spilling to " SPILL_FILE);
+
+  bw_inject_seq(bw, SPILL_INJECTS);
+  os->down = 0;
+
+  lost = bw_nlost_reset(bw);
+  bw_close(bw);
+  fail_unless(access(SPILL_FILE, F_OK) < 0, "Spill file " SPILL_FILE " not removed after replay");
+
+  return lost;
+}
+
+START_TEST (test_bw_spill)
+{
+  FlakyOutStream os;
+  int lost = run_bw_spill(&os, 1024 * 1024);
+
+  fail_unless(os.reordered == 0, "%d messages were received out of order", os.reordered);
+  fail_unless(lost == 0, "%d messages lost despite spilling", lost);
+  fail_unless(os.received == SPILL_INJECTS, "%d messages received out of %d",
+      os.received, SPILL_INJECTS);
+}
+END_TEST
+
+START_TEST (test_bw_spill_quota)
+{
+  FlakyOutStream os;
+  /* Room for about 256 more messages on disk */
+  int lost = run_bw_spill(&os, 2048);
+
+  fail_unless(os.reordered == 0, "%d messages were received out of order", os.reordered);
+  fail_unless(lost > 0, "No messages lost despite exceeding the spill quota");
+  fail_unless(os.received + lost == SPILL_INJECTS, "%d messages received and %d lost, out of %d",
+      os.received, lost, SPILL_INJECTS);
+}
+END_TEST
+
+START_TEST (test_bw_policy_spec)
+{
+  const char *valid[] = { "drop-oldest", "drop-newest", "block", "block:10", "thin", "thin:4", "thin:4:50" };
+  const char *invalid[] = { "", "drop", "drop-newest:1", "block:", "block:-1", "block:1:2",
+    "thin:0", "thin:4:101", "thin:a", "drop-oldest-ish" };
+  FlakyOutStream os;
+  BufferedWriterHdl bw;
+  unsigned int i;
+
+  flaky_stream_init(&os);
+  bw = bw_create((OmlOutStream*)&os, 4 * 256, 256);
+  fail_if(bw == NULL, "Cannot create BufferedWriter");
+
+  for (i = 0; i < sizeof(valid) / sizeof(valid[0]); i++) {
+    fail_if(bw_set_policy(bw, valid[i]), "Policy '%s' rejected", valid[i]);
+  }
+  for (i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+    fail_unless(bw_set_policy(bw, invalid[i]) < 0, "Policy '%s' accepted", invalid[i]);
+  }
+
+  os.down = 0;
+  bw_close(bw);
+}
+END_TEST
+
+/** Inject SPILL_INJECTS messages into a BufferedWriter with the given policy
+ * while its stream is down, then bring the stream back up.
+ *
+ * \return the number of lost messages, including those for which no buffer was returned
+ */
+static int
+run_bw_policy(FlakyOutStream *os, const char *policy, int *nobuf)
+{
+  BufferedWriterHdl bw;
+  int lost;
+
+  flaky_stream_init(os);
+
+  /* Room for 128 messages in memory */
+  bw = bw_create((OmlOutStream*)os, 4 * 256, 256);
+  fail_if(bw == NULL, "Cannot create BufferedWriter");
+  fail_if(bw_set_policy(bw, policy), "Cannot set policy '%s'", policy);
+
+  *nobuf = bw_inject_seq(bw, SPILL_INJECTS);
+  os->down = 0;
+
+  lost = bw_nlost_reset(bw);
+  bw_close(bw);
+
+  fail_unless(os->reordered == 0, "%s: %d messages were received out of order",
+      policy, os->reordered);
+  fail_unless(os->received + lost + *nobuf == SPILL_INJECTS,
+      "%s: %d messages received, %d lost and %d not written, out of %d",
+      policy, os->received, lost, *nobuf, SPILL_INJECTS);
+
+  return lost;
+}
+
+START_TEST (test_bw_policy_drop)
+{
+  FlakyOutStream os;
+  int lost, nobuf;
+
+  bw_policy_count_reset(BW_POLICY_DROP_OLDEST);
+  bw_policy_count_reset(BW_POLICY_DROP_NEWEST);
+
+  lost = run_bw_policy(&os, "drop-oldest", &nobuf);
+  fail_unless(lost > 0, "drop-oldest: No messages lost");
+  fail_unless(os.last_seq == SPILL_INJECTS, "drop-oldest: Last message %d not received",
+      SPILL_INJECTS);
+  /* Only the chunk being sent is protected */
+  fail_unless(os.first_missing <= 64, "drop-oldest: Messages up to %d kept",
+      os.first_missing - 1);
+  fail_unless(bw_policy_count_reset(BW_POLICY_DROP_OLDEST) + bw_policy_count_reset(BW_POLICY_DROP_NEWEST)
+      == (uint32_t)lost, "drop-oldest: Lost messages not all counted");
+
+  lost = run_bw_policy(&os, "drop-newest", &nobuf);
+  fail_unless(lost > 0, "drop-newest: No messages lost");
+  /* Three of the four chunks of 32 messages are still queued when the first message is dropped */
+  fail_unless(os.first_missing > 96, "drop-newest: Message %d dropped",
+      os.first_missing);
+  fail_unless(bw_policy_count_reset(BW_POLICY_DROP_NEWEST) == (uint32_t)lost,
+      "drop-newest: Lost messages not all counted");
+  fail_unless(bw_policy_count_reset(BW_POLICY_DROP_OLDEST) == 0,
+      "drop-newest: Oldest messages dropped");
+}
+END_TEST
+
+/** Bring a FlakyOutStream up after a while */
+static void*
+flaky_stream_up(void *arg)
+{
+  usleep(200000);
+  ((FlakyOutStream*)arg)->down = 0;
+  return NULL;
+}
+
+START_TEST (test_bw_policy_block)
+{
+  FlakyOutStream os;
+  BufferedWriterHdl bw;
+  pthread_t thread;
+  int lost, nobuf;
+
+  bw_policy_count_reset(BW_POLICY_BLOCK);
+
+  flaky_stream_init(&os);
+  bw = bw_create((OmlOutStream*)&os, 4 * 256, 256);
+  fail_if(bw == NULL, "Cannot create BufferedWriter");
+  fail_if(bw_set_policy(bw, "block:10000"), "Cannot set policy");
+
+  pthread_create(&thread, NULL, flaky_stream_up, &os);
+  nobuf = bw_inject_seq(bw, SPILL_INJECTS);
+  pthread_join(thread, NULL);
+
+  lost = bw_nlost_reset(bw);
+  bw_close(bw);
+
+  fail_unless(lost == 0 && nobuf == 0, "%d messages lost and %d not written despite blocking",
+      lost, nobuf);
+  fail_unless(os.received == SPILL_INJECTS, "%d messages received out of %d",
+      os.received, SPILL_INJECTS);
+  fail_unless(os.reordered == 0, "%d messages were received out of order", os.reordered);
+  fail_unless(bw_policy_count_reset(BW_POLICY_BLOCK) > 0, "Writers never blocked");
+}
+END_TEST
+
+/** A thread writing messages into a BufferedWriter, optionally as a batch */
+typedef struct {
+  BufferedWriterHdl bw;
+  /** Non zero to hold the BufferedWriter for a batch while writing */
+  int batch;
+  /** Number of messages for which no buffer was returned */
+  int nobuf;
+} BwBatcher;
+
+static void*
+bw_batcher_start(void *arg)
+{
+  BwBatcher *self = (BwBatcher*)arg;
+
+  if (self->batch) {
+    fail_if(bw_batch_begin(self->bw), "Cannot begin batch");
+  } else {
+    /* Let the other thread fill the queue and wait for room within its batch */
+    usleep(50000);
+  }
+  self->nobuf = bw_inject_seq(self->bw, SPILL_INJECTS);
+  if (self->batch) {
+    bw_batch_end(self->bw);
+  }
+  return NULL;
+}
+
+START_TEST (test_bw_policy_block_batch)
+{
+  FlakyOutStream os;
+  BufferedWriterHdl bw;
+  BwBatcher batchers[2];
+  pthread_t threads[2], up;
+  int i, lost;
+
+  flaky_stream_init(&os);
+  bw = bw_create((OmlOutStream*)&os, 4 * 256, 256);
+  fail_if(bw == NULL, "Cannot create BufferedWriter");
+  fail_if(bw_set_policy(bw, "block:10000"), "Cannot set policy");
+
+  /* The second thread gets the lock while the first waits for room in its
+   * batch, and must release it for the batch and the reader to go on */
+  pthread_create(&up, NULL, flaky_stream_up, &os);
+  for (i = 0; i < 2; i++) {
+    batchers[i].bw = bw;
+    batchers[i].batch = (0 == i);
+    batchers[i].nobuf = 0;
+    pthread_create(&threads[i], NULL, bw_batcher_start, &batchers[i]);
+  }
+  for (i = 0; i < 2; i++) {
+    pthread_join(threads[i], NULL);
+    fail_unless(batchers[i].nobuf == 0, "%d messages not written by thread %d despite blocking",
+        batchers[i].nobuf, i);
+  }
+  pthread_join(up, NULL);
+
+  lost = bw_nlost_reset(bw);
+  bw_close(bw);
+
+  fail_unless(lost == 0, "%d messages lost despite blocking", lost);
+  fail_unless(os.received == 2 * SPILL_INJECTS, "%d messages received out of %d",
+      os.received, 2 * SPILL_INJECTS);
+}
+END_TEST
+
+START_TEST (test_bw_policy_thin)
+{
+  FlakyOutStream os;
+  int nobuf;
+
+  bw_policy_count_reset(BW_POLICY_THIN);
+
+  run_bw_policy(&os, "thin:4:50", &nobuf);
+  fail_unless(nobuf > 0, "No messages thinned out");
+  fail_unless(bw_policy_count_reset(BW_POLICY_THIN) == (uint32_t)nobuf,
+      "Thinned messages not all counted");
+}
+END_TEST
+
+#ifdef HAVE_LIBZ
+/** An OmlOutStream recording what is written into it, one MBuffer per connection */
+typedef struct {
+  oml_outs_write_f write;
+  oml_outs_close_f close;
+  char *dest;
+
+  MBuffer *conn[2];
+  int current;
+  int header_written;
+} CaptureOutStream;
+
+static size_t
+capture_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length)
+{
+  CaptureOutStream *self = (CaptureOutStream*)hdl;
+
+  if (!self->header_written) {
+    mbuf_write(self->conn[self->current], header, header_length);
+    self->header_written = 1;
+  }
+  mbuf_write(self->conn[self->current], buffer, length);
+  return length;
+}
+
+static int
+capture_stream_close(OmlOutStream* hdl)
+{
+  (void)hdl;
+  return 0;
+}
+
+/** Check that data captured for one connection inflates back to expect */
+static void
+check_inflated(MBuffer *mbuf, const char *expect)
+{
+  const char encap[] = "encapsulation: deflate\n";
+  char out[256];
+  z_stream strm;
+
+  fail_unless(mbuf_fill(mbuf) > strlen(encap) &&
+      !strncmp((char*)mbuf_buffer(mbuf), encap, strlen(encap)),
+      "Encapsulation header missing");
+
+  memset(&strm, 0, sizeof(strm));
+  fail_unless(inflateInit2(&strm, -MAX_WBITS) == Z_OK);
+  strm.next_in = mbuf_buffer(mbuf) + strlen(encap);
+  strm.avail_in = mbuf_fill(mbuf) - strlen(encap);
+  strm.next_out = (uint8_t*)out;
+  strm.avail_out = sizeof(out) - 1;
+  fail_if(inflate(&strm, Z_SYNC_FLUSH) < 0, "Cannot inflate data: %s", strm.msg);
+  fail_unless(strm.avail_in == 0, "%d bytes left uninflated", strm.avail_in);
+  out[sizeof(out) - 1 - strm.avail_out] = 0;
+  inflateEnd(&strm);
+
+  fail_unless(!strcmp(out, expect), "Inflated `%s', expected `%s'", out, expect);
+}
+
+START_TEST (test_zw_reconnect)
+{
+  char h1[] = "protocol: 4\ncontent: text\n\n";
+  char h2[] = "protocol: 4\nschema: 1 a b:int32\ncontent: text\n\n";
+  char d1[] = "first\n", d2[] = "second\n", d3[] = "third\n";
+  CaptureOutStream cs;
+  OmlOutStream *os;
+  char expect[256];
+
+  memset(&cs, 0, sizeof(cs));
+  cs.write = capture_stream_write;
+  cs.close = capture_stream_close;
+  cs.dest = "capture";
+  cs.conn[0] = mbuf_create();
+  cs.conn[1] = mbuf_create();
+
+  os = zlib_stream_new((OmlOutStream*)&cs);
+  fail_if(os == NULL, "Cannot create zlib stream");
+
+  fail_unless(os->write(os, (uint8_t*)d1, strlen(d1), (uint8_t*)h1, strlen(h1)) == strlen(d1));
+  fail_unless(os->write(os, (uint8_t*)d2, strlen(d2), (uint8_t*)h1, strlen(h1)) == strlen(d2));
+
+  /* After reconnecting, the compressed headers are resent, and must be
+   * sufficient to decompress new data */
+  cs.current = 1;
+  cs.header_written = 0;
+  fail_unless(os->write(os, (uint8_t*)d3, strlen(d3), (uint8_t*)h2, strlen(h2)) == strlen(d3));
+
+  snprintf(expect, sizeof(expect), "%s%s%s", h1, d1, d2);
+  check_inflated(cs.conn[0], expect);
+  snprintf(expect, sizeof(expect), "%s%s", h2, d3);
+  check_inflated(cs.conn[1], expect);
+
+  os->close(os);
+  mbuf_destroy(cs.conn[0]);
+  mbuf_destroy(cs.conn[1]);
+}
+END_TEST
+#endif /* HAVE_LIBZ */
+
 Suite*
 writers_suite (void)
 {
   Suite* s = suite_create ("Writers");
 
   /* Test cases */
-  /*TCase* tc_bw = tcase_create ("BfWr");*/
+  TCase* tc_bw = tcase_create ("BfWr");
   TCase* tc_fw = tcase_create ("FileWr");
+#ifdef HAVE_LIBZ
+  TCase* tc_zw = tcase_create ("ZlibWr");
+#endif
 
   /* Add tests */
   /*tcase_add_test (tc_bw, test_bw_create);*/
+  tcase_add_test (tc_bw, test_bw_slow_stream);
+  tcase_add_test (tc_bw, test_bw_spill);
+  tcase_add_test (tc_bw, test_bw_spill_quota);
+  tcase_add_test (tc_bw, test_bw_policy_spec);
+  tcase_add_test (tc_bw, test_bw_policy_drop);
+  tcase_add_test (tc_bw, test_bw_policy_block);
+  tcase_add_test (tc_bw, test_bw_policy_block_batch);
+  tcase_add_test (tc_bw, test_bw_policy_thin);
+  tcase_set_timeout (tc_bw, 30);
 
   tcase_add_test (tc_fw, test_fw_create_buffered);
 
-  /*suite_add_tcase (s, tc_bw);*/
+#ifdef HAVE_LIBZ
+  tcase_add_test (tc_zw, test_zw_reconnect);
+#endif
+
+  suite_add_tcase (s, tc_bw);
   suite_add_tcase (s, tc_fw);
+#ifdef HAVE_LIBZ
+  suite_add_tcase (s, tc_zw);
+#endif
   return s;
 }
 
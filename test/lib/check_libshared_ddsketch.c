@@ -0,0 +1,214 @@
+/*
+ * Copyright 2014 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+
+#include <check.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mem.h"
+#include "ddsketch.h"
+
+/** Sort doubles in increasing order, for qsort(3) */
+static int
+cmp_double(const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+/** Check that the quantiles of a DDSketch are within its accuracy of those of sorted values */
+static void
+check_quantiles(const DDSketch *sketch, const double *sorted, int n)
+{
+  const double qs[] = { 0., 0.01, 0.25, 0.5, 0.75, 0.9, 0.99, 0.999, 1. };
+  unsigned int i;
+
+  fail_unless(ddsketch_count(sketch) == (uint64_t)n);
+  for (i = 0; i < sizeof(qs) / sizeof(qs[0]); i++) {
+    double expected = sorted[(int)(qs[i] * (n - 1))];
+    double actual = ddsketch_quantile(sketch, qs[i]);
+    fail_unless(fabs(actual - expected) <= sketch->accuracy * fabs(expected) + 1e-12,
+        "q%g: expected %g, got %g", qs[i], expected, actual);
+  }
+}
+
+START_TEST(test_ddsketch_empty)
+{
+  DDSketch *s = ddsketch_new(DDSKETCH_DEFAULT_ACCURACY, DDSKETCH_DEFAULT_BINS);
+
+  fail_if(s == NULL);
+  fail_unless(ddsketch_count(s) == 0);
+  fail_unless(isnan(ddsketch_quantile(s, 0.5)));
+
+  /* Non-finite values are ignored */
+  ddsketch_add(s, NAN);
+  ddsketch_add(s, INFINITY);
+  ddsketch_add(s, -INFINITY);
+  fail_unless(ddsketch_count(s) == 0);
+
+  ddsketch_add(s, 1.);
+  fail_unless(isnan(ddsketch_quantile(s, -0.1)));
+  fail_unless(isnan(ddsketch_quantile(s, 1.1)));
+
+  fail_unless(ddsketch_new(0., 10) == NULL);
+  fail_unless(ddsketch_new(1., 10) == NULL);
+  fail_unless(ddsketch_new(0.01, 0) == NULL);
+
+  ddsketch_free(s);
+}
+END_TEST
+
+START_TEST(test_ddsketch_accuracy)
+{
+  /* Mixed signs, zeros, and values over several orders of magnitude */
+  enum { N = 10000 };
+  double *values = oml_malloc(N * sizeof(double));
+  DDSketch *s = ddsketch_new(0.02, DDSKETCH_DEFAULT_BINS);
+  int i;
+
+  srand(42);
+  for (i = 0; i < N; i++) {
+    values[i] = exp((double)rand() / RAND_MAX * 20. - 5.);
+    if (i % 10 == 0) {
+      values[i] = -values[i];
+    } else if (i % 97 == 0) {
+      values[i] = 0.;
+    }
+    ddsketch_add(s, values[i]);
+  }
+  qsort(values, N, sizeof(double), cmp_double);
+  check_quantiles(s, values, N);
+
+  ddsketch_clear(s);
+  fail_unless(ddsketch_count(s) == 0);
+
+  ddsketch_free(s);
+  oml_free(values);
+}
+END_TEST
+
+START_TEST(test_ddsketch_collapse)
+{
+  /* With 16 bins of 1%, only values within ~1.4x of the maximum are kept apart */
+  DDSketch *s = ddsketch_new(0.01, 16);
+  int i;
+
+  for (i = 1; i <= 1000; i++) {
+    ddsketch_add(s, i);
+  }
+  fail_unless(ddsketch_count(s) == 1000);
+  fail_unless(s->stores[DDSKETCH_POSITIVE].hi - s->stores[DDSKETCH_POSITIVE].lo < 16);
+  /* The highest quantiles remain accurate */
+  fail_unless(fabs(ddsketch_quantile(s, 0.999) - 999.) <= 0.01 * 999.);
+  fail_unless(fabs(ddsketch_quantile(s, 1.) - 1000.) <= 0.01 * 1000.);
+  /* The lowest values were collapsed upwards */
+  fail_unless(ddsketch_quantile(s, 0.) > 1.);
+
+  /* Collapse everything when jumping far up */
+  ddsketch_add(s, 1e12);
+  fail_unless(ddsketch_count(s) == 1001);
+  fail_unless(fabs(ddsketch_quantile(s, 1.) - 1e12) <= 0.01 * 1e12);
+
+  ddsketch_free(s);
+}
+END_TEST
+
+START_TEST(test_ddsketch_merge)
+{
+  enum { N = 3000 };
+  double values[N];
+  DDSketch *a = ddsketch_new(0.01, DDSKETCH_DEFAULT_BINS);
+  DDSketch *b = ddsketch_new(0.01, DDSKETCH_DEFAULT_BINS);
+  DDSketch *c = ddsketch_new(0.05, DDSKETCH_DEFAULT_BINS);
+  int i;
+
+  for (i = 0; i < N; i++) {
+    values[i] = (i % 3 ? 1. : -1.) * (1 + i * 0.37);
+    ddsketch_add(i < N / 3 ? a : b, values[i]);
+  }
+  fail_unless(ddsketch_merge(a, b) == 0);
+  fail_unless(ddsketch_merge(a, c) == -1);
+  qsort(values, N, sizeof(double), cmp_double);
+  check_quantiles(a, values, N);
+
+  ddsketch_free(a);
+  ddsketch_free(b);
+  ddsketch_free(c);
+}
+END_TEST
+
+START_TEST(test_ddsketch_encode)
+{
+  enum { N = 1000 };
+  double values[N];
+  uint8_t buf[4096];
+  DDSketch *s = ddsketch_new(0.01, DDSKETCH_DEFAULT_BINS);
+  DDSketch *d;
+  size_t len;
+  int i;
+
+  /* An empty sketch can be serialised too */
+  len = ddsketch_encode(s, buf, sizeof(buf));
+  fail_unless(len == 1 + 8 + 3, "Empty sketch encoded in %zu bytes", len);
+  d = ddsketch_decode(buf, len, DDSKETCH_DEFAULT_BINS);
+  fail_if(d == NULL);
+  fail_unless(ddsketch_count(d) == 0);
+  ddsketch_free(d);
+
+  for (i = 0; i < N; i++) {
+    values[i] = (i % 4 ? 1. : -1.) * (i % 50) * 1.5;
+    ddsketch_add(s, values[i]);
+  }
+  fail_unless(ddsketch_encode(s, NULL, 0) == (len = ddsketch_encode(s, buf, sizeof(buf))));
+  fail_unless(len < sizeof(buf));
+
+  d = ddsketch_decode(buf, len, DDSKETCH_DEFAULT_BINS);
+  fail_if(d == NULL);
+  fail_unless(d->gamma == s->gamma);
+  qsort(values, N, sizeof(double), cmp_double);
+  check_quantiles(d, values, N);
+  fail_unless(ddsketch_merge(d, s) == 0);
+  fail_unless(ddsketch_count(d) == 2 * N);
+  ddsketch_free(d);
+
+  /* Truncated, extended, or otherwise invalid input */
+  fail_unless(ddsketch_decode(buf, len - 1, DDSKETCH_DEFAULT_BINS) == NULL);
+  fail_unless(ddsketch_decode(buf, len + 1, DDSKETCH_DEFAULT_BINS) == NULL);
+  buf[0]++;
+  fail_unless(ddsketch_decode(buf, len, DDSKETCH_DEFAULT_BINS) == NULL);
+
+  ddsketch_free(s);
+}
+END_TEST
+
+Suite*
+ddsketch_suite(void)
+{
+  Suite *s = suite_create("DDSketch");
+  TCase *tc_core = tcase_create("DDSketch");
+  tcase_add_test(tc_core, test_ddsketch_empty);
+  tcase_add_test(tc_core, test_ddsketch_accuracy);
+  tcase_add_test(tc_core, test_ddsketch_collapse);
+  tcase_add_test(tc_core, test_ddsketch_merge);
+  tcase_add_test(tc_core, test_ddsketch_encode);
+  suite_add_tcase(s, tc_core);
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
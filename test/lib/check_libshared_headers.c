@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <string.h>
 #include <check.h>
 #include <arpa/inet.h>
 
@@ -7,6 +8,7 @@
 #include "binary.h"
 #include "oml_util.h"
 #include "oml_value.h"
+#include "marshal.h"
 
 /*
  * Used by:  test_tag_from_string
@@ -286,6 +288,124 @@ START_TEST (test_bin_read)
 }
 END_TEST
 
+START_TEST (test_bin_read_compact)
+{
+  /* Timestamps in microseconds, then not */
+  double times[] = { 10.5, 10.500125, 1. / 3., 11. };
+  int seqnos[] = { 7, 8, 6, 9 };
+  OmlBinStreamState enc = { 0, 0 }, dec[OMB_MAX_STREAMS];
+  MBuffer *mbuf = mbuf_create ();
+  struct oml_message msg;
+  OmlValue v;
+  int result;
+  unsigned int i;
+
+  oml_value_init(&v);
+  memset(dec, 0, sizeof(dec));
+
+  for (i = 0; i < LENGTH(times); i++) {
+    oml_value_set_type(&v, OML_UINT32_VALUE);
+    omlc_set_uint32(*oml_value_get_value(&v), 1000 * i);
+    marshal_init (mbuf, OMB_CDATA_P);
+    marshal_measurements_compact (mbuf, 4, seqnos[i], times[i], &enc, 0 == i);
+    marshal_values2 (mbuf, &v, 1, OMB_COMPACT_PROTOCOL);
+    marshal_finalize (mbuf);
+  }
+
+  for (i = 0; i < LENGTH(times); i++) {
+    bzero(&msg, sizeof(msg));
+    msg.streams = dec;
+    result = bin_read_msg_start (&msg, mbuf);
+
+    fail_unless(result > 0, "Unable to start reading compact message %d", i);
+    fail_unless(msg.stream == 4, "Unexpected stream %d", msg.stream);
+    fail_unless(msg.count == 1, "Unexpected count %d", msg.count);
+    fail_unless((int)msg.seqno == seqnos[i], "Unexpected seqno %d, expected %d", msg.seqno, seqnos[i]);
+    fail_unless(msg.timestamp == times[i], "Unexpected timestamp %.17g, expected %.17g", msg.timestamp, times[i]);
+
+    fail_unless(unmarshal_value (mbuf, &v) == 1);
+    fail_unless(oml_value_get_type(&v) == OML_UINT32_VALUE);
+    fail_unless(omlc_get_uint32(*oml_value_get_value(&v)) == 1000 * i);
+    mbuf_consume_message (mbuf);
+  }
+
+  bzero(&msg, sizeof(msg));
+  marshal_init (mbuf, OMB_CDATA_P);
+  marshal_measurements_compact (mbuf, 4, 10, 12., &enc, 0);
+  marshal_finalize (mbuf);
+  fail_unless(bin_read_msg_start (&msg, mbuf) == -1,
+      "Compact message read without decoding state");
+
+  oml_value_reset(&v);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+START_TEST (test_bin_read_batch)
+{
+  double times[] = { 10.5, 10.500125, 1. / 3., 11. };
+  int seqnos[] = { 7, 8, 6, 9 };
+  OmlBinStreamState enc = { 0, 0 }, dec[OMB_MAX_STREAMS];
+  MBuffer *mbuf = mbuf_create ();
+  struct oml_message msg;
+  OmlValue v;
+  size_t offset, length;
+  int result;
+  unsigned int i;
+
+  oml_value_init(&v);
+  memset(dec, 0, sizeof(dec));
+
+  marshal_init (mbuf, OMB_BATCH_P);
+  offset = mbuf_message_offset (mbuf);
+  marshal_batch_init (mbuf, 4);
+  for (i = 0; i < LENGTH(times); i++) {
+    mbuf_begin_write (mbuf);
+    oml_value_set_type(&v, OML_UINT32_VALUE);
+    omlc_set_uint32(*oml_value_get_value(&v), 1000 * i);
+    marshal_batch_row (mbuf, seqnos[i], times[i], &enc, 0 == i);
+    marshal_batch_values (mbuf, &v, 1, OMB_BATCH_PROTOCOL);
+    marshal_batch_finalize (mbuf, offset, 1);
+  }
+  length = mbuf_write_offset (mbuf);
+
+  /* A following compact message relies on the state after the last row */
+  marshal_init (mbuf, OMB_CDATA_P);
+  marshal_measurements_compact (mbuf, 4, 10, 12., &enc, 0);
+  marshal_values2 (mbuf, &v, 1, OMB_BATCH_PROTOCOL);
+  marshal_finalize (mbuf);
+
+  bzero(&msg, sizeof(msg));
+  msg.streams = dec;
+  result = bin_read_msg_start (&msg, mbuf);
+  fail_unless(result == (int)length, "Unexpected batch message length %d, expected %d", result, length);
+  fail_unless(msg.stream == 4, "Unexpected stream %d", msg.stream);
+  fail_unless(msg.count == 1, "Unexpected count %d", msg.count);
+  fail_unless((int)msg.seqno == seqnos[0], "Unexpected seqno %d, expected %d", msg.seqno, seqnos[0]);
+  fail_unless(msg.timestamp == times[0], "Unexpected timestamp %.17g, expected %.17g", msg.timestamp, times[0]);
+  mbuf_consume_message (mbuf);
+
+  bzero(&msg, sizeof(msg));
+  msg.streams = dec;
+  fail_unless(bin_read_msg_start (&msg, mbuf) > 0, "Unable to start reading compact message after batch");
+  fail_unless((int)msg.seqno == 10, "Unexpected seqno %d after batch", msg.seqno);
+  fail_unless(msg.timestamp == 12., "Unexpected timestamp %.17g after batch", msg.timestamp);
+
+  bzero(&msg, sizeof(msg));
+  mbuf_clear (mbuf);
+  marshal_init (mbuf, OMB_BATCH_P);
+  marshal_batch_init (mbuf, 4);
+  marshal_batch_row (mbuf, 1, 1., NULL, 1);
+  marshal_batch_values (mbuf, &v, 1, OMB_BATCH_PROTOCOL);
+  marshal_batch_finalize (mbuf, mbuf_message_offset (mbuf), 1);
+  fail_unless(bin_read_msg_start (&msg, mbuf) == -1,
+      "Batch message read without decoding state");
+
+  oml_value_reset(&v);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
 Suite *
 headers_suite (void)
 {
@@ -307,6 +427,8 @@ headers_suite (void)
 
   tcase_add_test (tc_header_from_string, test_text_read);
   tcase_add_test (tc_header_from_string, test_bin_read);
+  tcase_add_test (tc_header_from_string, test_bin_read_compact);
+  tcase_add_test (tc_header_from_string, test_bin_read_batch);
 
   suite_add_tcase (s, tc_tag_from_string);
   suite_add_tcase (s, tc_header_from_string);
@@ -56,6 +56,7 @@ static const int BLOB_T = 0x9;        // marshal.c BLOB_T
 static const int GUID_T = 0xa;        // marshal.c GUID_T
 static const int BOOL_FALSE_T = 0xb;  // marshal.c BOOL_FALSE_T
 static const int BOOL_TRUE_T = 0xc;   // marshal.c BOOL_TRUE_T
+static const int DOUBLE64_T = 0xf;    // marshal.c DOUBLE64_T
 
 #define PACKET_HEADER_SIZE 5 // marshal.c
 
@@ -996,6 +997,423 @@ START_TEST (test_marshal_unmarshal_double)
 }
 END_TEST
 
+START_TEST (test_marshal_unmarshal_double64)
+{
+  const int DOUBLE64_LENGTH = 9;
+  /* These need more than the 31 bits of mantissa of DOUBLE_T */
+  const double timestamp = 1413331200.123456789;
+  const double exact_values[] = { M_PI, 1. / 3., -1e-300, 1.7976931348623157e308 };
+  double expected, got;
+  uint64_t nv64;
+  int values_offset, result;
+  unsigned int i, n = LENGTH (double_values) + LENGTH (exact_values);
+  OmlValue value;
+  OmlValueU v;
+
+  oml_value_init(&value);
+  omlc_zero(v);
+
+  MBuffer* mbuf = mbuf_create ();
+  marshal_init (mbuf, OMB_DATA_P);
+  result = marshal_measurements2 (mbuf, 98, 99, timestamp, OMB_DOUBLE64_PROTOCOL);
+  fail_if (result == -1);
+  values_offset = mbuf_fill (mbuf);
+
+  for (i = 0; i < n; i++) {
+    expected = (i < LENGTH (double_values)) ? double_values[i] : exact_values[i - LENGTH (double_values)];
+    omlc_set_double(v, expected);
+    result = marshal_value2 (mbuf, OML_DOUBLE_VALUE, &v, OMB_DOUBLE64_PROTOCOL);
+    fail_if (result != 1);
+
+    uint8_t* buf = &mbuf->base[values_offset + i * DOUBLE64_LENGTH];
+    fail_unless (buf[0] == DOUBLE64_T, "Type == %d", buf[0]);
+    memcpy (&nv64, &expected, sizeof (nv64));
+    nv64 = htonll (nv64);
+    fail_if (memcmp (&buf[1], &nv64, sizeof (nv64)),
+        "%g not marshalled as IEEE 754 binary64 in network byte order\n", expected);
+  }
+
+  /* The old encoding can still be mixed in, and decoded */
+  omlc_set_double(v, 1.2345);
+  result = marshal_value (mbuf, OML_DOUBLE_VALUE, &v);
+  fail_if (result != 1);
+  fail_unless (mbuf->base[values_offset + n * DOUBLE64_LENGTH] == DOUBLE_T);
+
+  marshal_finalize (mbuf);
+
+  OmlBinaryHeader header;
+  unmarshal_init(mbuf, &header);
+  fail_unless(header.stream == 98);
+  fail_unless(header.seqno == 99);
+  fail_unless(header.timestamp == timestamp,
+      "Unmarshalled timestamp %.9f, expected %.9f\n", header.timestamp, timestamp);
+
+  for (i = 0; i < n; i++) {
+    expected = (i < LENGTH (double_values)) ? double_values[i] : exact_values[i - LENGTH (double_values)];
+    fail_unless (unmarshal_value (mbuf, &value) == 1);
+    fail_unless (oml_value_get_type(&value) == OML_DOUBLE_VALUE);
+    got = omlc_get_double(*oml_value_get_value(&value));
+    if (isnan(expected)) {
+      fail_unless (isnan(got));
+    } else {
+      /* Compare representations, to also check the sign of zeroes */
+      fail_if (memcmp (&expected, &got, sizeof (double)),
+          "Unmarshalled value %.17g, expected %.17g\n", got, expected);
+    }
+  }
+
+  fail_unless (unmarshal_value (mbuf, &value) == 1);
+  fail_unless (relative_error (omlc_get_double(*oml_value_get_value(&value)), 1.2345) < EPSILON);
+
+  oml_value_reset(&value);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+START_TEST (test_marshal_unmarshal_compact)
+{
+  OmlValueT types[] = { OML_INT32_VALUE, OML_UINT32_VALUE, OML_INT64_VALUE, OML_UINT64_VALUE };
+  OmlValue values[LENGTH (types)], value;
+  OmlBinStreamState enc = { 0, 0 }, dec[OMB_MAX_STREAMS];
+  OmlBinaryHeader header;
+  MBuffer *mbuf = mbuf_create ();
+  size_t full_len, compact_len;
+  unsigned int i, j;
+  int result;
+
+  oml_value_array_init(values, LENGTH (types));
+  oml_value_init(&value);
+  memset(dec, 0, sizeof(dec));
+
+  /* Edge values of all integer types, as varints */
+  for (i = 0; i < LENGTH (int64_values); i++) {
+    mbuf_clear (mbuf);
+    for (j = 0; j < LENGTH (types); j++) {
+      oml_value_set_type(&values[j], types[j]);
+    }
+    omlc_set_int32(*oml_value_get_value(&values[0]), (int32_t)int64_values[i]);
+    omlc_set_uint32(*oml_value_get_value(&values[1]), (uint32_t)int64_values[i]);
+    omlc_set_int64(*oml_value_get_value(&values[2]), int64_values[i]);
+    omlc_set_uint64(*oml_value_get_value(&values[3]), (uint64_t)int64_values[i]);
+
+    marshal_init (mbuf, OMB_CDATA_P);
+    marshal_measurements_compact (mbuf, 2, i, i * 0.25, &enc, 0 == i);
+    result = marshal_values2 (mbuf, values, LENGTH (types), OMB_COMPACT_PROTOCOL);
+    fail_unless (result == 1);
+    marshal_finalize (mbuf);
+    compact_len = mbuf_message_length (mbuf);
+
+    fail_unless (unmarshal_init2 (mbuf, &header, dec) == 1);
+    fail_unless (header.type == OMB_CDATA_P);
+    fail_unless (header.stream == 2);
+    fail_unless (header.values == LENGTH (types));
+    fail_unless (header.seqno == (int)i, "Unmarshalled seqno %d, expected %d", header.seqno, i);
+    fail_unless (header.timestamp == i * 0.25);
+
+    for (j = 0; j < LENGTH (types); j++) {
+      fail_unless (unmarshal_value (mbuf, &value) == 1);
+      fail_unless (oml_value_get_type(&value) == types[j],
+          "Unmarshalled type %s, expected %s",
+          oml_type_to_s(oml_value_get_type(&value)), oml_type_to_s(types[j]));
+      switch (types[j]) {
+      case OML_INT32_VALUE:
+        result = omlc_get_int32(*oml_value_get_value(&value)) == (int32_t)int64_values[i];
+        break;
+      case OML_UINT32_VALUE:
+        result = omlc_get_uint32(*oml_value_get_value(&value)) == (uint32_t)int64_values[i];
+        break;
+      case OML_INT64_VALUE:
+        result = omlc_get_int64(*oml_value_get_value(&value)) == int64_values[i];
+        break;
+      default:
+        result = omlc_get_uint64(*oml_value_get_value(&value)) == (uint64_t)int64_values[i];
+        break;
+      }
+      fail_unless (result, "Unmarshalled %s value differs for %" PRId64,
+          oml_type_to_s(types[j]), int64_values[i]);
+    }
+
+    /* Small values should be smaller than in full packets; negative ones are
+     * large when unsigned */
+    if (int64_values[i] >= 0 && int64_values[i] < 64) {
+      mbuf_clear (mbuf);
+      marshal_init (mbuf, OMB_DATA_P);
+      marshal_measurements (mbuf, 2, i, i * 0.25);
+      marshal_values (mbuf, values, LENGTH (types));
+      marshal_finalize (mbuf);
+      full_len = mbuf_message_length (mbuf);
+      fail_unless (compact_len < full_len / 2,
+          "Compact packet not much smaller (%d vs. %d)", compact_len, full_len);
+    }
+  }
+
+  /* An absolute packet resets the decoding state */
+  mbuf_clear (mbuf);
+  marshal_init (mbuf, OMB_CDATA_P);
+  marshal_measurements_compact (mbuf, 2, 1000, 1e5, &enc, 1);
+  marshal_finalize (mbuf);
+  dec[2].seqno = 42;
+  dec[2].ts_us = 42;
+  fail_unless (unmarshal_init2 (mbuf, &header, dec) == 1);
+  fail_unless (header.seqno == 1000);
+  fail_unless (header.timestamp == 1e5);
+
+  /* Compact packets need decoding state */
+  mbuf_reset_read (mbuf);
+  fail_unless (unmarshal_init (mbuf, &header) == 0);
+
+  oml_value_array_reset(values, LENGTH (types));
+  oml_value_reset(&value);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+START_TEST (test_marshal_unmarshal_batch)
+{
+  OmlValue values[2], got[2];
+  OmlBinStreamState enc = { 0, 0 }, dec[OMB_MAX_STREAMS];
+  OmlBinaryHeader header;
+  MBuffer *mbuf = mbuf_create ();
+  char string[200];
+  size_t offset;
+  int i, rows, nrows = 1000;
+
+  oml_value_array_init(values, LENGTH (values));
+  oml_value_array_init(got, LENGTH (got));
+  memset(dec, 0, sizeof(dec));
+  memset(string, 'x', sizeof(string) - 1);
+  string[sizeof(string) - 1] = 0;
+
+  oml_value_set_type(&values[0], OML_UINT32_VALUE);
+  oml_value_set_type(&values[1], OML_STRING_VALUE);
+  omlc_set_const_string(*oml_value_get_value(&values[1]), string);
+
+  /* Enough rows to need a long packet */
+  marshal_init (mbuf, OMB_BATCH_P);
+  offset = mbuf_message_offset (mbuf);
+  fail_unless (marshal_batch_init (mbuf, 3) == 1);
+  for (i = 0; i < nrows; i++) {
+    if (i > 0) {
+      /* Rows are added after the packet has been finalised */
+      mbuf_begin_write (mbuf);
+    }
+    omlc_set_uint32(*oml_value_get_value(&values[0]), i);
+    fail_unless (marshal_batch_row (mbuf, 100 + i, 1. + i * 0.001, &enc, 0 == i) == 1);
+    fail_unless (marshal_batch_values (mbuf, values, LENGTH (values), OMB_BATCH_PROTOCOL) == 1);
+    rows = marshal_batch_finalize (mbuf, offset, LENGTH (values));
+    fail_unless (rows == i + 1, "Batch has %d rows, expected %d", rows, i + 1);
+  }
+  mbuf_begin_write (mbuf);
+  fail_unless (mbuf_buffer (mbuf)[offset + 2] == OMB_LBATCH_P,
+      "Batch of %dB was not promoted to a long packet", mbuf_fill (mbuf));
+
+  /* Followed by a compact packet for the same stream, delta-encoded against the last row */
+  marshal_init (mbuf, OMB_CDATA_P);
+  marshal_measurements_compact (mbuf, 3, 100 + nrows, 1. + nrows * 0.001, &enc, 0);
+  marshal_values2 (mbuf, values, 1, OMB_BATCH_PROTOCOL);
+  marshal_finalize (mbuf);
+
+  fail_unless (unmarshal_init (mbuf, &header) == 0, "Batch packet read without decoding state");
+  mbuf_reset_read (mbuf);
+  fail_unless (unmarshal_init2 (mbuf, &header, dec) == 1);
+  fail_unless (header.type == OMB_LBATCH_P);
+  fail_unless (header.stream == 3);
+  fail_unless (header.values == LENGTH (values));
+  fail_unless (header.rows == nrows, "Unmarshalled %d rows, expected %d", header.rows, nrows);
+
+  for (i = 0; i < nrows; i++) {
+    fail_unless (unmarshal_batch_row (mbuf, &header, dec) == 0);
+    fail_unless (header.seqno == 100 + i, "Unmarshalled seqno %d, expected %d", header.seqno, 100 + i);
+    fail_unless (header.timestamp == 1. + i * 0.001,
+        "Unmarshalled timestamp %.17g, expected %.17g", header.timestamp, 1. + i * 0.001);
+    fail_unless (unmarshal_values (mbuf, &header, got, LENGTH (got)) == LENGTH (got));
+    fail_unless (omlc_get_uint32(*oml_value_get_value(&got[0])) == (uint32_t)i);
+    fail_unless (!strcmp (omlc_get_string_ptr(*oml_value_get_value(&got[1])), string));
+  }
+  mbuf_consume_message (mbuf);
+
+  fail_unless (unmarshal_init2 (mbuf, &header, dec) == 1);
+  fail_unless (header.type == OMB_CDATA_P);
+  fail_unless (header.rows == 1);
+  fail_unless (header.seqno == 100 + nrows);
+  fail_unless (header.timestamp == 1. + nrows * 0.001);
+
+  oml_value_array_reset(values, LENGTH (values));
+  oml_value_array_reset(got, LENGTH (got));
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+/** Types of the fields of the rows marshalled with and without a MarshalPlan */
+static OmlValueT plan_types[] = {
+  OML_INT32_VALUE, OML_UINT32_VALUE, OML_INT64_VALUE, OML_UINT64_VALUE,
+  OML_DOUBLE_VALUE, OML_STRING_VALUE, OML_BOOL_VALUE, OML_GUID_VALUE,
+  OML_BLOB_VALUE, OML_VECTOR_DOUBLE_VALUE, OML_VECTOR_INT32_VALUE, OML_VECTOR_BOOL_VALUE,
+};
+
+/** Set the values of row i of plan_types; their sizes vary with i */
+static void
+set_plan_row (OmlValue *values, int i)
+{
+  static char string[300], blob[64];
+  int j;
+
+  memset (string, 'a' + i % 26, sizeof (string) - 1);
+  memset (blob, i, sizeof (blob));
+  /* Strings longer than the 254 characters which can be marshalled are truncated */
+  string[(i * 37) % sizeof (string)] = '\0';
+
+  for (j = 0; j < (int)LENGTH (plan_types); j++) {
+    oml_value_set_type (&values[j], plan_types[j]);
+  }
+  omlc_set_int32 (*oml_value_get_value (&values[0]), int32_values[i % LENGTH (int32_values)]);
+  omlc_set_uint32 (*oml_value_get_value (&values[1]), (uint32_t)int32_values[(i + 1) % LENGTH (int32_values)]);
+  omlc_set_int64 (*oml_value_get_value (&values[2]), int64_values[i % LENGTH (int64_values)]);
+  omlc_set_uint64 (*oml_value_get_value (&values[3]), (uint64_t)int64_values[(i + 1) % LENGTH (int64_values)]);
+  omlc_set_double (*oml_value_get_value (&values[4]), double_values[i % LENGTH (double_values)]);
+  omlc_set_const_string (*oml_value_get_value (&values[5]), string);
+  omlc_set_bool (*oml_value_get_value (&values[6]), bool_values[i % LENGTH (bool_values)]);
+  omlc_set_guid (*oml_value_get_value (&values[7]), (oml_guid_t)(i * 0x100000001ULL));
+  omlc_reset_blob (*oml_value_get_value (&values[8]));
+  omlc_set_blob (*oml_value_get_value (&values[8]), blob, 1 + i % sizeof (blob));
+  omlc_reset_vector (*oml_value_get_value (&values[9]));
+  omlc_set_vector_double (*oml_value_get_value (&values[9]), double_values, 1 + i % LENGTH (double_values));
+  omlc_reset_vector (*oml_value_get_value (&values[10]));
+  omlc_set_vector_int32 (*oml_value_get_value (&values[10]), int32_values, 1 + i % LENGTH (int32_values));
+  omlc_reset_vector (*oml_value_get_value (&values[11]));
+  omlc_set_vector_bool (*oml_value_get_value (&values[11]), bool_values, 1 + i % LENGTH (bool_values));
+}
+
+/** Check that the messages in two MBuffers are identical */
+static void
+check_same_messages (MBuffer *plan_mbuf, MBuffer *mbuf, const char *what)
+{
+  size_t i, len = mbuf_fill (mbuf);
+
+  fail_unless (mbuf_fill (plan_mbuf) == len,
+      "%s: marshalled %zuB with a plan, %zuB without", what, mbuf_fill (plan_mbuf), len);
+  for (i = 0; i < len; i++) {
+    fail_unless (mbuf_buffer (plan_mbuf)[i] == mbuf_buffer (mbuf)[i],
+        "%s: byte %zu is 0x%02x with a plan, 0x%02x without",
+        what, i, mbuf_buffer (plan_mbuf)[i], mbuf_buffer (mbuf)[i]);
+  }
+}
+
+/** Check that rows marshalled following a MarshalPlan are identical to
+ * those marshalled by marshal_values2, for all protocols */
+START_TEST (test_marshal_plan_values)
+{
+  int protocols[] = { 4, OMB_DOUBLE64_PROTOCOL, OMB_COMPACT_PROTOCOL, OMB_BATCH_PROTOCOL };
+  OmlValue values[LENGTH (plan_types)];
+  OmlBinStreamState plan_enc, enc;
+  MBuffer *plan_mbuf = mbuf_create (), *mbuf = mbuf_create ();
+  MarshalPlan *plan;
+  char what[64];
+  int i, p, split = 5;
+
+  oml_value_array_init (values, LENGTH (values));
+
+  for (p = 0; p < (int)LENGTH (protocols); p++) {
+    plan = marshal_plan_new (plan_types, LENGTH (plan_types), protocols[p]);
+    fail_if (plan == NULL, "Cannot compile plan for OMSPv%d", protocols[p]);
+    memset (&plan_enc, 0, sizeof (plan_enc));
+    memset (&enc, 0, sizeof (enc));
+    mbuf_clear (plan_mbuf);
+    mbuf_clear (mbuf);
+
+    for (i = 0; i < 20; i++) {
+      set_plan_row (values, i);
+      if (i == 19) {
+        /* Values not matching the types of the plan are marshalled without it */
+        oml_value_set_type (&values[0], OML_DOUBLE_VALUE);
+        omlc_set_double (*oml_value_get_value (&values[0]), 0.125);
+      }
+
+      if (protocols[p] >= OMB_COMPACT_PROTOCOL) {
+        marshal_init (plan_mbuf, OMB_CDATA_P);
+        marshal_measurements_compact (plan_mbuf, 1, i, i * 0.5, &plan_enc, 0 == i);
+        marshal_init (mbuf, OMB_CDATA_P);
+        marshal_measurements_compact (mbuf, 1, i, i * 0.5, &enc, 0 == i);
+      } else {
+        marshal_init (plan_mbuf, OMB_DATA_P);
+        marshal_measurements2 (plan_mbuf, 1, i, i * 0.5, protocols[p]);
+        marshal_init (mbuf, OMB_DATA_P);
+        marshal_measurements2 (mbuf, 1, i, i * 0.5, protocols[p]);
+      }
+      /* As output by two filters */
+      fail_unless (marshal_plan_values (plan_mbuf, plan, 0, values, split) == 1);
+      fail_unless (marshal_plan_values (plan_mbuf, plan, split, &values[split], LENGTH (values) - split) == 1);
+      fail_unless (marshal_values2 (mbuf, values, LENGTH (values), protocols[p]) == 1);
+      marshal_finalize (plan_mbuf);
+      marshal_finalize (mbuf);
+
+      snprintf (what, sizeof (what), "OMSPv%d row %d", protocols[p], i);
+      check_same_messages (plan_mbuf, mbuf, what);
+      mbuf_begin_write (plan_mbuf);
+      mbuf_begin_write (mbuf);
+    }
+    marshal_plan_free (plan);
+  }
+
+  oml_value_array_reset (values, LENGTH (values));
+  mbuf_destroy (plan_mbuf);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+/** Check that rows added to an OMSPv8 batch following a MarshalPlan are
+ * identical to those marshalled by marshal_batch_values */
+START_TEST (test_marshal_plan_batch_values)
+{
+  OmlValue values[LENGTH (plan_types)];
+  OmlBinStreamState plan_enc = { 0, 0 }, enc = { 0, 0 };
+  MBuffer *plan_mbuf = mbuf_create (), *mbuf = mbuf_create ();
+  MarshalPlan *plan;
+  size_t plan_offset, offset;
+  char what[64];
+  int i, rows, nrows = 50, split = 5;
+
+  oml_value_array_init (values, LENGTH (values));
+  plan = marshal_plan_new (plan_types, LENGTH (plan_types), OMB_BATCH_PROTOCOL);
+  fail_if (plan == NULL, "Cannot compile plan for OMSPv%d", OMB_BATCH_PROTOCOL);
+
+  marshal_init (plan_mbuf, OMB_BATCH_P);
+  plan_offset = mbuf_message_offset (plan_mbuf);
+  fail_unless (marshal_batch_init (plan_mbuf, 2) == 1);
+  marshal_init (mbuf, OMB_BATCH_P);
+  offset = mbuf_message_offset (mbuf);
+  fail_unless (marshal_batch_init (mbuf, 2) == 1);
+
+  for (i = 0; i < nrows; i++) {
+    if (i > 0) {
+      /* Rows are added after the packet has been finalised */
+      mbuf_begin_write (plan_mbuf);
+      mbuf_begin_write (mbuf);
+    }
+    set_plan_row (values, i);
+
+    fail_unless (marshal_batch_row (plan_mbuf, i, 1. + i * 0.001, &plan_enc, 0 == i) == 1);
+    fail_unless (marshal_plan_batch_values (plan_mbuf, plan, 0, values, split) == 1);
+    fail_unless (marshal_plan_batch_values (plan_mbuf, plan, split, &values[split], LENGTH (values) - split) == 1);
+    rows = marshal_batch_finalize (plan_mbuf, plan_offset, LENGTH (values));
+    fail_unless (rows == i + 1, "Batch has %d rows with a plan, expected %d", rows, i + 1);
+
+    fail_unless (marshal_batch_row (mbuf, i, 1. + i * 0.001, &enc, 0 == i) == 1);
+    fail_unless (marshal_batch_values (mbuf, values, LENGTH (values), OMB_BATCH_PROTOCOL) == 1);
+    rows = marshal_batch_finalize (mbuf, offset, LENGTH (values));
+    fail_unless (rows == i + 1, "Batch has %d rows without a plan, expected %d", rows, i + 1);
+
+    snprintf (what, sizeof (what), "OMSPv%d batch of %d rows", OMB_BATCH_PROTOCOL, i + 1);
+    check_same_messages (plan_mbuf, mbuf, what);
+  }
+
+  marshal_plan_free (plan);
+  oml_value_array_reset (values, LENGTH (values));
+  mbuf_destroy (plan_mbuf);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
 START_TEST (test_marshal_unmarshal_string)
 {
   int VALUES_OFFSET = 7;
@@ -1833,6 +2251,11 @@ marshal_suite (void)
   tcase_add_test (tc_marshal, test_marshal_unmarshal_int64);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_uint64);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_double);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_double64);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_compact);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_batch);
+  tcase_add_test (tc_marshal, test_marshal_plan_values);
+  tcase_add_test (tc_marshal, test_marshal_plan_batch_values);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_string);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_guid);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_bool);
@@ -54,6 +54,38 @@ START_TEST (test_util_uri)
 }
 END_TEST
 
+static struct {
+  char *uri;
+  OmlURICompression compression;
+  char *rest;
+} compression_uris[] = {
+  { "tcp:localhost:3003", OML_URI_COMPRESSION_NONE, "tcp:localhost:3003" },
+  { "localhost", OML_URI_COMPRESSION_NONE, "localhost" },
+  { "file:/tmp/a+b", OML_URI_COMPRESSION_NONE, "file:/tmp/a+b" },
+  { "zlib+tcp:localhost:3003", OML_URI_COMPRESSION_ZLIB, "tcp:localhost:3003" },
+  { "zlib+file:-", OML_URI_COMPRESSION_ZLIB, "file:-" },
+  { "lz4+tcp:localhost", OML_URI_COMPRESSION_NONE, NULL },
+};
+
+START_TEST (test_util_uri_compression)
+{
+  OmlURICompression compression;
+  const char *rest;
+
+  rest = oml_uri_strip_compression(compression_uris[_i].uri, &compression);
+  fail_unless(compression == compression_uris[_i].compression,
+      "Invalid compression for `%s': %d instead of %d", compression_uris[_i].uri,
+      compression, compression_uris[_i].compression);
+  if (compression_uris[_i].rest) {
+    fail_unless(rest && !strcmp(rest, compression_uris[_i].rest),
+        "Invalid remainder for `%s': `%s' instead of `%s'", compression_uris[_i].uri,
+        rest, compression_uris[_i].rest);
+  } else {
+    fail_unless(rest == NULL, "Unsupported compression accepted in `%s'", compression_uris[_i].uri);
+  }
+}
+END_TEST
+
 START_TEST (test_util_find)
 {
   char ws[] = "   ";
@@ -170,6 +202,7 @@ Suite* util_suite (void)
   TCase* tc_util = tcase_create ("Util");
 
   tcase_add_test (tc_util, test_util_uri);
+  tcase_add_loop_test (tc_util, test_util_uri_compression, 0, LENGTH(compression_uris));
   tcase_add_test (tc_util, test_util_find);
   tcase_add_loop_test (tc_util, test_util_parse_uri, 0, LENGTH(test_uris));
 
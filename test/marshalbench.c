@@ -0,0 +1,205 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file marshalbench.c
+ * \brief Compare OMSP binary packet sizes and decoding speed across protocols.
+ *
+ * For each of a few representative schemas, marshal NSAMPLES samples, as a
+ * client would, using full packets (OMSPv5), compact packets (OMSPv7) and
+ * batch packets of BATCH_ROWS rows (OMSPv8), then unmarshal them all back, as
+ * the server would. The average number of bytes per sample on the wire, and
+ * the average wall-clock time spent decoding each sample are printed.
+ *
+ * A different number of samples can be given as the only argument.
+ *
+ *   marshalbench [NSAMPLES]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oml2/omlc.h"
+#include "ocomm/o_log.h"
+#include "oml_value.h"
+#include "mbuf.h"
+#include "marshal.h"
+
+#define NSAMPLES 262144
+#define MAX_FIELDS 4
+/** Number of rows in each OMSPv8 batch packet */
+#define BATCH_ROWS 64
+
+/** A representative schema */
+typedef struct {
+  const char *name;
+  int nfields;
+  OmlValueT types[MAX_FIELDS];
+} BenchSchema;
+
+static BenchSchema schemas[] = {
+  { "counter",  2, { OML_UINT32_VALUE, OML_UINT64_VALUE } },
+  { "rtt",      3, { OML_UINT32_VALUE, OML_INT32_VALUE, OML_DOUBLE_VALUE } },
+  { "iface",    4, { OML_UINT32_VALUE, OML_UINT64_VALUE, OML_UINT64_VALUE, OML_INT32_VALUE } },
+};
+
+#define LENGTH(a) (sizeof (a) / sizeof (a[0]))
+
+/** Get the current monotonic time, in ns */
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Fill values with plausible content for sample n of schema s */
+static void
+fill_values (BenchSchema *s, OmlValue *values, unsigned long n)
+{
+  int i;
+  for (i = 0; i < s->nfields; i++) {
+    OmlValueU *v = oml_value_get_value (&values[i]);
+    oml_value_set_type (&values[i], s->types[i]);
+    switch (s->types[i]) {
+    case OML_UINT32_VALUE: omlc_set_uint32 (*v, n % 16); break;
+    case OML_INT32_VALUE:  omlc_set_int32 (*v, (int32_t)(n % 200) - 100); break;
+    case OML_UINT64_VALUE: omlc_set_uint64 (*v, (uint64_t)n * 1500); break;
+    case OML_DOUBLE_VALUE: omlc_set_double (*v, 12.5 + (n % 7) * 0.1); break;
+    default: break;
+    }
+  }
+}
+
+/** Marshal nsamples samples of schema s into mbuf, as protocol
+ *
+ * \return the number of bytes written
+ */
+static size_t
+encode (BenchSchema *s, MBuffer *mbuf, unsigned long nsamples, int protocol)
+{
+  OmlValue values[MAX_FIELDS];
+  OmlBinStreamState state = { 0, 0 };
+  unsigned long n;
+  size_t offset = 0;
+  double ts;
+
+  oml_value_array_init (values, MAX_FIELDS);
+  mbuf_clear (mbuf);
+  for (n = 0; n < nsamples; n++) {
+    fill_values (s, values, n);
+    ts = (double)(n / 1000) + 0.000001 * ((n % 1000) * 1000 + 17);
+    if (protocol >= OMB_BATCH_PROTOCOL) {
+      if (0 == n % BATCH_ROWS) {
+        marshal_init (mbuf, OMB_BATCH_P);
+        offset = mbuf_message_offset (mbuf);
+        marshal_batch_init (mbuf, 1);
+      } else {
+        mbuf_begin_write (mbuf);
+      }
+      marshal_batch_row (mbuf, n + 1, ts, &state, 0 == n);
+      marshal_batch_values (mbuf, values, s->nfields, protocol);
+      marshal_batch_finalize (mbuf, offset, s->nfields);
+      continue;
+    } else if (protocol >= OMB_COMPACT_PROTOCOL) {
+      marshal_init (mbuf, OMB_CDATA_P);
+      marshal_measurements_compact (mbuf, 1, n + 1, ts, &state, 0 == n);
+    } else {
+      marshal_init (mbuf, OMB_DATA_P);
+      marshal_measurements2 (mbuf, 1, n + 1, ts, protocol);
+    }
+    marshal_values2 (mbuf, values, s->nfields, protocol);
+    marshal_finalize (mbuf);
+  }
+  oml_value_array_reset (values, MAX_FIELDS);
+
+  return mbuf_fill (mbuf);
+}
+
+/** Unmarshal all samples in mbuf
+ *
+ * \return the number of samples decoded
+ */
+static unsigned long
+decode (MBuffer *mbuf)
+{
+  OmlBinStreamState states[OMB_MAX_STREAMS];
+  OmlValue values[MAX_FIELDS];
+  OmlBinaryHeader header;
+  unsigned long n = 0;
+  int i;
+
+  memset (states, 0, sizeof (states));
+  oml_value_array_init (values, MAX_FIELDS);
+  mbuf_reset_read (mbuf);
+  while (unmarshal_init2 (mbuf, &header, states) > 0) {
+    for (i = 0; i < header.rows; i++) {
+      if ((OMB_BATCH_P == header.type && unmarshal_batch_row (mbuf, &header, states)) ||
+          unmarshal_values (mbuf, &header, values, MAX_FIELDS) < 0) {
+        break;
+      }
+      n++;
+    }
+    mbuf_consume_message (mbuf);
+  }
+  oml_value_array_reset (values, MAX_FIELDS);
+
+  return n;
+}
+
+int
+main (int argc, const char **argv)
+{
+  int protocols[] = { 5, OMB_COMPACT_PROTOCOL, OMB_BATCH_PROTOCOL };
+  unsigned long nsamples = NSAMPLES, decoded;
+  unsigned int i, j;
+  size_t len;
+  double start, elapsed;
+  MBuffer *mbuf = mbuf_create ();
+
+  if (argc > 1) {
+    nsamples = strtoul (argv[1], NULL, 10);
+  }
+  o_set_log_level (O_LOG_ERROR);
+
+  printf ("# %lu samples per run\n", nsamples);
+  printf ("# schema\tprotocol\tbytes/sample\tdecode ns/sample\n");
+
+  for (i = 0; i < LENGTH (schemas); i++) {
+    for (j = 0; j < LENGTH (protocols); j++) {
+      len = encode (&schemas[i], mbuf, nsamples, protocols[j]);
+
+      start = now_ns ();
+      decoded = decode (mbuf);
+      elapsed = now_ns () - start;
+
+      if (decoded != nsamples) {
+        fprintf (stderr, "Only decoded %lu/%lu %s samples as OMSPv%d\n",
+            decoded, nsamples, schemas[i].name, protocols[j]);
+        return 1;
+      }
+      printf ("%s\t%d\t%.2f\t%.1f\n", schemas[i].name, protocols[j],
+          (double)len / nsamples, elapsed / nsamples);
+    }
+  }
+
+  mbuf_destroy (mbuf);
+
+  return 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
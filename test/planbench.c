@@ -0,0 +1,175 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file planbench.c
+ * \brief Compare the cost of marshalling samples with and without a MarshalPlan.
+ *
+ * For schemas of 4, 16 and 64 fields, cycling through a mix of integer,
+ * double, string and boolean types, NSAMPLES samples are marshalled into full
+ * packets (OMSPv5) and compact packets (OMSPv7), first with marshal_values2,
+ * then with marshal_plan_values. The average wall-clock time spent encoding
+ * each sample is printed for each; the benchmark fails if both do not
+ * produce exactly the same bytes.
+ *
+ * A different number of samples can be given as the only argument.
+ *
+ *   planbench [NSAMPLES]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oml2/omlc.h"
+#include "ocomm/o_log.h"
+#include "oml_value.h"
+#include "mbuf.h"
+#include "marshal.h"
+
+#define NSAMPLES 65536
+#define MAX_FIELDS 64
+
+/** Types the fields of the schemas cycle through */
+static const OmlValueT mix[] = {
+  OML_UINT32_VALUE, OML_INT64_VALUE, OML_DOUBLE_VALUE, OML_STRING_VALUE,
+  OML_UINT64_VALUE, OML_INT32_VALUE, OML_DOUBLE_VALUE, OML_BOOL_VALUE,
+};
+
+#define LENGTH(a) (sizeof (a) / sizeof (a[0]))
+
+/** Get the current monotonic time, in ns */
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Fill the nfields first values with plausible content for sample n */
+static void
+fill_values (OmlValue *values, int nfields, unsigned long n)
+{
+  int i;
+  for (i = 0; i < nfields; i++) {
+    OmlValueU *v = oml_value_get_value (&values[i]);
+    values[i].type = mix[i % LENGTH (mix)];
+    switch (values[i].type) {
+    case OML_UINT32_VALUE: omlc_set_uint32 (*v, n % 16); break;
+    case OML_INT32_VALUE:  omlc_set_int32 (*v, (int32_t)(n % 200) - 100); break;
+    case OML_UINT64_VALUE: omlc_set_uint64 (*v, (uint64_t)n * 1500); break;
+    case OML_INT64_VALUE:  omlc_set_int64 (*v, -(int64_t)n * i); break;
+    case OML_DOUBLE_VALUE: omlc_set_double (*v, 12.5 + (n % 7) * 0.1); break;
+    case OML_STRING_VALUE: omlc_set_const_string (*v, "eth0"); break;
+    case OML_BOOL_VALUE:   omlc_set_bool (*v, n & 1); break;
+    default: break;
+    }
+  }
+}
+
+/** Marshal nsamples samples of nfields fields into mbuf, as protocol,
+ * following plan if not NULL
+ *
+ * \return the time spent marshalling [ns]
+ */
+static double
+encode (MBuffer *mbuf, int nfields, unsigned long nsamples, int protocol, MarshalPlan *plan)
+{
+  OmlValue values[MAX_FIELDS];
+  OmlBinStreamState state = { 0, 0 };
+  unsigned long n;
+  double start, elapsed = 0;
+
+  oml_value_array_init (values, MAX_FIELDS);
+  mbuf_clear (mbuf);
+  for (n = 0; n < nsamples; n++) {
+    double ts = (double)(n / 1000) + 0.000001 * ((n % 1000) * 1000 + 17);
+    fill_values (values, nfields, n);
+
+    start = now_ns ();
+    if (protocol >= OMB_COMPACT_PROTOCOL) {
+      marshal_init (mbuf, OMB_CDATA_P);
+      marshal_measurements_compact (mbuf, 1, n + 1, ts, &state, 0 == n);
+    } else {
+      marshal_init (mbuf, OMB_DATA_P);
+      marshal_measurements2 (mbuf, 1, n + 1, ts, protocol);
+    }
+    if (plan) {
+      marshal_plan_values (mbuf, plan, 0, values, nfields);
+    } else {
+      marshal_values2 (mbuf, values, nfields, protocol);
+    }
+    marshal_finalize (mbuf);
+    elapsed += now_ns () - start;
+  }
+  /* Strings were not copied */
+  memset (values, 0, sizeof (values));
+
+  return elapsed;
+}
+
+int
+main (int argc, const char **argv)
+{
+  int protocols[] = { 5, OMB_COMPACT_PROTOCOL };
+  int sizes[] = { 4, 16, 64 };
+  OmlValueT types[MAX_FIELDS];
+  unsigned long nsamples = NSAMPLES;
+  unsigned int i, j;
+  int k;
+  double plain, planned;
+  MBuffer *mbuf = mbuf_create ();
+  MBuffer *ref = mbuf_create ();
+  MarshalPlan *plan;
+
+  if (argc > 1) {
+    nsamples = strtoul (argv[1], NULL, 10);
+  }
+  o_set_log_level (O_LOG_ERROR);
+
+  for (k = 0; k < MAX_FIELDS; k++) {
+    types[k] = mix[k % LENGTH (mix)];
+  }
+
+  printf ("# %lu samples per run\n", nsamples);
+  printf ("# fields\tprotocol\tvalues2 ns/sample\tplan ns/sample\n");
+
+  for (i = 0; i < LENGTH (sizes); i++) {
+    for (j = 0; j < LENGTH (protocols); j++) {
+      plain = encode (ref, sizes[i], nsamples, protocols[j], NULL);
+
+      plan = marshal_plan_new (types, sizes[i], protocols[j]);
+      planned = encode (mbuf, sizes[i], nsamples, protocols[j], plan);
+      marshal_plan_free (plan);
+
+      if (mbuf_fill (mbuf) != mbuf_fill (ref) ||
+          memcmp (mbuf_rdptr (mbuf), mbuf_rdptr (ref), mbuf_fill (ref))) {
+        fprintf (stderr, "Planned marshalling of %d fields as OMSPv%d differs\n",
+            sizes[i], protocols[j]);
+        return 1;
+      }
+      printf ("%d\t%d\t%.1f\t%.1f\n", sizes[i], protocols[j],
+          plain / nsamples, planned / nsamples);
+    }
+  }
+
+  mbuf_destroy (ref);
+  mbuf_destroy (mbuf);
+
+  return 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,233 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file quantilebench.c
+ * \brief Measure the accuracy and per-sample cost of the quantile filter.
+ *
+ * For several distributions, from uniform to heavy-tailed, NSAMPLES samples
+ * are added to a DDSketch, then fed to a quantile filter. The average
+ * wall-clock time spent per sample is printed for each, along with the
+ * relative error of the p50, p90, p99 and p999 estimates against the exact
+ * quantiles of the samples, and the size of the serialised sketch. The
+ * benchmark fails if any error exceeds the accuracy of the sketch.
+ *
+ * A different number of samples can be given as the first argument, and a
+ * different accuracy as the second.
+ *
+ *   quantilebench [NSAMPLES [ACCURACY]]
+ */
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_filter.h"
+#include "ocomm/o_log.h"
+#include "oml_value.h"
+#include "ddsketch.h"
+#include "filter/factory.h"
+
+#define NSAMPLES 1048576
+
+static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+#define LENGTH(a) (sizeof (a) / sizeof (a[0]))
+
+/** Get the current monotonic time, in ns */
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Get a uniformly distributed number in ]0, 1[ (xorshift64*) */
+static double
+uniform (void)
+{
+  static uint64_t x = 88172645463325252ULL;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  return ((x * 2685821657736338717ULL >> 11) + 0.5) / 9007199254740992.;
+}
+
+/** Uniform latencies between 0 and 1000 */
+static double
+dist_uniform (void)
+{
+  return 1000. * uniform ();
+}
+
+/** Exponential latencies, with a mean of 10 */
+static double
+dist_exponential (void)
+{
+  return -10. * log (uniform ());
+}
+
+/** Log-normal latencies, spanning several orders of magnitude */
+static double
+dist_lognormal (void)
+{
+  /* Box-Muller */
+  return exp (1. + 2. * sqrt (-2. * log (uniform ())) * cos (2. * M_PI * uniform ()));
+}
+
+/** Pareto (heavy-tailed) latencies, with a shape of 1.2 */
+static double
+dist_pareto (void)
+{
+  return pow (uniform (), -1. / 1.2);
+}
+
+/** Signed samples, centred on 0 */
+static double
+dist_signed (void)
+{
+  return dist_exponential () * (uniform () < 0.5 ? -1. : 1.);
+}
+
+static const struct {
+  const char *name;
+  double (*draw) (void);
+} dists[] = {
+  { "uniform", dist_uniform },
+  { "exponential", dist_exponential },
+  { "lognormal", dist_lognormal },
+  { "pareto", dist_pareto },
+  { "signed", dist_signed },
+};
+
+/** Sort doubles in increasing order, for qsort(3) */
+static int
+cmp_double (const void *a, const void *b)
+{
+  double x = *(const double*)a, y = *(const double*)b;
+  return x < y ? -1 : x > y;
+}
+
+/** Feed samples to a quantile filter
+ *
+ * \return the time spent [ns]
+ */
+static double
+run_filter (const double *samples, unsigned long nsamples, double accuracy)
+{
+  OmlFilter *f = create_filter ("quantile", "q", OML_DOUBLE_VALUE, NULL, 0);
+  OmlValue v;
+  unsigned long n;
+  double start, elapsed;
+
+  oml_value_init (&v);
+  oml_value_set_type (&v, OML_DOUBLE_VALUE);
+  omlc_set_double (*oml_value_get_value (&v), accuracy);
+  f->set (f, "accuracy", &v);
+
+  start = now_ns ();
+  for (n = 0; n < nsamples; n++) {
+    omlc_set_double (*oml_value_get_value (&v), samples[n]);
+    f->input (f, &v);
+  }
+  elapsed = now_ns () - start;
+
+  destroy_filter (f);
+  return elapsed;
+}
+
+int
+main (int argc, const char **argv)
+{
+  unsigned long nsamples = NSAMPLES, n;
+  double accuracy = DDSKETCH_DEFAULT_ACCURACY;
+  double *samples, *sorted;
+  double start, added, filtered, exact, estimate, err, max_err = 0.;
+  unsigned int i, j;
+  size_t size;
+  DDSketch *sketch;
+  int ret = 0;
+
+  if (argc > 1) {
+    nsamples = strtoul (argv[1], NULL, 10);
+  }
+  if (argc > 2) {
+    accuracy = strtod (argv[2], NULL);
+  }
+  o_set_log_level (O_LOG_ERROR);
+  register_builtin_filters ();
+
+  if (!nsamples || !(sketch = ddsketch_new (accuracy, DDSKETCH_DEFAULT_BINS))) {
+    fprintf (stderr, "Invalid number of samples or accuracy\n");
+    return 1;
+  }
+  samples = malloc (nsamples * sizeof (double));
+  sorted = malloc (nsamples * sizeof (double));
+
+  printf ("# %lu samples per run, accuracy %g, %d bins\n", nsamples, accuracy, DDSKETCH_DEFAULT_BINS);
+  printf ("# distribution\tsketch ns/sample\tfilter ns/sample\tsketch bytes");
+  for (j = 0; j < LENGTH (quantiles); j++) {
+    printf ("\tp%g rel. error", quantiles[j] * 100);
+  }
+  printf ("\n");
+
+  for (i = 0; i < LENGTH (dists); i++) {
+    for (n = 0; n < nsamples; n++) {
+      samples[n] = dists[i].draw ();
+    }
+
+    ddsketch_clear (sketch);
+    start = now_ns ();
+    for (n = 0; n < nsamples; n++) {
+      ddsketch_add (sketch, samples[n]);
+    }
+    added = now_ns () - start;
+
+    filtered = run_filter (samples, nsamples, accuracy);
+
+    size = ddsketch_encode (sketch, NULL, 0);
+    printf ("%s\t%.1f\t%.1f\t%zu", dists[i].name, added / nsamples, filtered / nsamples, size);
+
+    memcpy (sorted, samples, nsamples * sizeof (double));
+    qsort (sorted, nsamples, sizeof (double), cmp_double);
+    for (j = 0; j < LENGTH (quantiles); j++) {
+      exact = sorted[(unsigned long)(quantiles[j] * (nsamples - 1))];
+      estimate = ddsketch_quantile (sketch, quantiles[j]);
+      err = fabs (estimate - exact) / fabs (exact);
+      printf ("\t%.5f", err);
+      if (err > max_err) {
+        max_err = err;
+      }
+      if (err > accuracy) {
+        fprintf (stderr, "%s: p%g estimated as %g instead of %g\n",
+            dists[i].name, quantiles[j] * 100, estimate, exact);
+        ret = 1;
+      }
+    }
+    printf ("\n");
+  }
+  printf ("# maximal relative error %.5f\n", max_err);
+
+  ddsketch_free (sketch);
+  free (sorted);
+  free (samples);
+
+  return ret;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
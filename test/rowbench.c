@@ -0,0 +1,183 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file rowbench.c
+ * \brief Measure the per-sample cost of injecting string- and blob-heavy samples.
+ *
+ * NSAMPLES samples are injected into an MP with NSTRINGS strings of
+ * STRING_LEN characters, then into one with a BLOB_LEN-byte and a 64-byte
+ * blob, first with omlc_inject, then with the omlc_row_* API. The average
+ * wall-clock time spent per sample is printed for each.
+ *
+ * All --oml-* options are passed to liboml2; by default, the output is
+ * written to /dev/null. Use --oml-binary to measure the binary encoding, and
+ * --oml-samples N to put filters which do aggregate in the way. A different
+ * number of samples can be given as the only other argument.
+ *
+ *   rowbench [NSAMPLES] [--oml-collect URI] [--oml-...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "oml2/omlc.h"
+
+#define NSAMPLES 262144
+#define NSTRINGS 4
+#define STRING_LEN 64
+#define BLOB_LEN 1024
+
+static OmlMPDef strings_def[] = {
+  { "seq", OML_UINT32_VALUE, NULL },
+  { "host", OML_STRING_VALUE, NULL },
+  { "iface", OML_STRING_VALUE, NULL },
+  { "src", OML_STRING_VALUE, NULL },
+  { "dst", OML_STRING_VALUE, NULL },
+  { NULL, (OmlValueT)0, NULL }
+};
+
+static OmlMPDef blobs_def[] = {
+  { "seq", OML_UINT32_VALUE, NULL },
+  { "packet", OML_BLOB_VALUE, NULL },
+  { "header", OML_BLOB_VALUE, NULL },
+  { NULL, (OmlValueT)0, NULL }
+};
+
+#define LENGTH(a) (sizeof (a) / sizeof (a[0]))
+
+/** Get the current monotonic time, in ns */
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int
+main (int argc, const char **argv)
+{
+  const char *def_argv[] = {
+    "--oml-id", "rowbench",
+    "--oml-domain", "rowbench",
+    "--oml-collect", "file:/dev/null",
+    "--oml-bufsize", "1048576" };
+  const char **oml_argv;
+  char strings[NSTRINGS][STRING_LEN + 1];
+  unsigned char blob[BLOB_LEN];
+  OmlValueU v[NSTRINGS + 1];
+  unsigned long nsamples = NSAMPLES, n;
+  int oml_argc, i;
+  double start, elapsed;
+  OmlMP *smp, *bmp;
+  OmlRow *row;
+
+  /* Prepend the defaults, so they can be overridden from the command line */
+  oml_argv = malloc ((argc + LENGTH (def_argv)) * sizeof (char*));
+  oml_argv[0] = argv[0];
+  memcpy (oml_argv + 1, def_argv, sizeof (def_argv));
+  for (i = 1, oml_argc = 1 + LENGTH (def_argv); i < argc; i++) {
+    if (!strncmp (argv[i], "--oml-", 6)) {
+      oml_argv[oml_argc++] = argv[i];
+      if (i + 1 < argc && strncmp (argv[i + 1], "--", 2)) {
+        oml_argv[oml_argc++] = argv[++i];
+      }
+    } else {
+      nsamples = strtoul (argv[i], NULL, 10);
+    }
+  }
+
+  if (omlc_init ("rowbench", &oml_argc, oml_argv, NULL)) {
+    fprintf (stderr, "Could not initialise OML\n");
+    return 1;
+  }
+  if (!(smp = omlc_add_mp ("strings", strings_def)) ||
+      !(bmp = omlc_add_mp ("blobs", blobs_def))) {
+    fprintf (stderr, "Could not add MPs\n");
+    return 1;
+  }
+  if (omlc_start ()) {
+    fprintf (stderr, "Could not start OML\n");
+    return 1;
+  }
+
+  for (i = 0; i < NSTRINGS; i++) {
+    memset (strings[i], 'a' + i, STRING_LEN);
+    strings[i][STRING_LEN] = '\0';
+  }
+  for (i = 0; i < BLOB_LEN; i++) {
+    blob[i] = i;
+  }
+
+  printf ("# %lu samples per run\n", nsamples);
+  printf ("# MP\tAPI\tns/sample\n");
+
+  omlc_zero_array (v, LENGTH (v));
+  start = now_ns ();
+  for (n = 0; n < nsamples; n++) {
+    omlc_set_uint32 (v[0], n);
+    for (i = 0; i < NSTRINGS; i++) {
+      omlc_set_const_string (v[i + 1], strings[i]);
+    }
+    omlc_inject (smp, v);
+  }
+  elapsed = now_ns () - start;
+  printf ("strings\tinject\t%.1f\n", elapsed / nsamples);
+
+  start = now_ns ();
+  for (n = 0; n < nsamples; n++) {
+    row = omlc_row_begin (smp);
+    omlc_row_set_uint32 (row, 0, n);
+    for (i = 0; i < NSTRINGS; i++) {
+      omlc_row_set_string (row, i + 1, strings[i]);
+    }
+    omlc_row_commit (row);
+  }
+  elapsed = now_ns () - start;
+  printf ("strings\trow\t%.1f\n", elapsed / nsamples);
+
+  omlc_zero_array (v, LENGTH (v));
+  start = now_ns ();
+  for (n = 0; n < nsamples; n++) {
+    omlc_set_uint32 (v[0], n);
+    omlc_set_blob_ptr (v[1], blob);
+    omlc_set_blob_length (v[1], BLOB_LEN);
+    omlc_set_blob_ptr (v[2], blob);
+    omlc_set_blob_length (v[2], 64);
+    omlc_inject (bmp, v);
+  }
+  elapsed = now_ns () - start;
+  printf ("blobs\tinject\t%.1f\n", elapsed / nsamples);
+
+  start = now_ns ();
+  for (n = 0; n < nsamples; n++) {
+    row = omlc_row_begin (bmp);
+    omlc_row_set_uint32 (row, 0, n);
+    omlc_row_set_blob (row, 1, blob, BLOB_LEN);
+    omlc_row_set_blob (row, 2, blob, 64);
+    omlc_row_commit (row);
+  }
+  elapsed = now_ns () - start;
+  printf ("blobs\trow\t%.1f\n", elapsed / nsamples);
+
+  omlc_close ();
+  free (oml_argv);
+
+  return 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
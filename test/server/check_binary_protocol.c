@@ -217,6 +217,220 @@ START_TEST(test_binary_resync)
 }
 END_TEST
 
+START_TEST(test_binary_compact)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  MBuffer* mbuf = mbuf_create();
+  OmlBinStreamState state = { 0, 0 };
+
+  char domain[] = "binary-compact-test";
+  char dbname[sizeof(domain)+3];
+  char table[] = "compact_table";
+  /* The third timestamp is not an integer number of microseconds */
+  double times[] = { 1.096202, 2.092702, 3.14159265358979, 4.5 };
+  int32_t seqnos[] = { 1, 2, 5, 6 };
+  int32_t sizes[] = { -3, 106037248, 0, INT32_MIN };
+  unsigned int i;
+
+  char h1[200];
+  char select1[200];
+
+  OmlValue v[2];
+  oml_value_array_init(v, 2);
+
+  int rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h1, sizeof(h1),  "protocol: 7\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s size:int32 value:double\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select1, sizeof(select1), "select oml_ts_client, oml_seq, size, value from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary compact socket";
+  ch = check_server_prepare_client_handler("test_binary_compact", &source);
+  client_callback(&source, ch, h1, strlen(h1));
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+
+  for (i = 0; i < LENGTH(times); i++) {
+    logdebug("Sending compact sample %d, in two steps\n", seqnos[i]);
+    oml_value_set_type(&v[0], OML_INT32_VALUE);
+    omlc_set_int32(*oml_value_get_value(&v[0]), sizes[i]);
+    oml_value_set_type(&v[1], OML_DOUBLE_VALUE);
+    omlc_set_double(*oml_value_get_value(&v[1]), times[i] / 3.);
+    mbuf_clear(mbuf);
+    marshal_init(mbuf, OMB_CDATA_P);
+    marshal_measurements_compact(mbuf, 1, seqnos[i], times[i], &state, 0 == i);
+    marshal_values2(mbuf, v, 2, OMB_COMPACT_PROTOCOL);
+    marshal_finalize(mbuf);
+    printmbuf(mbuf);
+    client_callback(&source, ch, mbuf_buffer(mbuf), 5);
+    fail_if(ch->state == C_PROTOCOL_ERROR, "An incomplete compact sample confused the client_handler");
+    client_callback(&source, ch, mbuf_buffer(mbuf)+5, mbuf_rd_remaining(mbuf)-5);
+    fail_unless(ch->state == C_BINARY_DATA, "Compact sample %d confused the client_handler", seqnos[i]);
+  }
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  mbuf_destroy(mbuf);
+  oml_value_array_reset(v, 2);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select1, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select1, rc);
+
+  for (i = 0; i < LENGTH(times); i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == 100, "Step %d of statement `%s' failed; rc=%d", i, select1, rc);
+    fail_unless(fabs(sqlite3_column_double(stmt, 0) - times[i]) < 1e-8,
+        "Invalid oml_ts_client in row %d: expected `%f', got `%f'",
+        i, times[i], sqlite3_column_double(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == seqnos[i],
+        "Invalid oml_seq in row %d: expected `%d', got `%d'",
+        i, seqnos[i], sqlite3_column_int(stmt, 1));
+    fail_unless(sqlite3_column_int(stmt, 2) == sizes[i],
+        "Invalid size in row %d: expected `%d', got `%d'",
+        i, sizes[i], sqlite3_column_int(stmt, 2));
+    fail_unless(sqlite3_column_double(stmt, 3) == times[i] / 3.,
+        "Invalid value in row %d: expected `%.17g', got `%.17g'",
+        i, times[i] / 3., sqlite3_column_double(stmt, 3));
+  }
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+START_TEST(test_binary_batch)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  MBuffer* mbuf = mbuf_create();
+  OmlBinStreamState state[2] = { { 0, 0 }, { 0, 0 } };
+
+  char domain[] = "binary-batch-test";
+  char dbname[sizeof(domain)+3];
+  char table[] = "batch_table";
+  double times[] = { 1.096202, 1.096302, 3.14159265358979, 4.5, 4.75, 5. };
+  int32_t seqnos[] = { 1, 2, 5, 6, 7, 8 };
+  int32_t sizes[] = { -3, 106037248, 0, INT32_MIN, 42, 7 };
+  /* Rows in each batch; the second one only contains one row */
+  int batches[] = { 3, 1, 1 };
+  unsigned int i, j, n;
+  size_t offset;
+
+  char h1[200];
+  char select1[200];
+
+  OmlValue v[2];
+  oml_value_array_init(v, 2);
+
+  int rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h1, sizeof(h1),  "protocol: 8\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s size:int32 value:double\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select1, sizeof(select1), "select oml_ts_client, oml_seq, size, value from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary batch socket";
+  ch = check_server_prepare_client_handler("test_binary_batch", &source);
+  client_callback(&source, ch, h1, strlen(h1));
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+
+  oml_value_set_type(&v[0], OML_INT32_VALUE);
+  oml_value_set_type(&v[1], OML_DOUBLE_VALUE);
+  for (i = 0, n = 0; i < LENGTH(batches); i++) {
+    if (1 == i) {
+      /* A batch for an undefined stream, which should be skipped entirely */
+      marshal_init(mbuf, OMB_BATCH_P);
+      offset = mbuf_message_offset(mbuf);
+      marshal_batch_init(mbuf, 2);
+      for (j = 0; j < 2; j++) {
+        mbuf_begin_write(mbuf);
+        marshal_batch_row(mbuf, j, 1. + j, &state[0], 0 == j);
+        marshal_batch_values(mbuf, v, 2, OMB_BATCH_PROTOCOL);
+        marshal_batch_finalize(mbuf, offset, 2);
+      }
+    }
+    marshal_init(mbuf, OMB_BATCH_P);
+    offset = mbuf_message_offset(mbuf);
+    marshal_batch_init(mbuf, 1);
+    for (j = 0; j < (unsigned int)batches[i]; j++, n++) {
+      mbuf_begin_write(mbuf);
+      omlc_set_int32(*oml_value_get_value(&v[0]), sizes[n]);
+      omlc_set_double(*oml_value_get_value(&v[1]), times[n] / 3.);
+      marshal_batch_row(mbuf, seqnos[n], times[n], &state[1], 0 == n);
+      marshal_batch_values(mbuf, v, 2, OMB_BATCH_PROTOCOL);
+      marshal_batch_finalize(mbuf, offset, 2);
+    }
+    mbuf_begin_write(mbuf);
+  }
+  /* Followed by a compact message delta-encoded against the last row */
+  omlc_set_int32(*oml_value_get_value(&v[0]), sizes[n]);
+  omlc_set_double(*oml_value_get_value(&v[1]), times[n] / 3.);
+  marshal_init(mbuf, OMB_CDATA_P);
+  marshal_measurements_compact(mbuf, 1, seqnos[n], times[n], &state[1], 0);
+  marshal_values2(mbuf, v, 2, OMB_BATCH_PROTOCOL);
+  marshal_finalize(mbuf);
+  printmbuf(mbuf);
+
+  /* Feed the data in small pieces, to exercise incomplete batches */
+  for (offset = 0; offset < mbuf_fill(mbuf); offset += 7) {
+    client_callback(&source, ch, mbuf_buffer(mbuf) + offset,
+        (mbuf_fill(mbuf) - offset < 7) ? mbuf_fill(mbuf) - offset : 7);
+    fail_unless(ch->state == C_BINARY_DATA, "Batch data at offset %d confused the client_handler", offset);
+  }
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  mbuf_destroy(mbuf);
+  oml_value_array_reset(v, 2);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select1, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select1, rc);
+
+  for (i = 0; i < LENGTH(times); i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == 100, "Step %d of statement `%s' failed; rc=%d", i, select1, rc);
+    fail_unless(fabs(sqlite3_column_double(stmt, 0) - times[i]) < 1e-8,
+        "Invalid oml_ts_client in row %d: expected `%f', got `%f'",
+        i, times[i], sqlite3_column_double(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == seqnos[i],
+        "Invalid oml_seq in row %d: expected `%d', got `%d'",
+        i, seqnos[i], sqlite3_column_int(stmt, 1));
+    fail_unless(sqlite3_column_int(stmt, 2) == sizes[i],
+        "Invalid size in row %d: expected `%d', got `%d'",
+        i, sizes[i], sqlite3_column_int(stmt, 2));
+    fail_unless(sqlite3_column_double(stmt, 3) == times[i] / 3.,
+        "Invalid value in row %d: expected `%.17g', got `%.17g'",
+        i, times[i] / 3., sqlite3_column_double(stmt, 3));
+  }
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
 START_TEST(test_binary_flexibility)
 {
   /* XXX: Code duplication with check_text_protocol.c:test_text_flexibility */
@@ -589,6 +803,8 @@ Suite* binary_protocol_suite (void)
   TCase* tc_bin_flex = tcase_create ("Binary flexibility");
   tcase_add_test (tc_bin_flex, test_binary_flexibility);
   tcase_add_test (tc_bin_flex, test_binary_metadata);
+  tcase_add_test (tc_bin_flex, test_binary_compact);
+  tcase_add_test (tc_bin_flex, test_binary_batch);
   suite_add_tcase (s, tc_bin_flex);
 
   return s;
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_columnar_adapter.c
+ * \brief Tests the storage and reopening of databases in the columnar backend.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <check.h>
+
+#include "ocomm/o_log.h"
+#include "oml_util.h"
+#include "oml_value.h"
+#include "mem.h"
+#include "schema.h"
+#include "database.h"
+#include "columnar_adapter.h"
+
+extern char *dbbackend;
+extern char *sqlite_database_dir;
+
+static char *saved_dbbackend;
+
+static void
+columnar_setup (void)
+{
+  saved_dbbackend = dbbackend;
+  dbbackend = "columnar";
+  sqlite_database_dir = ".";
+}
+
+static void
+columnar_teardown (void)
+{
+  dbbackend = saved_dbbackend;
+}
+
+/** Read a whole segment file
+ *
+ * \param path path to the file
+ * \param[out] len length of the file
+ * \return an oml_malloc'd buffer with the contents of the file (or fail the test)
+ */
+static char*
+read_segment (const char *path, size_t *len)
+{
+  FILE *f = fopen (path, "r");
+  char *buf;
+
+  fail_if (f == NULL, "Cannot open segment file %s", path);
+  fseek (f, 0, SEEK_END);
+  *len = ftell (f);
+  rewind (f);
+  buf = oml_malloc (*len + 1);
+  fail_unless (fread (buf, 1, *len, f) == *len, "Cannot read segment file %s", path);
+  fclose (f);
+  return buf;
+}
+
+/** Check that samples, metadata and senders are stored, and found again when reopening the database */
+START_TEST(test_columnar_reopen)
+{
+  Database *db;
+  DbTable *table;
+  struct schema *schema;
+  OmlValue v[2];
+  OmlValueU u;
+  char *buf, *value;
+  size_t len;
+  uint64_t *offsets;
+  const char *strings[] = { "first", "", "third sample" };
+  int i;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  fail_unless(system ("rm -rf columnar-test.col") == 0, "Cannot remove pre-existing database");
+  fail_unless(database_setup_backend (dbbackend) == 0, "Cannot setup columnar backend");
+
+  db = database_find ("columnar-test");
+  fail_if(db == NULL, "Cannot create columnar database");
+  fail_unless(db->set_metadata (db, "start_time", "1332132092") == 0);
+  fail_unless(db->add_sender_id (db, "alice") == 1);
+  fail_unless(db->add_sender_id (db, "bob") == 2);
+  fail_unless(db->add_sender_id (db, "alice") == 1);
+
+  schema = schema_from_meta ("1 columnar_table n:int32 s:string");
+  table = database_find_or_create_table (db, schema);
+  fail_if(table == NULL, "Cannot create table");
+
+  oml_value_array_init (v, 2);
+  for (i = 0; i < (int)LENGTH (strings); i++) {
+    omlc_zero (u);
+    omlc_set_int32 (u, 10 * i);
+    oml_value_set (&v[0], &u, OML_INT32_VALUE);
+    omlc_zero (u);
+    omlc_set_const_string (u, strings[i]);
+    oml_value_set (&v[1], &u, OML_STRING_VALUE);
+    fail_unless(database_insert (db, table, 2, i + 1, i * 0.5, v, 2) == 0,
+        "Cannot insert sample %d", i);
+  }
+  oml_value_array_reset (v, 2);
+  database_release (db);
+
+  /* Check the files */
+  buf = read_segment ("columnar-test.col/columnar_table/n.dat", &len);
+  fail_unless(len == LENGTH (strings) * sizeof (int32_t),
+      "Invalid size of column n: expected %d, got %d", (int)(LENGTH (strings) * sizeof (int32_t)), (int)len);
+  for (i = 0; i < (int)LENGTH (strings); i++) {
+    fail_unless(((int32_t*)buf)[i] == 10 * i,
+        "Invalid value in row %d of column n: expected %d, got %d", i, 10 * i, ((int32_t*)buf)[i]);
+  }
+  oml_free (buf);
+
+  offsets = (uint64_t*)read_segment ("columnar-test.col/columnar_table/s.off", &len);
+  fail_unless(len == LENGTH (strings) * sizeof (uint64_t));
+  buf = read_segment ("columnar-test.col/columnar_table/s.dat", &len);
+  fail_unless(len == offsets[LENGTH (strings) - 1]);
+  for (i = 0; i < (int)LENGTH (strings); i++) {
+    size_t start = i ? offsets[i - 1] : 0;
+    fail_unless(offsets[i] - start == strlen (strings[i]) &&
+        !strncmp (buf + start, strings[i], strlen (strings[i])),
+        "Invalid value in row %d of column s: expected `%s', got `%.*s'",
+        i, strings[i], (int)(offsets[i] - start), buf + start);
+  }
+  oml_free (buf);
+  oml_free (offsets);
+
+  /* Reopen the database */
+  db = database_find ("columnar-test");
+  fail_if(db == NULL, "Cannot reopen columnar database");
+  fail_unless(db->start_time == 1332132092, "Invalid start time: got %ld", (long)db->start_time);
+  value = db->get_metadata (db, "table_columnar_table");
+  fail_if(value == NULL, "Schema of table not found in metadata");
+  oml_free (value);
+  fail_unless(db->add_sender_id (db, "bob") == 2);
+  fail_unless(db->add_sender_id (db, "carol") == 3);
+
+  table = database_find_table (db, "columnar_table");
+  fail_if(table == NULL, "Table not found after reopening");
+  fail_unless(schema_diff (schema, table->schema) == 0, "Schema of table differs after reopening");
+  fail_unless(((ColTable*)table->handle)->nrows == LENGTH (strings),
+      "Invalid number of samples after reopening: expected %d, got %d",
+      (int)LENGTH (strings), (int)((ColTable*)table->handle)->nrows);
+
+  database_release (db);
+  schema_free (schema);
+}
+END_TEST
+
+Suite*
+columnar_adapter_suite (void)
+{
+  Suite* s = suite_create ("Columnar adapter");
+
+  TCase* tc_columnar = tcase_create ("Columnar storage");
+  tcase_add_checked_fixture (tc_columnar, columnar_setup, columnar_teardown);
+  tcase_add_test (tc_columnar, test_columnar_reopen);
+  suite_add_tcase (s, tc_columnar);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,128 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_ingest.c
+ * \brief Tests the accounting of the memory used by samples waiting to be inserted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+#include "ocomm/o_log.h"
+#include "oml_value.h"
+#include "schema.h"
+#include "database.h"
+#include "ingest.h"
+
+extern char *dbbackend;
+extern char *sqlite_database_dir;
+
+/** Number of times the drain hook was called */
+static int drains;
+
+static void
+count_drains (void)
+{
+  __atomic_add_fetch (&drains, 1, __ATOMIC_SEQ_CST);
+}
+
+/** Check that queued samples are charged to their IngestAccount until inserted */
+START_TEST(test_ingest_account)
+{
+  Database *db;
+  DbTable *table;
+  struct schema *schema;
+  IngestAccount *account;
+  OmlValue v[2];
+  OmlValueU u;
+  size_t bytes;
+  int i;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  dbbackend = "sqlite";
+  sqlite_database_dir = ".";
+  ingest_queue_size = 16;
+  fail_unless(system ("rm -f ingest-test.sq3") == 0, "Cannot remove pre-existing database");
+  fail_unless(database_setup_backend (dbbackend) == 0, "Cannot setup sqlite backend");
+  ingest_set_drain_hook (count_drains);
+  drains = 0;
+
+  db = database_find ("ingest-test");
+  fail_if(db == NULL, "Cannot create database");
+  fail_if(db->ingest == NULL, "Database has no IngestQueue");
+  schema = schema_from_meta ("1 ingest_table n:int32 s:string");
+  table = database_find_or_create_table (db, schema);
+  fail_if(table == NULL, "Cannot create table");
+  account = ingest_account_new ();
+  fail_if(account == NULL, "Cannot create IngestAccount");
+
+  /* Prevent the writer thread from inserting anything */
+  database_lock (db);
+
+  oml_value_array_init (v, 2);
+  for (i = 0; i < 8; i++) {
+    omlc_zero (u);
+    omlc_set_int32 (u, i);
+    oml_value_set (&v[0], &u, OML_INT32_VALUE);
+    omlc_zero (u);
+    omlc_set_const_string (u, "a string of some length");
+    oml_value_set (&v[1], &u, OML_STRING_VALUE);
+    fail_unless(database_insert_from (db, account, table, 1, i + 1, i * 0.5, v, 2) == 0,
+        "Cannot queue sample %d", i);
+  }
+  oml_value_array_reset (v, 2);
+
+  bytes = ingest_account_bytes (account);
+  fail_unless(bytes >= 8 * (2 * sizeof (OmlValue) + strlen ("a string of some length")),
+      "Queued samples not charged to their account: %zu bytes", bytes);
+  fail_unless(ingest_queued_bytes () == bytes,
+      "Total of queued samples differs from the only account: %zu != %zu bytes",
+      ingest_queued_bytes (), bytes);
+  fail_unless(ingest_queue_load (db->ingest) == 0.5,
+      "Invalid queue load: expected 0.5, got %f", ingest_queue_load (db->ingest));
+
+  /* The account outlives the client while samples are queued */
+  ingest_account_release (account);
+  database_unlock (db);
+  database_release (db);
+
+  fail_unless(ingest_queued_bytes () == 0,
+      "Memory of inserted samples not released: %zu bytes", ingest_queued_bytes ());
+  fail_unless(drains > 0, "Drain hook not called");
+
+  ingest_set_drain_hook (NULL);
+  ingest_queue_size = DEFAULT_INGEST_QUEUE_SIZE;
+  schema_free (schema);
+}
+END_TEST
+
+Suite*
+ingest_suite (void)
+{
+  Suite* s = suite_create ("Ingest");
+
+  TCase* tc_account = tcase_create ("Memory accounting");
+  tcase_add_test (tc_account, test_ingest_account);
+  suite_add_tcase (s, tc_account);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
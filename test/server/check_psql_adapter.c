@@ -0,0 +1,129 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_psql_adapter.c
+ * \brief Tests the binary COPY data generated by the PostgreSQL adapter.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "mbuf.h"
+#include "oml_value.h"
+#include "schema.h"
+#include "database.h"
+#include "psql_adapter.h"
+
+/** Schema of the test table */
+static const char meta[] = "1 copy_table i:int32 u:uint32 ul:uint64 d:double s:string b:bool g:guid";
+
+/** Binary COPY of one sample of meta, with the values set by set_sample */
+static const uint8_t expected_copy[] = {
+  'P', 'G', 'C', 'O', 'P', 'Y', '\n', 0377, '\r', '\n', 0, /* Signature */
+  0, 0, 0, 0,  0, 0, 0, 0,                                 /* Flags, header extension */
+  0x00, 0x0b,                                              /* 4 metadata + 7 fields */
+  0, 0, 0, 4,  0, 0, 0, 2,                                 /* oml_sender_id */
+  0, 0, 0, 4,  0, 0, 0, 3,                                 /* oml_seq */
+  0, 0, 0, 8,  0x3f, 0xf8, 0, 0, 0, 0, 0, 0,               /* oml_ts_client 1.5 */
+  0, 0, 0, 8,  0x40, 0x04, 0, 0, 0, 0, 0, 0,               /* oml_ts_server 2.5 */
+  0, 0, 0, 4,  0xff, 0xff, 0xff, 0xfe,                     /* i -2 */
+  0, 0, 0, 8,  0, 0, 0, 0, 0xee, 0x6b, 0x28, 0x00,         /* u 4000000000, as INT8 */
+  0, 0, 0, 8,  0, 0, 0, 0, 0, 0, 0, 5,                     /* ul 5 */
+  0, 0, 0, 8,  0x3f, 0xe0, 0, 0, 0, 0, 0, 0,               /* d 0.5 */
+  0, 0, 0, 2,  'a', 'b',                                   /* s "ab" */
+  0, 0, 0, 1,  1,                                          /* b true */
+  0xff, 0xff, 0xff, 0xff,                                  /* g NULL */
+  0xff, 0xff,                                              /* Trailer */
+};
+
+/** Set the values of a sample of meta */
+static void
+set_sample (OmlValue *v, uint64_t ul)
+{
+  OmlValueU u;
+
+  omlc_zero (u); omlc_set_int32 (u, -2); oml_value_set (&v[0], &u, OML_INT32_VALUE);
+  omlc_zero (u); omlc_set_uint32 (u, 4000000000U); oml_value_set (&v[1], &u, OML_UINT32_VALUE);
+  omlc_zero (u); omlc_set_uint64 (u, ul); oml_value_set (&v[2], &u, OML_UINT64_VALUE);
+  omlc_zero (u); omlc_set_double (u, 0.5); oml_value_set (&v[3], &u, OML_DOUBLE_VALUE);
+  omlc_zero (u); omlc_set_const_string (u, "ab"); oml_value_set (&v[4], &u, OML_STRING_VALUE);
+  omlc_zero (u); omlc_set_bool (u, OMLC_BOOL_TRUE); oml_value_set (&v[5], &u, OML_BOOL_VALUE);
+  omlc_zero (u); omlc_set_guid (u, OMLC_GUID_NULL); oml_value_set (&v[6], &u, OML_GUID_VALUE);
+}
+
+START_TEST(test_psql_copy_encode)
+{
+  Database db;
+  DbTable table;
+  OmlValue v[7];
+  PsqlRow row;
+  MBuffer *mbuf = mbuf_create ();
+  size_t i;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  memset (&db, 0, sizeof (db));
+  strncpy (db.name, "copy-test", sizeof (db.name) - 1);
+  memset (&table, 0, sizeof (table));
+  table.schema = schema_from_meta (meta);
+  fail_if(table.schema == NULL, "Cannot parse schema '%s'", meta);
+
+  oml_value_array_init (v, 7);
+  set_sample (v, 5);
+  row.sender_id = 2;
+  row.seq_no = 3;
+  row.time_stamp = 1.5;
+  row.time_stamp_server = 2.5;
+  row.values = v;
+
+  fail_unless(psql_copy_encode (&db, &table, mbuf, &row, 1) == 0, "Cannot encode COPY data");
+  fail_unless(mbuf_fill (mbuf) == sizeof (expected_copy),
+      "Invalid COPY data length: expected %zu, got %zu", sizeof (expected_copy), mbuf_fill (mbuf));
+  for (i = 0; i < sizeof (expected_copy); i++) {
+    fail_unless(mbuf_rdptr (mbuf)[i] == expected_copy[i],
+        "Invalid COPY data at offset %zu: expected 0x%02x, got 0x%02x",
+        i, expected_copy[i], mbuf_rdptr (mbuf)[i]);
+  }
+
+  /* Unsigned values which do not fit in a BIGINT are left to the prepared INSERT */
+  set_sample (v, UINT64_C(0x8000000000000000));
+  fail_unless(psql_copy_encode (&db, &table, mbuf, &row, 1) == -1,
+      "UINT64 value out of the range of BIGINT encoded in COPY data");
+
+  oml_value_array_reset (v, 7);
+  schema_free (table.schema);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+Suite*
+psql_adapter_suite (void)
+{
+  Suite* s = suite_create ("PostgreSQL adapter");
+
+  TCase* tc_copy = tcase_create ("Binary COPY");
+  tcase_add_test (tc_copy, test_psql_copy_encode);
+  suite_add_tcase (s, tc_copy);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,229 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_reactor.c
+ * \brief Tests clients of shared databases served by multiple reactor threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include <sqlite3.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_socket.h"
+#include "ocomm/o_eventloop.h"
+#include "mem.h"
+#include "database.h"
+#include "client_handler.h"
+#include "reactor.h"
+
+extern char *dbbackend;
+extern char *sqlite_database_dir;
+
+#define NTHREADS 4
+#define NCLIENTS 8
+#define NROWS 200
+
+/** A client of the test server, running in its own thread */
+typedef struct {
+  /** Index of this client, in 0..NCLIENTS-1 */
+  int id;
+  /** Port of the server */
+  uint16_t port;
+  /** Socket to write to once done */
+  int done_fd;
+  /** Non zero if something went wrong */
+  int failed;
+} TestClient;
+
+/** Name of the database used by a client; each is shared by NCLIENTS/2 clients */
+static const char*
+client_domain (int id)
+{
+  return (id % 2) ? "reactor-test-b" : "reactor-test-a";
+}
+
+/** Send a text-protocol header and NROWS samples, then wait for the server
+ * to close the connection once it has processed them all */
+static void*
+client_run (void *arg)
+{
+  TestClient *self = (TestClient*)arg;
+  struct sockaddr_in sa;
+  char buf[256];
+  int fd, i, n;
+
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons (self->port);
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+  if ((fd = socket (AF_INET, SOCK_STREAM, 0)) < 0 ||
+      connect (fd, (struct sockaddr*)&sa, sizeof (sa))) {
+    self->failed = 1;
+
+  } else {
+    n = snprintf (buf, sizeof (buf), "protocol: 4\ndomain: %s\nstart-time: 1332132092\n"
+        "sender-id: client%d\napp-name: check_reactor\nschema: 1 reactor_table client:int32 n:int32\n\n",
+        client_domain (self->id), self->id);
+    self->failed = (send (fd, buf, n, MSG_NOSIGNAL) != n);
+    for (i = 0; i < NROWS && !self->failed; i++) {
+      n = snprintf (buf, sizeof (buf), "%f\t1\t%d\t%d\t%d\n", i * 0.1, i + 1, self->id, i);
+      self->failed = (send (fd, buf, n, MSG_NOSIGNAL) != n);
+    }
+
+    shutdown (fd, SHUT_WR);
+    while (recv (fd, buf, sizeof (buf), 0) > 0);
+  }
+  if (fd >= 0) {
+    close (fd);
+  }
+
+  (void)write (self->done_fd, "", 1);
+  return NULL;
+}
+
+/** Number of clients done */
+static int ndone;
+
+static void
+on_client_done (SockEvtSource *source, void *handle, void *buf, int buf_size)
+{
+  (void)handle;
+  (void)buf;
+  ndone += buf_size;
+  if (ndone >= NCLIENTS) {
+    eventloop_socket_release (source);
+    eventloop_terminate (1);
+  }
+}
+
+static void
+on_connect (Socket *new_sock, void *handle)
+{
+  (void)handle;
+  fail_if (reactor_dispatch (new_sock), "Cannot dispatch client %s", new_sock->name);
+}
+
+/** Count the rows in the reactor_table of a database, or return -1 on error */
+static int
+count_rows (const char *domain, const char *what)
+{
+  char path[64], select[128];
+  sqlite3 *conn;
+  sqlite3_stmt *stmt;
+  int count = -1;
+
+  snprintf (path, sizeof (path), "%s.sq3", domain);
+  snprintf (select, sizeof (select), "SELECT %s FROM reactor_table;", what);
+  if (sqlite3_open (path, &conn) == SQLITE_OK &&
+      sqlite3_prepare_v2 (conn, select, -1, &stmt, NULL) == SQLITE_OK) {
+    if (sqlite3_step (stmt) == SQLITE_ROW) {
+      count = sqlite3_column_int (stmt, 0);
+    }
+    sqlite3_finalize (stmt);
+  }
+  sqlite3_close (conn);
+  return count;
+}
+
+/** Check that clients of the same databases, served by different reactor
+ * threads, all get their samples stored, and release the databases */
+START_TEST(test_reactor_shared_databases)
+{
+  TestClient clients[NCLIENTS];
+  pthread_t threads[NCLIENTS];
+  Socket *server;
+  struct sockaddr_in sa;
+  socklen_t sa_len = sizeof (sa);
+  Database *db;
+  int done[2];
+  int i, n;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  dbbackend = "sqlite";
+  sqlite_database_dir = ".";
+  fail_unless(system ("rm -f reactor-test-a.sq3 reactor-test-b.sq3") == 0, "Cannot remove pre-existing databases");
+  fail_unless(database_setup_backend (dbbackend) == 0, "Cannot setup sqlite backend");
+
+  eventloop_init ();
+  fail_unless(socketpair (AF_UNIX, SOCK_DGRAM, 0, done) == 0, "Cannot create socketpair");
+  eventloop_on_read_in_fd ("clients done", done[0], on_client_done, NULL, NULL);
+  server = socket_server_new ("reactor-test", "127.0.0.1", "0", on_connect, NULL);
+  fail_if(server == NULL, "Cannot create listening socket");
+  fail_unless(getsockname (socket_get_sockfd (server), (struct sockaddr*)&sa, &sa_len) == 0,
+      "Cannot get port of listening socket");
+  fail_unless(reactor_start (NTHREADS, 0, 0) == 0, "Cannot start %d reactor threads", NTHREADS);
+
+  ndone = 0;
+  for (i = 0; i < NCLIENTS; i++) {
+    clients[i].id = i;
+    clients[i].port = ntohs (sa.sin_port);
+    clients[i].done_fd = done[1];
+    clients[i].failed = 0;
+    fail_if(pthread_create (&threads[i], NULL, client_run, &clients[i]), "Cannot start client %d", i);
+  }
+
+  eventloop_run ();
+
+  for (i = 0; i < NCLIENTS; i++) {
+    pthread_join (threads[i], NULL);
+    fail_if(clients[i].failed, "Client %d could not send its samples", i);
+  }
+  reactor_stop (1);
+  socket_free (server);
+  close (done[0]);
+  close (done[1]);
+
+  for (i = 0; i < 2; i++) {
+    n = count_rows (client_domain (i), "COUNT(*)");
+    fail_unless(n == NCLIENTS / 2 * NROWS,
+        "Invalid number of rows in %s: expected %d, got %d", client_domain (i), NCLIENTS / 2 * NROWS, n);
+    n = count_rows (client_domain (i), "COUNT(DISTINCT oml_sender_id)");
+    fail_unless(n == NCLIENTS / 2,
+        "Invalid number of senders in %s: expected %d, got %d", client_domain (i), NCLIENTS / 2, n);
+  }
+
+  /* All clients have released the database, which can be reopened */
+  db = database_find (client_domain (0));
+  fail_if(db == NULL, "Cannot reopen %s", client_domain (0));
+  fail_unless(db->ref_count == 1, "Database %s still in use: %d clients", client_domain (0), db->ref_count - 1);
+  database_release (db);
+}
+END_TEST
+
+Suite*
+reactor_suite (void)
+{
+  Suite* s = suite_create ("Reactor");
+
+  TCase* tc_shared = tcase_create ("Shared databases");
+  tcase_add_test (tc_shared, test_reactor_shared_databases);
+  suite_add_tcase (s, tc_shared);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
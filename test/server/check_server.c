@@ -80,6 +80,13 @@ main (void)
   o_set_log_file ("check_server_oml.log");
   SRunner *sr = srunner_create (text_protocol_suite ());
   srunner_add_suite (sr, binary_protocol_suite ());
+  srunner_add_suite (sr, columnar_adapter_suite ());
+  srunner_add_suite (sr, ingest_suite ());
+  srunner_add_suite (sr, reactor_suite ());
+  srunner_add_suite (sr, sparql_suite ());
+#ifdef HAVE_LIBPQ
+  srunner_add_suite (sr, psql_adapter_suite ());
+#endif
   //  srunner_add_suite (sr, database_suite ()); /* For example ... */
 
   srunner_run_all (sr, CK_ENV);
@@ -28,6 +28,11 @@
 
 extern Suite* text_protocol_suite (void);
 extern Suite* binary_protocol_suite (void);
+extern Suite* columnar_adapter_suite (void);
+extern Suite* ingest_suite (void);
+extern Suite* reactor_suite (void);
+extern Suite* sparql_suite (void);
+extern Suite* psql_adapter_suite (void);
 
 #endif /* CHECK_LIBOML2_SUITES_H__ */
 
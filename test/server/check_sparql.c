@@ -0,0 +1,526 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_sparql.c
+ * \brief Tests the batching and pipelining of SPARQL updates, against a local HTTP stand-in for the endpoint.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <check.h>
+#include <curl/curl.h>
+
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "mstring.h"
+#include "oml_value.h"
+#include "schema.h"
+#include "database.h"
+#include "ingest.h"
+#include "sparql.h"
+#include "fuseki_adapter.h"
+
+extern char *dbbackend;
+extern char *fus_host;
+extern char *fus_port;
+extern char *vir_host;
+extern char *vir_port;
+
+/** Maximum number of connections served at once by the stand-in */
+#define STANDIN_CONNS 16
+/** Maximum number of requests recorded by the stand-in */
+#define STANDIN_REQUESTS 256
+
+/** A connection to the stand-in */
+typedef struct {
+  int fd;           /**< socket, or -1 if unused */
+  MString *in;      /**< data received and not processed yet */
+  int continued;    /**< non zero once "100 Continue" was sent for the current request */
+} StandinConn;
+
+/** A minimal HTTP/1.1 server standing in for a SPARQL endpoint.
+ *
+ * It answers every POST request in its own thread, and records the path and
+ * the decoded form of its body, in order of completion.
+ */
+typedef struct {
+  int fd;                 /**< listening socket */
+  uint16_t port;          /**< port of the listening socket */
+  int wake[2];            /**< socketpair to stop the thread */
+  pthread_t thread;
+  StandinConn conns[STANDIN_CONNS];
+
+  pthread_mutex_t lock;   /**< protects the following fields */
+  char *paths[STANDIN_REQUESTS];  /**< request paths */
+  char *bodies[STANDIN_REQUESTS]; /**< decoded request bodies */
+  int nrequests;          /**< number of requests received */
+  int fail;               /**< answer the request with that 1-based number with an error, or 0 */
+} Standin;
+
+/** Decode an application/x-www-form-urlencoded string in place */
+static void
+url_decode (char *s)
+{
+  char *out = s, hex[3] = { 0, 0, 0 };
+
+  for (; *s; s++) {
+    if (*s == '%' && s[1] && s[2]) {
+      hex[0] = s[1];
+      hex[1] = s[2];
+      *out++ = (char)strtol (hex, NULL, 16);
+      s += 2;
+    } else {
+      *out++ = (*s == '+') ? ' ' : *s;
+    }
+  }
+  *out = '\0';
+}
+
+/** Send a response to a complete request, and record it.
+ * \return 0 on success, -1 if the connection should be closed */
+static int
+standin_answer (Standin *self, StandinConn *c, const char *request, const char *body, size_t body_len)
+{
+  char path[256] = "";
+  const char *status = "200 OK";
+  char response[128];
+  char *decoded;
+  int n;
+
+  sscanf (request, "POST %255s ", path);
+  if (!(decoded = oml_strndup (body, body_len))) {
+    return -1;
+  }
+  url_decode (decoded);
+
+  pthread_mutex_lock (&self->lock);
+  if (self->nrequests < STANDIN_REQUESTS) {
+    self->paths[self->nrequests] = oml_strndup (path, strlen (path));
+    self->bodies[self->nrequests] = decoded;
+    decoded = NULL;
+  }
+  if (++self->nrequests == self->fail) {
+    status = "500 Internal Server Error";
+  }
+  pthread_mutex_unlock (&self->lock);
+  if (decoded) {
+    oml_free (decoded);
+  }
+
+  n = snprintf (response, sizeof (response), "HTTP/1.1 %s\r\nContent-Length: 0\r\n\r\n", status);
+  return (send (c->fd, response, n, MSG_NOSIGNAL) == n) ? 0 : -1;
+}
+
+/** Process the complete requests received on a connection.
+ * \return 0 on success, -1 if the connection should be closed */
+static int
+standin_process (Standin *self, StandinConn *c)
+{
+  const char *buf, *end, *cl;
+  size_t head, len;
+
+  while ((buf = mstring_buf (c->in)) && (end = strstr (buf, "\r\n\r\n"))) {
+    head = end + 4 - buf;
+    len = 0;
+    for (cl = buf; cl < end && (cl = strchr (cl, '\n')); cl++) {
+      if (!strncasecmp (cl + 1, "Content-Length:", 15)) {
+        len = strtoul (cl + 16, NULL, 10);
+      } else if (!c->continued && !strncasecmp (cl + 1, "Expect: 100-continue", 20)) {
+        c->continued = 1;
+        if (send (c->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25, MSG_NOSIGNAL) != 25) {
+          return -1;
+        }
+      }
+    }
+    if (mstring_len (c->in) < head + len) {
+      return 0;
+    }
+    if (standin_answer (self, c, buf, buf + head, len)) {
+      return -1;
+    }
+    c->continued = 0;
+    mstring_set (c->in, buf + head + len);
+  }
+  return 0;
+}
+
+/** Main function of the stand-in thread */
+static void*
+standin_run (void *arg)
+{
+  Standin *self = (Standin*)arg;
+  struct pollfd fds[STANDIN_CONNS + 2];
+  char buf[4096];
+  ssize_t n;
+  int i, fd;
+
+  for (;;) {
+    fds[0].fd = self->wake[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = self->fd;
+    fds[1].events = POLLIN;
+    for (i = 0; i < STANDIN_CONNS; i++) {
+      fds[i + 2].fd = self->conns[i].fd;
+      fds[i + 2].events = POLLIN;
+    }
+    if (poll (fds, STANDIN_CONNS + 2, -1) < 0) {
+      continue;
+    }
+    if (fds[0].revents) {
+      break;
+    }
+    if (fds[1].revents & POLLIN && (fd = accept (self->fd, NULL, NULL)) >= 0) {
+      for (i = 0; i < STANDIN_CONNS && self->conns[i].fd >= 0; i++);
+      if (i < STANDIN_CONNS) {
+        self->conns[i].fd = fd;
+        mstring_set (self->conns[i].in, "");
+      } else {
+        close (fd);
+      }
+    }
+    for (i = 0; i < STANDIN_CONNS; i++) {
+      if (self->conns[i].fd < 0 || !fds[i + 2].revents) {
+        continue;
+      }
+      /* Form-encoded requests do not contain any nul character */
+      n = recv (self->conns[i].fd, buf, sizeof (buf) - 1, 0);
+      if (n > 0) {
+        buf[n] = '\0';
+      }
+      if (n <= 0 || mstring_cat (self->conns[i].in, buf) ||
+          standin_process (self, &self->conns[i])) {
+        close (self->conns[i].fd);
+        self->conns[i].fd = -1;
+      }
+    }
+  }
+  return NULL;
+}
+
+/** Start a stand-in HTTP server on a free port of the loopback interface */
+static Standin*
+standin_start (void)
+{
+  Standin *self = oml_malloc (sizeof (Standin));
+  struct sockaddr_in sa;
+  socklen_t sa_len = sizeof (sa);
+  int i;
+
+  fail_if(self == NULL, "Cannot allocate stand-in");
+  memset (&sa, 0, sizeof (sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  fail_unless((self->fd = socket (AF_INET, SOCK_STREAM, 0)) >= 0 &&
+      bind (self->fd, (struct sockaddr*)&sa, sizeof (sa)) == 0 &&
+      listen (self->fd, STANDIN_CONNS) == 0 &&
+      getsockname (self->fd, (struct sockaddr*)&sa, &sa_len) == 0,
+      "Cannot create listening socket for the stand-in");
+  self->port = ntohs (sa.sin_port);
+  for (i = 0; i < STANDIN_CONNS; i++) {
+    self->conns[i].fd = -1;
+    self->conns[i].in = mstring_create ();
+  }
+  pthread_mutex_init (&self->lock, NULL);
+  fail_unless(socketpair (AF_UNIX, SOCK_STREAM, 0, self->wake) == 0, "Cannot create socketpair");
+  fail_if(pthread_create (&self->thread, NULL, standin_run, self), "Cannot start the stand-in");
+
+  return self;
+}
+
+/** Stop a stand-in HTTP server; the requests it received can then be inspected without locking */
+static void
+standin_stop (Standin *self)
+{
+  int i;
+
+  fail_unless(write (self->wake[1], "", 1) == 1, "Cannot stop the stand-in");
+  pthread_join (self->thread, NULL);
+  for (i = 0; i < STANDIN_CONNS; i++) {
+    if (self->conns[i].fd >= 0) {
+      close (self->conns[i].fd);
+      self->conns[i].fd = -1;
+    }
+  }
+}
+
+/** Free a stopped stand-in HTTP server, and the requests it received */
+static void
+standin_free (Standin *self)
+{
+  int i;
+
+  for (i = 0; i < STANDIN_CONNS; i++) {
+    mstring_delete (self->conns[i].in);
+  }
+  for (i = 0; i < self->nrequests && i < STANDIN_REQUESTS; i++) {
+    oml_free (self->paths[i]);
+    oml_free (self->bodies[i]);
+  }
+  close (self->wake[0]);
+  close (self->wake[1]);
+  close (self->fd);
+  pthread_mutex_destroy (&self->lock);
+  oml_free (self);
+}
+
+/** Get the number of requests received by the stand-in so far */
+static int
+standin_nrequests (Standin *self)
+{
+  int n;
+
+  pthread_mutex_lock (&self->lock);
+  n = self->nrequests;
+  pthread_mutex_unlock (&self->lock);
+  return n;
+}
+
+/** Get the sequence numbers of the samples in an update request.
+ *
+ * \param body decoded body of the request
+ * \param[out] seqs array receiving the sequence numbers, in order
+ * \param max size of seqs
+ * \return the number of samples in the request
+ */
+static int
+request_seqs (const char *body, int *seqs, int max)
+{
+  const char marker[] = "SequenceIndexValue \"";
+  const char *p = body;
+  int n = 0;
+
+  while ((p = strstr (p, marker))) {
+    p += sizeof (marker) - 1;
+    if (n < max) {
+      seqs[n] = atoi (p);
+    }
+    n++;
+  }
+  return n;
+}
+
+/** Schema of the test table, with the concepts needed by the semantic backends */
+static const char meta[] = "1 sparql_table "
+  "x:int32:{MD:Meas|MD:hasX|MD:X}{MD:X|MD:val|%value%} "
+  "y:double:{MD:Meas|MD:hasY|MD:Y}{MD:Y|MD:val|%value%}";
+
+/** Insert nsamples samples, with sequence numbers from 0, into a database of a semantic backend.
+ * \return the number of insertions which reported an error */
+static int
+insert_samples (const char *backend, int nsamples)
+{
+  Database *db;
+  DbTable *table;
+  struct schema *schema;
+  OmlValue v[2];
+  OmlValueU u;
+  int i, errors = 0;
+
+  dbbackend = (char*)backend;
+  ingest_queue_size = 0;
+  db = database_find ("sparql-test");
+  fail_if(db == NULL, "Cannot create %s database", backend);
+  schema = schema_from_meta (meta);
+  fail_if(schema == NULL, "Cannot parse schema '%s'", meta);
+  table = database_find_or_create_table (db, schema);
+  fail_if(table == NULL, "Cannot create table");
+
+  oml_value_array_init (v, 2);
+  for (i = 0; i < nsamples; i++) {
+    omlc_zero (u);
+    omlc_set_int32 (u, i);
+    oml_value_set (&v[0], &u, OML_INT32_VALUE);
+    omlc_zero (u);
+    omlc_set_double (u, i * 0.5);
+    oml_value_set (&v[1], &u, OML_DOUBLE_VALUE);
+    if (database_insert (db, table, 1, i, i * 0.1, v, 2)) {
+      errors++;
+    }
+  }
+  oml_value_array_reset (v, 2);
+
+  /* Sends the samples still batched, and waits for all requests */
+  database_release (db);
+  ingest_queue_size = DEFAULT_INGEST_QUEUE_SIZE;
+  schema_free (schema);
+
+  return errors;
+}
+
+/** Check that samples are split into requests of at most sparql_batch_rows,
+ * sent in order when only one request is in flight */
+START_TEST(test_sparql_batch_order)
+{
+  Standin *standin;
+  char port[8];
+  int seqs[32];
+  int i, j, n, next = 0;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  standin = standin_start ();
+  snprintf (port, sizeof (port), "%u", standin->port);
+  fus_host = "127.0.0.1";
+  fus_port = port;
+  sparql_batch_rows = 10;
+  sparql_requests = 1;
+
+  fail_unless(insert_samples ("fuseki", 35) == 0, "Errors inserting samples");
+  standin_stop (standin);
+
+  /* Samples may be sent early if the second changes while inserting */
+  fail_unless(standin->nrequests >= 4, "Expected at least 4 requests, got %d", standin->nrequests);
+  for (i = 0; i < standin->nrequests; i++) {
+    fail_unless(!strcmp (standin->paths[i], "/" DEFAULT_FUS_NAMESPACE "/update"),
+        "Request %d sent to '%s'", i, standin->paths[i]);
+    fail_unless(!strncmp (standin->bodies[i], "update=", 7),
+        "Request %d does not contain an update: '%.20s'", i, standin->bodies[i]);
+    n = request_seqs (standin->bodies[i], seqs, sizeof (seqs) / sizeof (seqs[0]));
+    fail_unless(n > 0 && n <= 10, "Request %d contains %d samples, instead of 1 to 10", i, n);
+    for (j = 0; j < n; j++, next++) {
+      fail_unless(seqs[j] == next, "Request %d: expected sample %d, got %d", i, next, seqs[j]);
+    }
+  }
+  fail_unless(next == 35, "Expected 35 samples, got %d", next);
+
+  standin_free (standin);
+  sparql_batch_rows = DEFAULT_SPARQL_BATCH_ROWS;
+  sparql_requests = DEFAULT_SPARQL_REQUESTS;
+}
+END_TEST
+
+/** Check that all samples are sent once, when several requests are in flight */
+START_TEST(test_sparql_pipelined)
+{
+  Standin *standin;
+  char port[8];
+  char seen[100];
+  int seqs[32];
+  int i, j, n;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  standin = standin_start ();
+  snprintf (port, sizeof (port), "%u", standin->port);
+  vir_host = "127.0.0.1";
+  vir_port = port;
+  sparql_batch_rows = 5;
+  sparql_requests = 4;
+
+  fail_unless(insert_samples ("virtuoso", sizeof (seen)) == 0, "Errors inserting samples");
+  standin_stop (standin);
+
+  memset (seen, 0, sizeof (seen));
+  for (i = 0; i < standin->nrequests; i++) {
+    fail_unless(!strcmp (standin->paths[i], "/sparql/"), "Request %d sent to '%s'", i, standin->paths[i]);
+    fail_unless(!strncmp (standin->bodies[i], "query=", 6),
+        "Request %d does not contain a query: '%.20s'", i, standin->bodies[i]);
+    n = request_seqs (standin->bodies[i], seqs, sizeof (seqs) / sizeof (seqs[0]));
+    fail_unless(n > 0 && n <= 5, "Request %d contains %d samples, instead of 1 to 5", i, n);
+    for (j = 0; j < n; j++) {
+      fail_unless(seqs[j] >= 0 && seqs[j] < (int)sizeof (seen), "Request %d: unexpected sample %d", i, seqs[j]);
+      fail_if(seen[seqs[j]]++, "Request %d: sample %d sent twice", i, seqs[j]);
+      fail_unless(j == 0 || seqs[j] == seqs[j-1] + 1,
+          "Request %d: sample %d follows sample %d", i, seqs[j], seqs[j-1]);
+    }
+  }
+  for (i = 0; i < (int)sizeof (seen); i++) {
+    fail_unless(seen[i], "Sample %d not sent", i);
+  }
+
+  standin_free (standin);
+  sparql_batch_rows = DEFAULT_SPARQL_BATCH_ROWS;
+  sparql_requests = DEFAULT_SPARQL_REQUESTS;
+}
+END_TEST
+
+/** Check that a failed request is reported once, even if it completed while
+ * another one was being sent, and that the following ones still go through */
+START_TEST(test_sparql_failed_request)
+{
+  Standin *standin;
+  SparqlPipeline *pipeline;
+  CURL *curl;
+  char url[64];
+  const char *updates[] = { "a", "b", "c", "d" };
+  int i, j, ret;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  standin = standin_start ();
+  standin->fail = 2;
+  snprintf (url, sizeof (url), "http://127.0.0.1:%u/ds/update", standin->port);
+  sparql_requests = 2;
+  fail_if((curl = curl_easy_init ()) == NULL, "Cannot create curl handle");
+  curl_easy_setopt (curl, CURLOPT_URL, url);
+  pipeline = sparql_pipeline_new (curl, "update", "sparql-test");
+  fail_if(pipeline == NULL, "Cannot create pipeline");
+
+  for (i = 0; i < 4; i++) {
+    fail_unless(sparql_pipeline_send (pipeline, updates[i], 1) == 0, "Cannot send request %d", i);
+  }
+  /* The last requests waited for a free slot, so some results were collected by send */
+  fail_unless(standin_nrequests (standin) >= 2, "Requests sent without waiting for a free slot");
+  ret = sparql_pipeline_wait (pipeline);
+  fail_unless(ret == -1, "Failed request not reported: expected -1, got %d", ret);
+  fail_unless(standin_nrequests (standin) == 4, "Expected 4 requests, got %d", standin_nrequests (standin));
+  pthread_mutex_lock (&standin->lock);
+  for (i = 0; i < 4; i++) {
+    for (j = 0; j < 4 && strcmp (standin->bodies[j] + strlen ("update="), updates[i]); j++);
+    fail_unless(j < 4, "Update '%s' not received", updates[i]);
+  }
+  pthread_mutex_unlock (&standin->lock);
+
+  /* The failure is only reported once, and the pipeline keeps working */
+  fail_unless(sparql_pipeline_send (pipeline, "e", 1) == 0, "Cannot send request after a failure");
+  ret = sparql_pipeline_wait (pipeline);
+  fail_unless(ret == 0, "Unexpected failure reported: expected 0, got %d", ret);
+  fail_unless(standin_nrequests (standin) == 5, "Expected 5 requests, got %d", standin_nrequests (standin));
+
+  sparql_pipeline_free (pipeline);
+  curl_easy_cleanup (curl);
+  standin_stop (standin);
+  standin_free (standin);
+  sparql_requests = DEFAULT_SPARQL_REQUESTS;
+}
+END_TEST
+
+Suite*
+sparql_suite (void)
+{
+  Suite* s = suite_create ("SPARQL");
+
+  TCase* tc_pipeline = tcase_create ("Pipeline");
+  tcase_add_test (tc_pipeline, test_sparql_batch_order);
+  tcase_add_test (tc_pipeline, test_sparql_pipelined);
+  tcase_add_test (tc_pipeline, test_sparql_failed_request);
+  suite_add_tcase (s, tc_pipeline);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
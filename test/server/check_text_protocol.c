@@ -19,6 +19,9 @@
 #include <check.h>
 #include <sqlite3.h>
 #include <libgen.h>
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
 
 #include "ocomm/o_log.h"
 #include "oml_util.h"
@@ -131,6 +134,197 @@ START_TEST(test_text_insert)
 }
 END_TEST
 
+/** Check that samples held back for multi-row INSERTs are all stored, in order */
+START_TEST(test_text_batch)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+
+  char domain[] = "text-batch-test";
+  char dbname[sizeof(domain)+3];
+  char table[] = "batch_table";
+  /* More than one full batch, and a partial one */
+  int nsamples = SQ3_DEFAULT_BATCH_ROWS * 2 + 3;
+  int i;
+
+  char h[200];
+  char sample[50];
+  char select[200];
+
+  int rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h, sizeof(h),  "protocol: 4\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\nschema: 1 %s value:int32\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select, sizeof(select), "select count(*), min(oml_seq), max(oml_seq), sum(oml_seq = value), sum(oml_seq + 1 = oml_tuple_id) from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "text batch socket";
+  ch = check_server_prepare_client_handler("test_text_batch", &source);
+  client_callback(&source, ch, h, strlen(h));
+  fail_unless(ch->state == C_TEXT_DATA, "Inconsistent state: expected %d, got %d", C_TEXT_DATA, ch->state);
+
+  for (i = 0; i < nsamples; i++) {
+    snprintf(sample, sizeof(sample), "%f\t1\t%d\t%d\n", 1. + i, i, i);
+    client_callback(&source, ch, sample, strlen(sample));
+  }
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == 100, "First step of statement `%s' failed; rc=%d", select, rc);
+  fail_unless(sqlite3_column_int(stmt, 0) == nsamples,
+      "Invalid number of samples: expected %d, got %d", nsamples, sqlite3_column_int(stmt, 0));
+  fail_unless(sqlite3_column_int(stmt, 1) == 0 && sqlite3_column_int(stmt, 2) == nsamples - 1,
+      "Invalid range of oml_seq: expected [0, %d], got [%d, %d]",
+      nsamples - 1, sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2));
+  fail_unless(sqlite3_column_int(stmt, 3) == nsamples,
+      "Invalid values: only %d of %d match their oml_seq", sqlite3_column_int(stmt, 3), nsamples);
+  fail_unless(sqlite3_column_int(stmt, 4) == nsamples,
+      "Samples stored out of order: only %d of %d in place", sqlite3_column_int(stmt, 4), nsamples);
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+#ifdef HAVE_LIBZ
+/** Compress data as a zlib+ collection URI would, appending it to mbuf */
+static void
+deflate_chunk(z_stream *strm, MBuffer *mbuf, char *data, size_t len)
+{
+  uint8_t out[1024];
+
+  strm->next_in = (uint8_t*)data;
+  strm->avail_in = len;
+  do {
+    strm->next_out = out;
+    strm->avail_out = sizeof(out);
+    fail_if(deflate(strm, Z_FULL_FLUSH) == Z_STREAM_ERROR, "Cannot compress data");
+    mbuf_write(mbuf, out, sizeof(out) - strm->avail_out);
+  } while (strm->avail_out == 0);
+}
+
+START_TEST(test_text_deflate)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  z_stream strm;
+  MBuffer *mbuf;
+  size_t sent, len;
+
+  char domain[] = "text-deflate-test";
+  char dbname[sizeof(domain)+3];
+  char table[] = "deflate_table";
+  char h[200];
+  char s[50];
+  char select[200];
+  int i, rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h, sizeof(h),  "protocol: 4\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\nschema: 1 %s size:uint32\ncontent: text\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select, sizeof(select), "select oml_seq, size from %s;", table);
+
+  /* Headers and each chunk are compressed independently, as with zlib_stream */
+  mbuf = mbuf_create();
+  mbuf_write(mbuf, (uint8_t*)"encapsulation: deflate\n", strlen("encapsulation: deflate\n"));
+  memset(&strm, 0, sizeof(strm));
+  fail_unless(deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  deflate_chunk(&strm, mbuf, h, strlen(h));
+  for (i = 1; i <= 100; i++) {
+    snprintf(s, sizeof(s), "%f\t1\t%d\t%d\n", i * 0.1, i, i * 1000);
+    deflate_chunk(&strm, mbuf, s, strlen(s));
+  }
+  deflateEnd(&strm);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "text deflate socket";
+  ch = check_server_prepare_client_handler("test_text_deflate", &source);
+
+  /* Split the stream arbitrarily, including right after the encapsulation header */
+  len = mbuf_fill(mbuf);
+  for (sent = 0; sent < len; sent += i) {
+    i = (sent < 30) ? 30 : 97;
+    if (sent + i > len) {
+      i = len - sent;
+    }
+    client_callback(&source, ch, mbuf_buffer(mbuf) + sent, i);
+  }
+  mbuf_destroy(mbuf);
+
+  fail_unless(ch->state == C_TEXT_DATA, "Inconsistent state: expected %d, got %d", C_TEXT_DATA, ch->state);
+  fail_if(ch->inflater == NULL, "Decompression not enabled");
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+  for (i = 1; i <= 100; i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == 100, "Step %d of statement `%s' failed; rc=%d", i, select, rc);
+    fail_unless(sqlite3_column_int(stmt, 0) == i,
+        "Invalid oml_seq in row %d: got `%d'", i, sqlite3_column_int(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == i * 1000,
+        "Invalid size in row %d: expected `%d', got `%d'", i, i * 1000, sqlite3_column_int(stmt, 1));
+  }
+  sqlite3_finalize(stmt);
+
+  database_release(db);
+}
+END_TEST
+#endif /* HAVE_LIBZ */
+
+START_TEST(test_text_deflate_error)
+{
+  ClientHandler *ch;
+  SockEvtSource source;
+  size_t bcount = xmembytes();
+  /* A raw DEFLATE block of the reserved type 3 */
+  char data[] = "encapsulation: deflate\n\x07\x00\x00\x00";
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "text deflate error socket";
+  ch = check_server_prepare_client_handler("test_text_deflate_error", &source);
+  /* The ClientHandler frees itself on protocol errors; keep it off the fake event source */
+  ch->event = NULL;
+
+  /* Invalid compressed data (or, without zlib, the encapsulation itself) is
+   * a protocol error, and the decompressor must not outlive the handler */
+  client_callback(&source, ch, data, sizeof(data) - 1);
+  fail_unless(xmembytes() == bcount,
+      "Memory leaked after a decompression error: %zu bytes before, %zu after", bcount, xmembytes());
+}
+END_TEST
+
 #define MAXTYPETESTNAME 15
 static struct {
  char *name;        /* name of this test, no longer than MAXTYPETESTNAME */
@@ -540,12 +734,17 @@ text_protocol_suite (void)
 
   TCase* tc_text_insert = tcase_create ("Text insert");
   tcase_add_test (tc_text_insert, test_text_insert);
+  tcase_add_test (tc_text_insert, test_text_batch);
   tcase_add_loop_test (tc_text_insert, test_text_types, 0, LENGTH (type_tests));
   suite_add_tcase (s, tc_text_insert);
 
   TCase* tc_text_flex = tcase_create ("Text flexibility");
   tcase_add_test (tc_text_flex, test_text_flexibility);
   tcase_add_test (tc_text_flex, test_text_metadata);
+#ifdef HAVE_LIBZ
+  tcase_add_test (tc_text_flex, test_text_deflate);
+#endif
+  tcase_add_test (tc_text_flex, test_text_deflate_error);
   suite_add_tcase (s, tc_text_flex);
 
   return s;
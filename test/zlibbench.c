@@ -0,0 +1,241 @@
+/*
+ * Copyright 2014 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file zlibbench.c
+ * \brief Measure the compression ratio and speed of zlib+ collection URIs.
+ *
+ * NSAMPLES samples of a 4-field MS are serialised in text mode, and in binary
+ * mode (OMSPv5 full packets, and OMSPv8 batch packets). Each serialisation is
+ * then written through a zlib stream into a memory sink, in chunks of a few
+ * different sizes as the BufferedWriter would, and inflated back as the
+ * server would. The compression ratio, and the compression and
+ * decompression throughputs (in MB/s of uncompressed data) are printed.
+ *
+ * A different number of samples can be given as the only argument.
+ *
+ *   zlibbench [NSAMPLES]
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_out_stream.h"
+#include "ocomm/o_log.h"
+#include "oml_value.h"
+#include "mbuf.h"
+#include "marshal.h"
+#include "client.h"
+
+#define NSAMPLES 262144
+#define NFIELDS 4
+/** Number of rows in each OMSPv8 batch packet */
+#define BATCH_ROWS 64
+
+#define LENGTH(a) (sizeof (a) / sizeof (a[0]))
+
+/** An OmlOutStream which keeps a copy of everything written into it */
+typedef struct {
+  oml_outs_write_f write;
+  oml_outs_close_f close;
+  char *dest;
+
+  MBuffer *mbuf;
+  int header_written;
+} SinkOutStream;
+
+static size_t
+sink_stream_write (OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length)
+{
+  SinkOutStream *self = (SinkOutStream*)hdl;
+  if (!self->header_written) {
+    mbuf_write (self->mbuf, header, header_length);
+    self->header_written = 1;
+  }
+  mbuf_write (self->mbuf, buffer, length);
+  return length;
+}
+
+static int
+sink_stream_close (OmlOutStream* hdl)
+{
+  (void)hdl;
+  return 0;
+}
+
+/** Get the current monotonic time, in ns */
+static double
+now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/** Fill values with plausible content for sample n */
+static void
+fill_values (OmlValue *values, unsigned long n)
+{
+  omlc_set_uint32 (*oml_value_get_value (&values[0]), n % 16);
+  oml_value_set_type (&values[0], OML_UINT32_VALUE);
+  omlc_set_uint64 (*oml_value_get_value (&values[1]), (uint64_t)n * 1500);
+  oml_value_set_type (&values[1], OML_UINT64_VALUE);
+  omlc_set_int32 (*oml_value_get_value (&values[2]), (int32_t)(n % 200) - 100);
+  oml_value_set_type (&values[2], OML_INT32_VALUE);
+  omlc_set_double (*oml_value_get_value (&values[3]), 12.5 + (n % 7) * 0.1);
+  oml_value_set_type (&values[3], OML_DOUBLE_VALUE);
+}
+
+/** Serialise nsamples samples into mbuf, in text mode (protocol 0) or binary mode */
+static void
+encode (MBuffer *mbuf, unsigned long nsamples, int protocol)
+{
+  OmlValue values[NFIELDS];
+  OmlBinStreamState state = { 0, 0 };
+  unsigned long n;
+  size_t offset = 0;
+  double ts;
+
+  oml_value_array_init (values, NFIELDS);
+  mbuf_clear (mbuf);
+  for (n = 0; n < nsamples; n++) {
+    fill_values (values, n);
+    ts = (double)(n / 1000) + 0.000001 * ((n % 1000) * 1000 + 17);
+    if (!protocol) {
+      /* Same format as text_writer.c */
+      mbuf_print (mbuf, "%f\t%d\t%ld\t%" PRIu32 "\t%" PRIu64 "\t%" PRId32 "\t%f\n", ts, 1, n + 1,
+          omlc_get_uint32 (*oml_value_get_value (&values[0])),
+          omlc_get_uint64 (*oml_value_get_value (&values[1])),
+          omlc_get_int32 (*oml_value_get_value (&values[2])),
+          omlc_get_double (*oml_value_get_value (&values[3])));
+    } else if (protocol >= OMB_BATCH_PROTOCOL) {
+      if (0 == n % BATCH_ROWS) {
+        marshal_init (mbuf, OMB_BATCH_P);
+        offset = mbuf_message_offset (mbuf);
+        marshal_batch_init (mbuf, 1);
+      } else {
+        mbuf_begin_write (mbuf);
+      }
+      marshal_batch_row (mbuf, n + 1, ts, &state, 0 == n);
+      marshal_batch_values (mbuf, values, NFIELDS, protocol);
+      marshal_batch_finalize (mbuf, offset, NFIELDS);
+    } else {
+      marshal_init (mbuf, OMB_DATA_P);
+      marshal_measurements2 (mbuf, 1, n + 1, ts, protocol);
+      marshal_values2 (mbuf, values, NFIELDS, protocol);
+      marshal_finalize (mbuf);
+    }
+  }
+  oml_value_array_reset (values, NFIELDS);
+}
+
+/** Inflate data written by a zlib stream, after its encapsulation header
+ *
+ * \return the number of bytes inflated
+ */
+static size_t
+decode (MBuffer *mbuf)
+{
+  uint8_t out[16384];
+  size_t total = 0;
+  z_stream strm;
+  uint8_t *data = (uint8_t*)strchr ((char*)mbuf_buffer (mbuf), '\n') + 1;
+
+  memset (&strm, 0, sizeof (strm));
+  inflateInit2 (&strm, -MAX_WBITS);
+  strm.next_in = data;
+  strm.avail_in = mbuf_fill (mbuf) - (data - mbuf_buffer (mbuf));
+  do {
+    strm.next_out = out;
+    strm.avail_out = sizeof (out);
+    if (inflate (&strm, Z_NO_FLUSH) < 0) {
+      break;
+    }
+    total += sizeof (out) - strm.avail_out;
+  } while (strm.avail_in > 0);
+  inflateEnd (&strm);
+
+  return total;
+}
+
+int
+main (int argc, const char **argv)
+{
+  int protocols[] = { 0, 5, OMB_BATCH_PROTOCOL };
+  size_t chunks[] = { 1024, 4096, 16384, 65536 };
+  unsigned long nsamples = NSAMPLES;
+  unsigned int i, j;
+  size_t len, sent, inflated;
+  double start, tdeflate, tinflate;
+  MBuffer *data = mbuf_create ();
+  SinkOutStream sink;
+  OmlOutStream *os;
+
+  if (argc > 1) {
+    nsamples = strtoul (argv[1], NULL, 10);
+  }
+  o_set_log_level (O_LOG_ERROR);
+
+  printf ("# %lu samples per run\n", nsamples);
+  printf ("# encoding\tchunk\traw bytes/sample\tzlib bytes/sample\tratio\tdeflate MB/s\tinflate MB/s\n");
+
+  for (i = 0; i < LENGTH (protocols); i++) {
+    encode (data, nsamples, protocols[i]);
+    len = mbuf_fill (data);
+
+    for (j = 0; j < LENGTH (chunks); j++) {
+      memset (&sink, 0, sizeof (sink));
+      sink.write = sink_stream_write;
+      sink.close = sink_stream_close;
+      sink.dest = "sink";
+      sink.mbuf = mbuf_create ();
+      os = zlib_stream_new ((OmlOutStream*)&sink);
+
+      start = now_ns ();
+      for (sent = 0; sent < len; sent += chunks[j]) {
+        os->write (os, mbuf_buffer (data) + sent,
+            (len - sent < chunks[j]) ? len - sent : chunks[j], NULL, 0);
+      }
+      tdeflate = now_ns () - start;
+
+      start = now_ns ();
+      inflated = decode (sink.mbuf);
+      tinflate = now_ns () - start;
+
+      if (inflated != len) {
+        fprintf (stderr, "Only inflated %zu/%zu bytes\n", inflated, len);
+        return 1;
+      }
+      printf ("%s\t%zu\t%.2f\t%.2f\t%.2f\t%.0f\t%.0f\n",
+          protocols[i] ? (protocols[i] >= OMB_BATCH_PROTOCOL ? "binary8" : "binary5") : "text",
+          chunks[j], (double)len / nsamples, (double)mbuf_fill (sink.mbuf) / nsamples,
+          (double)len / mbuf_fill (sink.mbuf),
+          len / tdeflate * 1e3, len / tinflate * 1e3);
+
+      os->close (os);
+      mbuf_destroy (sink.mbuf);
+    }
+  }
+
+  mbuf_destroy (data);
+
+  return 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/